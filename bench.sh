@@ -0,0 +1,82 @@
+#!/bin/sh
+
+# End-to-end benchmarks with the fbpool-bench synthetic producer, printing
+# one JSON object with the results of each process.
+#
+# Usage: ./bench.sh relay|display
+#
+# relay:   producer -> fbpool -> fbpool-bench consumer
+# display: producer -> drm-display (a real, vkms or headless display)
+#
+# Configured by WIDTH, HEIGHT, BPP, NUM_FB, FPS (0 for as fast as possible),
+# DAMAGE (percent), DURATION, POOL_DIR and BIN_DIR.
+
+MODE=${1:-relay}
+WIDTH=${WIDTH:-1920}
+HEIGHT=${HEIGHT:-1080}
+BPP=${BPP:-32}
+NUM_FB=${NUM_FB:-3}
+FPS=${FPS:-60}
+DAMAGE=${DAMAGE:-100}
+DURATION=${DURATION:-10}
+POOL_DIR=${POOL_DIR:-/dev/shm}
+BIN_DIR=${BIN_DIR:-.}
+
+SRC=$POOL_DIR/fbpool-bench-src
+DST=$POOL_DIR/fbpool-bench-dst
+TMP=$(mktemp -d)
+
+trap 'kill $PIDS 2>/dev/null; rm -rf $TMP' EXIT
+
+rm -f $SRC $DST
+
+# Give the consumers time to attach before the measured period
+$BIN_DIR/fbpool-bench produce $SRC -w $WIDTH -h $HEIGHT -b $BPP \
+    -n $NUM_FB -f $FPS -d $DAMAGE -t $((DURATION + 2)) \
+    -o $TMP/producer.json &
+PRODUCER=$!
+PIDS=$PRODUCER
+sleep 0.5
+
+case $MODE in
+relay)
+    FBPOOL_LATENCY_LOG=$TMP/relay.log FBPOOL_STATS=$TMP/relay.stats \
+        $BIN_DIR/fbpool $SRC $DST \
+        > /dev/null &
+    PIDS="$PIDS $!"
+
+    $BIN_DIR/fbpool-bench consume $DST -t $DURATION -o $TMP/consumer.json
+    ;;
+display)
+    FBPOOL_LATENCY_LOG=$TMP/display.log FBPOOL_STATS=$TMP/display.stats \
+        $BIN_DIR/drm-display $SRC \
+        > /dev/null &
+    PIDS="$PIDS $!"
+
+    sleep $DURATION
+    ;;
+*)
+    echo "Usage: $0 relay|display" >&2
+    exit 1
+    ;;
+esac
+
+wait $PRODUCER
+kill $PIDS 2>/dev/null
+
+printf '{"bench": "%s", "producer": %s' $MODE "$(cat $TMP/producer.json)"
+for LOG in $TMP/*.log; do
+    [ -f $LOG ] || continue
+    NAME=$(basename $LOG .log)
+    printf ', "%s": %s' $NAME \
+        "$($BIN_DIR/fbpool-bench report $LOG)"
+done
+for STATS in $TMP/*.stats; do
+    [ -f $STATS ] || continue
+    NAME=$(basename $STATS .stats)
+    printf ', "%s_stats": %s' $NAME \
+        "$($BIN_DIR/fbpool-bench stats $STATS)"
+done
+[ -f $TMP/consumer.json ] && \
+    printf ', "consumer": %s' "$(cat $TMP/consumer.json)"
+printf '}\n'
@@ -0,0 +1,191 @@
+#ifndef _DAMAGE_H
+#define _DAMAGE_H
+
+#include <stdint.h>
+#include <string.h>
+
+#include "fbcopy.h"
+
+#define DAMAGE_MAX_RECTS    16
+
+typedef struct {
+    int32_t x;
+    int32_t y;
+    int32_t w;
+    int32_t h;
+} damage_rect;
+
+// Changed area of a frame, num < 0 means the whole frame
+typedef struct {
+    int num;
+    damage_rect rects[DAMAGE_MAX_RECTS];
+} damage_region;
+
+static inline void damage_reset(damage_region *region)
+{
+    region->num = 0;
+}
+
+static inline void damage_full(damage_region *region)
+{
+    region->num = -1;
+}
+
+static inline int damage_is_full(const damage_region *region)
+{
+    return region->num < 0;
+}
+
+static inline damage_rect damage_union(const damage_rect *a,
+                                       const damage_rect *b)
+{
+    damage_rect r;
+    int x2 = a->x + a->w > b->x + b->w ? a->x + a->w : b->x + b->w;
+    int y2 = a->y + a->h > b->y + b->h ? a->y + a->h : b->y + b->h;
+
+    r.x = a->x < b->x ? a->x : b->x;
+    r.y = a->y < b->y ? a->y : b->y;
+    r.w = x2 - r.x;
+    r.h = y2 - r.y;
+    return r;
+}
+
+static inline int64_t damage_rect_area(const damage_rect *r)
+{
+    return (int64_t)r->w * r->h;
+}
+
+// Add a rect clipped to width x height, merging rects when running out
+static inline void damage_add_rect(damage_region *region,
+                                   const damage_rect *rect,
+                                   int width, int height)
+{
+    damage_rect r = *rect, u;
+    int64_t cost, best_cost = -1, x0, y0, x1, y1;
+    int i, best = 0;
+
+    if (damage_is_full(region))
+        return;
+
+    // Possibly garbage from shared memory, clipped without int overflows
+    if (r.w <= 0 || r.h <= 0)
+        return;
+
+    x0 = r.x > 0 ? r.x : 0;
+    y0 = r.y > 0 ? r.y : 0;
+    x1 = (int64_t)r.x + r.w < width ? (int64_t)r.x + r.w : width;
+    y1 = (int64_t)r.y + r.h < height ? (int64_t)r.y + r.h : height;
+    if (x0 >= x1 || y0 >= y1)
+        return;
+
+    r.x = x0;
+    r.y = y0;
+    r.w = x1 - x0;
+    r.h = y1 - y0;
+
+    if (r.w == width && r.h == height) {
+        damage_full(region);
+        return;
+    }
+
+    // Merge into the rect that grows the least
+    for (i = 0; i < region->num; i++) {
+        u = damage_union(&region->rects[i], &r);
+        cost = damage_rect_area(&u) - damage_rect_area(&region->rects[i]) -
+            damage_rect_area(&r);
+        if (cost <= 0) {
+            region->rects[i] = u;
+            return;
+        }
+
+        if (best_cost < 0 || cost < best_cost) {
+            best_cost = cost;
+            best = i;
+        }
+    }
+
+    if (region->num < DAMAGE_MAX_RECTS) {
+        region->rects[region->num++] = r;
+        return;
+    }
+
+    region->rects[best] = damage_union(&region->rects[best], &r);
+}
+
+static inline void damage_add(damage_region *region, const damage_region *src,
+                              int width, int height)
+{
+    int i;
+
+    if (damage_is_full(src)) {
+        damage_full(region);
+        return;
+    }
+
+    for (i = 0; i < src->num; i++)
+        damage_add_rect(region, &src->rects[i], width, height);
+}
+
+// Grow the rects to multiples of align, e.g. 2 for the subsampled NV12
+static inline void damage_align(damage_region *region, int align,
+                                int width, int height)
+{
+    damage_rect *r;
+    int i, x2, y2;
+
+    for (i = 0; i < region->num; i++) {
+        r = &region->rects[i];
+        x2 = (r->x + r->w + align - 1) / align * align;
+        y2 = (r->y + r->h + align - 1) / align * align;
+        r->x = r->x / align * align;
+        r->y = r->y / align * align;
+        r->w = (x2 < width ? x2 : width) - r->x;
+        r->h = (y2 < height ? y2 : height) - r->y;
+    }
+}
+
+// Copy the damaged area of a frame, bpp 12 is NV12
+// Flags are the FBCOPY_* ones
+static inline void damage_copy(uint8_t *dst, int dst_pitch,
+                               const uint8_t *src, int src_pitch,
+                               const damage_region *region,
+                               int width, int height, int bpp, int flags)
+{
+    damage_region aligned;
+    const damage_rect *r;
+    int i, cpp = bpp == 12 ? 1 : bpp / 8;
+    int rows = bpp == 12 ? height * 3 / 2 : height;
+
+    if (damage_is_full(region)) {
+        if (dst_pitch == src_pitch)
+            fbcopy(dst, src, (size_t)src_pitch * rows, flags);
+        else
+            fbcopy_rows(dst, dst_pitch, src, src_pitch, width * cpp, rows,
+                        flags);
+        return;
+    }
+
+    if (bpp == 12) {
+        aligned = *region;
+        damage_align(&aligned, 2, width, height);
+        region = &aligned;
+    }
+
+    for (i = 0; i < region->num; i++) {
+        r = &region->rects[i];
+
+        fbcopy_rows(dst + r->y * dst_pitch + r->x * cpp, dst_pitch,
+                    src + r->y * src_pitch + r->x * cpp, src_pitch,
+                    r->w * cpp, r->h, flags);
+
+        if (bpp != 12)
+            continue;
+
+        // The interleaved UV plane, half height
+        fbcopy_rows(dst + (height + r->y / 2) * dst_pitch + r->x, dst_pitch,
+                    src + (height + r->y / 2) * src_pitch + r->x, src_pitch,
+                    r->w, (r->y + r->h) / 2 - r->y / 2, flags);
+    }
+}
+
+#endif // _DAMAGE_H
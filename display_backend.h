@@ -0,0 +1,173 @@
+#ifndef _DISPLAY_BACKEND_H
+#define _DISPLAY_BACKEND_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <xf86drmMode.h>
+
+#include "damage.h"
+
+#define MAX_FB      8
+#define MAX_IMPORTS 16
+#define QUEUE_SIZE  32 // Power of 2, holds all the bos and imports
+#define BO_CACHE_SIZE   (MAX_FB * 2)
+
+enum {
+    PRESENT_SYNC, // Render and flip on the caller's thread
+    PRESENT_FIFO, // Show every committed frame in order
+    PRESENT_MAILBOX, // Show the latest committed frame, drop the others
+};
+
+enum {
+    SCALER_AUTO, // Probed, see drm_init()
+    SCALER_PLANE, // The plane scales bos of the source size to the mode
+    SCALER_RGA, // RGA converts and scales into bos of the mode size
+    SCALER_CPU, // So do swconv and scale
+    SCALER_NUM,
+};
+
+struct drm_bo {
+    void *ptr;
+    size_t size;
+    size_t offset;
+    size_t pitch;
+    unsigned handle;
+    int fb_id;
+    int dma_fd;
+
+    int width;
+    int height;
+    int bpp;
+    int imported; // Imported dma-buf, no dumb buffer behind it
+    int uncached; // Write-combined mapping, never read from it
+    uint32_t seq; // Commit number, see device.queued
+
+    // Accumulated since the bo was last rendered
+    damage_region damage;
+};
+
+// Lock-free single producer, single consumer ring of bos
+struct bo_queue {
+    struct drm_bo *bos[QUEUE_SIZE];
+    uint32_t head;
+    uint32_t tail; // Also the futex word for waiting on new bos
+};
+
+struct display_backend;
+
+struct device {
+    const struct display_backend *backend;
+    void *backend_data; // Headless state
+
+    int fd;
+
+    struct {
+        int hdisplay;
+        int vdisplay;
+
+        struct drm_bo *bo[MAX_FB];
+        int current;
+        int fb_num;
+        int bpp;
+
+        int fb_width;
+        int fb_height;
+    } mode;
+
+    drmModeResPtr res;
+
+    int crtc_id;
+    int plane_id;
+    int crtc_pipe;
+    int overlay; // On the current mode, without setting one
+    struct drm_bo *dummy_bo;
+
+    int rgb; // RGB32 bos, even when the plane takes the source format
+    int scaler; // SCALER_*, how the frames get to the mode size
+    int scaler_request;
+
+    // Idle bos kept for reuse, the most recently used first
+    struct drm_bo *bo_cache[BO_CACHE_SIZE];
+    int bo_cache_num;
+    size_t bo_cache_bytes;
+    size_t bo_cache_budget;
+
+    // Zero-copy scanout buffers, see drm_import()
+    struct drm_bo *imports[MAX_IMPORTS];
+    int import_num;
+
+    // Atomic commits, with the legacy SetPlane as fallback
+    int atomic;
+    struct {
+        uint32_t fb_id;
+        uint32_t crtc_id;
+        uint32_t src_x;
+        uint32_t src_y;
+        uint32_t src_w;
+        uint32_t src_h;
+        uint32_t crtc_x;
+        uint32_t crtc_y;
+        uint32_t crtc_w;
+        uint32_t crtc_h;
+    } plane_props;
+    uint32_t out_fence_prop;
+    int out_fence_fd;
+
+    // The flip in flight, and the bo on screen
+    struct drm_bo *pending_bo;
+    struct drm_bo *scanout_bo;
+    int flip_pending;
+    // Replaced by drm_reconfigure() while on screen, or the dummy bo of the
+    // mode set, cached once it isn't
+    struct drm_bo *retired_bo;
+
+    // Presentation thread, owning the flips when not PRESENT_SYNC
+    int present_mode;
+    pthread_t present_thread;
+    int present_stop;
+    struct bo_queue free_queue; // Presentation thread -> render side
+    struct bo_queue ready_queue; // Render side -> presentation thread
+    struct drm_bo *mailbox;
+    uint32_t ready_seq; // Bumped on each commit, futex word
+    uint32_t queued; // Commits made by the render side
+    uint32_t presented; // Commits on screen, dropped or failed, futex word
+    int present_failed; // Since the last drm_wait_flip()
+    struct drm_bo *render_bo; // Being rendered, out of the queues
+    struct drm_bo *spare_bo; // Taken back from the mailbox
+
+    // Software scaling threads, DRM_WORKERS of them
+    struct workers *workers;
+};
+
+// Where the frames go, selected by DRM_BACKEND=drm|headless
+struct display_backend {
+    const char *name;
+
+    // Sets up the mode and the fb size, for frames of that bpp
+    int (*open)(struct device *dev, int bpp, int fb_width, int fb_height);
+    void (*close)(struct device *dev);
+
+    struct drm_bo *(*bo_create)(struct device *dev, int width, int height,
+                                int bpp);
+    void (*bo_destroy)(struct device *dev, struct drm_bo *bo);
+    // Optional, wraps a dma-buf into the preallocated bo
+    int (*import)(struct device *dev, struct drm_bo *bo, int dma_fd, int bpp);
+    // Optional, whether bos of that bpp can be shown as they are, without
+    // it they are RGB32
+    int (*has_format)(struct device *dev, int bpp);
+    // Optional, whether bos of that size can be scaled to the whole mode
+    // when shown, without it the render side scales
+    int (*can_scale)(struct device *dev, int bpp, int width, int height);
+
+    // Show the bo, possibly leaving the flip pending in dev->pending_bo
+    int (*display)(struct device *dev, struct drm_bo *bo);
+    // Wait for the pending flip, the bo becomes dev->scanout_bo
+    int (*flip_done)(struct device *dev);
+};
+
+extern const struct display_backend drm_backend;
+extern const struct display_backend headless_backend;
+
+#endif // _DISPLAY_BACKEND_H
@@ -1,6 +1,7 @@
 #include <fcntl.h>
 #include <poll.h>
 #include <errno.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -12,55 +13,75 @@
 #include <xf86drmMode.h>
 #include <drm_fourcc.h>
 
+#include "display_backend.h"
 #include "drm_display.h"
+#include "futex.h"
+#include "scale.h"
+#include "stats.h"
+#include "swconv.h"
+#include "workers.h"
 
-#define RGA // Use RGA to convert/scale images
-#define DRM_RGB // Use RGB32 DRM format
-//#define DRM_SCALE // Use DRM plane scaling
-//#define DRM_OVERLAY // Use DRM overlay plane
-
+// RGA (built with librga, see the Makefile) converts and scales images
 #ifdef RGA
 #include <rga/rga.h>
 #include <rga/RgaApi.h>
 #endif
 
-#define MAX_FB      3
+#define BO_CACHE_MB 64
+#define SCALER_BENCH_RUNS 3 // The best of them
 
-struct drm_bo {
-    void *ptr;
-    size_t size;
-    size_t offset;
-    size_t pitch;
-    unsigned handle;
-    int fb_id;
-    int dma_fd;
+static const char *scaler_names[SCALER_NUM] = {
+    "auto", "plane", "rga", "cpu",
 };
 
-struct device {
-    int fd;
+struct device *pdev;
 
-    struct {
-        int hdisplay;
-        int vdisplay;
+static int drm_flip_done(struct device *dev);
+static int drm_start_present(struct device *dev);
+static void drm_stop_present(struct device *dev);
+static int drm_choose_scaler(struct device *dev, int bpp, int width,
+                             int height);
 
-        struct drm_bo *bo[MAX_FB];
-        int current;
-        int fb_num;
-        int bpp;
+static int queue_push(struct bo_queue *queue, struct drm_bo *bo) {
+    uint32_t tail = __atomic_load_n(&queue->tail, __ATOMIC_RELAXED);
+    uint32_t head = __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE);
 
-        int fb_width;
-        int fb_height;
-    } mode;
+    if (tail - head >= QUEUE_SIZE)
+        return -1;
 
-    drmModeResPtr res;
+    queue->bos[tail % QUEUE_SIZE] = bo;
+    __atomic_store_n(&queue->tail, tail + 1, __ATOMIC_RELEASE);
+    futex_wake(&queue->tail, 1);
+    return 0;
+}
 
-    int crtc_id;
-    int plane_id;
-    int crtc_pipe;
-    struct drm_bo *dummy_bo;
-};
+static struct drm_bo *queue_pop(struct bo_queue *queue) {
+    uint32_t head = __atomic_load_n(&queue->head, __ATOMIC_RELAXED);
+    uint32_t tail = __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE);
+    struct drm_bo *bo;
 
-struct device *pdev;
+    if (head == tail)
+        return NULL;
+
+    bo = queue->bos[head % QUEUE_SIZE];
+    __atomic_store_n(&queue->head, head + 1, __ATOMIC_RELEASE);
+    return bo;
+}
+
+static struct drm_bo *queue_wait(struct bo_queue *queue) {
+    struct drm_bo *bo;
+    uint32_t tail;
+
+    while (1) {
+        tail = __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE);
+
+        bo = queue_pop(queue);
+        if (bo)
+            return bo;
+
+        futex_wait(&queue->tail, tail, -1);
+    }
+}
 
 static int bo_map(struct device *dev, struct drm_bo *bo) {
     struct drm_mode_map_dumb arg = {
@@ -103,12 +124,50 @@ static void bo_destroy(struct device *dev, struct drm_bo *bo) {
 
     bo_unmap(dev, bo);
 
-    if (bo->handle)
+    if (bo->handle && bo->imported) {
+        struct drm_gem_close close_arg = {
+            .handle = bo->handle,
+        };
+
+        drmIoctl(dev->fd, DRM_IOCTL_GEM_CLOSE, &close_arg);
+    } else if (bo->handle) {
         drmIoctl(dev->fd, DRM_IOCTL_MODE_DESTROY_DUMB, &arg);
+    }
 
     free(bo);
 }
 
+// The pitch is of the whole 12bpp buffer for NV12, like dumb buffers have
+static int bo_add_fb(struct device *dev, struct drm_bo *bo, int bpp) {
+    uint32_t handles[4] = {0}, pitches[4] = {0}, offsets[4] = {0};
+    int format;
+
+    switch (bpp) {
+    case 12:
+        handles[0] = handles[1] = bo->handle;
+        pitches[0] = pitches[1] = bo->pitch * 2 / 3;
+        offsets[1] = pitches[0] * bo->height;
+        format = DRM_FORMAT_NV12;
+        break;
+    case 16:
+        handles[0] = bo->handle;
+        pitches[0] = bo->pitch;
+        format = DRM_FORMAT_RGB565;
+        break;
+    case 24:
+    case 32:
+        handles[0] = bo->handle;
+        pitches[0] = bo->pitch;
+        format = DRM_FORMAT_XRGB8888;
+        break;
+    default:
+        return -1;
+    }
+
+    return drmModeAddFB2(dev->fd, bo->width, bo->height, format, handles,
+                         pitches, offsets, (uint32_t *)&bo->fb_id, 0);
+}
+
 static struct drm_bo *bo_create(struct device *dev, int width, int height,
                                 int bpp) {
     struct drm_mode_create_dumb arg = {
@@ -117,8 +176,6 @@ static struct drm_bo *bo_create(struct device *dev, int width, int height,
         .height = height,
     };
     struct drm_bo *bo;
-    uint32_t handles[4] = {0}, pitches[4] = {0}, offsets[4] = {0};
-    int format;
     int ret;
 
     bo = malloc(sizeof(struct drm_bo));
@@ -127,6 +184,7 @@ static struct drm_bo *bo_create(struct device *dev, int width, int height,
         return NULL;
     }
     memset(bo, 0, sizeof(*bo));
+    damage_full(&bo->damage);
 
     ret = drmIoctl(dev->fd, DRM_IOCTL_MODE_CREATE_DUMB, &arg);
     if (ret) {
@@ -137,6 +195,10 @@ static struct drm_bo *bo_create(struct device *dev, int width, int height,
     bo->handle = arg.handle;
     bo->size = arg.size;
     bo->pitch = arg.pitch;
+    bo->width = width;
+    bo->height = height;
+    bo->bpp = bpp;
+    bo->uncached = 1;
 
     ret = bo_map(dev, bo);
     if (ret) {
@@ -144,28 +206,7 @@ static struct drm_bo *bo_create(struct device *dev, int width, int height,
         goto err;
     }
 
-    switch (bpp) {
-    case 12:
-        handles[0] = handles[1] = bo->handle;
-        pitches[0] = pitches[1] = bo->pitch * 2 / 3;
-        offsets[1] = pitches[0] * height;
-        format = DRM_FORMAT_NV12;
-        break;
-    case 16:
-        handles[0] = bo->handle;
-        pitches[0] = bo->pitch;
-        format = DRM_FORMAT_RGB565;
-        break;
-    case 24:
-    case 32:
-        handles[0] = bo->handle;
-        pitches[0] = bo->pitch;
-        format = DRM_FORMAT_XRGB8888;
-        break;
-    }
-
-    ret = drmModeAddFB2(dev->fd, width, height, format, handles,
-                        pitches, offsets, (uint32_t *)&bo->fb_id, 0);
+    ret = bo_add_fb(dev, bo, bpp);
     if (ret) {
         fprintf(stderr, "add fb failed\n");
         goto err;
@@ -185,13 +226,89 @@ err:
     return NULL;
 }
 
+static void bo_cache_remove(struct device *dev, int i) {
+    dev->bo_cache_bytes -= dev->bo_cache[i]->size;
+    dev->bo_cache_num--;
+    memmove(&dev->bo_cache[i], &dev->bo_cache[i + 1],
+            (dev->bo_cache_num - i) * sizeof(dev->bo_cache[0]));
+}
+
+// Keep an idle bo for bo_cache_get(), the least recently used ones go first
+// when over the budget. The one on screen stays until it isn't anymore.
+static void bo_cache_put(struct device *dev, struct drm_bo *bo) {
+    struct drm_bo *old;
+    int i;
+
+    // Imports are only good for the buffers they wrap
+    if (bo->imported) {
+        dev->backend->bo_destroy(dev, bo);
+        return;
+    }
+
+    for (i = dev->bo_cache_num - 1; i >= 0; i--) {
+        if (dev->bo_cache_num < BO_CACHE_SIZE &&
+            dev->bo_cache_bytes + bo->size <= dev->bo_cache_budget)
+            break;
+
+        old = dev->bo_cache[i];
+        if (old == dev->scanout_bo || old == dev->pending_bo)
+            continue;
+
+        bo_cache_remove(dev, i);
+        dev->backend->bo_destroy(dev, old);
+    }
+
+    if (dev->bo_cache_num == BO_CACHE_SIZE ||
+        dev->bo_cache_bytes + bo->size > dev->bo_cache_budget) {
+        dev->backend->bo_destroy(dev, bo);
+        return;
+    }
+
+    memmove(&dev->bo_cache[1], &dev->bo_cache[0],
+            dev->bo_cache_num * sizeof(dev->bo_cache[0]));
+    dev->bo_cache[0] = bo;
+    dev->bo_cache_num++;
+    dev->bo_cache_bytes += bo->size;
+}
+
+// A cached bo of that size and format, without any ioctl, or a new one
+static struct drm_bo *bo_cache_get(struct device *dev, int width, int height,
+                                   int bpp) {
+    struct drm_bo *bo;
+    int i;
+
+    for (i = 0; i < dev->bo_cache_num; i++) {
+        bo = dev->bo_cache[i];
+        if (bo->width != width || bo->height != height || bo->bpp != bpp)
+            continue;
+
+        bo_cache_remove(dev, i);
+
+        // Whatever it had is stale
+        damage_full(&bo->damage);
+
+        DRM_DEBUG("Reused bo: %d, %dx%d\n", bo->fb_id, width, height);
+        return bo;
+    }
+
+    return dev->backend->bo_create(dev, width, height, bpp);
+}
+
+static void bo_cache_flush(struct device *dev) {
+    while (dev->bo_cache_num)
+        dev->backend->bo_destroy(dev, dev->bo_cache[--dev->bo_cache_num]);
+
+    dev->bo_cache_bytes = 0;
+}
+
 static void free_fb(struct device *dev) {
     unsigned int i;
 
     DRM_DEBUG("Free fb, num: %d, bpp: %d\n", dev->mode.fb_num, dev->mode.bpp);
     for (i = 0; i < dev->mode.fb_num; i++) {
         if (dev->mode.bo[i])
-            bo_destroy(dev, dev->mode.bo[i]);
+            bo_cache_put(dev, dev->mode.bo[i]);
+        dev->mode.bo[i] = NULL;
     }
 
     dev->mode.fb_num = 0;
@@ -209,8 +326,8 @@ static int alloc_fb(struct device *dev, int fb_num, int bpp) {
     dev->mode.current = 0;
 
     for (i = 0; i < dev->mode.fb_num; i++) {
-        dev->mode.bo[i] =
-            bo_create(dev, dev->mode.fb_width, dev->mode.fb_height, bpp);
+        dev->mode.bo[i] = bo_cache_get(dev, dev->mode.fb_width,
+                                       dev->mode.fb_height, bpp);
         if (!dev->mode.bo[i]) {
             fprintf(stderr, "create bo failed\n");
             free_fb(dev);
@@ -221,7 +338,6 @@ static int alloc_fb(struct device *dev, int fb_num, int bpp) {
     return 0;
 }
 
-#ifdef DRM_OVERLAY
 static drmModeCrtcPtr drm_find_current_crtc(struct device *dev, int *pipe) {
     drmModeResPtr res = dev->res;
     drmModeCrtcPtr crtc;
@@ -237,7 +353,7 @@ static drmModeCrtcPtr drm_find_current_crtc(struct device *dev, int *pipe) {
     }
     return NULL;
 }
-#else
+
 static drmModeConnectorPtr drm_get_connector(struct device *dev,
                                              int connector_id) {
     drmModeConnectorPtr conn;
@@ -315,30 +431,105 @@ static drmModeCrtcPtr drm_find_best_crtc(struct device *dev,
     *pipe = ffs(crtcs_for_connector) - 1;
     return drmModeGetCrtc(dev->fd, res->crtcs[*pipe]);
 }
-#endif
 
-static int drm_plane_match_type(struct device *dev, int plane_id, int type) {
+// The format of the bos of a bpp, 0 when they can't be scanned out as they are
+static uint32_t drm_bpp_format(int bpp) {
+    switch (bpp) {
+    case 12:
+        return DRM_FORMAT_NV12;
+    case 16:
+        return DRM_FORMAT_RGB565;
+    case 32:
+        return DRM_FORMAT_XRGB8888;
+    default:
+        return 0;
+    }
+}
+
+static int drm_plane_prop(struct device *dev, int plane_id, const char *name,
+                          uint64_t *value) {
     drmModeObjectPropertiesPtr props;
     drmModePropertyPtr prop;
-    int i, matched = 0;
+    int i, ret = -1;
 
     props = drmModeObjectGetProperties(dev->fd, plane_id,
                                        DRM_MODE_OBJECT_PLANE);
     if (!props)
-        return 0;
+        return -1;
 
-    for (i = 0; i < props->count_props; i++) {
+    for (i = 0; i < props->count_props && ret; i++) {
         prop = drmModeGetProperty(dev->fd, props->props[i]);
-        if (prop && !strcmp(prop->name, "type"))
-            matched = props->prop_values[i] == type;
+        if (prop && !strcmp(prop->name, name)) {
+            *value = props->prop_values[i];
+            ret = 0;
+        }
         drmModeFreeProperty(prop);
     }
-    DRM_DEBUG("Plane: %d, matched: %d\n", plane_id, matched);
 
     drmModeFreeObjectProperties(props);
+    return ret;
+}
+
+static int drm_plane_match_type(struct device *dev, int plane_id, int type) {
+    uint64_t value;
+    int matched;
+
+    matched = !drm_plane_prop(dev, plane_id, "type", &value) && value == type;
+    DRM_DEBUG("Plane: %d, matched: %d\n", plane_id, matched);
+
     return matched;
 }
 
+// Whether the plane takes linear bos of the format, as dumb buffers are.
+// Without IN_FORMATS, the formats it lists are for those.
+static int drm_plane_has_format(struct device *dev, drmModePlanePtr plane,
+                                uint32_t format) {
+    const struct drm_format_modifier_blob *blob;
+    const struct drm_format_modifier *mods;
+    drmModePropertyBlobPtr prop_blob = NULL;
+    const uint32_t *formats;
+    uint64_t blob_id;
+    uint32_t i, j;
+    int found = 0;
+
+    for (i = 0; i < plane->count_formats; i++) {
+        if (plane->formats[i] == format)
+            break;
+    }
+
+    if (!format || i == plane->count_formats)
+        return 0;
+
+    if (!drm_plane_prop(dev, plane->plane_id, "IN_FORMATS", &blob_id) &&
+        blob_id)
+        prop_blob = drmModeGetPropertyBlob(dev->fd, blob_id);
+    if (!prop_blob)
+        return 1;
+
+    blob = prop_blob->data;
+    formats = (const uint32_t *)((const uint8_t *)blob + blob->formats_offset);
+    mods = (const struct drm_format_modifier *)
+        ((const uint8_t *)blob + blob->modifiers_offset);
+
+    for (i = 0; i < blob->count_formats; i++) {
+        if (formats[i] == format)
+            break;
+    }
+
+    // Each modifier has a mask of 64 formats, from its offset on
+    for (j = 0; i < blob->count_formats && j < blob->count_modifiers; j++) {
+        if (mods[j].modifier != DRM_FORMAT_MOD_LINEAR ||
+            i < mods[j].offset || i >= mods[j].offset + 64)
+            continue;
+
+        if (mods[j].formats & (1ULL << (i - mods[j].offset)))
+            found = 1;
+    }
+
+    drmModeFreePropertyBlob(prop_blob);
+    return found;
+}
+
 static drmModePlanePtr drm_get_plane(struct device *dev,
                                      int plane_id, int pipe, int type) {
     drmModePlanePtr plane;
@@ -358,16 +549,15 @@ static drmModePlanePtr drm_get_plane(struct device *dev,
     return NULL;
 }
 
-static drmModePlanePtr drm_find_best_plane(struct device *dev, int crtc_pipe) {
+// Preferably one taking the source format, otherwise the frames get
+// converted to RGB32 for the first one
+static drmModePlanePtr drm_find_best_plane(struct device *dev, int crtc_pipe,
+                                           int bpp) {
+    drmModePlanePtr plane, first = NULL;
     drmModePlaneResPtr pres;
-    drmModePlanePtr plane;
     int i, type;
 
-#ifdef DRM_OVERLAY
-    type = DRM_PLANE_TYPE_OVERLAY;
-#else
-    type = DRM_PLANE_TYPE_PRIMARY;
-#endif
+    type = dev->overlay ? DRM_PLANE_TYPE_OVERLAY : DRM_PLANE_TYPE_PRIMARY;
 
     pres = drmModeGetPlaneResources(dev->fd);
     if (!pres)
@@ -375,18 +565,39 @@ static drmModePlanePtr drm_find_best_plane(struct device *dev, int crtc_pipe) {
 
     for (i = 0; i < pres->count_planes; i++) {
         plane = drm_get_plane(dev, pres->planes[i], crtc_pipe, type);
-        if (plane) {
-            drmModeFreePlaneResources(pres);
-            return plane;
+        if (!plane)
+            continue;
+
+        if (drm_plane_has_format(dev, plane, drm_bpp_format(bpp))) {
+            DRM_DEBUG("Plane: %d takes bpp: %d\n", plane->plane_id, bpp);
+            drmModeFreePlane(first);
+            first = plane;
+            break;
         }
-        drmModeFreePlane(plane);
+
+        if (!first)
+            first = plane;
+        else
+            drmModeFreePlane(plane);
     }
 
     drmModeFreePlaneResources(pres);
-    return NULL;
+    return first;
+}
+
+static int drm_has_format(struct device *dev, int bpp) {
+    drmModePlanePtr plane;
+    int ret;
+
+    plane = drmModeGetPlane(dev->fd, dev->plane_id);
+    if (!plane)
+        return 0;
+
+    ret = drm_plane_has_format(dev, plane, drm_bpp_format(bpp));
+    drmModeFreePlane(plane);
+    return ret;
 }
 
-#ifndef DRM_OVERLAY
 static drmModeModeInfoPtr drm_find_best_mode(struct device *dev,
                                              drmModeConnectorPtr conn) {
     drmModeModeInfoPtr mode;
@@ -408,7 +619,6 @@ static drmModeModeInfoPtr drm_find_best_mode(struct device *dev,
 
     return mode;
 }
-#endif
 
 static void drm_free(struct device *dev) {
     if (dev->res) {
@@ -422,11 +632,9 @@ static void drm_free(struct device *dev) {
     dev->mode.vdisplay = 0;
 }
 
-static int drm_setup(struct device *dev, int fb_width, int fb_height) {
-#ifndef DRM_OVERLAY
+static int drm_setup(struct device *dev, int bpp) {
     drmModeConnectorPtr conn = NULL;
-    drmModeModeInfoPtr mode;
-#endif
+    drmModeModeInfoPtr mode = NULL;
     drmModePlanePtr plane = NULL;
     drmModeCrtcPtr crtc = NULL;
     int crtc_pipe, success = 0;
@@ -437,40 +645,40 @@ static int drm_setup(struct device *dev, int fb_width, int fb_height) {
         goto err;
     }
 
-#ifndef DRM_OVERLAY
-    conn = drm_find_best_connector(dev);
-    if (!conn) {
-        fprintf(stderr, "drm find connector failed\n");
-        goto err;
-    }
-    DRM_DEBUG("Best connector id: %d\n", conn->connector_id);
+    if (dev->overlay) {
+        crtc = drm_find_current_crtc(dev, &crtc_pipe);
+        if (!crtc) {
+            fprintf(stderr, "drm find crtc failed\n");
+            goto err;
+        }
 
-    mode = drm_find_best_mode(dev, conn);
-    if (!mode) {
-        fprintf(stderr, "drm find mode failed\n");
-        goto err;
-    }
-    DRM_DEBUG("Best mode: %dx%d\n", mode->hdisplay, mode->vdisplay);
+        DRM_DEBUG("Current crtc: %d with mode: %dx%d\n", crtc->crtc_id,
+                  crtc->width, crtc->height);
+    } else {
+        conn = drm_find_best_connector(dev);
+        if (!conn) {
+            fprintf(stderr, "drm find connector failed\n");
+            goto err;
+        }
+        DRM_DEBUG("Best connector id: %d\n", conn->connector_id);
 
-    crtc = drm_find_best_crtc(dev, conn, &crtc_pipe);
-    if (!crtc) {
-        fprintf(stderr, "drm find crtc failed\n");
-        goto err;
-    }
+        mode = drm_find_best_mode(dev, conn);
+        if (!mode) {
+            fprintf(stderr, "drm find mode failed\n");
+            goto err;
+        }
+        DRM_DEBUG("Best mode: %dx%d\n", mode->hdisplay, mode->vdisplay);
 
-    DRM_DEBUG("Best crtc: %d\n", crtc->crtc_id);
-#else
-    crtc = drm_find_current_crtc(dev, &crtc_pipe);
-    if (!crtc) {
-        fprintf(stderr, "drm find crtc failed\n");
-        goto err;
-    }
+        crtc = drm_find_best_crtc(dev, conn, &crtc_pipe);
+        if (!crtc) {
+            fprintf(stderr, "drm find crtc failed\n");
+            goto err;
+        }
 
-    DRM_DEBUG("Current crtc: %d with mode: %dx%d\n", crtc->crtc_id,
-              crtc->width, crtc->height);
-#endif
+        DRM_DEBUG("Best crtc: %d\n", crtc->crtc_id);
+    }
 
-    plane = drm_find_best_plane(dev, crtc_pipe);
+    plane = drm_find_best_plane(dev, crtc_pipe, bpp);
     if (!plane) {
         fprintf(stderr, "drm find plane failed\n");
         goto err;
@@ -478,48 +686,41 @@ static int drm_setup(struct device *dev, int fb_width, int fb_height) {
 
     DRM_DEBUG("Best plane: %d\n", plane->plane_id);
 
-#ifndef DRM_OVERLAY
-    dev->dummy_bo = bo_create(dev, mode->hdisplay, mode->vdisplay, 32);
-    if (!dev->dummy_bo) {
-        fprintf(stderr, "create dummy bo failed\n");
-        goto err;
-    }
-    DRM_DEBUG("Created dummy bo fb: %d\n", dev->dummy_bo->fb_id);
-
-    DRM_DEBUG("Set CRTC: %d(%d) with connector: %d, mode: %dx%d\n",
-              crtc->crtc_id, crtc_pipe, conn->connector_id,
-              mode->hdisplay, mode->vdisplay);
-    if (drmModeSetCrtc(dev->fd, crtc->crtc_id,
-                       dev->dummy_bo->fb_id, 0, 0,
-                       &conn->connector_id, 1, mode) < 0) {
-        fprintf(stderr, "drm set mode failed\n");
-        goto err;
+    if (!dev->overlay) {
+        dev->dummy_bo = bo_create(dev, mode->hdisplay, mode->vdisplay, 32);
+        if (!dev->dummy_bo) {
+            fprintf(stderr, "create dummy bo failed\n");
+            goto err;
+        }
+        DRM_DEBUG("Created dummy bo fb: %d\n", dev->dummy_bo->fb_id);
+
+        DRM_DEBUG("Set CRTC: %d(%d) with connector: %d, mode: %dx%d\n",
+                  crtc->crtc_id, crtc_pipe, conn->connector_id,
+                  mode->hdisplay, mode->vdisplay);
+        if (drmModeSetCrtc(dev->fd, crtc->crtc_id,
+                           dev->dummy_bo->fb_id, 0, 0,
+                           &conn->connector_id, 1, mode) < 0) {
+            fprintf(stderr, "drm set mode failed\n");
+            goto err;
+        }
+        dev->scanout_bo = dev->dummy_bo;
     }
-#endif
 
     dev->crtc_id = crtc->crtc_id;
     dev->crtc_pipe = crtc_pipe;
     dev->plane_id = plane->plane_id;
-#ifdef DRM_OVERLAY
-    dev->mode.hdisplay = crtc->width;
-    dev->mode.vdisplay = crtc->height;
-#else
-    dev->mode.hdisplay = mode->hdisplay;
-    dev->mode.vdisplay = mode->vdisplay;
-#endif
+    dev->mode.hdisplay = mode ? mode->hdisplay : crtc->width;
+    dev->mode.vdisplay = mode ? mode->vdisplay : crtc->height;
 
-#ifdef DRM_SCALE
-    dev->mode.fb_width = fb_width;
-    dev->mode.fb_height = fb_height;
-#else
+    // Until the scaler is chosen
     dev->mode.fb_width = dev->mode.hdisplay;
     dev->mode.fb_height = dev->mode.vdisplay;
-#endif
 
     success = 1;
 err:
     drmModeFreePlane(plane);
     drmModeFreeCrtc(crtc);
+    drmModeFreeConnector(conn);
     if (!success) {
         drm_free(dev);
         return -1;
@@ -527,101 +728,342 @@ err:
     return 0;
 }
 
-int drm_init(int fb_num, int bpp, int fb_width, int fb_height) {
-    int ret;
+static uint32_t drm_get_prop_id(struct device *dev, uint32_t obj_id,
+                                uint32_t obj_type, const char *name) {
+    drmModeObjectPropertiesPtr props;
+    drmModePropertyPtr prop;
+    uint32_t prop_id = 0;
+    int i;
 
-    if (fb_num > MAX_FB)
-        return -1;
+    props = drmModeObjectGetProperties(dev->fd, obj_id, obj_type);
+    if (!props)
+        return 0;
 
-    pdev = malloc(sizeof(struct device));
-    if (pdev == NULL) {
-        fprintf(stderr, "allocate device failed\n");
+    for (i = 0; i < props->count_props && !prop_id; i++) {
+        prop = drmModeGetProperty(dev->fd, props->props[i]);
+        if (prop && !strcmp(prop->name, name))
+            prop_id = prop->prop_id;
+        drmModeFreeProperty(prop);
+    }
+
+    drmModeFreeObjectProperties(props);
+    return prop_id;
+}
+
+static int drm_setup_atomic(struct device *dev) {
+    const char *out_fence = getenv("DRM_OUT_FENCE");
+    uint32_t *ids = (uint32_t *)&dev->plane_props;
+    const char *names[] = {
+        "FB_ID", "CRTC_ID", "SRC_X", "SRC_Y", "SRC_W", "SRC_H",
+        "CRTC_X", "CRTC_Y", "CRTC_W", "CRTC_H",
+    };
+    unsigned int i;
+
+    for (i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        ids[i] = drm_get_prop_id(dev, dev->plane_id,
+                                 DRM_MODE_OBJECT_PLANE, names[i]);
+        if (!ids[i]) {
+            DRM_DEBUG("Plane property: %s not found\n", names[i]);
+            return -1;
+        }
+    }
+
+    if (out_fence && atoi(out_fence))
+        dev->out_fence_prop = drm_get_prop_id(dev, dev->crtc_id,
+                                              DRM_MODE_OBJECT_CRTC,
+                                              "OUT_FENCE_PTR");
+
+    DRM_DEBUG("Using atomic commits, out fence: %d\n", !!dev->out_fence_prop);
+    return 0;
+}
+
+static int drm_open(struct device *dev, int bpp, int fb_width,
+                    int fb_height) {
+    const char *atomic = getenv("DRM_ATOMIC");
+    const char *plane = getenv("DRM_PLANE");
+    int ret;
+
+    if (plane && !strcmp(plane, "overlay")) {
+        dev->overlay = 1;
+    } else if (plane && strcmp(plane, "primary")) {
+        fprintf(stderr, "invalid plane: %s\n", plane);
         return -1;
     }
-    memset(pdev, 0, sizeof(*pdev));
 
-    pdev->fd = drmOpen(NULL, NULL);
-    if (pdev->fd < 0)
-        pdev->fd = open("/dev/dri/card0", O_RDWR);
-    if (pdev->fd < 0) {
+    dev->fd = drmOpen(NULL, NULL);
+    if (dev->fd < 0)
+        dev->fd = open("/dev/dri/card0", O_RDWR);
+    if (dev->fd < 0) {
         fprintf(stderr, "drm open failed\n");
-        goto err_drm_open;
+        return -1;
     }
-    fcntl(pdev->fd, F_SETFD, FD_CLOEXEC);
+    fcntl(dev->fd, F_SETFD, FD_CLOEXEC);
 
-    drmSetClientCap(pdev->fd, DRM_CLIENT_CAP_ATOMIC, 1);
-    drmSetClientCap(pdev->fd, DRM_CLIENT_CAP_UNIVERSAL_PLANES, 1);
+    dev->out_fence_fd = -1;
+    dev->atomic = !drmSetClientCap(dev->fd, DRM_CLIENT_CAP_ATOMIC, 1);
+    drmSetClientCap(dev->fd, DRM_CLIENT_CAP_UNIVERSAL_PLANES, 1);
 
-    ret = drm_setup(pdev, fb_width, fb_height);
+    ret = drm_setup(dev, bpp);
     if (ret) {
         fprintf(stderr, "drm setup failed\n");
-        goto err_drm_setup;
+        drmClose(dev->fd);
+        return -1;
     }
 
-#ifdef DRM_RGB
-    bpp = 32;
-#endif
+    if (atomic && !atoi(atomic))
+        dev->atomic = 0;
 
-    ret = alloc_fb(pdev, fb_num, bpp);
-    if (ret) {
-        fprintf(stderr, "alloc fb failed\n");
-        goto err_alloc_fb;
+    if (dev->atomic && drm_setup_atomic(dev) < 0)
+        dev->atomic = 0;
+
+    // Cached once the first flip replaced it, it can be one of the bos then
+    if (dev->dummy_bo) {
+        dev->retired_bo = dev->dummy_bo;
+        dev->dummy_bo = NULL;
     }
 
     return 0;
-err_alloc_fb:
-    drm_free(pdev);
-err_drm_setup:
-    drmClose(pdev->fd);
-err_drm_open:
-    free(pdev);
-    pdev = NULL;
-    return -1;
 }
 
-void drm_deinit(void) {
-    struct device *dev = pdev;
-    if (!dev)
-        return;
-
+static void drm_close(struct device *dev) {
     if (dev->dummy_bo)
         bo_destroy(dev, dev->dummy_bo);
 
-    free_fb(dev);
     drm_free(dev);
 
-    if (pdev->fd > 0)
+    if (dev->fd > 0)
         drmClose(dev->fd);
-
-    free(pdev);
-    pdev = NULL;
 }
 
-static inline struct drm_bo *drm_get_bo(void) {
-    return pdev->mode.bo[pdev->mode.current];
-}
+// The source bpp when the bos can be shown in it and the CPU doesn't have to
+// scale into them, otherwise the frames get converted to RGB32
+static int drm_scanout_bpp(struct device *dev, int bpp, int scaled) {
+    if (!dev->rgb && !scaled && dev->backend->has_format &&
+        dev->backend->has_format(dev, bpp))
+        return bpp;
 
-static void drm_next_bo(void) {
-    pdev->mode.current ++;
-    if (pdev->mode.current >= MAX_FB || pdev->mode.current >= pdev->mode.fb_num)
-        pdev->mode.current = 0;
+    return 32;
 }
 
-static void sync_handler(int fd, uint32_t frame,
-                         uint32_t sec, uint32_t usec, void *data) {
-    int *waiting = data;
+int drm_init(int fb_num, int bpp, int fb_width, int fb_height) {
+    const char *backend = getenv("DRM_BACKEND");
+    const char *buffers = getenv("DRM_BUFFERS");
+    const char *present = getenv("DRM_PRESENT");
+    const char *cache = getenv("DRM_BO_CACHE");
+    const char *scaler = getenv("DRM_SCALER");
+    const char *rgb = getenv("DRM_RGB");
+    int i, ret;
+
+    if (buffers)
+        fb_num = atoi(buffers);
+
+    if (fb_num < 2 || fb_num > MAX_FB) {
+        fprintf(stderr, "invalid buffer num: %d\n", fb_num);
+        return -1;
+    }
 
-    *waiting = 0;
-}
+    pdev = malloc(sizeof(struct device));
+    if (pdev == NULL) {
+        fprintf(stderr, "allocate device failed\n");
+        return -1;
+    }
+    memset(pdev, 0, sizeof(*pdev));
+
+    pdev->bo_cache_budget = (size_t)(cache ? atoi(cache) : BO_CACHE_MB) << 20;
+    pdev->rgb = rgb && atoi(rgb);
+
+    for (i = 0; scaler && i < SCALER_NUM; i++) {
+        if (!strcmp(scaler, scaler_names[i]))
+            break;
+    }
+    if (i == SCALER_NUM) {
+        fprintf(stderr, "invalid scaler: %s\n", scaler);
+        goto err_open;
+    }
+    pdev->scaler_request = scaler ? i : SCALER_AUTO;
+
+    if (!backend || !strcmp(backend, drm_backend.name)) {
+        pdev->backend = &drm_backend;
+    } else if (!strcmp(backend, headless_backend.name)) {
+        pdev->backend = &headless_backend;
+    } else {
+        fprintf(stderr, "invalid backend: %s\n", backend);
+        goto err_open;
+    }
+
+    ret = pdev->backend->open(pdev, bpp, fb_width, fb_height);
+    if (ret) {
+        fprintf(stderr, "%s open failed\n", pdev->backend->name);
+        goto err_open;
+    }
+
+    pdev->scaler = drm_choose_scaler(pdev, bpp, fb_width, fb_height);
+
+    // Only scaled by the plane, the bos follow the source size
+    if (pdev->scaler == SCALER_PLANE) {
+        pdev->mode.fb_width = fb_width;
+        pdev->mode.fb_height = fb_height;
+    }
+
+    bpp = drm_scanout_bpp(pdev, bpp, fb_width != pdev->mode.fb_width ||
+                          fb_height != pdev->mode.fb_height);
+
+    ret = alloc_fb(pdev, fb_num, bpp);
+    if (ret) {
+        fprintf(stderr, "alloc fb failed\n");
+        goto err_alloc_fb;
+    }
+
+    if (present && !strcmp(present, "sync"))
+        pdev->present_mode = PRESENT_SYNC;
+    else if (present && !strcmp(present, "mailbox"))
+        pdev->present_mode = PRESENT_MAILBOX;
+    else
+        pdev->present_mode = PRESENT_FIFO;
+
+    if (pdev->present_mode != PRESENT_SYNC && drm_start_present(pdev) < 0) {
+        fprintf(stderr, "start present thread failed, presenting in sync\n");
+        pdev->present_mode = PRESENT_SYNC;
+    }
+
+    DRM_DEBUG("Backend: %s, buffers: %d, present mode: %d\n",
+              pdev->backend->name, fb_num, pdev->present_mode);
+    return 0;
+err_alloc_fb:
+    bo_cache_flush(pdev);
+    pdev->backend->close(pdev);
+err_open:
+    free(pdev);
+    pdev = NULL;
+    return -1;
+}
+
+void drm_deinit(void) {
+    struct device *dev = pdev;
+    if (!dev)
+        return;
+
+    drm_wait_flip();
 
-static int drm_sync(void) {
+    if (dev->present_mode != PRESENT_SYNC) {
+        drm_stop_present(dev);
+        dev->present_mode = PRESENT_SYNC;
+    }
+
+    dev->backend->flip_done(dev);
+
+    workers_destroy(dev->workers);
+
+    drm_free_imports();
+    free_fb(dev);
+    if (dev->retired_bo)
+        dev->backend->bo_destroy(dev, dev->retired_bo);
+    bo_cache_flush(dev);
+    dev->backend->close(dev);
+
+    free(pdev);
+    pdev = NULL;
+}
+
+static struct drm_bo *drm_get_bo(void) {
     struct device *dev = pdev;
-    int ret, waiting = 1;
+
+    if (dev->present_mode == PRESENT_SYNC)
+        return dev->mode.bo[dev->mode.current];
+
+    if (!dev->render_bo) {
+        if (dev->spare_bo) {
+            dev->render_bo = dev->spare_bo;
+            dev->spare_bo = NULL;
+        } else {
+            // Blocks until the presentation thread is done with one
+            dev->render_bo = queue_wait(&dev->free_queue);
+        }
+    }
+
+    return dev->render_bo;
+}
+
+static void drm_next_bo(void) {
+    if (pdev->present_mode != PRESENT_SYNC)
+        return;
+
+    pdev->mode.current ++;
+    if (pdev->mode.current >= MAX_FB || pdev->mode.current >= pdev->mode.fb_num)
+        pdev->mode.current = 0;
+}
+
+// The dumb bos go back to the free queue, imports are owned by the caller
+static int drm_is_dumb_bo(struct device *dev, struct drm_bo *bo) {
+    int i;
+
+    for (i = 0; bo && i < dev->mode.fb_num; i++) {
+        if (dev->mode.bo[i] == bo)
+            return 1;
+    }
+
+    return 0;
+}
+
+// Once a bo of the new format replaced it on screen
+static void drm_release_retired(struct device *dev) {
+    if (!dev->retired_bo || dev->retired_bo == dev->scanout_bo ||
+        dev->retired_bo == dev->pending_bo)
+        return;
+
+    bo_cache_put(dev, dev->retired_bo);
+    dev->retired_bo = NULL;
+}
+
+static void sync_handler(int fd, uint32_t frame,
+                         uint32_t sec, uint32_t usec, void *data) {
+    int *waiting = data;
+
+    *waiting = 0;
+}
+
+static void flip_handler(int fd, uint32_t frame, uint32_t sec, uint32_t usec,
+                         uint32_t crtc_id, void *data) {
+    struct device *dev = data;
+
+    dev->flip_pending = 0;
+}
+
+static int drm_handle_events(struct device *dev, int *waiting) {
+    int ret;
 
     drmEventContext evctxt = {
         .version = DRM_EVENT_CONTEXT_VERSION,
         .vblank_handler = sync_handler,
+        .page_flip_handler2 = flip_handler,
+    };
+
+    struct pollfd fds[1] = {
+        {
+            .events = POLLIN,
+            .fd = dev->fd,
+        },
     };
+
+    while (*waiting) {
+        do {
+            ret = poll(fds, 1, 3000);
+        } while (ret == -1 && (errno == EAGAIN || errno == EINTR));
+
+        if (ret <= 0)
+            return -1;
+
+        ret = drmHandleEvent(dev->fd, &evctxt);
+        if (ret < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+static int drm_sync(struct device *dev) {
+    int waiting = 1;
+
     drmVBlank vbl = {
         .request = {
             .type = DRM_VBLANK_RELATIVE | DRM_VBLANK_EVENT,
@@ -630,43 +1072,119 @@ static int drm_sync(void) {
         },
     };
 
+    if (dev->crtc_pipe == 1)
+        vbl.request.type |= DRM_VBLANK_SECONDARY;
+    else if (dev->crtc_pipe > 1)
+        vbl.request.type |= dev->crtc_pipe << DRM_VBLANK_HIGH_CRTC_SHIFT;
+
+    if (drmWaitVBlank(dev->fd, &vbl) < 0)
+        return -1;
+
+    return drm_handle_events(dev, &waiting);
+}
+
+static int drm_flip_done(struct device *dev) {
     struct pollfd fds[1] = {
         {
             .events = POLLIN,
-            .fd = dev->fd,
         },
     };
+    uint64_t start;
+    int ret = 0;
 
-    if (dev->crtc_pipe == 1)
-        vbl.request.type |= DRM_VBLANK_SECONDARY;
-    else if (dev->crtc_pipe > 1)
-        vbl.request.type |= dev->crtc_pipe << DRM_VBLANK_HIGH_CRTC_SHIFT;
+    if (!dev->pending_bo)
+        return 0;
 
-    if (drmWaitVBlank(dev->fd, &vbl) < 0)
+    start = stats_now_us();
+
+    if (dev->out_fence_fd >= 0) {
+        // Signaled when the new fb replaced the old one on screen
+        fds[0].fd = dev->out_fence_fd;
+        if (poll(fds, 1, 3000) <= 0)
+            ret = -1;
+
+        close(dev->out_fence_fd);
+        dev->out_fence_fd = -1;
+    } else {
+        ret = drm_handle_events(dev, &dev->flip_pending);
+    }
+
+    if (ret < 0)
+        fprintf(stderr, "drm wait flip failed\n");
+    else
+        stats_record(STATS_VBLANK, stats_now_us() - start);
+
+    dev->scanout_bo = dev->pending_bo;
+    dev->pending_bo = NULL;
+    dev->flip_pending = 0;
+
+    return ret;
+}
+
+static void drm_atomic_add_plane(struct device *dev, drmModeAtomicReqPtr req,
+                                 struct drm_bo *bo, int crtc_x, int crtc_y,
+                                 int crtc_w, int crtc_h) {
+    uint32_t plane = dev->plane_id;
+
+    drmModeAtomicAddProperty(req, plane, dev->plane_props.fb_id, bo->fb_id);
+    drmModeAtomicAddProperty(req, plane, dev->plane_props.crtc_id,
+                             dev->crtc_id);
+    drmModeAtomicAddProperty(req, plane, dev->plane_props.src_x, 0);
+    drmModeAtomicAddProperty(req, plane, dev->plane_props.src_y, 0);
+    drmModeAtomicAddProperty(req, plane, dev->plane_props.src_w,
+                             bo->width << 16);
+    drmModeAtomicAddProperty(req, plane, dev->plane_props.src_h,
+                             bo->height << 16);
+    drmModeAtomicAddProperty(req, plane, dev->plane_props.crtc_x, crtc_x);
+    drmModeAtomicAddProperty(req, plane, dev->plane_props.crtc_y, crtc_y);
+    drmModeAtomicAddProperty(req, plane, dev->plane_props.crtc_w, crtc_w);
+    drmModeAtomicAddProperty(req, plane, dev->plane_props.crtc_h, crtc_h);
+}
+
+static int drm_display_atomic(struct device *dev, struct drm_bo *bo,
+                              int crtc_x, int crtc_y, int crtc_w, int crtc_h) {
+    drmModeAtomicReqPtr req;
+    uint32_t flags = DRM_MODE_ATOMIC_NONBLOCK;
+    uint64_t start;
+    int ret;
+
+    // Only one commit can be in flight
+    drm_flip_done(dev);
+
+    req = drmModeAtomicAlloc();
+    if (!req)
         return -1;
 
-    while (waiting) {
-        do {
-            poll(fds, 1, 3000);
-        } while (ret == -1 && (errno == EAGAIN || errno == EINTR));
+    drm_atomic_add_plane(dev, req, bo, crtc_x, crtc_y, crtc_w, crtc_h);
 
-        ret = drmHandleEvent(dev->fd, &evctxt);
-        if (ret < 0)
-            return -1;
+    if (dev->out_fence_prop)
+        drmModeAtomicAddProperty(req, dev->crtc_id, dev->out_fence_prop,
+                                 (uint64_t)(uintptr_t)&dev->out_fence_fd);
+    else
+        flags |= DRM_MODE_PAGE_FLIP_EVENT;
+
+    start = stats_now_us();
+    ret = drmModeAtomicCommit(dev->fd, req, flags, dev);
+    drmModeAtomicFree(req);
+    if (ret) {
+        dev->out_fence_fd = -1;
+        return -1;
     }
+    stats_record(STATS_COMMIT, stats_now_us() - start);
 
+    dev->pending_bo = bo;
+    dev->flip_pending = !dev->out_fence_prop;
     return 0;
 }
 
-static int drm_display(void) {
-    struct device *dev = pdev;
-    struct drm_bo *bo = drm_get_bo();
+static int drm_display(struct device *dev, struct drm_bo *bo) {
     int crtc_x, crtc_y, crtc_w, crtc_h;
+    uint64_t start;
     int sw, sh;
     int ret;
 
-    sw = dev->mode.fb_width;
-    sh = dev->mode.fb_height;
+    sw = bo->width;
+    sh = bo->height;
     crtc_w = dev->mode.hdisplay;
     crtc_h = dev->mode.vdisplay;
     crtc_x = 0;
@@ -675,6 +1193,15 @@ static int drm_display(void) {
     // Set fb to main plane
     DRM_DEBUG("Display bo %d(%dx%d) at (%d,%d) %dx%d\n", bo->fb_id, sw, sh,
               crtc_x, crtc_y, crtc_w, crtc_h);
+
+    if (dev->atomic) {
+        if (!drm_display_atomic(dev, bo, crtc_x, crtc_y, crtc_w, crtc_h))
+            return 0;
+
+        DRM_DEBUG("Atomic commit failed, trying SetPlane: %d\n", bo->fb_id);
+    }
+
+    start = stats_now_us();
     ret = drmModeSetPlane(dev->fd, dev->plane_id, dev->crtc_id, bo->fb_id, 0,
                           crtc_x, crtc_y, crtc_w, crtc_h,
                           0, 0, sw << 16, sh << 16);
@@ -682,15 +1209,259 @@ static int drm_display(void) {
         fprintf(stderr, "drm set plane failed\n");
         return -1;
     }
+    stats_record(STATS_COMMIT, stats_now_us() - start);
+
+    // The driver's atomic support doesn't work for us
+    if (dev->atomic) {
+        fprintf(stderr, "drm atomic commit failed, using SetPlane\n");
+        dev->atomic = 0;
+    }
+
+    start = stats_now_us();
+    if (!drm_sync(dev))
+        stats_record(STATS_VBLANK, stats_now_us() - start);
+    dev->scanout_bo = bo;
+
+    return 0;
+}
+
+// Asks the driver, which knows the limits of the plane's scaler. Without
+// atomic commits, there is no asking before showing the bo.
+static int drm_can_scale(struct device *dev, int bpp, int width, int height) {
+    drmModeAtomicReqPtr req;
+    struct drm_bo *bo;
+    int ret = -1;
+
+    if (width == dev->mode.hdisplay && height == dev->mode.vdisplay)
+        return 1;
+
+    if (!dev->atomic)
+        return 0;
+
+    bo = bo_cache_get(dev, width, height, bpp);
+    if (!bo)
+        return 0;
+
+    req = drmModeAtomicAlloc();
+    if (req) {
+        drm_atomic_add_plane(dev, req, bo, 0, 0,
+                             dev->mode.hdisplay, dev->mode.vdisplay);
+        ret = drmModeAtomicCommit(dev->fd, req, DRM_MODE_ATOMIC_TEST_ONLY,
+                                  NULL);
+        drmModeAtomicFree(req);
+    }
+
+    DRM_DEBUG("Plane scaling %dx%d to %dx%d: %s\n", width, height,
+              dev->mode.hdisplay, dev->mode.vdisplay, ret ? "no" : "yes");
+
+    bo_cache_put(dev, bo);
+    return !ret;
+}
+
+static void *drm_present(void *data) {
+    struct device *dev = data;
+    struct drm_bo *bo, *prev;
+    uint32_t seq;
+
+    while (!__atomic_load_n(&dev->present_stop, __ATOMIC_ACQUIRE)) {
+        seq = __atomic_load_n(&dev->ready_seq, __ATOMIC_ACQUIRE);
+
+        if (dev->present_mode == PRESENT_MAILBOX)
+            bo = __atomic_exchange_n(&dev->mailbox, NULL, __ATOMIC_ACQ_REL);
+        else
+            bo = queue_pop(&dev->ready_queue);
+
+        if (!bo) {
+            futex_wait(&dev->ready_seq, seq, -1);
+            continue;
+        }
+
+        // Wait for the flip here, the render side has the other bos
+        prev = dev->scanout_bo;
+        if (dev->backend->display(dev, bo) < 0) {
+            __atomic_store_n(&dev->present_failed, 1, __ATOMIC_RELAXED);
+            prev = bo;
+        } else {
+            dev->backend->flip_done(dev);
+        }
+
+        if (prev && prev != dev->scanout_bo && drm_is_dumb_bo(dev, prev))
+            queue_push(&dev->free_queue, prev);
+        drm_release_retired(dev);
+
+        __atomic_store_n(&dev->presented, bo->seq, __ATOMIC_RELEASE);
+        futex_wake(&dev->presented, INT_MAX);
+    }
+
+    return NULL;
+}
+
+static int drm_start_present(struct device *dev) {
+    int i;
+
+    for (i = 0; i < dev->mode.fb_num; i++)
+        queue_push(&dev->free_queue, dev->mode.bo[i]);
+
+    if (pthread_create(&dev->present_thread, NULL, drm_present, dev)) {
+        memset(&dev->free_queue, 0, sizeof(dev->free_queue));
+        return -1;
+    }
+
+    return 0;
+}
+
+// After drm_wait_flip(), the presentation thread has nothing left to show
+static void drm_stop_present(struct device *dev) {
+    __atomic_store_n(&dev->present_stop, 1, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&dev->ready_seq, 1, __ATOMIC_RELEASE);
+    futex_wake(&dev->ready_seq, 1);
+    pthread_join(dev->present_thread, NULL);
+    dev->present_stop = 0;
+}
+
+// Hand a bo over to the presentation thread
+static int drm_queue(struct device *dev, struct drm_bo *bo) {
+    struct drm_bo *old;
+
+    bo->seq = ++dev->queued;
+
+    if (dev->present_mode == PRESENT_MAILBOX) {
+        old = __atomic_exchange_n(&dev->mailbox, bo, __ATOMIC_ACQ_REL);
+
+        // Replaced before it got shown, render the next frame into it
+        if (old && drm_is_dumb_bo(dev, old))
+            dev->spare_bo = old;
+    } else if (queue_push(&dev->ready_queue, bo) < 0) {
+        return -1;
+    }
+
+    __atomic_add_fetch(&dev->ready_seq, 1, __ATOMIC_RELEASE);
+    futex_wake(&dev->ready_seq, 1);
+    return 0;
+}
+
+int drm_wait_flip(void) {
+    struct device *dev = pdev;
+    uint32_t presented;
+
+    if (dev->present_mode == PRESENT_SYNC)
+        return dev->backend->flip_done(dev);
+
+    while (1) {
+        presented = __atomic_load_n(&dev->presented, __ATOMIC_ACQUIRE);
+        if ((int32_t)(presented - dev->queued) >= 0)
+            break;
+
+        futex_wait(&dev->presented, presented, -1);
+    }
+
+    // Some of them weren't shown
+    if (__atomic_exchange_n(&dev->present_failed, 0, __ATOMIC_RELAXED)) {
+        DRM_DEBUG("Present failed, queued: %u\n", dev->queued);
+        return -1;
+    }
+
+    return 0;
+}
+
+int drm_reconfigure(int bpp, int fb_width, int fb_height) {
+    struct device *dev = pdev;
+    int width = dev->mode.hdisplay, height = dev->mode.vdisplay;
+    int fb_num = dev->mode.fb_num, i;
+    struct drm_bo *keep;
+
+    drm_wait_flip();
+
+    // Keeping the plane, which might not scale the new size
+    dev->scaler = drm_choose_scaler(dev, bpp, fb_width, fb_height);
+
+    // Only scaled by the plane, the bos follow the source size
+    if (dev->scaler == SCALER_PLANE) {
+        width = fb_width;
+        height = fb_height;
+    }
+
+    // Nor take the new format
+    bpp = drm_scanout_bpp(dev, bpp, fb_width != width || fb_height != height);
+
+    // The render side converts and scales into them anyway
+    if (bpp == dev->mode.bpp && width == dev->mode.fb_width &&
+        height == dev->mode.fb_height) {
+        for (i = 0; i < fb_num; i++)
+            damage_full(&dev->mode.bo[i]->damage);
+        return 0;
+    }
+
+    DRM_DEBUG("Reconfigure fb: %dx%d, bpp: %d\n", width, height, bpp);
+
+    if (dev->present_mode != PRESENT_SYNC)
+        drm_stop_present(dev);
+    dev->backend->flip_done(dev);
+
+    // Shown until the next flip, without a blank screen in between
+    keep = drm_is_dumb_bo(dev, dev->scanout_bo) ? dev->scanout_bo : NULL;
+    if (dev->retired_bo && dev->retired_bo != dev->scanout_bo) {
+        bo_cache_put(dev, dev->retired_bo);
+        dev->retired_bo = NULL;
+    }
+
+    for (i = 0; i < fb_num; i++) {
+        if (dev->mode.bo[i] == keep)
+            dev->retired_bo = keep;
+        else
+            bo_cache_put(dev, dev->mode.bo[i]);
+        dev->mode.bo[i] = NULL;
+    }
+
+    memset(&dev->free_queue, 0, sizeof(dev->free_queue));
+    memset(&dev->ready_queue, 0, sizeof(dev->ready_queue));
+    dev->mailbox = NULL;
+    dev->render_bo = NULL;
+    dev->spare_bo = NULL;
+
+    dev->mode.fb_width = width;
+    dev->mode.fb_height = height;
+
+    if (alloc_fb(dev, fb_num, bpp) < 0) {
+        fprintf(stderr, "alloc fb failed\n");
+        dev->present_mode = PRESENT_SYNC;
+        return -1;
+    }
+
+    if (dev->present_mode != PRESENT_SYNC && drm_start_present(dev) < 0) {
+        fprintf(stderr, "start present thread failed, presenting in sync\n");
+        dev->present_mode = PRESENT_SYNC;
+    }
+
+    return 0;
+}
 
-    drm_sync();
+// Once, returns -1 when RGA isn't there
+static int drm_init_rga(void) {
+#ifdef RGA
+    static int rga_supported = 1;
+    static int rga_inited = 0;
+
+    if (!rga_supported)
+        return -1;
+
+    if (!rga_inited) {
+        if (c_RkRgaInit() < 0) {
+            rga_supported = 0;
+            return -1;
+        }
+        rga_inited = 1;
+    }
 
     return 0;
+#else
+    return -1;
+#endif
 }
 
 #ifdef RGA
 static int rga_prepare_info(int bpp, int width, int height, int pitch,
-                            rga_info_t *info) {
+                            const damage_rect *rect, rga_info_t *info) {
     RgaSURF_FORMAT format;
 
     memset(info, 0, sizeof(rga_info_t));
@@ -712,37 +1483,26 @@ static int rga_prepare_info(int bpp, int width, int height, int pitch,
         return -1;
     }
 
-    rga_set_rect(&info->rect, 0, 0, width, height,
-                 pitch * 8 / bpp, height, format);
+    if (rect)
+        rga_set_rect(&info->rect, rect->x, rect->y, rect->w, rect->h,
+                     pitch * 8 / bpp, height, format);
+    else
+        rga_set_rect(&info->rect, 0, 0, width, height,
+                     pitch * 8 / bpp, height, format);
     return 0;
 }
 
-static int drm_render_rga(void *buf, int bpp,
-                          int width, int height, int pitch) {
-    struct device *dev = pdev;
-    struct drm_bo *bo = drm_get_bo();
+static int drm_blit_rga(struct drm_bo *bo, void *buf, int bpp,
+                        int width, int height, int pitch,
+                        const damage_rect *rect) {
     rga_info_t src_info = {0};
     rga_info_t dst_info = {0};
 
-    static int rga_supported = 1;
-    static int rga_inited = 0;
-
-    if (!rga_supported)
+    if (rga_prepare_info(bpp, width, height, pitch, rect, &src_info) < 0)
         return -1;
 
-    if (!rga_inited) {
-        if (c_RkRgaInit() < 0) {
-            rga_supported = 0;
-            return -1;
-        }
-        rga_inited = 1;
-    }
-
-    if (rga_prepare_info(bpp, width, height, pitch, &src_info) < 0)
-        return -1;
-
-    if (rga_prepare_info(dev->mode.bpp, dev->mode.fb_width,
-                         dev->mode.fb_height, bo->pitch, &dst_info) < 0)
+    if (rga_prepare_info(bo->bpp, bo->width, bo->height, bo->pitch, rect,
+                         &dst_info) < 0)
         return -1;
 
     src_info.virAddr = buf;
@@ -750,29 +1510,388 @@ static int drm_render_rga(void *buf, int bpp,
 
     return c_RkRgaBlit(&src_info, &dst_info, NULL);
 }
+
+static int drm_render_rga(struct drm_bo *bo, void *buf, int bpp,
+                          int width, int height, int pitch) {
+    damage_region region = bo->damage;
+    int i;
+
+    if (drm_init_rga() < 0)
+        return -1;
+
+    // Only blit the damaged rects when not scaling
+    if (width != bo->width || height != bo->height ||
+        damage_is_full(&region))
+        return drm_blit_rga(bo, buf, bpp, width, height, pitch, NULL);
+
+    if (bpp == 12 || bo->bpp == 12)
+        damage_align(&region, 2, width, height);
+
+    for (i = 0; i < region.num; i++) {
+        if (drm_blit_rga(bo, buf, bpp, width, height, pitch,
+                         &region.rects[i]) < 0)
+            return -1;
+    }
+
+    return 0;
+}
 #endif
 
-int drm_render(void *buf, int bpp, int width, int height, int pitch) {
+static int drm_render_swconv(struct drm_bo *bo, void *buf, int bpp,
+                             int width, int height, int pitch) {
+    int i;
+
+    DRM_DEBUG("Converting bpp %d with %s\n", bpp, swconv_name());
+
+    if (damage_is_full(&bo->damage))
+        return swconv_xrgb8888(bo->ptr, bo->pitch, buf, pitch, bpp,
+                               width, height, NULL);
+
+    for (i = 0; i < bo->damage.num; i++) {
+        if (swconv_xrgb8888(bo->ptr, bo->pitch, buf, pitch, bpp,
+                            width, height, &bo->damage.rects[i]) < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+static void drm_fill_border(struct drm_bo *bo, const damage_rect *rect) {
+    uint8_t *ptr = bo->ptr;
+    int y;
+
+    for (y = 0; y < bo->height; y++) {
+        if (y < rect->y || y >= rect->y + rect->h) {
+            memset(ptr + y * bo->pitch, 0, bo->width * 4);
+            continue;
+        }
+
+        memset(ptr + y * bo->pitch, 0, rect->x * 4);
+        memset(ptr + y * bo->pitch + (rect->x + rect->w) * 4, 0,
+               (bo->width - rect->x - rect->w) * 4);
+    }
+}
+
+static int drm_render_scale(struct drm_bo *bo, void *buf, int bpp,
+                            int width, int height, int pitch) {
     struct device *dev = pdev;
-    struct drm_bo *bo = drm_get_bo();
-    int ret;
+    const char *workers = getenv("DRM_WORKERS");
+    damage_rect rect, clip;
+    int i, filter;
+
+    if (!dev->workers)
+        dev->workers = workers_create(workers ? atoi(workers) : 0);
+
+    scale_placement(&rect, width, height, bo->width, bo->height);
+    filter = scale_filter(width, height, rect.w, rect.h);
+
+    DRM_DEBUG("Scaling %dx%d to %dx%d at (%d,%d), filter: %d\n",
+              width, height, rect.w, rect.h, rect.x, rect.y, filter);
+
+    if (damage_is_full(&bo->damage)) {
+        drm_fill_border(bo, &rect);
+        return scale_xrgb8888(dev->workers, filter, bo->ptr, bo->pitch, &rect,
+                              NULL, buf, pitch, bpp, width, height);
+    }
+
+    for (i = 0; i < bo->damage.num; i++) {
+        scale_damage(&clip, &bo->damage.rects[i], &rect, width, height);
+        if (scale_xrgb8888(dev->workers, filter, bo->ptr, bo->pitch, &rect,
+                           &clip, buf, pitch, bpp, width, height) < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+// Updates the damaged area of the bo, in its size and format
+static int drm_render_bo(struct device *dev, struct drm_bo *bo, void *buf,
+                         int bpp, int width, int height, int pitch) {
+    int ret = -1;
 
 #ifdef RGA
-    ret = drm_render_rga(buf, bpp, width, height, pitch);
+    if (dev->scaler != SCALER_CPU)
+        ret = drm_render_rga(bo, buf, bpp, width, height, pitch);
 #endif
 
-    if (ret && bpp == dev->mode.bpp && pitch == bo->pitch &&
-        width == dev->mode.fb_width && height == dev->mode.fb_height) {
-        memcpy(bo->ptr, buf, pitch * height);
+    // Scanned out in the source format
+    if (ret && bpp == bo->bpp && width == bo->width && height == bo->height) {
+        damage_copy(bo->ptr, bpp == 12 ? bo->pitch * 2 / 3 : bo->pitch,
+                    buf, bpp == 12 ? pitch * 2 / 3 : pitch,
+                    &bo->damage, width, height, bpp,
+                    bo->uncached ? FBCOPY_UNCACHED : 0);
         ret = 0;
     }
 
+    if (ret && bo->bpp == 32 && swconv_supported(bpp)) {
+        if (width == bo->width && height == bo->height)
+            ret = drm_render_swconv(bo, buf, bpp, width, height,
+                                    bpp == 12 ? pitch * 2 / 3 : pitch);
+        else
+            ret = drm_render_scale(bo, buf, bpp, width, height,
+                                   bpp == 12 ? pitch * 2 / 3 : pitch);
+    }
+
+    return ret;
+}
+
+// How long the scaler takes to render a whole frame into a bo of its own,
+// -1 when it can't
+static int64_t drm_bench_scaler(struct device *dev, int scaler, void *buf,
+                                int bpp, int width, int height) {
+    int bo_width = dev->mode.hdisplay, bo_height = dev->mode.vdisplay;
+    int saved = dev->scaler, i, ret = 0;
+    uint64_t start, elapsed, best = UINT64_MAX;
+    struct drm_bo *bo;
+
+    if (scaler == SCALER_PLANE) {
+        bo_width = width;
+        bo_height = height;
+    }
+
+    bo = bo_cache_get(dev, bo_width, bo_height,
+                      drm_scanout_bpp(dev, bpp, bo_width != width ||
+                                      bo_height != height));
+    if (!bo)
+        return -1;
+
+    dev->scaler = scaler;
+    for (i = 0; i < SCALER_BENCH_RUNS && !ret; i++) {
+        damage_full(&bo->damage);
+
+        start = stats_now_us();
+        ret = drm_render_bo(dev, bo, buf, bpp, width, height,
+                            width * bpp / 8);
+        elapsed = stats_now_us() - start;
+        if (elapsed < best)
+            best = elapsed;
+    }
+    dev->scaler = saved;
+
+    // For the bos to come
+    bo_cache_put(dev, bo);
+    return ret ? -1 : (int64_t)best;
+}
+
+// As requested, otherwise the first of the plane, RGA and the CPU which can
+// scale frames of that size, or the fastest of them
+static int drm_choose_scaler(struct device *dev, int bpp, int width,
+                             int height) {
+    const char *bench = getenv("DRM_SCALER_BENCH");
+    const char *reason = "requested";
+    int64_t elapsed, best = -1;
+    int scaler, chosen = SCALER_CPU;
+    void *buf = NULL;
+
+    // Without a plane to scale, like headless, only the render side does
+    if (dev->scaler_request != SCALER_AUTO &&
+        (dev->scaler_request != SCALER_PLANE || dev->backend->can_scale)) {
+        chosen = dev->scaler_request;
+        goto out;
+    }
+
+    if (bench && atoi(bench))
+        buf = calloc(height, width * bpp / 8);
+    reason = buf ? "fastest" : "probed";
+
+    for (scaler = SCALER_PLANE; scaler < SCALER_NUM; scaler++) {
+        if (scaler == SCALER_PLANE &&
+            (!dev->backend->can_scale ||
+             !dev->backend->can_scale(dev, drm_scanout_bpp(dev, bpp, 0),
+                                      width, height)))
+            continue;
+
+        if (scaler == SCALER_RGA && drm_init_rga() < 0)
+            continue;
+
+        if (!buf) {
+            chosen = scaler;
+            break;
+        }
+
+        elapsed = drm_bench_scaler(dev, scaler, buf, bpp, width, height);
+        DRM_DEBUG("Scaler %s: %lld us\n", scaler_names[scaler],
+                  (long long)elapsed);
+        if (elapsed >= 0 && (best < 0 || elapsed < best)) {
+            best = elapsed;
+            chosen = scaler;
+        }
+    }
+
+    free(buf);
+out:
+    printf("[DRM] Scaler for %dx%d to %dx%d: %s (%s)\n", width, height,
+           dev->mode.hdisplay, dev->mode.vdisplay, scaler_names[chosen],
+           reason);
+    return chosen;
+}
+
+int drm_prepare_damage(void *buf, int bpp, int width, int height, int pitch,
+                       const damage_region *damage) {
+    struct device *dev = pdev;
+    struct drm_bo *bo = drm_get_bo();
+    int i, ret;
+
+    // The other bos would need this area updated when they get rendered
+    for (i = 0; i < dev->mode.fb_num; i++) {
+        if (damage)
+            damage_add(&dev->mode.bo[i]->damage, damage, width, height);
+        else
+            damage_full(&dev->mode.bo[i]->damage);
+    }
+
+    if (!damage_is_full(&bo->damage) && !bo->damage.num)
+        return 0;
+
+    // Still on screen, or about to be
+    if (dev->present_mode == PRESENT_SYNC && (bo == dev->pending_bo ||
+                                              (dev->pending_bo &&
+                                               bo == dev->scanout_bo)))
+        dev->backend->flip_done(dev);
+
+    ret = drm_render_bo(dev, bo, buf, bpp, width, height, pitch);
     if (ret)
         fprintf(stderr, "render failed\n");
     else
-        ret = drm_display();
+        damage_reset(&bo->damage);
+
+    return ret;
+}
+
+int drm_prepare(void *buf, int bpp, int width, int height, int pitch) {
+    return drm_prepare_damage(buf, bpp, width, height, pitch, NULL);
+}
+
+int drm_commit(void) {
+    struct device *dev = pdev;
+    int ret;
+
+    if (dev->present_mode != PRESENT_SYNC) {
+        ret = drm_queue(dev, drm_get_bo());
+        if (!ret)
+            dev->render_bo = NULL;
+        return ret;
+    }
+
+    ret = dev->backend->display(dev, drm_get_bo());
+    drm_release_retired(dev);
 
     drm_next_bo();
 
     return ret;
 }
+
+static int drm_import_bo(struct device *dev, struct drm_bo *bo, int dma_fd,
+                         int bpp) {
+    if (drmPrimeFDToHandle(dev->fd, dma_fd, &bo->handle)) {
+        DRM_DEBUG("Import dma fd: %d failed\n", dma_fd);
+        return -1;
+    }
+
+    // The scanout engine might not like the pitch or format
+    if (bo_add_fb(dev, bo, bpp)) {
+        DRM_DEBUG("Add fb for dma fd: %d failed\n", dma_fd);
+        return -1;
+    }
+
+    return 0;
+}
+
+int drm_import(int dma_fd, int bpp, int width, int height, int pitch) {
+    struct device *dev = pdev;
+    struct drm_bo *bo;
+
+    if (dev->import_num >= MAX_IMPORTS || !dev->backend->import)
+        return -1;
+
+    bo = malloc(sizeof(struct drm_bo));
+    if (bo == NULL) {
+        fprintf(stderr, "allocate bo failed\n");
+        return -1;
+    }
+    memset(bo, 0, sizeof(*bo));
+
+    bo->imported = 1;
+    bo->width = width;
+    bo->height = height;
+    bo->bpp = bpp;
+    bo->pitch = pitch;
+    bo->dma_fd = -1;
+
+    if (dev->backend->import(dev, bo, dma_fd, bpp)) {
+        dev->backend->bo_destroy(dev, bo);
+        return -1;
+    }
+
+    DRM_DEBUG("Imported bo: %d, %dx%d\n", bo->fb_id, width, height);
+
+    dev->imports[dev->import_num] = bo;
+    return dev->import_num++;
+}
+
+int drm_commit_import(int id) {
+    struct device *dev = pdev;
+    int ret;
+
+    if (id < 0 || id >= dev->import_num)
+        return -1;
+
+    if (dev->present_mode != PRESENT_SYNC)
+        return drm_queue(dev, dev->imports[id]);
+
+    ret = dev->backend->display(dev, dev->imports[id]);
+    drm_release_retired(dev);
+
+    return ret;
+}
+
+void drm_free_imports(void) {
+    struct device *dev = pdev;
+    int i;
+
+    drm_wait_flip();
+
+    // Freed once the next flip replaces it, the retired bo can't be on
+    // screen along with an import
+    drm_release_retired(dev);
+
+    for (i = 0; i < dev->import_num; i++) {
+        if (dev->imports[i] == dev->scanout_bo)
+            dev->retired_bo = dev->scanout_bo;
+        else
+            dev->backend->bo_destroy(dev, dev->imports[i]);
+    }
+
+    dev->import_num = 0;
+}
+
+void drm_discard(void) {
+    struct drm_bo *bo = drm_get_bo();
+
+    damage_full(&bo->damage);
+}
+
+int drm_render(void *buf, int bpp, int width, int height, int pitch) {
+    int ret;
+
+    ret = drm_prepare(buf, bpp, width, height, pitch);
+    if (ret) {
+        drm_next_bo();
+        return ret;
+    }
+
+    return drm_commit();
+}
+
+const struct display_backend drm_backend = {
+    .name = "drm",
+    .open = drm_open,
+    .close = drm_close,
+    .bo_create = bo_create,
+    .bo_destroy = bo_destroy,
+    .import = drm_import_bo,
+    .has_format = drm_has_format,
+    .can_scale = drm_can_scale,
+    .display = drm_display,
+    .flip_done = drm_flip_done,
+};
@@ -1,6 +1,8 @@
 #ifndef _DRM_DISPLAY_H
 #define _DRM_DISPLAY_H
 
+#include "damage.h"
+
 #define DEBUG
 #ifdef DEBUG
 #define DRM_DEBUG(fmt, ...) \
@@ -10,8 +12,53 @@
 #define DRM_DEBUG(fmt, ...)
 #endif
 
+/*
+ * DRM_BACKEND=drm|headless selects the output, see headless.c for the
+ * display-less one (default drm).
+ *
+ * DRM_BUFFERS overrides fb_num, DRM_PRESENT=fifo|mailbox|sync selects how
+ * the committed frames are shown:
+ * fifo: by a presentation thread, each of them (default)
+ * mailbox: by a presentation thread, only the latest at each vblank
+ * sync: on the caller's thread
+ *
+ * DRM_BO_CACHE=<MB> bounds the idle bos kept, with their fbs, for the next
+ * ones of the same size and format (64 by default, 0 for none).
+ *
+ * DRM_PLANE=primary|overlay: the primary plane on a mode of its own (default),
+ * or an overlay plane on the current one.
+ * DRM_RGB=1 converts the frames to RGB32 even when the plane takes them.
+ *
+ * DRM_SCALER=auto|plane|rga|cpu selects how the frames are scaled to the mode:
+ * plane: by the plane, scanning out bos of the source size
+ * rga: by RGA, into bos of the mode size, or the CPU when it fails
+ * cpu: by the CPU, into bos of the mode size
+ * auto: the first of them which works for the source size (default). With
+ * DRM_SCALER_BENCH=1, the one rendering a frame the fastest instead.
+ * The choice is made again for each source size.
+ */
 int drm_init(int fb_num, int bpp, int fb_width, int fb_height);
+// For a new source format, keeping the mode and what is on screen. The bos
+// are only allocated again when they can't take it as they are.
+int drm_reconfigure(int bpp, int fb_width, int fb_height);
 int drm_render(void *buf, int bpp, int width, int height, int pitch);
+
+// drm_render() split in two, to be able to drop the frame before showing it
+int drm_prepare(void *buf, int bpp, int width, int height, int pitch);
+// Only update the area changed since the previous frame
+int drm_prepare_damage(void *buf, int bpp, int width, int height, int pitch,
+                       const damage_region *damage);
+int drm_commit(void);
+// Commits are non-blocking, wait for the last one to be on screen
+int drm_wait_flip(void);
+// Drop the prepared frame instead of committing it
+void drm_discard(void);
+
+// Zero-copy: register a dma-buf as a scanout fb, returns its id or -1.
+// The dma_fd can be closed after that.
+int drm_import(int dma_fd, int bpp, int width, int height, int pitch);
+int drm_commit_import(int id);
+void drm_free_imports(void);
 void drm_deinit(void);
 
 #endif // _DRM_DISPLAY_H
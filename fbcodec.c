@@ -0,0 +1,478 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fbcodec.h"
+
+#define HASH_BITS       14
+#define MIN_MATCH       4
+#define MF_LIMIT        12 // The last match starts this far from the end
+#define LAST_LITERALS   5
+#define MAX_DISTANCE    65535
+#define SKIP_TRIGGER    6 // Search faster after 2^6 misses in a row
+
+// The skip-runs of all words changed, plus varints and the tail
+#define DELTA_BOUND(size)   ((size) + 64)
+
+struct fbcodec {
+    size_t raw_size;
+    int key_interval;
+    int since_key;
+
+    // The previous frame
+    uint8_t *ref;
+    uint32_t frame;
+    int valid;
+
+    uint8_t *scratch; // The skip-runs
+    uint32_t table[1 << HASH_BITS];
+};
+
+static inline uint32_t load32(const uint8_t *p) {
+    uint32_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t load64(const uint8_t *p) {
+    uint64_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline void store32(uint8_t *p, uint32_t v) {
+    memcpy(p, &v, sizeof(v));
+}
+
+static inline uint32_t lz4_hash(uint32_t v) {
+    return (v * 2654435761U) >> (32 - HASH_BITS);
+}
+
+static inline uint8_t *lz4_put_length(uint8_t *op, size_t len) {
+    for (; len >= 255; len -= 255)
+        *op++ = 255;
+    *op++ = len;
+    return op;
+}
+
+static size_t lz4_match_length(const uint8_t *ip, const uint8_t *match,
+                               const uint8_t *limit) {
+    const uint8_t *start = ip;
+    uint64_t diff;
+
+    while (ip + 8 <= limit) {
+        diff = load64(ip) ^ load64(match);
+        if (diff)
+            return ip - start + __builtin_ctzll(diff) / 8;
+        ip += 8;
+        match += 8;
+    }
+
+    while (ip < limit && *ip == *match) {
+        ip++;
+        match++;
+    }
+
+    return ip - start;
+}
+
+static uint8_t *lz4_put_sequence(uint8_t *op, uint8_t *oend,
+                                 const uint8_t *anchor, size_t lit,
+                                 size_t offset, size_t len) {
+    uint8_t *token;
+
+    // Worst case of the lengths' extra bytes
+    if (oend - op < (long)(lit + lit / 255 + len / 255 + 8))
+        return NULL;
+
+    token = op++;
+    *token = (lit < 15 ? lit : 15) << 4;
+    if (lit >= 15)
+        op = lz4_put_length(op, lit - 15);
+
+    memcpy(op, anchor, lit);
+    op += lit;
+
+    // The last sequence has literals only
+    if (!len)
+        return op;
+
+    *op++ = offset;
+    *op++ = offset >> 8;
+
+    len -= MIN_MATCH;
+    *token |= len < 15 ? len : 15;
+    if (len >= 15)
+        op = lz4_put_length(op, len - 15);
+
+    return op;
+}
+
+// LZ4 block format, returns 0 when dst is too small
+static size_t lz4_compress(uint8_t *dst, size_t dst_size, const uint8_t *src,
+                           size_t size, uint32_t *table) {
+    const uint8_t *ip = src, *anchor = src, *end = src + size;
+    const uint8_t *mf_limit = end - MF_LIMIT;
+    const uint8_t *match_limit = end - LAST_LITERALS;
+    uint8_t *op = dst, *oend = dst + dst_size;
+    unsigned attempts;
+    uint32_t h;
+    size_t len;
+
+    if (size < MF_LIMIT + 1)
+        goto last;
+
+    memset(table, 0, sizeof(uint32_t) << HASH_BITS);
+
+    for (ip++; ip < mf_limit;) {
+        const uint8_t *match;
+
+        // Skip faster over what doesn't compress
+        for (attempts = 1 << SKIP_TRIGGER;;) {
+            h = lz4_hash(load32(ip));
+            match = src + table[h];
+            table[h] = ip - src;
+
+            if (ip - match <= MAX_DISTANCE && load32(match) == load32(ip))
+                break;
+
+            ip += attempts++ >> SKIP_TRIGGER;
+            if (ip >= mf_limit)
+                goto last;
+        }
+
+        while (ip > anchor && match > src && ip[-1] == match[-1]) {
+            ip--;
+            match--;
+        }
+
+        len = MIN_MATCH + lz4_match_length(ip + MIN_MATCH, match + MIN_MATCH,
+                                           match_limit);
+
+        op = lz4_put_sequence(op, oend, anchor, ip - anchor, ip - match,
+                              len);
+        if (!op)
+            return 0;
+
+        ip += len;
+        anchor = ip;
+
+        if (ip < mf_limit)
+            table[lz4_hash(load32(ip - 2))] = ip - 2 - src;
+    }
+
+last:
+    op = lz4_put_sequence(op, oend, anchor, end - anchor, 0, 0);
+    return op ? op - dst : 0;
+}
+
+// Returns the decompressed size, -1 when invalid or dst is too small
+static long lz4_decompress(uint8_t *dst, size_t dst_size, const uint8_t *src,
+                           size_t size) {
+    const uint8_t *ip = src, *iend = src + size, *match;
+    uint8_t *op = dst, *oend = dst + dst_size;
+    size_t lit, len, offset, chunk;
+    uint8_t token, byte;
+
+    while (ip < iend) {
+        token = *ip++;
+
+        lit = token >> 4;
+        if (lit == 15) {
+            do {
+                if (ip == iend)
+                    return -1;
+                byte = *ip++;
+                lit += byte;
+            } while (byte == 255);
+        }
+
+        if (lit > (size_t)(iend - ip) || lit > (size_t)(oend - op))
+            return -1;
+
+        memcpy(op, ip, lit);
+        op += lit;
+        ip += lit;
+
+        if (ip == iend)
+            break;
+
+        if (iend - ip < 2)
+            return -1;
+        offset = ip[0] | ip[1] << 8;
+        ip += 2;
+
+        if (!offset || offset > (size_t)(op - dst))
+            return -1;
+
+        len = token & 15;
+        if (len == 15) {
+            do {
+                if (ip == iend)
+                    return -1;
+                byte = *ip++;
+                len += byte;
+            } while (byte == 255);
+        }
+        len += MIN_MATCH;
+
+        if (len > (size_t)(oend - op))
+            return -1;
+
+        // Overlapping for runs, the repeated pattern doubles every copy
+        for (match = op - offset; len; len -= chunk) {
+            chunk = len < (size_t)(op - match) ? len : (size_t)(op - match);
+            memcpy(op, match, chunk);
+            op += chunk;
+        }
+    }
+
+    return op - dst;
+}
+
+static inline uint8_t *put_varint(uint8_t *p, size_t v) {
+    for (; v >= 0x80; v >>= 7)
+        *p++ = v | 0x80;
+    *p++ = v;
+    return p;
+}
+
+static inline const uint8_t *get_varint(const uint8_t *p, const uint8_t *end,
+                                        size_t *v) {
+    int shift;
+
+    *v = 0;
+    for (shift = 0; p < end && shift < 64; shift += 7) {
+        *v |= (size_t)(*p & 0x7f) << shift;
+        if (!(*p++ & 0x80))
+            return p;
+    }
+
+    return NULL;
+}
+
+// The skip-runs against the previous frame into scratch, updating it
+static size_t delta_encode(fbcodec *codec, const uint8_t *src) {
+    uint8_t *ref = codec->ref, *op = codec->scratch;
+    size_t words = codec->raw_size / 4, i = 0, start, changed, j;
+    uint32_t v;
+
+    while (i < words) {
+        // Unchanged, a cache line at a time first
+        start = i;
+        while (i + 16 <= words && !memcmp(src + i * 4, ref + i * 4, 64))
+            i += 16;
+        while (i < words && load32(src + i * 4) == load32(ref + i * 4))
+            i++;
+
+        if (i == words)
+            break;
+
+        // Changed, up to a single unchanged word in between
+        changed = i;
+        while (i < words) {
+            if (load32(src + i * 4) != load32(ref + i * 4))
+                i++;
+            else if (i + 1 < words &&
+                     load32(src + i * 4 + 4) != load32(ref + i * 4 + 4))
+                i += 2;
+            else
+                break;
+        }
+
+        op = put_varint(op, changed - start);
+        op = put_varint(op, i - changed);
+
+        for (j = changed; j < i; j++) {
+            v = load32(src + j * 4);
+            store32(op, v ^ load32(ref + j * 4));
+            store32(ref + j * 4, v);
+            op += 4;
+        }
+    }
+
+    for (j = words * 4; j < codec->raw_size; j++) {
+        *op++ = src[j] ^ ref[j];
+        ref[j] = src[j];
+    }
+
+    return op - codec->scratch;
+}
+
+static int delta_decode(fbcodec *codec, const uint8_t *ip, size_t size) {
+    const uint8_t *iend = ip + size;
+    size_t words = codec->raw_size / 4, tail = codec->raw_size % 4;
+    size_t pos = 0, skip, changed, j;
+    uint8_t *ref = codec->ref;
+
+    while ((size_t)(iend - ip) > tail) {
+        ip = get_varint(ip, iend, &skip);
+        if (ip)
+            ip = get_varint(ip, iend, &changed);
+        if (!ip || skip > words - pos || changed > words - pos - skip ||
+            changed > (size_t)(iend - ip) / 4)
+            return -1;
+
+        pos += skip;
+        for (j = 0; j < changed; j++, pos++, ip += 4)
+            store32(ref + pos * 4, load32(ref + pos * 4) ^ load32(ip));
+    }
+
+    if ((size_t)(iend - ip) != tail)
+        return -1;
+
+    for (j = words * 4; j < codec->raw_size; j++)
+        ref[j] ^= *ip++;
+
+    return 0;
+}
+
+size_t fbcodec_bound(size_t raw_size) {
+    return (sizeof(fbcodec_header) + raw_size + 4095) & ~(size_t)4095;
+}
+
+fbcodec *fbcodec_create(size_t raw_size, int key_interval) {
+    fbcodec *codec;
+
+    codec = malloc(sizeof(*codec));
+    if (!codec) {
+        fprintf(stderr, "allocate codec failed\n");
+        return NULL;
+    }
+    memset(codec, 0, sizeof(*codec));
+
+    codec->raw_size = raw_size;
+    codec->key_interval = key_interval;
+
+    codec->ref = malloc(raw_size);
+    codec->scratch = malloc(DELTA_BOUND(raw_size));
+    if (!codec->ref || !codec->scratch) {
+        fprintf(stderr, "allocate codec buffers failed\n");
+        fbcodec_destroy(codec);
+        return NULL;
+    }
+
+    return codec;
+}
+
+void fbcodec_destroy(fbcodec *codec) {
+    if (!codec)
+        return;
+
+    free(codec->ref);
+    free(codec->scratch);
+    free(codec);
+}
+
+void fbcodec_reset(fbcodec *codec) {
+    codec->valid = 0;
+}
+
+size_t fbcodec_encode(fbcodec *codec, void *dst, const void *src,
+                      uint32_t frame) {
+    fbcodec_header *hdr = dst;
+    uint8_t *out = (uint8_t *)(hdr + 1);
+    size_t room = fbcodec_bound(codec->raw_size) - sizeof(*hdr);
+    size_t size = 0, delta;
+
+    memcpy(hdr->magic, FBCODEC_MAGIC, 4);
+    hdr->frame = frame;
+    hdr->ref_frame = codec->frame;
+    hdr->raw_size = codec->raw_size;
+    memset(hdr->reserved, 0, sizeof(hdr->reserved));
+
+    if (codec->valid && (!codec->key_interval ||
+                         codec->since_key < codec->key_interval)) {
+        delta = delta_encode(codec, src);
+
+        hdr->type = FBCODEC_DELTA;
+        size = lz4_compress(out, room, codec->scratch, delta, codec->table);
+    } else {
+        memcpy(codec->ref, src, codec->raw_size);
+    }
+
+    // Compressed from the copy, the source might be changing meanwhile
+    if (!size) {
+        hdr->type = FBCODEC_KEY;
+        size = lz4_compress(out, room, codec->ref, codec->raw_size,
+                            codec->table);
+    }
+
+    if (!size) {
+        hdr->type = FBCODEC_RAW;
+        memcpy(out, codec->ref, codec->raw_size);
+        size = codec->raw_size;
+    }
+
+    if (hdr->type == FBCODEC_DELTA)
+        codec->since_key++;
+    else
+        codec->since_key = 1;
+
+    hdr->size = size;
+    codec->frame = frame;
+    codec->valid = 1;
+
+    return sizeof(*hdr) + size;
+}
+
+int fbcodec_decode(fbcodec *codec, const void *enc, size_t size) {
+    const fbcodec_header *hdr = enc;
+    const uint8_t *data = (const uint8_t *)(hdr + 1);
+    long delta;
+
+    if (size < sizeof(*hdr) || memcmp(hdr->magic, FBCODEC_MAGIC, 4) ||
+        hdr->raw_size != codec->raw_size ||
+        hdr->size > size - sizeof(*hdr))
+        return -1;
+
+    // Published again, like the relay does with unchanged frames
+    if (codec->valid && codec->frame == hdr->frame)
+        return 0;
+
+    switch (hdr->type) {
+    case FBCODEC_RAW:
+        if (hdr->size != codec->raw_size)
+            return -1;
+        memcpy(codec->ref, data, codec->raw_size);
+        break;
+    case FBCODEC_KEY:
+        if (lz4_decompress(codec->ref, codec->raw_size, data, hdr->size) !=
+            (long)codec->raw_size)
+            goto err;
+        break;
+    case FBCODEC_DELTA:
+        if (!codec->valid || codec->frame != hdr->ref_frame)
+            return 1;
+
+        delta = lz4_decompress(codec->scratch, DELTA_BOUND(codec->raw_size),
+                               data, hdr->size);
+        if (delta < 0 || delta_decode(codec, codec->scratch, delta) < 0)
+            goto err;
+        break;
+    default:
+        return -1;
+    }
+
+    codec->frame = hdr->frame;
+    codec->valid = 1;
+    return 0;
+err:
+    // Partially decoded
+    codec->valid = 0;
+    return -1;
+}
+
+uint8_t *fbcodec_data(fbcodec *codec) {
+    return codec->ref;
+}
+
+int fbcodec_frame(fbcodec *codec, uint32_t *frame) {
+    if (!codec->valid)
+        return -1;
+
+    *frame = codec->frame;
+    return 0;
+}
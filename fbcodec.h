@@ -0,0 +1,65 @@
+#ifndef _FBCODEC_H
+#define _FBCODEC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Encoded fbs, for relaying onto slow or remote filesystems: consecutive UI
+ * frames are mostly identical, so only their difference is written.
+ *
+ * An encoded fb is a fbcodec_header, then size bytes of:
+ * raw:   the fb as is, when it doesn't compress.
+ * key:   the fb, LZ4 block compressed.
+ * delta: skip-runs of the 32-bit words XORed with ref_frame, LZ4 block
+ *        compressed. Each run is the number of unchanged words, the number
+ *        of changed ones (as LEB128 varints) and their XORs. The bytes
+ *        after the last whole word are always a changed run.
+ *
+ * The encoder keeps a copy of the previous frame and the decoder the last
+ * decoded one, a delta only decodes on top of its ref_frame.
+ */
+
+#define FBCODEC_MAGIC   "FBZ1"
+
+enum {
+    FBCODEC_RAW,
+    FBCODEC_KEY,
+    FBCODEC_DELTA,
+};
+
+typedef struct {
+    char magic[4];
+    uint32_t type;      // FBCODEC_*
+    uint32_t frame;     // Frame number of the content
+    uint32_t ref_frame; // The frame a delta applies to
+    uint32_t raw_size;  // Of the decoded fb
+    uint32_t size;      // Of the encoded data after the header
+    uint32_t reserved[2];
+} fbcodec_header;
+
+typedef struct fbcodec fbcodec;
+
+// Room for an encoded fb of raw_size bytes, page aligned
+size_t fbcodec_bound(size_t raw_size);
+
+// key_interval: frames between keyframes, 0 for only the first one
+fbcodec *fbcodec_create(size_t raw_size, int key_interval);
+void fbcodec_destroy(fbcodec *codec);
+
+// The next fb is encoded as a keyframe, or needs one to decode
+void fbcodec_reset(fbcodec *codec);
+
+// Into dst of fbcodec_bound() bytes, returns the size of the encoded fb
+size_t fbcodec_encode(fbcodec *codec, void *dst, const void *src,
+                      uint32_t frame);
+
+// Returns 0 when decoded (or already was), 1 when it needs another
+// ref_frame, -1 if invalid
+int fbcodec_decode(fbcodec *codec, const void *enc, size_t size);
+
+// The last decoded (or encoded) fb, and its frame number
+uint8_t *fbcodec_data(fbcodec *codec);
+int fbcodec_frame(fbcodec *codec, uint32_t *frame);
+
+#endif // _FBCODEC_H
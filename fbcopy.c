@@ -0,0 +1,425 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define FBCOPY_X86
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define FBCOPY_NEON
+#endif
+
+#include "fbcopy.h"
+#include "workers.h"
+
+// Far enough ahead to cover the memory latency at full bandwidth
+#define FBCOPY_PREFETCH 512
+
+// Bigger than what a core can expect to keep of the shared cache
+#define FBCOPY_NT_MIN_DEFAULT   (1 << 20)
+// Smaller copies aren't worth waking up the threads for
+#define FBCOPY_MT_MIN_DEFAULT   (4 << 20)
+// Copies timed for each thread count when tuning
+#define FBCOPY_TUNE_COPIES      4
+#define FBCOPY_MAX_THREADS      32
+// Contiguous copies are split on cache lines of the destination
+#define FBCOPY_LINE             64
+
+struct fbcopy_ops {
+    const char *name;
+    void (*copy)(uint8_t *dst, const uint8_t *src, size_t size);
+    // Orders the non-temporal stores before the following ones
+    void (*fence)(void);
+};
+
+static void copy_memcpy(uint8_t *dst, const uint8_t *src, size_t size) {
+    memcpy(dst, src, size);
+}
+
+static void fence_none(void) {
+}
+
+#ifdef FBCOPY_X86
+__attribute__((target("sse2")))
+static void copy_sse2(uint8_t *dst, const uint8_t *src, size_t size) {
+    size_t head = -(uintptr_t)dst & 15;
+    __m128i a, b, c, d;
+
+    if (size < head + 64) {
+        memcpy(dst, src, size);
+        return;
+    }
+
+    // Streaming stores need an aligned destination
+    memcpy(dst, src, head);
+    dst += head;
+    src += head;
+    size -= head;
+
+    for (; size >= 64; size -= 64, src += 64, dst += 64) {
+        _mm_prefetch((const char *)src + FBCOPY_PREFETCH, _MM_HINT_T0);
+
+        a = _mm_loadu_si128((const __m128i *)src);
+        b = _mm_loadu_si128((const __m128i *)(src + 16));
+        c = _mm_loadu_si128((const __m128i *)(src + 32));
+        d = _mm_loadu_si128((const __m128i *)(src + 48));
+        _mm_stream_si128((__m128i *)dst, a);
+        _mm_stream_si128((__m128i *)(dst + 16), b);
+        _mm_stream_si128((__m128i *)(dst + 32), c);
+        _mm_stream_si128((__m128i *)(dst + 48), d);
+    }
+
+    memcpy(dst, src, size);
+}
+
+__attribute__((target("avx2")))
+static void copy_avx2(uint8_t *dst, const uint8_t *src, size_t size) {
+    size_t head = -(uintptr_t)dst & 31;
+    __m256i a, b, c, d;
+
+    if (size < head + 128) {
+        memcpy(dst, src, size);
+        return;
+    }
+
+    memcpy(dst, src, head);
+    dst += head;
+    src += head;
+    size -= head;
+
+    for (; size >= 128; size -= 128, src += 128, dst += 128) {
+        _mm_prefetch((const char *)src + FBCOPY_PREFETCH, _MM_HINT_T0);
+        _mm_prefetch((const char *)src + FBCOPY_PREFETCH + 64, _MM_HINT_T0);
+
+        a = _mm256_loadu_si256((const __m256i *)src);
+        b = _mm256_loadu_si256((const __m256i *)(src + 32));
+        c = _mm256_loadu_si256((const __m256i *)(src + 64));
+        d = _mm256_loadu_si256((const __m256i *)(src + 96));
+        _mm256_stream_si256((__m256i *)dst, a);
+        _mm256_stream_si256((__m256i *)(dst + 32), b);
+        _mm256_stream_si256((__m256i *)(dst + 64), c);
+        _mm256_stream_si256((__m256i *)(dst + 96), d);
+    }
+
+    memcpy(dst, src, size);
+}
+
+__attribute__((target("sse2")))
+static void fence_sse2(void) {
+    _mm_sfence();
+}
+#endif
+
+#ifdef FBCOPY_NEON
+static void copy_neon(uint8_t *dst, const uint8_t *src, size_t size) {
+    for (; size >= 64; size -= 64, src += 64, dst += 64) {
+        __builtin_prefetch(src + FBCOPY_PREFETCH, 0, 3);
+#ifdef __aarch64__
+        // Non-temporal pairs, there are no intrinsics for them
+        __asm__ volatile(
+            "ldp q0, q1, [%1]\n"
+            "ldp q2, q3, [%1, #32]\n"
+            "stnp q0, q1, [%0]\n"
+            "stnp q2, q3, [%0, #32]\n"
+            : : "r"(dst), "r"(src) : "v0", "v1", "v2", "v3", "memory");
+#else
+        vst1q_u8(dst, vld1q_u8(src));
+        vst1q_u8(dst + 16, vld1q_u8(src + 16));
+        vst1q_u8(dst + 32, vld1q_u8(src + 32));
+        vst1q_u8(dst + 48, vld1q_u8(src + 48));
+#endif
+    }
+
+    memcpy(dst, src, size);
+}
+
+static void fence_neon(void) {
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+#endif
+
+static const struct fbcopy_ops fbcopy_ops_list[] = {
+#ifdef FBCOPY_NEON
+    { "neon", copy_neon, fence_neon },
+#endif
+#ifdef FBCOPY_X86
+    { "avx2", copy_avx2, fence_sse2 },
+    { "sse2", copy_sse2, fence_sse2 },
+#endif
+    { "memcpy", copy_memcpy, fence_none },
+};
+
+#define FBCOPY_OPS_NUM \
+    (int)(sizeof(fbcopy_ops_list) / sizeof(fbcopy_ops_list[0]))
+
+static const struct fbcopy_ops *fbcopy_ops;
+static size_t fbcopy_nt_min;
+
+// Striped copies, the thread count is tuned on the first large copies to
+// the fewest threads getting (nearly) the best bandwidth
+static struct {
+    int inited;
+    size_t min_size;
+    struct workers *workers;
+
+    int threads; // 0 while tuning
+    int trying;
+    int copies;
+    double rates[FBCOPY_MAX_THREADS + 1]; // Best MB/s of each thread count
+} fbcopy_mt;
+
+// Held by the thread whose copy is striped
+static pthread_mutex_t fbcopy_mt_lock = PTHREAD_MUTEX_INITIALIZER;
+
+struct fbcopy_job {
+    const struct fbcopy_ops *ops;
+    uint8_t *dst;
+    size_t dst_pitch;
+    const uint8_t *src;
+    size_t src_pitch;
+    size_t width;
+    int rows; // 1 for contiguous copies, split in byte ranges
+    int stripes;
+};
+
+static uint64_t fbcopy_now_us(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static int fbcopy_available(const struct fbcopy_ops *ops) {
+#ifdef FBCOPY_X86
+    __builtin_cpu_init();
+
+    if (!strcmp(ops->name, "avx2"))
+        return __builtin_cpu_supports("avx2");
+    if (!strcmp(ops->name, "sse2"))
+        return __builtin_cpu_supports("sse2");
+#endif
+    return 1;
+}
+
+static const struct fbcopy_ops *fbcopy_find(const char *name) {
+    int i;
+
+    // The list is sorted from the fastest
+    for (i = 0; i < FBCOPY_OPS_NUM; i++) {
+        if (name && strcmp(name, fbcopy_ops_list[i].name))
+            continue;
+
+        if (fbcopy_available(&fbcopy_ops_list[i]))
+            return &fbcopy_ops_list[i];
+    }
+
+    return NULL;
+}
+
+static const struct fbcopy_ops *fbcopy_get_ops(void) {
+    const struct fbcopy_ops *ops;
+    const char *name, *nt_min;
+
+    ops = __atomic_load_n(&fbcopy_ops, __ATOMIC_ACQUIRE);
+    if (ops)
+        return ops;
+
+    name = getenv("FBCOPY");
+    ops = fbcopy_find(name);
+    if (!ops) {
+        fprintf(stderr, "fbcopy %s unavailable\n", name);
+        ops = &fbcopy_ops_list[FBCOPY_OPS_NUM - 1];
+    }
+
+    nt_min = getenv("FBCOPY_NT_MIN");
+    fbcopy_nt_min = nt_min ? strtoul(nt_min, NULL, 0) : FBCOPY_NT_MIN_DEFAULT;
+    __atomic_store_n(&fbcopy_ops, ops, __ATOMIC_RELEASE);
+    return ops;
+}
+
+const char *fbcopy_name(void) {
+    return fbcopy_get_ops()->name;
+}
+
+int fbcopy_set(const char *name) {
+    const struct fbcopy_ops *ops = fbcopy_find(name);
+
+    if (!ops)
+        return -1;
+
+    fbcopy_get_ops();
+    __atomic_store_n(&fbcopy_ops, ops, __ATOMIC_RELEASE);
+    return 0;
+}
+
+void fbcopy(void *dst, const void *src, size_t size, int flags) {
+    fbcopy_rows(dst, size, src, size, size, 1, flags);
+}
+
+static void fbcopy_stripe(const struct fbcopy_ops *ops, uint8_t *dst,
+                          size_t dst_pitch, const uint8_t *src,
+                          size_t src_pitch, size_t width, int rows) {
+    int y;
+
+    if (dst_pitch == width && src_pitch == width) {
+        ops->copy(dst, src, width * rows);
+    } else {
+        for (y = 0; y < rows; y++)
+            ops->copy(dst + y * dst_pitch, src + y * src_pitch, width);
+    }
+
+    // On the thread which did the stores
+    ops->fence();
+}
+
+// Start of a stripe of a contiguous copy
+static size_t fbcopy_job_offset(struct fbcopy_job *job, int index) {
+    uintptr_t dst = (uintptr_t)job->dst, line;
+
+    if (index == job->stripes)
+        return job->width;
+
+    line = (dst + job->width * index / job->stripes) &
+        ~(uintptr_t)(FBCOPY_LINE - 1);
+    return line > dst ? line - dst : 0;
+}
+
+static void fbcopy_job_run(void *data, int index) {
+    struct fbcopy_job *job = data;
+    int y0 = job->rows * index / job->stripes;
+    int y1 = job->rows * (index + 1) / job->stripes;
+    size_t x0, x1;
+
+    if (job->rows == 1) {
+        x0 = fbcopy_job_offset(job, index);
+        x1 = fbcopy_job_offset(job, index + 1);
+        fbcopy_stripe(job->ops, job->dst + x0, x1 - x0, job->src + x0,
+                      x1 - x0, x1 - x0, 1);
+        return;
+    }
+
+    fbcopy_stripe(job->ops, job->dst + y0 * job->dst_pitch, job->dst_pitch,
+                  job->src + y0 * job->src_pitch, job->src_pitch,
+                  job->width, y1 - y0);
+}
+
+static void fbcopy_mt_init(void) {
+    const char *threads = getenv("FBCOPY_THREADS");
+    const char *min_size = getenv("FBCOPY_MT_MIN");
+    int num = threads ? atoi(threads) : 0;
+
+    fbcopy_mt.inited = 1;
+    fbcopy_mt.min_size = min_size ? strtoul(min_size, NULL, 0) :
+        FBCOPY_MT_MIN_DEFAULT;
+
+    if (num == 1)
+        return;
+
+    fbcopy_mt.workers = workers_create(num);
+    if (workers_pin(fbcopy_mt.workers) < 0)
+        fprintf(stderr, "fbcopy pin threads failed\n");
+
+    // Forced, no tuning
+    if (num > 1)
+        fbcopy_mt.threads = workers_num(fbcopy_mt.workers);
+    else
+        fbcopy_mt.trying = 1;
+}
+
+// Called with the time of each copy while tuning
+static void fbcopy_mt_tune(size_t size, uint64_t us) {
+    int max = workers_num(fbcopy_mt.workers);
+    double *rates = fbcopy_mt.rates;
+    double rate = (double)size / (us + 1), best = 0;
+    int i;
+
+    if (rate > rates[fbcopy_mt.trying])
+        rates[fbcopy_mt.trying] = rate;
+
+    if (++fbcopy_mt.copies < FBCOPY_TUNE_COPIES)
+        return;
+
+    fbcopy_mt.copies = 0;
+    if (++fbcopy_mt.trying <= max)
+        return;
+
+    for (i = 1; i <= max; i++) {
+        if (rates[i] > best)
+            best = rates[i];
+    }
+
+    for (i = 1; i < max && rates[i] < best * 0.95; i++);
+
+    fbcopy_mt.threads = i;
+}
+
+// Stripes to split a copy into, 0 to do it on the caller's thread
+static int fbcopy_mt_stripes(size_t size) {
+    if (!fbcopy_mt.inited)
+        fbcopy_mt_init();
+
+    if (size < fbcopy_mt.min_size || workers_num(fbcopy_mt.workers) < 2)
+        return 0;
+
+    return fbcopy_mt.threads ? fbcopy_mt.threads : fbcopy_mt.trying;
+}
+
+void fbcopy_rows(void *dst, size_t dst_pitch, const void *src,
+                 size_t src_pitch, size_t width, int rows, int flags) {
+    const struct fbcopy_ops *ops = fbcopy_get_ops();
+    struct fbcopy_job job;
+    size_t size = width * rows;
+    uint64_t start;
+
+    // Small enough to be worth keeping in the cache
+    if (!(flags & FBCOPY_UNCACHED) && size < fbcopy_nt_min)
+        ops = &fbcopy_ops_list[FBCOPY_OPS_NUM - 1];
+
+    // The workers busy with another thread's copy, this one stays on the
+    // caller's thread
+    if (pthread_mutex_trylock(&fbcopy_mt_lock)) {
+        fbcopy_stripe(ops, dst, dst_pitch, src, src_pitch, width, rows);
+        return;
+    }
+
+    job.stripes = fbcopy_mt_stripes(size);
+    if (!job.stripes) {
+        pthread_mutex_unlock(&fbcopy_mt_lock);
+        fbcopy_stripe(ops, dst, dst_pitch, src, src_pitch, width, rows);
+        return;
+    }
+
+    job.ops = ops;
+    job.dst = dst;
+    job.dst_pitch = dst_pitch;
+    job.src = src;
+    job.src_pitch = src_pitch;
+    job.width = width;
+    job.rows = rows;
+
+    // Whole frames of packed rows too, as a single row of their bytes
+    if (dst_pitch == width && src_pitch == width) {
+        job.width = size;
+        job.rows = 1;
+    }
+
+    if (job.rows > 1 && job.stripes > job.rows)
+        job.stripes = job.rows;
+
+    start = fbcopy_now_us();
+    workers_run(fbcopy_mt.workers, fbcopy_job_run, &job, job.stripes);
+
+    if (!fbcopy_mt.threads)
+        fbcopy_mt_tune(size, fbcopy_now_us() - start);
+    pthread_mutex_unlock(&fbcopy_mt_lock);
+}
+
+void fbcopy_deinit(void) {
+    workers_destroy(fbcopy_mt.workers);
+    memset(&fbcopy_mt, 0, sizeof(fbcopy_mt));
+}
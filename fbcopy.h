@@ -0,0 +1,40 @@
+#ifndef _FBCOPY_H
+#define _FBCOPY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Frame copies with non-temporal stores, which skip the cache: the copied
+ * frame is too big to stay there anyway, or the destination is a
+ * write-combined mapping where reads for ownership are slow.
+ *
+ * The kernels (memcpy, sse2, avx2, neon) are picked at runtime from the CPU
+ * features, FBCOPY=<name> forces one of them. Cached copies smaller than
+ * FBCOPY_NT_MIN bytes (1MiB by default) use memcpy.
+ *
+ * Copies of FBCOPY_MT_MIN bytes (4MiB by default) or more are split in row
+ * stripes, or in byte ranges when contiguous, over pinned threads, as many
+ * as FBCOPY_THREADS or else as are worth it for the memory bandwidth,
+ * measured on the first copies. Copies made meanwhile by other threads stay
+ * on their own thread.
+ */
+
+// The destination is a write-combined or uncached mapping, like dumb bos
+#define FBCOPY_UNCACHED (1 << 0)
+
+// Name of the kernel in use
+const char *fbcopy_name(void);
+// Force a kernel, for benchmarks
+int fbcopy_set(const char *name);
+
+void fbcopy(void *dst, const void *src, size_t size, int flags);
+
+// Copy rows of width bytes between buffers of different pitches
+void fbcopy_rows(void *dst, size_t dst_pitch, const void *src,
+                 size_t src_pitch, size_t width, int rows, int flags);
+
+// Stop the copy threads
+void fbcopy_deinit(void);
+
+#endif // _FBCOPY_H
@@ -0,0 +1,402 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define FBHASH_X86
+#endif
+
+#if defined(__aarch64__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#define FBHASH_ARM
+#endif
+
+#include "fbhash.h"
+
+// CRC32C, reversed
+#define FBHASH_POLY 0x82f63b78
+
+// After that many frames changed all over, the tiles are only hashed again
+// every FBHASH_BACKOFF frames: full frame updates gain nothing from them
+#define FBHASH_BUSY     8
+#define FBHASH_BACKOFF  30
+
+struct fbhash_ops {
+    const char *name;
+    uint64_t (*hash)(const uint8_t *data, size_t size, uint64_t seed);
+};
+
+struct fbhash_tiles {
+    int width;
+    int height;
+    int bpp;
+    int cols;
+    int rows;
+
+    int valid;
+    int hashed; // The last frame was, into next
+    int busy; // Frames in a row changed all over
+    int backoff; // Frames left without hashing
+    uint64_t *hashes; // Of the last frame shown
+    uint64_t *next; // Of the last frame hashed
+};
+
+static uint32_t fbhash_table[8][256];
+
+static void fbhash_init_table(void) {
+    uint32_t crc;
+    int i, j;
+
+    for (i = 0; i < 256; i++) {
+        crc = i;
+        for (j = 0; j < 8; j++)
+            crc = crc & 1 ? (crc >> 1) ^ FBHASH_POLY : crc >> 1;
+        fbhash_table[0][i] = crc;
+    }
+
+    for (i = 0; i < 256; i++) {
+        for (j = 1; j < 8; j++)
+            fbhash_table[j][i] = (fbhash_table[j - 1][i] >> 8) ^
+                fbhash_table[0][fbhash_table[j - 1][i] & 0xff];
+    }
+}
+
+// Slice-by-8, of a little endian word like the CRC instructions
+static inline uint32_t soft_crc64(uint32_t crc, uint64_t word) {
+    uint32_t hi = word >> 32;
+
+    crc ^= (uint32_t)word;
+    return fbhash_table[7][crc & 0xff] ^
+        fbhash_table[6][(crc >> 8) & 0xff] ^
+        fbhash_table[5][(crc >> 16) & 0xff] ^
+        fbhash_table[4][crc >> 24] ^
+        fbhash_table[3][hi & 0xff] ^
+        fbhash_table[2][(hi >> 8) & 0xff] ^
+        fbhash_table[1][(hi >> 16) & 0xff] ^
+        fbhash_table[0][hi >> 24];
+}
+
+static inline uint32_t soft_crc8(uint32_t crc, uint8_t byte) {
+    return (crc >> 8) ^ fbhash_table[0][(crc ^ byte) & 0xff];
+}
+
+/*
+ * The lanes hide the latency of the CRC instructions. 32 bytes at a time
+ * into lanes a-d, the words left into a, then the bytes. The CRCs are
+ * linear, the same change in two lanes would cancel out in a xor.
+ */
+static inline uint64_t fbhash_fold(uint32_t a, uint32_t b, uint32_t c,
+                                   uint32_t d) {
+    return ((uint64_t)b << 32 | a) +
+        ((uint64_t)d << 32 | c) * 0x9e3779b97f4a7c15ULL;
+}
+
+static uint64_t hash_soft(const uint8_t *data, size_t size, uint64_t seed) {
+    uint32_t a = seed, b = seed >> 32, c = 0, d = 0;
+    uint64_t w[4];
+
+    for (; size >= 32; size -= 32, data += 32) {
+        memcpy(w, data, 32);
+        a = soft_crc64(a, w[0]);
+        b = soft_crc64(b, w[1]);
+        c = soft_crc64(c, w[2]);
+        d = soft_crc64(d, w[3]);
+    }
+
+    for (; size >= 8; size -= 8, data += 8) {
+        memcpy(w, data, 8);
+        a = soft_crc64(a, w[0]);
+    }
+
+    for (; size; size--, data++)
+        a = soft_crc8(a, *data);
+
+    return fbhash_fold(a, b, c, d);
+}
+
+#ifdef FBHASH_X86
+__attribute__((target("sse4.2")))
+static uint64_t hash_sse42(const uint8_t *data, size_t size, uint64_t seed) {
+    uint64_t a = (uint32_t)seed, b = seed >> 32, c = 0, d = 0;
+    uint64_t w[4];
+
+    for (; size >= 32; size -= 32, data += 32) {
+        memcpy(w, data, 32);
+        a = _mm_crc32_u64(a, w[0]);
+        b = _mm_crc32_u64(b, w[1]);
+        c = _mm_crc32_u64(c, w[2]);
+        d = _mm_crc32_u64(d, w[3]);
+    }
+
+    for (; size >= 8; size -= 8, data += 8) {
+        memcpy(w, data, 8);
+        a = _mm_crc32_u64(a, w[0]);
+    }
+
+    for (; size; size--, data++)
+        a = _mm_crc32_u8(a, *data);
+
+    return fbhash_fold(a, b, c, d);
+}
+#endif
+
+#ifdef FBHASH_ARM
+__attribute__((target("+crc")))
+static uint64_t hash_crc(const uint8_t *data, size_t size, uint64_t seed) {
+    uint32_t a = seed, b = seed >> 32, c = 0, d = 0;
+    uint64_t w[4];
+
+    for (; size >= 32; size -= 32, data += 32) {
+        memcpy(w, data, 32);
+        a = __crc32cd(a, w[0]);
+        b = __crc32cd(b, w[1]);
+        c = __crc32cd(c, w[2]);
+        d = __crc32cd(d, w[3]);
+    }
+
+    for (; size >= 8; size -= 8, data += 8) {
+        memcpy(w, data, 8);
+        a = __crc32cd(a, w[0]);
+    }
+
+    for (; size; size--, data++)
+        a = __crc32cb(a, *data);
+
+    return fbhash_fold(a, b, c, d);
+}
+#endif
+
+static const struct fbhash_ops fbhash_ops_list[] = {
+#ifdef FBHASH_ARM
+    { "crc", hash_crc },
+#endif
+#ifdef FBHASH_X86
+    { "sse42", hash_sse42 },
+#endif
+    { "soft", hash_soft },
+};
+
+#define FBHASH_OPS_NUM \
+    (int)(sizeof(fbhash_ops_list) / sizeof(fbhash_ops_list[0]))
+
+static const struct fbhash_ops *fbhash_ops;
+
+static int fbhash_available(const struct fbhash_ops *ops) {
+#ifdef FBHASH_X86
+    __builtin_cpu_init();
+
+    if (!strcmp(ops->name, "sse42"))
+        return __builtin_cpu_supports("sse4.2");
+#endif
+#ifdef FBHASH_ARM
+    if (!strcmp(ops->name, "crc"))
+        return !!(getauxval(AT_HWCAP) & HWCAP_CRC32);
+#endif
+    return 1;
+}
+
+static const struct fbhash_ops *fbhash_find(const char *name) {
+    int i;
+
+    // The list is sorted from the fastest
+    for (i = 0; i < FBHASH_OPS_NUM; i++) {
+        if (name && strcmp(name, fbhash_ops_list[i].name))
+            continue;
+
+        if (fbhash_available(&fbhash_ops_list[i]))
+            return &fbhash_ops_list[i];
+    }
+
+    return NULL;
+}
+
+static const struct fbhash_ops *fbhash_get_ops(void) {
+    const struct fbhash_ops *ops;
+    const char *name;
+
+    ops = __atomic_load_n(&fbhash_ops, __ATOMIC_ACQUIRE);
+    if (ops)
+        return ops;
+
+    name = getenv("FBHASH");
+    ops = fbhash_find(name);
+    if (!ops) {
+        fprintf(stderr, "fbhash %s unavailable\n", name);
+        ops = &fbhash_ops_list[FBHASH_OPS_NUM - 1];
+    }
+
+    fbhash_init_table();
+    __atomic_store_n(&fbhash_ops, ops, __ATOMIC_RELEASE);
+    return ops;
+}
+
+const char *fbhash_name(void) {
+    return fbhash_get_ops()->name;
+}
+
+int fbhash_set(const char *name) {
+    const struct fbhash_ops *ops = fbhash_find(name);
+
+    if (!ops)
+        return -1;
+
+    fbhash_get_ops();
+    __atomic_store_n(&fbhash_ops, ops, __ATOMIC_RELEASE);
+    return 0;
+}
+
+uint64_t fbhash(const void *data, size_t size, uint64_t seed) {
+    return fbhash_get_ops()->hash(data, size, seed);
+}
+
+uint64_t fbhash_frame(const void *data, int pitch, int width, int height,
+                      int bpp) {
+    const struct fbhash_ops *ops = fbhash_get_ops();
+    const uint8_t *ptr = data;
+    int rows = bpp == 12 ? height * 3 / 2 : height;
+    int row_size = bpp == 12 ? width : width * bpp / 8;
+    uint64_t hash = 0;
+    int y;
+
+    if (pitch == row_size)
+        return ops->hash(ptr, (size_t)pitch * rows, 0);
+
+    for (y = 0; y < rows; y++)
+        hash = ops->hash(ptr + (size_t)y * pitch, row_size, hash);
+
+    return hash;
+}
+
+fbhash_tiles *fbhash_tiles_create(int width, int height, int bpp) {
+    fbhash_tiles *tiles;
+    size_t num;
+
+    tiles = malloc(sizeof(*tiles));
+    if (!tiles) {
+        fprintf(stderr, "allocate tiles failed\n");
+        return NULL;
+    }
+    memset(tiles, 0, sizeof(*tiles));
+
+    tiles->width = width;
+    tiles->height = height;
+    tiles->bpp = bpp;
+    tiles->cols = (width + FBHASH_TILE_WIDTH - 1) / FBHASH_TILE_WIDTH;
+    tiles->rows = (height + FBHASH_TILE_HEIGHT - 1) / FBHASH_TILE_HEIGHT;
+
+    num = (size_t)tiles->cols * tiles->rows;
+    tiles->hashes = malloc(num * sizeof(uint64_t));
+    tiles->next = malloc(num * sizeof(uint64_t));
+    if (!tiles->hashes || !tiles->next) {
+        fprintf(stderr, "allocate tiles failed\n");
+        fbhash_tiles_destroy(tiles);
+        return NULL;
+    }
+
+    return tiles;
+}
+
+void fbhash_tiles_destroy(fbhash_tiles *tiles) {
+    if (!tiles)
+        return;
+
+    free(tiles->hashes);
+    free(tiles->next);
+    free(tiles);
+}
+
+int fbhash_tiles_damage(fbhash_tiles *tiles, const void *data, int pitch,
+                        damage_region *damage) {
+    const struct fbhash_ops *ops = fbhash_get_ops();
+    const uint8_t *ptr = data;
+    int cpp = tiles->bpp == 12 ? 1 : tiles->bpp / 8;
+    int tx, ty, x0, y0, w, h, y, changed = 0, same = 0;
+    damage_rect run = { 0 };
+    uint64_t hash, *next = tiles->next;
+
+    tiles->hashed = !tiles->backoff;
+    if (tiles->backoff) {
+        tiles->backoff--;
+        damage_full(damage);
+        return 1;
+    }
+
+    damage_reset(damage);
+
+    for (ty = 0; ty < tiles->rows; ty++) {
+        y0 = ty * FBHASH_TILE_HEIGHT;
+        h = tiles->height - y0 < FBHASH_TILE_HEIGHT ?
+            tiles->height - y0 : FBHASH_TILE_HEIGHT;
+        run.w = 0;
+
+        for (tx = 0; tx < tiles->cols; tx++, next++) {
+            x0 = tx * FBHASH_TILE_WIDTH;
+            w = tiles->width - x0 < FBHASH_TILE_WIDTH ?
+                tiles->width - x0 : FBHASH_TILE_WIDTH;
+
+            hash = 0;
+            for (y = y0; y < y0 + h; y++)
+                hash = ops->hash(ptr + (size_t)y * pitch + x0 * cpp,
+                                 w * cpp, hash);
+
+            // The interleaved UV rows of the tile, the tile height is even
+            if (tiles->bpp == 12) {
+                for (y = tiles->height + y0 / 2;
+                     y < tiles->height + (y0 + h + 1) / 2; y++)
+                    hash = ops->hash(ptr + (size_t)y * pitch + x0, w, hash);
+            }
+
+            *next = hash;
+            if (tiles->valid && hash == tiles->hashes[next - tiles->next]) {
+                if (run.w)
+                    damage_add_rect(damage, &run, tiles->width,
+                                    tiles->height);
+                run.w = 0;
+                same = 1;
+                continue;
+            }
+
+            // Changed tiles next to each other in a rect
+            if (!run.w) {
+                run.x = x0;
+                run.y = y0;
+                run.h = h;
+            }
+            run.w = x0 + w - run.x;
+            changed = 1;
+        }
+
+        if (run.w)
+            damage_add_rect(damage, &run, tiles->width, tiles->height);
+    }
+
+    if (!tiles->valid) {
+        damage_full(damage);
+    } else if (same) {
+        tiles->busy = 0;
+    } else if (++tiles->busy >= FBHASH_BUSY) {
+        tiles->backoff = FBHASH_BACKOFF;
+    }
+
+    return changed;
+}
+
+void fbhash_tiles_commit(fbhash_tiles *tiles) {
+    uint64_t *hashes = tiles->hashes;
+
+    if (!tiles->hashed) {
+        tiles->valid = 0;
+        return;
+    }
+
+    tiles->hashes = tiles->next;
+    tiles->next = hashes;
+    tiles->valid = 1;
+}
+
+void fbhash_tiles_invalidate(fbhash_tiles *tiles) {
+    tiles->valid = 0;
+}
@@ -0,0 +1,55 @@
+#ifndef _FBHASH_H
+#define _FBHASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "damage.h"
+
+/*
+ * Frame content hashes, to skip frames identical to the last one and find
+ * the changed area of frames without damage info.
+ *
+ * The 64-bit hash is CRC32C over 4 interleaved lanes of 8-byte words,
+ * folded together with a multiply. The kernels (sse42, crc, soft) are
+ * picked at runtime from the CPU features, FBHASH=<name> forces one of
+ * them. They all give the same hashes.
+ */
+
+// Tiles of the consumer side hashing, in pixels
+#define FBHASH_TILE_WIDTH   64
+#define FBHASH_TILE_HEIGHT  32
+
+// Name of the kernel in use
+const char *fbhash_name(void);
+// Force a kernel, for benchmarks
+int fbhash_set(const char *name);
+
+// Hash of size bytes, chained from seed (0 to start)
+uint64_t fbhash(const void *data, size_t size, uint64_t seed);
+
+// Hash of a frame, bpp 12 is NV12
+uint64_t fbhash_frame(const void *data, int pitch, int width, int height,
+                      int bpp);
+
+/*
+ * Per tile hashes of the last frame shown, or relayed: the tiles of a new
+ * frame differing from them are its damage.
+ */
+typedef struct fbhash_tiles fbhash_tiles;
+
+fbhash_tiles *fbhash_tiles_create(int width, int height, int bpp);
+void fbhash_tiles_destroy(fbhash_tiles *tiles);
+
+// The changed tiles of the frame into damage (all of them without a last
+// frame, or while backing off from frames changed all over), returns 0 when
+// none changed
+int fbhash_tiles_damage(fbhash_tiles *tiles, const void *data, int pitch,
+                        damage_region *damage);
+
+// The frame hashed last is the one shown now
+void fbhash_tiles_commit(fbhash_tiles *tiles);
+// Or some other, unhashed one is
+void fbhash_tiles_invalidate(fbhash_tiles *tiles);
+
+#endif // _FBHASH_H
@@ -1,14 +1,24 @@
+#define _GNU_SOURCE
+#include <errno.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/mman.h>
-#include <sys/time.h>
+#include <sys/stat.h>
 
-// The mmap might failed, for example in sshfs's direct_io mode
-#define USE_MMAP
+#include "fbcodec.h"
+#include "fbcopy.h"
+#include "fbhash.h"
+#include "fbpool.h"
+#include "poolio.h"
+#include "relay.h"
+#include "stats.h"
+#include "transport.h"
+#include "workers.h"
 
 #ifdef DRM_DISPLAY
 #include "drm_display.h"
@@ -28,310 +38,1093 @@
 #define FBPOOL_DEBUG DRM_DEBUG
 #endif
 
-#define FBPOOL_MAGIC "FBPL"
-
-typedef struct {
-    char magic[4];
-    int32_t width;
-    int32_t height;
-    int32_t bpp;
-    int32_t num_fb;
-    int32_t fb_size;
-    int32_t current_fb;
-} fbpool_header;
-
 #define FPS_UPDATE_INTERVAL 60
 
 static void log_fps(void) {
-    struct timeval tv;
     uint64_t curr_time;
     float fps;
 
     static uint64_t last_fps_time = 0;
     static unsigned frames = 0;
 
-    if (!last_fps_time) {
-        gettimeofday(&tv, NULL);
-        last_fps_time = tv.tv_sec * 1000 + tv.tv_usec / 1000;
-    }
+    if (!last_fps_time)
+        last_fps_time = fbpool_now_us();
 
     if (++frames % FPS_UPDATE_INTERVAL)
         return;
 
-    gettimeofday(&tv, NULL);
-    curr_time = tv.tv_sec * 1000 + tv.tv_usec / 1000;
+    curr_time = fbpool_now_us();
 
-    fps = 1000.0f * FPS_UPDATE_INTERVAL / (curr_time - last_fps_time);
+    fps = 1000000.0f * FPS_UPDATE_INTERVAL / (curr_time - last_fps_time);
     last_fps_time = curr_time;
 
     printf("[FBPOOL] FPS: %6.1f || Frames: %u\n", fps, frames);
 }
 
+// FBPOOL_LATENCY_LOG=<path>: log "frame latency_us" for each fb sent, from
+// the producer's timestamp, see fbpool-bench report
+static FILE *latency_log_open(void) {
+    const char *path = getenv("FBPOOL_LATENCY_LOG");
+    FILE *log;
+
+    if (!path)
+        return NULL;
+
+    log = fopen(path, "w");
+    if (!log) {
+        fprintf(stderr, "open %s failed\n", path);
+        return NULL;
+    }
+
+    // Complete lines, whenever the process gets killed
+    setvbuf(log, NULL, _IOLBF, 0);
+    return log;
+}
+
+static void latency_log(FILE *log, uint32_t frame, uint64_t timestamp) {
+    if (!log || !timestamp)
+        return;
+
+    fprintf(log, "%u %llu\n", frame,
+            (unsigned long long)(fbpool_now_us() - timestamp));
+}
+
+// Done with a fb, shown or relayed
+static void frame_done(FILE *latency, uint32_t frame, uint64_t frame_us,
+                       uint64_t timestamp) {
+    uint64_t now = fbpool_now_us();
+
+    stats_count(STATS_FRAMES, 1);
+    stats_record(STATS_FRAME, now - frame_us);
+    if (timestamp)
+        stats_record(STATS_LATENCY, now - timestamp);
+    stats_update();
+
+    latency_log(latency, frame, timestamp);
+    log_fps();
+}
+
+// Done, without showing or copying the fb again
+static void skip_fb(FILE *latency, int fb, uint32_t frame, uint64_t frame_us,
+                    uint64_t timestamp) {
+    FBPOOL_DEBUG("Skipped unchanged fb: %d\n", fb);
+    stats_count(STATS_SKIPPED, 1);
+    frame_done(latency, frame, frame_us, timestamp);
+}
+
+#ifndef DRM_DISPLAY
+// Once all the destinations are done with a frame
+static void relay_done(void *data, relay_frame *frame) {
+    FILE *latency = data;
+
+    // Flushed, or dropped by all of them
+    if (frame->fb < 0 || !frame->sent)
+        return;
+
+    if (frame->repeat)
+        skip_fb(latency, frame->fb, frame->frame, frame->frame_us,
+                frame->timestamp);
+    else
+        frame_done(latency, frame->frame, frame->frame_us, frame->timestamp);
+}
+#endif
+
 void usage(const char *prog) {
 #ifdef DRM_DISPLAY
     fprintf(stderr, "Usage: %s <source pool path>\n", prog);
 #else
-    fprintf(stderr, "Usage: %s <source pool path> <dest pool path>\n", prog);
+    fprintf(stderr, "Usage: %s <source pool path> <dest pool path>...\n"
+            "       %s -c <config file>\n", prog, prog);
 #endif
     exit(-1);
 }
 
-#ifndef USE_MMAP
-static inline int sync_area(int fd, uint8_t *buf,
-                            size_t offset, size_t size, int is_read)
+#if defined(DRM_DISPLAY) && defined(USE_MMAP)
+// Scan out the fbs directly when they can be exported as dma-bufs
+static int *import_fbs(int fd, fbpool_header *hdr, int version,
+                       size_t hdr_size)
 {
-    if (lseek(fd, offset, SEEK_SET) < 0) {
-        fprintf(stderr, "failed to seek file\n");
-        return -1;
-    }
+    const char *zero_copy = getenv("FBPOOL_ZERO_COPY");
+    int *ids, fb, dma_fd;
 
-    if (is_read) {
-        if (read(fd, buf + offset, size) != size) {
-            fprintf(stderr, "failed to read file\n");
-            return -1;
-        }
-    } else {
-        if (write(fd, buf + offset, size) != size) {
-            fprintf(stderr, "failed to write file\n");
-            return -1;
-        }
+    // The fb on screen is held through the slot readers
+    if (version < 2 || fbpool_is_encoded(hdr, version) ||
+        (zero_copy && !atoi(zero_copy)))
+        return NULL;
+
+    ids = malloc(hdr->num_fb * sizeof(int));
+    if (!ids)
+        return NULL;
+
+    for (fb = 0; fb < hdr->num_fb; fb++) {
+        dma_fd = pool_dmabuf(fd, hdr_size + fb * hdr->fb_size, hdr->fb_size);
+        if (dma_fd < 0)
+            goto err;
+
+        ids[fb] = drm_import(dma_fd, hdr->bpp, hdr->width, hdr->height,
+                             hdr->width * hdr->bpp / 8);
+        close(dma_fd);
+
+        if (ids[fb] < 0)
+            goto err;
     }
 
-    return 0;
+    FBPOOL_DEBUG("Zero-copy scanout of %d fbs\n", hdr->num_fb);
+    return ids;
+err:
+    FBPOOL_DEBUG("Zero-copy scanout unavailable for fb: %d\n", fb);
+    drm_free_imports();
+    free(ids);
+    return NULL;
 }
 #endif
 
-static inline void *map_buf(int fd, size_t offset, size_t size, int needs_read)
+#ifdef DRM_DISPLAY
+#define DECODE_PEEK 65536 // Read along with the encoded header, without mmap
+
+// An encoded fb into enc, between fbpool_begin_read() and fbpool_end_read(),
+// returns its size
+static int read_encoded(struct poolio *io, int fd, fbpool_header *hdr,
+                        size_t hdr_size, int fb, uint8_t *enc)
 {
-    void *buf;
+    fbcodec_header *enc_hdr = (fbcodec_header *)enc;
+    size_t offset = hdr_size + (size_t)fb * hdr->fb_size, size;
 
 #ifdef USE_MMAP
-    buf = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, offset);
-    if (buf == MAP_FAILED) {
-        fprintf(stderr, "mmap failed\n");
-        return NULL;
-    }
+    memcpy(enc_hdr, (uint8_t *)hdr + offset, sizeof(*enc_hdr));
+    size = sizeof(*enc_hdr) + enc_hdr->size;
+    if (size > (size_t)hdr->fb_size)
+        return -1;
+
+    memcpy(enc_hdr + 1, (uint8_t *)hdr + offset + sizeof(*enc_hdr),
+           enc_hdr->size);
 #else
-    buf = malloc(size);
-    if (!buf) {
-        fprintf(stderr, "malloc failed\n");
-        return NULL;
-    }
+    // The slot again after the fb, for fbpool_end_read()
+    size = hdr->fb_size < DECODE_PEEK ? hdr->fb_size : DECODE_PEEK;
+    poolio_read(io, fd, enc, size, offset);
+    QUEUE_SLOT(io, fd, hdr, fb, 1);
+    if (poolio_submit(io) < 0 ||
+        sizeof(*enc_hdr) + enc_hdr->size > (size_t)hdr->fb_size)
+        return -1;
 
-    if (needs_read && sync_area(fd, buf, offset, size, 1) < 0) {
-        fprintf(stderr, "read failed\n");
-        return NULL;
+    if (sizeof(*enc_hdr) + enc_hdr->size > size) {
+        poolio_read(io, fd, enc + size, sizeof(*enc_hdr) + enc_hdr->size - size,
+                    offset + size);
+        QUEUE_SLOT(io, fd, hdr, fb, 1);
+        if (poolio_submit(io) < 0)
+            return -1;
     }
+    size = sizeof(*enc_hdr) + enc_hdr->size;
 #endif
 
-    return buf;
+    return size;
 }
 
-static inline void release_buf(void *buf, size_t size)
+// The fbs missed since the last decoded one, while other slots have them
+static void decode_missed(fbcodec *codec, uint8_t *enc, struct poolio *io,
+                          int fd, fbpool_header *hdr, int version,
+                          size_t hdr_size, uint32_t fb_frame)
 {
-#ifdef USE_MMAP
-    munmap(buf, size);
-#else
-    free(buf);
-#endif
-}
+    uint32_t frame, decoded;
+    fbpool_read rd;
+    int fb, size;
 
-#ifndef USE_MMAP
-#define SYNC_MEMBER(fd, s, m, is_read) \
-    sync_area(fd, (void *)(s), (void *)&(s)->m - (void *)s, \
-              sizeof((s)->m), is_read)
-#endif
+    while (!fbcodec_frame(codec, &frame) && fb_frame - frame > 1) {
+        for (fb = 0; fb < hdr->num_fb; fb++) {
+            if (fbpool_get_slot(hdr, fb)->frame == frame + 1)
+                break;
+        }
 
-int main(int argc, char **argv)
-{
-    fbpool_header *src;
-#if defined(DRM_DISPLAY) || defined(USE_MMAP)
-    uint8_t *src_ptr;
-#endif
-    char *src_file;
-    int src_fd, old_fb, fb;
-    size_t size, offset;
+        if (fb == hdr->num_fb || fbpool_begin_read(hdr, version, fb, &rd) < 0)
+            return;
 
-#ifndef DRM_DISPLAY
-    fbpool_header *dst;
-#if defined(USE_MMAP)
-    uint8_t *dst_ptr;
-#endif
-    char *dst_file;
-    int dst_fd;
+        size = read_encoded(io, fd, hdr, hdr_size, fb, enc);
+        if (fbpool_end_read(hdr, version, fb, &rd) < 0 || size < 0 ||
+            fbcodec_decode(codec, enc, size))
+            return;
 
-    if (argc != 3)
-        usage(argv[0]);
-#else // DRM_DISPLAY
-    if (argc != 2)
-        usage(argv[0]);
-#endif // DRM_DISPLAY
+        // A republished fb, of the frame decoded already
+        if (fbcodec_frame(codec, &decoded) || decoded == frame)
+            return;
 
-    src_file = argv[1];
+        FBPOOL_DEBUG("Caught up with frame: %u\n", frame + 1);
+    }
+}
 
-    while (1) {
-        src_fd = open(src_file, O_RDWR);
-        if (src_fd >= 0)
-            break;
+// Ends the read of the fb, returns 0 when decoded
+static int decode_fb(fbcodec *codec, uint8_t *enc, struct poolio *io, int fd,
+                     fbpool_header *hdr, int version, size_t hdr_size,
+                     int fb, uint32_t fb_frame, const fbpool_read *rd)
+{
+    int size, ret;
 
-        fprintf(stderr, "open %s failed, retrying in 1s\n", src_file);
-        sleep(1);
+    decode_missed(codec, enc, io, fd, hdr, version, hdr_size, fb_frame);
+
+    size = read_encoded(io, fd, hdr, hdr_size, fb, enc);
+    if (fbpool_end_read(hdr, version, fb, rd) < 0) {
+        FBPOOL_DEBUG("Dropped torn fb: %d\n", fb);
+        stats_count(STATS_TORN, 1);
+        return -1;
     }
 
-    size = sizeof(fbpool_header);
+    if (size < 0)
+        return -1;
 
-    src = (fbpool_header *)map_buf(src_fd, 0, size, 1);
-    if (!src) {
-        fprintf(stderr, "map %s failed\n", src_file);
-        goto err_close_src;
+    ret = fbcodec_decode(codec, enc, size);
+    if (ret) {
+        FBPOOL_DEBUG("Undecodable fb: %d, %s\n", fb,
+                     ret > 0 ? "missed its reference" : "invalid");
+        stats_count(STATS_UNDECODED, 1);
+        return -1;
     }
 
-    while (strncmp(src->magic, FBPOOL_MAGIC, 4)) {
-#ifdef DRM_DISPLAY
-        FBPOOL_DEBUG("magic not matched: %4s\n", src->magic);
-        sleep(1);
-#else
-        fprintf(stderr, "magic not matched: %4s\n", src->magic);
-        goto err_unmap_src;
+    return 0;
+}
+
+// The source pool as attached, again each time its producer restarts it with
+// another layout, or replaces or truncates it
+typedef struct {
+    int fd;
+    fbpool_header *src;
+    fbpool_header layout; // The header when attached
+    int version;
+    size_t hdr_size;
+    size_t size;
+
+    pool_watch *watch;
+    struct poolio *io;
+    fbhash_tiles *tiles;
+    fbcodec *codec;
+    uint8_t *enc;
+} display_source;
+
+static void source_detach(display_source *source)
+{
+    pool_watch_destroy(source->watch);
+
+    free(source->enc);
+    fbcodec_destroy(source->codec);
+    fbhash_tiles_destroy(source->tiles);
+    poolio_destroy(source->io);
+
+#ifdef USE_MMAP
+    pool_unguard();
+#endif
+    if (source->src)
+        release_buf((void *)source->src, source->size);
+    if (source->fd >= 0)
+        close(source->fd);
+
+    memset(source, 0, sizeof(*source));
+    source->fd = -1;
+}
+
+static int source_attach(display_source *source, const char *path)
+{
+    const char *hashing = getenv("FBPOOL_HASH");
+    fbpool_header *src, hdr;
+#ifndef USE_MMAP
+    struct iovec bufs[1];
 #endif
+
+    source->fd = pool_open(path);
+    if (source->fd < 0) {
+        fprintf(stderr, "open %s failed\n", path);
+        return -1;
     }
 
-    FBPOOL_DEBUG("Source fb pool with %d fb, size: %dx%d(%d), bpp: %d\n",
-                 src->num_fb, src->width, src->height, src->fb_size, src->bpp);
+    // From now on, not to miss it being replaced
+    source->watch = pool_watch_create(path);
 
-    size = sizeof(fbpool_header) + src->num_fb * src->fb_size;
+    if (pool_wait_header(source->fd, &hdr, &source->version,
+                         &source->size) < 0) {
+        fprintf(stderr, "read %s failed\n", path);
+        goto err;
+    }
+    source->hdr_size = fbpool_header_size(&hdr, source->version);
 
-    release_buf(src, sizeof(fbpool_header));
+    FBPOOL_DEBUG("Source fb pool v%d with %d fb, size: %dx%d(%d), bpp: %d\n",
+                 source->version, hdr.num_fb, hdr.width, hdr.height,
+                 hdr.fb_size, hdr.bpp);
 
-    src = (fbpool_header *)map_buf(src_fd, 0, size, 0);
+    src = (fbpool_header *)map_buf(source->fd, 0, source->size, 0);
+    source->src = src;
     if (!src) {
-        fprintf(stderr, "map %s failed\n", src_file);
-        goto err_close_src;
+        fprintf(stderr, "map %s failed\n", path);
+        goto err;
     }
 
-#ifndef USE_MMAP
-    if (sync_area(src_fd, (void *)src, 0, sizeof(fbpool_header), 1) < 0) {
-        fprintf(stderr, "read %s failed\n", src_file);
-        goto err_close_src;
+#ifdef USE_MMAP
+    // The producer might shrink it before we notice
+    pool_guard(src, source->size);
+    pool_watch_wake(source->watch, fbpool_notify_word(src, source->version));
+#else
+    if (poolio_rw(source->fd, src, source->hdr_size, 0, 1) < 0) {
+        fprintf(stderr, "read %s failed\n", path);
+        goto err;
+    }
+
+    source->io = poolio_create();
+    if (!source->io) {
+        fprintf(stderr, "create io engine failed\n");
+        goto err;
     }
+
+    bufs[0].iov_base = src;
+    bufs[0].iov_len = source->size;
+    poolio_register(source->io, &source->fd, 1, bufs, 1);
 #endif
 
-#ifdef DRM_DISPLAY
-    if (drm_init(2, src->bpp, src->width, src->height) < 0) {
-        fprintf(stderr, "init drm failed\n");
-        goto err_unmap_src;
+    source->layout = *src;
+
+    // FBPOOL_HASH=0: the fbs without damage info are shown as a whole.
+    // Otherwise only their changed tiles are, and unchanged fbs not at all.
+    if (!hashing || atoi(hashing)) {
+        source->tiles = fbhash_tiles_create(src->width, src->height, src->bpp);
+        if (!source->tiles)
+            goto err;
     }
-#else
-    dst_file = argv[2];
 
-    dst_fd = open(dst_file, O_RDWR | O_CREAT, 0666);
-    if (dst_fd < 0) {
-        fprintf(stderr, "open %s failed\n", dst_file);
-        goto err_unmap_src;
+    // Relayed with FBPOOL_ENCODE
+    if (fbpool_is_encoded(src, source->version)) {
+        source->codec = fbcodec_create(fbpool_image_size(src), 0);
+        source->enc = malloc(src->fb_size);
+        if (!source->codec || !source->enc) {
+            fprintf(stderr, "create decoder failed\n");
+            goto err;
+        }
     }
 
-    if (lseek(dst_fd, size, SEEK_SET) < 0 && ftruncate(dst_fd, size) < 0) {
-        fprintf(stderr, "truncate %s failed\n", dst_file);
-        goto err_close_dst;
+    return 0;
+err:
+    source_detach(source);
+    return -1;
+}
+
+// Its producer restarted it with another layout, replaced or truncated it
+static int source_changed(display_source *source)
+{
+    if (pool_watch_changed(source->watch)) {
+        FBPOOL_DEBUG("Source replaced: %d\n", source->fd);
+        return 1;
     }
 
-    dst = (fbpool_header *)map_buf(dst_fd, 0, size, 0);
-    if (!dst) {
-        fprintf(stderr, "map %s failed\n", dst_file);
-        goto err_close_dst;
+#ifdef USE_MMAP
+    if (pool_guard_hit()) {
+        FBPOOL_DEBUG("Source truncated: %d\n", source->fd);
+        return 1;
     }
+#endif
 
-    memcpy(dst, src, sizeof(fbpool_header));
+    return !fbpool_same_layout(source->src, &source->layout, source->version);
+}
 
-    dst_ptr = (uint8_t *)dst + sizeof(fbpool_header);
-    dst->current_fb = -1;
-#endif // DRM_DISPLAY
+int main(int argc, char **argv)
+{
+    display_source source = {
+        .fd = -1,
+    };
+    fbpool_header *src = NULL;
+    fbpool_waiter waiter;
+    uint8_t *src_ptr = NULL;
+    char *src_file;
+    int src_fd = -1, old_fb = -1, fb, version = 1, drm_ready = 0;
+    uint32_t frame, old_frame = 0, fb_frame, last_frame = 0;
+    fbpool_read rd;
+    size_t offset, hdr_size = 0;
+    damage_region damage;
+    uint64_t timestamp, wait_us = 0, frame_us, stage_us;
+    uint64_t hash, last_hash = 0;
+    fbhash_tiles *tiles = NULL;
+    int hashed, ret;
+    FILE *latency;
 
-#if defined(DRM_DISPLAY) || defined(USE_MMAP)
-    src_ptr = (uint8_t *)src + sizeof(fbpool_header);
+#ifdef USE_MMAP
+    int *import_ids = NULL, held_fb = -1;
+    fbpool_read held_rd;
 #endif
-    old_fb = -1;
+
+    uint8_t *fb_ptr;
+    uint8_t *enc = NULL;
+    fbcodec *codec = NULL;
+    struct poolio *io = NULL;
+
+    if (argc != 2)
+        usage(argv[0]);
+
+    src_file = argv[1];
+
+#ifdef USE_MMAP
+    fbpool_waiter_init(&waiter, 1);
+#else
+    fbpool_waiter_init(&waiter, 0);
+#endif
+
+    latency = latency_log_open();
+
+    stats_init("drm_display");
 
     while (1) {
+        // At first, and whenever the producer changed the pool under us
+        if (source.fd < 0 || source_changed(&source)) {
+#ifdef USE_MMAP
+            if (held_fb >= 0)
+                fbpool_end_read(src, version, held_fb, &held_rd);
+            held_fb = -1;
+
+            if (import_ids) {
+                drm_free_imports();
+                free(import_ids);
+                import_ids = NULL;
+            }
+#endif
+            source_detach(&source);
+
+            if (source_attach(&source, src_file) < 0)
+                break;
+
+            src = source.src;
+            src_fd = source.fd;
+            version = source.version;
+            hdr_size = source.hdr_size;
+            io = source.io;
+            tiles = source.tiles;
+            codec = source.codec;
+            enc = source.enc;
+            src_ptr = (uint8_t *)src + hdr_size;
+            fbpool_waiter_version(&waiter, version);
+
+            // Keeping the mode, the bos only follow the source format
+            if (drm_ready)
+                ret = drm_reconfigure(src->bpp, src->width, src->height);
+            else
+                ret = drm_init(3, src->bpp, src->width, src->height);
+            if (ret < 0) {
+                fprintf(stderr, "%s drm failed\n",
+                        drm_ready ? "reconfigure" : "init");
+                break;
+            }
+            drm_ready = 1;
+
+#ifdef USE_MMAP
+            import_ids = import_fbs(src_fd, src, version, hdr_size);
+#endif
+
+            old_fb = -1;
+            last_frame = 0;
+            last_hash = 0;
+
+            // Make sure that the current fb would be sent
+            old_frame = fbpool_frame(src, version) - 1;
+        }
+
 #ifndef USE_MMAP
-        if (SYNC_MEMBER(src_fd, src, current_fb, 1) < 0)
+        // Polling, along with the sleep since the last one
+        if (wait_us)
+            poolio_sleep(io, FBPOOL_POLL_US);
+        QUEUE_HEADER(io, src_fd, src, hdr_size);
+        if (poolio_submit(io) < 0)
+            continue;
+
+        // Attached again first
+        if (!fbpool_same_layout(src, &source.layout, version))
             continue;
 #endif
-        if (src->current_fb == old_fb) {
-            usleep(1000);
+        frame = fbpool_frame(src, version);
+        if (frame == old_frame) {
+            if (!wait_us)
+                wait_us = fbpool_now_us();
+#ifdef USE_MMAP
+            fbpool_wait(&waiter, fbpool_notify_word(src, version), old_frame);
+#endif
             continue;
         }
+        old_frame = frame;
+
+        frame_us = fbpool_now_us();
+        if (wait_us)
+            stats_record(STATS_WAIT, frame_us - wait_us);
+        wait_us = 0;
 
-        fb = src->current_fb;
+        fb = fbpool_current(src);
         offset = fb * src->fb_size;
 
         if (fb < 0) {
             FBPOOL_DEBUG("Flushing fb: %d\n", fb);
             old_fb = -1;
-
-#ifndef DRM_DISPLAY
-            dst->current_fb = -1;
-#ifndef USE_MMAP
-            if (SYNC_MEMBER(dst_fd, dst, current_fb, 0) < 0)
-                continue;
-#endif
-#endif // DRM_DISPLAY
-
             continue;
         } else if (fb >= src->num_fb) {
+            // Being laid out again, or broken until then
             fprintf(stderr, "invalid fb: %d\n", fb);
-            break;
-        } else if (fb != ((old_fb + 1) % src->num_fb)) {
-            if (old_fb != -1)
+            old_fb = -1;
+            continue;
+        }
+
+        if (fbpool_begin_read(src, version, fb, &rd) < 0) {
+            FBPOOL_DEBUG("Dropped fb: %d, being written\n", fb);
+            stats_count(STATS_TORN, 1);
+            continue;
+        }
+
+        timestamp = fbpool_get_timestamp(src, version, fb);
+        hash = fbpool_get_hash(src, version, fb);
+
+        if (version > 1) {
+            fb_frame = fbpool_get_slot(src, fb)->frame;
+            if (last_frame && fb_frame == last_frame) {
+                stats_count(STATS_REPEATED, 1);
+            } else if (last_frame && (int32_t)(fb_frame - last_frame) < 0) {
+                FBPOOL_DEBUG("Producer restarted at frame: %u\n", fb_frame);
+            } else if (last_frame && fb_frame != last_frame + 1) {
+                FBPOOL_DEBUG("Lost %u frames before: %u\n",
+                             fb_frame - last_frame - 1, fb_frame);
+                stats_count(STATS_DROPPED, fb_frame - last_frame - 1);
+            }
+        } else {
+            fb_frame = frame;
+            if (old_fb != -1 && fb != ((old_fb + 1) % src->num_fb)) {
                 FBPOOL_DEBUG("Lost fb between: %d - %d\n", old_fb, fb);
+                stats_count(STATS_DROPPED,
+                            (fb - old_fb - 1 + src->num_fb) % src->num_fb);
+            }
         }
 
+        // The damage is relative to the previous frame
+        fbpool_get_damage(src, version, fb, &damage);
+        if (version < 2 || !last_frame || fb_frame != last_frame + 1)
+            damage_full(&damage);
+
         FBPOOL_DEBUG("Sending fb: %d\n", fb);
+        fbpool_waiter_frame(&waiter);
 
-#ifdef DRM_DISPLAY
-#ifndef USE_MMAP
-        if (sync_area(src_fd, (void *)src, offset + sizeof(fbpool_header),
-                      src->fb_size, 1) < 0)
+        // Encoded fbs are decoded anyway, the next deltas build on them
+        if (!codec && fbpool_unchanged(version, fb_frame, last_frame,
+                                       &damage, hash, last_hash)) {
+            fbpool_end_read(src, version, fb, &rd);
+            skip_fb(latency, fb, fb_frame, frame_us, timestamp);
+            old_fb = fb;
+            last_frame = fb_frame;
+            last_hash = hash;
             continue;
-#endif
-        drm_render(src_ptr + offset, src->bpp,
-                   src->width, src->height, src->width * src->bpp / 8);
-#else // DRM_DISPLAY
+        }
+
 #ifdef USE_MMAP
-        memcpy(dst_ptr + offset, src_ptr + offset, src->fb_size);
-#else
-        if (sync_area(dst_fd, (void *)dst, offset + sizeof(fbpool_header),
-                      src->fb_size, 0) < 0)
-            continue;
+        if (import_ids) {
+            if (fbpool_check_read(src, version, fb, rd.seq) < 0) {
+                FBPOOL_DEBUG("Dropped torn fb: %d\n", fb);
+                stats_count(STATS_TORN, 1);
+                fbpool_end_read(src, version, fb, &rd);
+                continue;
+            }
+
+            if (!drm_commit_import(import_ids[fb]) && !drm_wait_flip()) {
+                // Keep the producer away from the fb on screen
+                if (held_fb >= 0)
+                    fbpool_end_read(src, version, held_fb, &held_rd);
+                held_fb = fb;
+                held_rd = rd;
+
+                if (tiles)
+                    fbhash_tiles_invalidate(tiles);
+
+                old_fb = fb;
+                last_frame = fb_frame;
+                last_hash = hash;
+                frame_done(latency, fb_frame, frame_us, timestamp);
+                continue;
+            }
+
+            fprintf(stderr, "zero-copy scanout failed, copying instead\n");
+            drm_free_imports();
+            free(import_ids);
+            import_ids = NULL;
+
+            // The bos missed all the zero-copy frames
+            damage_full(&damage);
+        }
 #endif
-        fsync(dst_fd);
-#endif // DRM_DISPLAY
+        if (codec) {
+            stage_us = fbpool_now_us();
+            if (decode_fb(codec, enc, io, src_fd, src, version, hdr_size, fb,
+                          fb_frame, &rd) < 0)
+                continue;
+            fb_ptr = fbcodec_data(codec);
 
-#ifndef DRM_DISPLAY
-        dst->current_fb = fb;
+            if (fbpool_unchanged(version, fb_frame, last_frame, &damage,
+                                 hash, last_hash)) {
+                skip_fb(latency, fb, fb_frame, frame_us, timestamp);
+                old_fb = fb;
+                last_frame = fb_frame;
+                last_hash = hash;
+                continue;
+            }
+        } else {
 #ifndef USE_MMAP
-        if (SYNC_MEMBER(dst_fd, dst, current_fb, 0) < 0)
+            // The slot again after the fb, for fbpool_end_read()
+            queue_area(io, src_fd, (void *)src, offset + hdr_size,
+                       src->fb_size, 1);
+            if (version > 1)
+                QUEUE_SLOT(io, src_fd, src, fb, 1);
+            if (poolio_submit(io) < 0) {
+                fbpool_end_read(src, version, fb, &rd);
+                continue;
+            }
+#endif
+            stage_us = fbpool_now_us();
+            fb_ptr = src_ptr + offset;
+        }
+
+        // Only the changed tiles of fbs without damage info
+        hashed = tiles && damage_is_full(&damage);
+        if (hashed && !fbhash_tiles_damage(tiles, fb_ptr, fbpool_pitch(src),
+                                           &damage)) {
+            if (!codec)
+                fbpool_end_read(src, version, fb, &rd);
+            skip_fb(latency, fb, fb_frame, frame_us, timestamp);
+            old_fb = fb;
+            last_frame = fb_frame;
+            last_hash = hash;
+            continue;
+        }
+
+        if (drm_prepare_damage(fb_ptr, src->bpp, src->width, src->height,
+                               src->width * src->bpp / 8, &damage) < 0) {
+            if (!codec)
+                fbpool_end_read(src, version, fb, &rd);
+            continue;
+        }
+        stats_record(STATS_COPY, fbpool_now_us() - stage_us);
+
+        // Decoded fbs were checked before
+        if (!codec && fbpool_end_read(src, version, fb, &rd) < 0) {
+            FBPOOL_DEBUG("Dropped torn fb: %d\n", fb);
+            stats_count(STATS_TORN, 1);
+            drm_discard();
             continue;
+        }
+
+        drm_commit();
+#ifdef USE_MMAP
+        // Off screen now, the fb left there by the zero-copy scanout
+        if (held_fb >= 0 && !drm_wait_flip()) {
+            fbpool_end_read(src, version, held_fb, &held_rd);
+            held_fb = -1;
+        }
 #endif
-        fsync(dst_fd);
-#endif // DRM_DISPLAY
+        if (hashed)
+            fbhash_tiles_commit(tiles);
+        else if (tiles)
+            fbhash_tiles_invalidate(tiles);
 
         old_fb = fb;
-        log_fps();
+        last_frame = fb_frame;
+        frame_done(latency, fb_frame, frame_us, timestamp);
     }
 
-#ifdef DRM_DISPLAY
-    drm_deinit();
+    if (latency)
+        fclose(latency);
+    stats_deinit();
+    fbcopy_deinit();
+
+#ifdef USE_MMAP
+    free(import_ids);
+#endif
+    if (drm_ready)
+        drm_deinit();
+    source_detach(&source);
+
+    return 0;
+}
+#else // Relay
+/*
+ * The config file of fbpool -c, for one process to relay several pools, one
+ * per line:
+ * <source pool path> <dest pool path>... [stats=<path>] [stats_text=<path>]
+ *
+ * With stats=/stats_text=, the pool has stats of its own, as FBPOOL_STATS
+ * and FBPOOL_STATS_TEXT, otherwise its frames count into the process's.
+ * Empty lines and the ones starting with '#' are skipped.
+ *
+ * Each pool is relayed as soon as its producer laid it out, the ones not
+ * there yet don't hold up the others.
+ */
+typedef struct {
+    char *line; // Holding the paths
+    const char *source;
+    const char *dests[RELAY_MAX_DESTS];
+    int num_dests;
+    const char *stats;
+    const char *stats_text;
+} relay_config;
+
+// Returns the number of pools, or -1
+static int config_load(const char *path, relay_config *configs, int max)
+{
+    relay_config *config;
+    char *line = NULL, *token, *save;
+    size_t line_size = 0;
+    int num = 0, line_num = 0;
+    FILE *file;
+
+    file = fopen(path, "r");
+    if (!file) {
+        fprintf(stderr, "open %s failed\n", path);
+        return -1;
+    }
+
+    while (getline(&line, &line_size, file) >= 0) {
+        line_num++;
+
+        token = strtok_r(line, " \t\n", &save);
+        if (!token || token[0] == '#')
+            continue;
+
+        if (num == max) {
+            fprintf(stderr, "%s:%d: more than %d pools\n", path, line_num,
+                    max);
+            goto err;
+        }
+
+        // Kept by the config
+        config = &configs[num++];
+        memset(config, 0, sizeof(*config));
+        config->line = line;
+        config->source = token;
+        line = NULL;
+        line_size = 0;
+
+        while ((token = strtok_r(NULL, " \t\n", &save))) {
+            if (!strncmp(token, "stats=", 6)) {
+                config->stats = token + 6;
+            } else if (!strncmp(token, "stats_text=", 11)) {
+                config->stats_text = token + 11;
+            } else if (config->num_dests < RELAY_MAX_DESTS) {
+                config->dests[config->num_dests++] = token;
+            } else {
+                fprintf(stderr, "%s:%d: more than %d destinations\n", path,
+                        line_num, RELAY_MAX_DESTS);
+                goto err;
+            }
+        }
+
+        if (!config->num_dests) {
+            fprintf(stderr, "%s:%d: no destination\n", path, line_num);
+            goto err;
+        }
+    }
+
+    free(line);
+    fclose(file);
+    return num;
+err:
+    while (num--)
+        free(configs[num].line);
+    free(line);
+    fclose(file);
+    return -1;
+}
+
+// Without the watch of its path telling, trying to attach a source again
+#define RELAY_ATTACH_RETRY_US   100000
+
+#ifdef USE_MMAP
+// Woken by the watches of the sources not attached
+static uint32_t attach_word;
+#endif
+
+// A pool of the config, relayed once its producer laid it out
+typedef struct {
+    relay_config *config;
+    relay_source *source; // NULL until attached
+    int version;
+    stats_ctx *stats;
+    pool_watch *watch; // Of the source path
+    int fd; // Opened, waiting for the layout, or -1
+    uint64_t retry_us; // When to try attaching again, 0 on the watch only
+} relay_pool;
+
+// Without waiting for its producer, returns 1 once the source is attached
+static int relay_pool_attach(relay_pool *pool, FILE *latency)
+{
+    relay_config *config = pool->config;
+    fbpool_header hdr;
+    size_t size;
+    int ret;
+
+    pool->retry_us = 0;
+    if (pool->fd < 0) {
+        pool->fd = pool_try_open(config->source);
+        if (pool->fd < 0) {
+            if (!pool->watch)
+                pool->retry_us = fbpool_now_us() + RELAY_ATTACH_RETRY_US;
+            return 0;
+        }
+    }
+
+    // Opened as soon as created, maybe before the producer laid it out
+    ret = pool_read_header(pool->fd, &hdr, &pool->version, &size);
+    if (ret > 0) {
+        pool->retry_us = fbpool_now_us() + POOL_ATTACH_RETRY_US;
+        return 0;
+    }
+
+    if (ret < 0) {
+        close(pool->fd);
+        pool->source = NULL;
+    } else {
+        pool->source = relay_source_create(config->source, pool->fd,
+                                           config->dests, config->num_dests,
+                                           pool->stats, relay_done, latency);
+    }
+    pool->fd = -1;
+
+    if (!pool->source) {
+        fprintf(stderr, "relay %s failed, until it changes\n",
+                config->source);
+        if (!pool->watch)
+            pool->retry_us = fbpool_now_us() + RELAY_ATTACH_RETRY_US;
+        return 0;
+    }
+
+    FBPOOL_DEBUG("Relaying %s\n", config->source);
+    return 1;
+}
+
+// Until attached again, trying at once
+static void relay_pool_detach(relay_pool *pool)
+{
+#ifdef USE_MMAP
+    pool_watch_wake(pool->watch, &attach_word);
+#endif
+    relay_source_destroy(pool->source);
+    pool->source = NULL;
+    pool->retry_us = fbpool_now_us();
+}
+
+// The sources with a new fb, polled in parallel
+typedef struct {
+    relay_pool *pools;
+    int ready[RELAY_MAX_SOURCES];
+    int results[RELAY_MAX_SOURCES];
+    int sleep_us;
+} relay_poll_job;
+
+static void relay_poll(void *data, int index)
+{
+    relay_poll_job *job = data;
+
+    job->results[index] =
+        relay_source_poll(job->pools[job->ready[index]].source,
+                          job->sleep_us);
+}
+
+int main(int argc, char **argv)
+{
+    relay_config configs[RELAY_MAX_SOURCES];
+    relay_pool pools[RELAY_MAX_SOURCES];
+#ifdef USE_MMAP
+    // The sources attached, then the word woken by the watches of the others
+    volatile void *words[RELAY_MAX_SOURCES + 1];
+    uint32_t seen[RELAY_MAX_SOURCES + 1];
+    int num_words, watching, min_version, waiter_version = 0;
+#else
+    uint32_t seen;
+#endif
+    const char *num_workers = getenv("FBPOOL_WORKERS");
+    struct workers *workers = NULL;
+    relay_poll_job job;
+    fbpool_waiter waiter;
+    relay_pool *pool;
+    FILE *latency;
+    uint64_t now, retry_us;
+    int num, num_ready, num_attached, relayed = 1, i;
+
+    if (argc == 3 && !strcmp(argv[1], "-c")) {
+        num = config_load(argv[2], configs, RELAY_MAX_SOURCES);
+        if (num < 0)
+            return -1;
+    } else if (argc >= 3 && argc <= 2 + RELAY_MAX_DESTS &&
+               strcmp(argv[1], "-c")) {
+        memset(&configs[0], 0, sizeof(configs[0]));
+        configs[0].source = argv[1];
+        for (i = 2; i < argc; i++)
+            configs[0].dests[configs[0].num_dests++] = argv[i];
+        num = 1;
+    } else {
+        usage(argv[0]);
+    }
+
+    latency = latency_log_open();
+    stats_init("fbpool");
+
+    for (i = 0; i < num; i++) {
+        pool = &pools[i];
+        memset(pool, 0, sizeof(*pool));
+        pool->config = &configs[i];
+        pool->fd = -1;
+
+        if (configs[i].stats || configs[i].stats_text) {
+            pool->stats = stats_create("fbpool", configs[i].stats,
+                                       configs[i].stats_text);
+            if (!pool->stats)
+                goto err_destroy_pools;
+        }
+
+        // Before trying, not to miss its creation in between
+        pool->watch = pool_watch_create(configs[i].source);
+#ifdef USE_MMAP
+        pool_watch_wake(pool->watch, &attach_word);
+#endif
+    }
+
+    // The ones ready right away, the others from the loop as they come
+    for (i = 0; i < num; i++)
+        relay_pool_attach(&pools[i], latency);
+
+    // FBPOOL_WORKERS: the threads reading the sources with a new fb at the
+    // same time, the caller included, as many as the CPUs by default
+    if (num > 1)
+        workers = workers_create(num_workers ? atoi(num_workers) : 0);
+
+    fbpool_waiter_init(&waiter, 1);
+    job.pools = pools;
+
+    while (1) {
+        now = fbpool_now_us();
+        retry_us = 0;
+        num_ready = 0;
+        num_attached = 0;
+#ifdef USE_MMAP
+        num_words = 0;
+        watching = 0;
+        // Without sources, woken up by the watches
+        min_version = 2;
+#endif
+
+        for (i = 0; i < num; i++) {
+            pool = &pools[i];
+
+            // Replaced, or gone
+            if (pool->source && pool_watch_changed(pool->watch)) {
+                FBPOOL_DEBUG("Source changed: %s\n", pool->config->source);
+                relay_pool_detach(pool);
+            }
+
+            if (!pool->source &&
+                (pool_watch_changed(pool->watch) ||
+                 (pool->retry_us && now >= pool->retry_us)))
+                relay_pool_attach(pool, latency);
+
+            if (!pool->source) {
+#ifdef USE_MMAP
+                if (pool->watch)
+                    watching = 1;
+#endif
+                if (pool->retry_us &&
+                    (!retry_us || pool->retry_us < retry_us))
+                    retry_us = pool->retry_us;
+                continue;
+            }
+            num_attached++;
+
+#ifdef USE_MMAP
+            if (pool->version < min_version)
+                min_version = pool->version;
+
+            words[num_words] = relay_source_wait(pool->source,
+                                                 &seen[num_words]);
+            pool_watch_wake(pool->watch, words[num_words]);
+            num_words++;
+            if (fbpool_load_word(words[num_words - 1]) == seen[num_words - 1])
+                continue;
 #else
-    release_buf((void *)dst, size);
+            relay_source_wait(pool->source, &seen);
+#endif
+            job.ready[num_ready++] = i;
+        }
 
-err_close_dst:
-    close(dst_fd);
+        // Until the next attach to try, at the latest
+        now = fbpool_now_us();
+        waiter.max_us = !retry_us ? 0 : retry_us > now ? retry_us - now : 1;
+
+#ifdef USE_MMAP
+        // Polling every 1ms only for v1 pools, which might not wake us up
+        if (min_version != waiter_version) {
+            fbpool_waiter_version(&waiter, min_version);
+            waiter_version = min_version;
+        }
+
+        if (watching) {
+            words[num_words] = &attach_word;
+            seen[num_words++] = 0;
+        }
+
+        // A single wakeup for any of them
+        if (!num_ready) {
+            if (num_words)
+                fbpool_wait_any(&waiter, words, seen, num_words);
+            else
+                usleep(waiter.max_us ? waiter.max_us : RELAY_ATTACH_RETRY_US);
+            continue;
+        }
+        job.sleep_us = 0;
+#else
+        // All polled, sleeping since the last round along with the polling
+        // of a single one
+        job.sleep_us = relayed ? 0 : FBPOOL_POLL_US;
+        if ((num_attached > 1 || !num_ready) && job.sleep_us) {
+            usleep(job.sleep_us);
+            job.sleep_us = 0;
+        }
+        if (!num_ready) {
+            relayed = 0;
+            continue;
+        }
 #endif
-err_unmap_src:
-    release_buf((void *)src, size);
-err_close_src:
-    close(src_fd);
+
+        workers_run(workers, relay_poll, &job, num_ready);
+
+        relayed = 0;
+        for (i = 0; i < num_ready; i++) {
+            if (job.results[i] > 0) {
+                relayed = 1;
+                continue;
+            } else if (!job.results[i]) {
+                continue;
+            }
+
+            // Restarted by its producer, going on with the others
+            pool = &pools[job.ready[i]];
+            fprintf(stderr, "%s laid out again, attaching again\n",
+                    pool->config->source);
+            relay_pool_detach(pool);
+        }
+
+        if (relayed)
+            fbpool_waiter_frame(&waiter);
+    }
+
+    i = num;
+err_destroy_pools:
+    // Writing the frames queued first
+    stats_use(NULL);
+    while (i--) {
+        pool_watch_destroy(pools[i].watch);
+        relay_source_destroy(pools[i].source);
+        if (pools[i].fd >= 0)
+            close(pools[i].fd);
+        stats_destroy(pools[i].stats);
+    }
+    workers_destroy(workers);
+
+    for (i = 0; i < num; i++)
+        free(configs[i].line);
+
+    if (latency)
+        fclose(latency);
+    stats_deinit();
+    fbcopy_deinit();
 
     return 0;
 }
+#endif // DRM_DISPLAY
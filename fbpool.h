@@ -0,0 +1,680 @@
+#ifndef _FBPOOL_H
+#define _FBPOOL_H
+
+#include <errno.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "damage.h"
+#include "futex.h"
+
+#define FBPOOL_MAGIC "FBPL"
+
+/*
+ * Pool layout:
+ * version 1: fbpool_header up to current_fb (28 bytes), then num_fb fbs.
+ * version 2: the whole fbpool_header, num_fb fbpool_slot descriptors of
+ *            slot_size bytes each, then num_fb fbs starting at header_size.
+ *
+ * The v2 fields are placed where a v1 pool has its fb data, so they are only
+ * trusted after fbpool_version() validated them. Producers should write the
+ * magic last.
+ *
+ * Optional slot fields are enabled by the header flags, and only used when
+ * slot_size covers them.
+ *
+ * Readers hold a slot from fbpool_begin_read() to fbpool_end_read(), through
+ * an entry of reader_pid when slot_size covers it and one is free, otherwise
+ * through the readers count, and release the hold they took (kept in
+ * fbpool_read). fbpool_acquire_slot() frees the entries of readers which
+ * don't exist anymore, so a consumer crashing mid-read only keeps the fb
+ * until the producer looks for one to write. Holds through the
+ * readers count, of older consumers or past FBPOOL_MAX_READERS, are never
+ * recovered. Pids are those of the producer's pid namespace: a consumer in
+ * another one may lose its hold, and then sees its reads torn.
+ */
+#define FBPOOL_VERSION      2
+#define FBPOOL_V1_SIZE      offsetof(fbpool_header, version)
+#define FBPOOL_MAX_HEADER   (1 << 20)
+#define FBPOOL_MAX_READERS  8
+
+#define FBPOOL_FLAG_DAMAGE  (1 << 0) // Slots carry damage rects
+// The fbs are fbcodec encoded, in fb_size bytes of room each
+#define FBPOOL_FLAG_ENCODED (1 << 1)
+#define FBPOOL_FLAG_HASH    (1 << 2) // Slots carry content hashes
+
+typedef struct {
+    char magic[4];
+    int32_t width;
+    int32_t height;
+    int32_t bpp;
+    int32_t num_fb;
+    int32_t fb_size;
+    int32_t current_fb; // The futex word for frame notification in v1
+
+    // Version 2
+    int32_t version;
+    int32_t header_size; // Offset of the first fb
+    int32_t slot_size;
+    int32_t flags;
+    uint32_t frame;      // Bumped for every published fb, the futex word
+} fbpool_header;
+
+// Slot states, advisory for the producer
+enum {
+    FBPOOL_SLOT_FREE,
+    FBPOOL_SLOT_WRITING,
+    FBPOOL_SLOT_READY,
+};
+
+typedef struct {
+    uint32_t seq;     // Seqlock, odd while the producer is writing the fb
+    int32_t state;    // FBPOOL_SLOT_*
+    int32_t readers;  // Consumers reading the fb without a reader_pid entry
+    uint32_t frame;   // Frame number of the fb content
+
+    // FBPOOL_FLAG_DAMAGE: area changed since the previous frame, < 0 for all
+    int32_t num_damage;
+    damage_rect damage[DAMAGE_MAX_RECTS];
+
+    // CLOCK_MONOTONIC us when the producer wrote the fb, 0 if unknown
+    uint64_t timestamp;
+
+    // FBPOOL_FLAG_HASH: fbhash_frame() of the (decoded) fb, 0 if unknown
+    uint64_t hash;
+
+    // Pids of the consumers reading the fb, 0 for free entries
+    int32_t reader_pid[FBPOOL_MAX_READERS];
+} fbpool_slot;
+
+#define FBPOOL_SLOT_MIN_SIZE    offsetof(fbpool_slot, num_damage)
+#define FBPOOL_SLOT_HAS(hdr, field) \
+    ((hdr)->slot_size >= (int32_t)(offsetof(fbpool_slot, field) + \
+                                   sizeof(((fbpool_slot *)0)->field)))
+
+static inline uint64_t fbpool_now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static inline int fbpool_version(fbpool_header *hdr, size_t file_size)
+{
+    size_t slots_end;
+
+    if (hdr->version != FBPOOL_VERSION)
+        return 1;
+
+    if (hdr->slot_size < (int32_t)FBPOOL_SLOT_MIN_SIZE ||
+        hdr->slot_size % 4 || hdr->num_fb <= 0)
+        return 1;
+
+    slots_end = sizeof(fbpool_header) + (size_t)hdr->num_fb * hdr->slot_size;
+    if (hdr->header_size < slots_end || hdr->header_size > FBPOOL_MAX_HEADER)
+        return 1;
+
+    if (file_size && file_size <
+        hdr->header_size + (size_t)hdr->num_fb * hdr->fb_size)
+        return 1;
+
+    return 2;
+}
+
+static inline size_t fbpool_header_size(fbpool_header *hdr, int version)
+{
+    return version > 1 ? hdr->header_size : FBPOOL_V1_SIZE;
+}
+
+// Consumer side: whether the pool still has the layout of attached, the
+// header it had when attached. Producers restarting in place change it.
+static inline int fbpool_same_layout(fbpool_header *hdr,
+                                     const fbpool_header *attached,
+                                     int version)
+{
+    if (strncmp(hdr->magic, FBPOOL_MAGIC, 4) ||
+        hdr->width != attached->width || hdr->height != attached->height ||
+        hdr->bpp != attached->bpp || hdr->num_fb != attached->num_fb ||
+        hdr->fb_size != attached->fb_size)
+        return 0;
+
+    if (version < 2)
+        return 1;
+
+    return hdr->version == attached->version &&
+        hdr->header_size == attached->header_size &&
+        hdr->slot_size == attached->slot_size &&
+        hdr->flags == attached->flags;
+}
+
+// Bytes of a fb's image, less than fb_size in encoded pools
+static inline size_t fbpool_image_size(fbpool_header *hdr)
+{
+    return (size_t)hdr->width * hdr->height * hdr->bpp / 8;
+}
+
+static inline int fbpool_is_encoded(fbpool_header *hdr, int version)
+{
+    return version > 1 && (hdr->flags & FBPOOL_FLAG_ENCODED);
+}
+
+// Row pitch of the fbs, the Y plane pitch for NV12
+static inline int fbpool_pitch(fbpool_header *hdr)
+{
+    return hdr->bpp == 12 ? hdr->width : hdr->width * hdr->bpp / 8;
+}
+
+static inline fbpool_slot *fbpool_get_slot(fbpool_header *hdr, int fb)
+{
+    return (fbpool_slot *)((uint8_t *)hdr + sizeof(fbpool_header) +
+                           fb * hdr->slot_size);
+}
+
+// Fill a v2 header, header_size is the offset of the first fb, 0 for packed
+static inline void fbpool_init_header(fbpool_header *hdr, int width,
+                                      int height, int bpp, int num_fb,
+                                      size_t header_size, int flags)
+{
+    size_t min_size = sizeof(fbpool_header) + num_fb * sizeof(fbpool_slot);
+
+    memset(hdr, 0, min_size);
+
+    hdr->width = width;
+    hdr->height = height;
+    hdr->bpp = bpp;
+    hdr->num_fb = num_fb;
+    hdr->fb_size = width * height * bpp / 8;
+    hdr->current_fb = -1;
+
+    hdr->version = FBPOOL_VERSION;
+    hdr->header_size = header_size > min_size ? header_size : min_size;
+    hdr->slot_size = sizeof(fbpool_slot);
+    hdr->flags = flags;
+
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(hdr->magic, FBPOOL_MAGIC, 4);
+}
+
+// The frame counter, which is current_fb for v1
+static inline uint32_t fbpool_frame(fbpool_header *hdr, int version)
+{
+    if (version > 1)
+        return __atomic_load_n(&hdr->frame, __ATOMIC_ACQUIRE);
+
+    return __atomic_load_n(&hdr->current_fb, __ATOMIC_ACQUIRE);
+}
+
+static inline volatile void *fbpool_notify_word(fbpool_header *hdr,
+                                                int version)
+{
+    return version > 1 ? (void *)&hdr->frame : (void *)&hdr->current_fb;
+}
+
+static inline int32_t fbpool_current(fbpool_header *hdr)
+{
+    return __atomic_load_n(&hdr->current_fb, __ATOMIC_ACQUIRE);
+}
+
+// Producer side: publish a new fb and wake up the waiting consumers.
+// Producers that only store current_fb still work, consumers would fall
+// back to polling for them.
+static inline void fbpool_publish(fbpool_header *hdr, int version, int32_t fb,
+                                  uint32_t frame)
+{
+    __atomic_store_n(&hdr->current_fb, fb, __ATOMIC_RELEASE);
+    if (version > 1)
+        __atomic_store_n(&hdr->frame, frame, __ATOMIC_RELEASE);
+
+    futex_wake(fbpool_notify_word(hdr, version), INT_MAX);
+}
+
+// Producer side: whether a consumer is reading the fb, forgetting the ones
+// which exited without closing their read
+static inline int fbpool_slot_busy(fbpool_header *hdr, fbpool_slot *slot)
+{
+    int32_t pid;
+    int i, busy = 0;
+
+    if (__atomic_load_n(&slot->readers, __ATOMIC_ACQUIRE))
+        return 1;
+
+    if (!FBPOOL_SLOT_HAS(hdr, reader_pid))
+        return 0;
+
+    for (i = 0; i < FBPOOL_MAX_READERS; i++) {
+        pid = __atomic_load_n(&slot->reader_pid[i], __ATOMIC_ACQUIRE);
+        if (!pid)
+            continue;
+
+        if (kill(pid, 0) < 0 && errno == ESRCH)
+            __atomic_compare_exchange_n(&slot->reader_pid[i], &pid, 0, 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+        else
+            busy = 1;
+    }
+
+    return busy;
+}
+
+// Producer side: pick the oldest fb that nobody is reading, or -1
+static inline int fbpool_acquire_slot(fbpool_header *hdr)
+{
+    fbpool_slot *slot;
+    int32_t current = fbpool_current(hdr);
+    uint32_t age, oldest = 0;
+    int fb, best = -1;
+
+    for (fb = 0; fb < hdr->num_fb; fb++) {
+        slot = fbpool_get_slot(hdr, fb);
+        if (fb == current || fbpool_slot_busy(hdr, slot))
+            continue;
+
+        age = hdr->frame - slot->frame;
+        if (best < 0 || slot->state == FBPOOL_SLOT_FREE || age > oldest) {
+            best = fb;
+            oldest = age;
+            if (slot->state == FBPOOL_SLOT_FREE)
+                break;
+        }
+    }
+
+    return best;
+}
+
+static inline void fbpool_begin_write(fbpool_header *hdr, int version, int fb)
+{
+    fbpool_slot *slot;
+
+    if (version < 2)
+        return;
+
+    slot = fbpool_get_slot(hdr, fb);
+    slot->state = FBPOOL_SLOT_WRITING;
+    __atomic_add_fetch(&slot->seq, 1, __ATOMIC_ACQ_REL);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+// Close the write, the fb is then ready to be published with frame number
+static inline void fbpool_end_write(fbpool_header *hdr, int version, int fb,
+                                    uint32_t frame)
+{
+    fbpool_slot *slot;
+
+    if (version < 2)
+        return;
+
+    slot = fbpool_get_slot(hdr, fb);
+    slot->frame = frame;
+    slot->state = FBPOOL_SLOT_READY;
+    __atomic_add_fetch(&slot->seq, 1, __ATOMIC_RELEASE);
+}
+
+// Drop a partially written fb
+static inline void fbpool_abort_write(fbpool_header *hdr, int version, int fb)
+{
+    fbpool_slot *slot;
+
+    if (version < 2)
+        return;
+
+    slot = fbpool_get_slot(hdr, fb);
+    slot->state = FBPOOL_SLOT_FREE;
+    __atomic_add_fetch(&slot->seq, 1, __ATOMIC_RELEASE);
+}
+
+// Producer side, between fbpool_begin_write() and fbpool_end_write()
+static inline void fbpool_set_damage(fbpool_header *hdr, int version, int fb,
+                                     const damage_region *region)
+{
+    fbpool_slot *slot;
+
+    if (version < 2 || !(hdr->flags & FBPOOL_FLAG_DAMAGE) ||
+        !FBPOOL_SLOT_HAS(hdr, damage))
+        return;
+
+    slot = fbpool_get_slot(hdr, fb);
+    slot->num_damage = region->num;
+    if (region->num > 0)
+        memcpy(slot->damage, region->rects,
+               region->num * sizeof(damage_rect));
+}
+
+// Consumer side, between fbpool_begin_read() and fbpool_end_read()
+static inline void fbpool_get_damage(fbpool_header *hdr, int version, int fb,
+                                     damage_region *region)
+{
+    fbpool_slot *slot;
+    int i, num;
+
+    damage_full(region);
+
+    if (version < 2 || !(hdr->flags & FBPOOL_FLAG_DAMAGE) ||
+        !FBPOOL_SLOT_HAS(hdr, damage))
+        return;
+
+    // Read once, the producer might change it under us
+    slot = fbpool_get_slot(hdr, fb);
+    num = *(volatile int32_t *)&slot->num_damage;
+    if (num < 0 || num > DAMAGE_MAX_RECTS)
+        return;
+
+    damage_reset(region);
+    for (i = 0; i < num; i++)
+        damage_add_rect(region, &slot->damage[i], hdr->width, hdr->height);
+}
+
+// Producer side, between fbpool_begin_write() and fbpool_end_write()
+static inline void fbpool_set_timestamp(fbpool_header *hdr, int version,
+                                        int fb, uint64_t timestamp)
+{
+    if (version < 2 || !FBPOOL_SLOT_HAS(hdr, timestamp))
+        return;
+
+    fbpool_get_slot(hdr, fb)->timestamp = timestamp;
+}
+
+// Consumer side, between fbpool_begin_read() and fbpool_end_read()
+static inline uint64_t fbpool_get_timestamp(fbpool_header *hdr, int version,
+                                            int fb)
+{
+    if (version < 2 || !FBPOOL_SLOT_HAS(hdr, timestamp))
+        return 0;
+
+    return fbpool_get_slot(hdr, fb)->timestamp;
+}
+
+// Producer side, between fbpool_begin_write() and fbpool_end_write()
+static inline void fbpool_set_hash(fbpool_header *hdr, int version, int fb,
+                                   uint64_t hash)
+{
+    if (version < 2 || !(hdr->flags & FBPOOL_FLAG_HASH) ||
+        !FBPOOL_SLOT_HAS(hdr, hash))
+        return;
+
+    fbpool_get_slot(hdr, fb)->hash = hash;
+}
+
+// Consumer side, between fbpool_begin_read() and fbpool_end_read()
+static inline uint64_t fbpool_get_hash(fbpool_header *hdr, int version,
+                                       int fb)
+{
+    if (version < 2 || !(hdr->flags & FBPOOL_FLAG_HASH) ||
+        !FBPOOL_SLOT_HAS(hdr, hash))
+        return 0;
+
+    return fbpool_get_slot(hdr, fb)->hash;
+}
+
+// Consumer side: the same content as the last fb done, published again,
+// without damage or with the same hash
+static inline int fbpool_unchanged(int version, uint32_t fb_frame,
+                                   uint32_t last_frame,
+                                   const damage_region *damage, uint64_t hash,
+                                   uint64_t last_hash)
+{
+    if (version < 2 || !last_frame)
+        return 0;
+
+    return fb_frame == last_frame || !damage->num ||
+        (hash && hash == last_hash);
+}
+
+// An open read, from fbpool_begin_read() to fbpool_end_read()
+typedef struct {
+    uint32_t seq;
+    int hold; // The reader_pid entry taken, or -1 for the readers count
+} fbpool_read;
+
+// Consumer side: hold the fb against the producer, with a reader_pid entry
+// when there is one free, returns the hold for fbpool_release_slot()
+static inline int fbpool_hold_slot(fbpool_header *hdr, fbpool_slot *slot)
+{
+    int32_t pid = getpid(), free_pid;
+    int i;
+
+    if (FBPOOL_SLOT_HAS(hdr, reader_pid)) {
+        for (i = 0; i < FBPOOL_MAX_READERS; i++) {
+            free_pid = 0;
+            if (__atomic_compare_exchange_n(&slot->reader_pid[i], &free_pid,
+                                            pid, 0, __ATOMIC_ACQ_REL,
+                                            __ATOMIC_RELAXED))
+                return i;
+        }
+    }
+
+    __atomic_add_fetch(&slot->readers, 1, __ATOMIC_ACQ_REL);
+    return -1;
+}
+
+static inline void fbpool_release_slot(fbpool_slot *slot, int hold)
+{
+    int32_t pid = getpid();
+
+    // Nothing to release when the producer took our entry back
+    if (hold >= 0)
+        __atomic_compare_exchange_n(&slot->reader_pid[hold], &pid, 0, 0,
+                                    __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+    else
+        __atomic_sub_fetch(&slot->readers, 1, __ATOMIC_RELEASE);
+}
+
+// Consumer side: returns -1 if the producer is writing the fb
+static inline int fbpool_begin_read(fbpool_header *hdr, int version, int fb,
+                                    fbpool_read *rd)
+{
+    fbpool_slot *slot;
+
+    rd->seq = 0;
+    rd->hold = -1;
+    if (version < 2)
+        return 0;
+
+    slot = fbpool_get_slot(hdr, fb);
+    rd->hold = fbpool_hold_slot(hdr, slot);
+
+    rd->seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+    if (rd->seq & 1) {
+        fbpool_release_slot(slot, rd->hold);
+        return -1;
+    }
+
+    return 0;
+}
+
+// Returns -1 if the fb has been modified since fbpool_begin_read()
+static inline int fbpool_check_read(fbpool_header *hdr, int version, int fb,
+                                    uint32_t seq)
+{
+    fbpool_slot *slot;
+
+    if (version < 2)
+        return 0;
+
+    slot = fbpool_get_slot(hdr, fb);
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq ? -1 : 0;
+}
+
+// Close the read, returns -1 if the fb has been modified meanwhile
+static inline int fbpool_end_read(fbpool_header *hdr, int version, int fb,
+                                  const fbpool_read *rd)
+{
+    fbpool_slot *slot;
+    int torn;
+
+    if (version < 2)
+        return 0;
+
+    slot = fbpool_get_slot(hdr, fb);
+    torn = fbpool_check_read(hdr, version, fb, rd->seq);
+
+    fbpool_release_slot(slot, rd->hold);
+    return torn;
+}
+
+/*
+ * Consumer side waiting, configured by FBPOOL_WAIT:
+ * poll:  the legacy usleep() polling.
+ * futex: sleep on the futex word, default.
+ * spin:  futex, plus busy polling for FBPOOL_SPIN_US around the time the
+ *        next frame is expected.
+ */
+enum {
+    FBPOOL_WAIT_POLL,
+    FBPOOL_WAIT_FUTEX,
+    FBPOOL_WAIT_SPIN,
+};
+
+#define FBPOOL_POLL_US          1000
+#define FBPOOL_WAKE_TIMEOUT_US  100000
+#define FBPOOL_SPIN_US          200
+
+typedef struct {
+    int mode;
+    int spin_us;
+
+    // Whether the producer wakes us up, otherwise keep polling every 1ms
+    int producer_wakes;
+    // The longest to wait for if not 0, for callers with timers of their own
+    int max_us;
+
+    uint64_t last_frame_us;
+    uint64_t frame_interval_us;
+} fbpool_waiter;
+
+static inline void fbpool_waiter_init(fbpool_waiter *w, int can_futex)
+{
+    const char *mode = getenv("FBPOOL_WAIT");
+    const char *spin = getenv("FBPOOL_SPIN_US");
+
+    memset(w, 0, sizeof(*w));
+
+    w->mode = FBPOOL_WAIT_FUTEX;
+    if (mode && !strcmp(mode, "poll"))
+        w->mode = FBPOOL_WAIT_POLL;
+    else if (mode && !strcmp(mode, "spin"))
+        w->mode = FBPOOL_WAIT_SPIN;
+
+    // The futex needs a shared mapping
+    if (!can_futex)
+        w->mode = FBPOOL_WAIT_POLL;
+
+    w->spin_us = spin ? atoi(spin) : FBPOOL_SPIN_US;
+}
+
+// Producers of v2 pools wake their consumers up, waited for with the long
+// timeout from the start. Those of v1 pools might only store current_fb,
+// polled until they turn out to wake them up as well.
+static inline void fbpool_waiter_version(fbpool_waiter *w, int version)
+{
+    w->producer_wakes = version > 1;
+}
+
+// Called for every new fb, to predict when the next one would come
+static inline void fbpool_waiter_frame(fbpool_waiter *w)
+{
+    uint64_t now = fbpool_now_us();
+    uint64_t interval = now - w->last_frame_us;
+
+    if (w->last_frame_us && interval < 1000000)
+        w->frame_interval_us = w->frame_interval_us ?
+            (w->frame_interval_us * 7 + interval) / 8 : interval;
+
+    w->last_frame_us = now;
+}
+
+static inline uint32_t fbpool_load_word(volatile void *word)
+{
+    return __atomic_load_n((volatile uint32_t *)word, __ATOMIC_ACQUIRE);
+}
+
+// Wait for the futex word to change from old, returns after a bounded time
+static inline void fbpool_wait(fbpool_waiter *w, volatile void *word,
+                               uint32_t old)
+{
+    uint64_t now, due;
+    int timeout_us, ret;
+
+    if (w->mode == FBPOOL_WAIT_POLL) {
+        usleep(FBPOOL_POLL_US);
+        return;
+    }
+
+    timeout_us = w->producer_wakes ? FBPOOL_WAKE_TIMEOUT_US : FBPOOL_POLL_US;
+    if (w->max_us && w->max_us < timeout_us)
+        timeout_us = w->max_us;
+
+    if (w->mode == FBPOOL_WAIT_SPIN && w->frame_interval_us) {
+        now = fbpool_now_us();
+        due = w->last_frame_us + w->frame_interval_us;
+
+        if (now + w->spin_us >= due) {
+            // The next fb is due, spin a while before sleeping
+            due = now + w->spin_us;
+            while (fbpool_load_word(word) == old) {
+                if (fbpool_now_us() >= due)
+                    break;
+                cpu_relax();
+            }
+
+            if (fbpool_load_word(word) != old)
+                return;
+        } else if (due - w->spin_us - now < timeout_us) {
+            // Sleep until the spinning window
+            timeout_us = due - w->spin_us - now;
+        }
+    }
+
+    ret = futex_wait(word, old, timeout_us);
+    if (fbpool_load_word(word) == old)
+        return;
+
+    if (!ret)
+        w->producer_wakes = 1;
+    else if (ret == -ETIMEDOUT)
+        w->producer_wakes = 0;
+}
+
+// Wait for any of the futex words to change from olds, returns after a
+// bounded time. Without spinning, which is for a single one.
+static inline void fbpool_wait_any(fbpool_waiter *w, volatile void **words,
+                                   const uint32_t *olds, int num)
+{
+    int i, changed = 0, ret = -ENOSYS, timeout_us;
+
+    if (num == 1) {
+        fbpool_wait(w, words[0], olds[0]);
+        return;
+    }
+
+    timeout_us = w->producer_wakes ? FBPOOL_WAKE_TIMEOUT_US : FBPOOL_POLL_US;
+    if (w->max_us && w->max_us < timeout_us)
+        timeout_us = w->max_us;
+
+    if (w->mode != FBPOOL_WAIT_POLL && num <= FUTEX_WAITV_MAX)
+        ret = futex_waitv(words, olds, num, timeout_us);
+    if (ret == -ENOSYS) {
+        usleep(FBPOOL_POLL_US);
+        return;
+    }
+
+    for (i = 0; i < num && !changed; i++)
+        changed = fbpool_load_word(words[i]) != olds[i];
+    if (!changed)
+        return;
+
+    // Any producer not waking them up has them all polled
+    if (ret >= 0)
+        w->producer_wakes = 1;
+    else if (ret == -ETIMEDOUT)
+        w->producer_wakes = 0;
+}
+
+#endif // _FBPOOL_H
@@ -0,0 +1,1214 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <xf86drm.h>
+
+#include "fbcodec.h"
+#include "fbcopy.h"
+#include "fbhash.h"
+#include "fbpool.h"
+#include "stats.h"
+#include "swconv.h"
+#include "transport.h"
+
+/*
+ * Synthetic load for fbpool consumers:
+ * produce: write patterned, timestamped fbs into a pool at a given rate.
+ * consume: read a pool like the relay does, measuring throughput, lost and
+ *          torn fbs and the latency from the producer's timestamp. Encoded
+ *          pools are decoded, counting the encoded bytes.
+ * report:  the same latency summary from a FBPOOL_LATENCY_LOG file, for
+ *          the relay and drm-display themselves.
+ * stats:   dump a FBPOOL_STATS block.
+ * copy:    frame copies with each fbcopy kernel against memcpy, into
+ *          cached memory and into a write-combined dumb bo of the given DRM
+ *          card ("none" to skip it), -t seconds in total. Single threaded
+ *          unless FBCOPY_THREADS is set.
+ * codec:   fbcodec ratio and throughput on synthetic desktop fbs, at each of
+ *          the comma separated damage percents, -t seconds in total. Every
+ *          decoded fb is checked against its source.
+ * swconv:  swconv kernels (or "all" of them) against the scalar one, for
+ *          each source format: first checked on every width up to
+ *          SWCONV_CHECK_WIDTH, at odd offsets and in damage rects, then
+ *          timed on whole frames (MB/s of XRGB8888 out), -t seconds in
+ *          total. Fails on mismatches.
+ *
+ * The results are printed as JSON, to stdout or the -o file.
+ */
+
+typedef struct {
+    uint32_t *samples;
+    size_t num;
+    size_t max;
+} latency_samples;
+
+typedef struct {
+    const char *pool;
+    const char *output;
+    int width;
+    int height;
+    int bpp;
+    int num_fb;
+    int fps;
+    int seconds;
+    int damage; // Percent of the fb changed per frame, 100 for all, 0 for none
+} bench_config;
+
+static volatile sig_atomic_t stopped;
+
+static void stop_handler(int sig) {
+    stopped = 1;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s produce <pool> [-w width] [-h height] [-b bpp] "
+            "[-n num_fb] [-f fps] [-d damage %%] [-t seconds] [-o json]\n"
+            "       %s consume <pool> [-t seconds] [-o json]\n"
+            "       %s report <latency log> [-o json]\n"
+            "       %s stats <stats block> [-o json]\n"
+            "       %s copy <dri card|none> [-w width] [-h height] [-b bpp] "
+            "[-t seconds] [-o json]\n"
+            "       %s codec <damage %%,...> [-w width] [-h height] [-b bpp] "
+            "[-t seconds] [-o json]\n"
+            "       %s swconv <kernel|all> [-w width] [-h height] "
+            "[-t seconds] [-o json]\n",
+            prog, prog, prog, prog, prog, prog, prog);
+    exit(-1);
+}
+
+static void latency_add(latency_samples *lat, uint64_t us) {
+    uint32_t *samples;
+
+    if (lat->num == lat->max) {
+        lat->max = lat->max ? lat->max * 2 : 4096;
+        samples = realloc(lat->samples, lat->max * sizeof(*samples));
+        if (!samples) {
+            fprintf(stderr, "allocate samples failed\n");
+            exit(-1);
+        }
+        lat->samples = samples;
+    }
+
+    lat->samples[lat->num++] = us > UINT32_MAX ? UINT32_MAX : us;
+}
+
+static int compare_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static uint32_t percentile(latency_samples *lat, double p) {
+    size_t i = lat->num * p / 100;
+
+    return lat->samples[i < lat->num ? i : lat->num - 1];
+}
+
+static void latency_json(FILE *out, latency_samples *lat) {
+    uint64_t sum = 0;
+    size_t i;
+
+    if (!lat->num) {
+        fprintf(out, "null");
+        return;
+    }
+
+    qsort(lat->samples, lat->num, sizeof(*lat->samples), compare_u32);
+    for (i = 0; i < lat->num; i++)
+        sum += lat->samples[i];
+
+    fprintf(out, "{\"samples\": %zu, \"min\": %u, \"mean\": %llu, "
+            "\"p50\": %u, \"p90\": %u, \"p99\": %u, \"p999\": %u, "
+            "\"max\": %u}", lat->num, lat->samples[0],
+            (unsigned long long)(sum / lat->num), percentile(lat, 50),
+            percentile(lat, 90), percentile(lat, 99), percentile(lat, 99.9),
+            lat->samples[lat->num - 1]);
+}
+
+static FILE *output_open(const char *path) {
+    FILE *out;
+
+    if (!path)
+        return stdout;
+
+    out = fopen(path, "w");
+    if (!out) {
+        fprintf(stderr, "open %s failed\n", path);
+        return stdout;
+    }
+
+    return out;
+}
+
+static void output_close(FILE *out) {
+    if (out != stdout)
+        fclose(out);
+}
+
+static fbpool_header *map_pool(int fd, size_t size) {
+    void *ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+    return ptr == MAP_FAILED ? NULL : ptr;
+}
+
+// Moving bars over a gradient, only within the damaged band. Nothing at 0%
+static void draw_frame(fbpool_header *hdr, uint8_t *fb, uint32_t frame,
+                       damage_region *damage, int percent) {
+    int pitch = fbpool_pitch(hdr);
+    int rows = hdr->bpp == 12 ? hdr->height * 3 / 2 : hdr->height;
+    int band = hdr->height * percent / 100;
+    damage_rect rect = { 0, 0, hdr->width, hdr->height };
+    int y, y0, y1;
+
+    damage_reset(damage);
+    if (!percent)
+        return;
+
+    if (band <= 0)
+        band = 1;
+
+    if (band >= hdr->height) {
+        damage_full(damage);
+        y0 = 0;
+        y1 = rows;
+    } else {
+        // Whole rows, NV12's uv rows follow the damaged luma rows
+        y0 = (uint64_t)frame * band % (hdr->height - band + 1) & ~1;
+        y1 = y0 + band;
+        rect.y = y0;
+        rect.h = band;
+        damage_add_rect(damage, &rect, hdr->width, hdr->height);
+    }
+
+    for (y = y0; y < y1; y++)
+        memset(fb + (size_t)y * pitch, (frame + y) & 0xff, pitch);
+
+    if (hdr->bpp == 12 && y1 <= hdr->height) {
+        for (y = hdr->height + y0 / 2; y < hdr->height + y1 / 2; y++)
+            memset(fb + (size_t)y * pitch, 0x80, pitch);
+    }
+}
+
+static int produce(bench_config *cfg) {
+    pool_server *server;
+    fbpool_header *hdr;
+    damage_region damage;
+    struct timespec next;
+    size_t hdr_size, size;
+    uint64_t start, elapsed, interval_ns;
+    uint32_t frame = 0, skipped = 0;
+    uint8_t *data;
+    int fd, fb;
+    FILE *out;
+
+    // The fbs page aligned, for zero-copy scanout
+    hdr_size = sizeof(fbpool_header) + cfg->num_fb * sizeof(fbpool_slot);
+    hdr_size = (hdr_size + 4095) & ~(size_t)4095;
+
+    size = hdr_size +
+        (size_t)cfg->num_fb * cfg->width * cfg->height * cfg->bpp / 8;
+
+    fd = pool_create(cfg->pool, size, &server);
+    if (fd < 0)
+        return -1;
+
+    hdr = map_pool(fd, size);
+    if (!hdr) {
+        fprintf(stderr, "map %s failed\n", cfg->pool);
+        pool_server_destroy(server);
+        close(fd);
+        return -1;
+    }
+
+    memset(hdr->magic, 0, 4);
+    fbpool_init_header(hdr, cfg->width, cfg->height, cfg->bpp, cfg->num_fb,
+                       hdr_size, FBPOOL_FLAG_DAMAGE | FBPOOL_FLAG_HASH);
+
+    interval_ns = cfg->fps ? 1000000000ULL / cfg->fps : 0;
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    start = fbpool_now_us();
+
+    while (!stopped) {
+        elapsed = fbpool_now_us() - start;
+        if (cfg->seconds && elapsed >= cfg->seconds * 1000000ULL)
+            break;
+
+        fb = fbpool_acquire_slot(hdr);
+        if (fb < 0) {
+            // Every fb being read, the consumers are too slow
+            skipped++;
+        } else {
+            data = (uint8_t *)hdr + hdr_size + (size_t)fb * hdr->fb_size;
+
+            fbpool_begin_write(hdr, 2, fb);
+            draw_frame(hdr, data, frame + 1, &damage, cfg->damage);
+            fbpool_set_damage(hdr, 2, fb, &damage);
+            fbpool_set_hash(hdr, 2, fb,
+                            fbhash_frame(data, fbpool_pitch(hdr), hdr->width,
+                                         hdr->height, hdr->bpp));
+            fbpool_set_timestamp(hdr, 2, fb, fbpool_now_us());
+            fbpool_end_write(hdr, 2, fb, ++frame);
+            fbpool_publish(hdr, 2, fb, frame);
+        }
+
+        if (!interval_ns)
+            continue;
+
+        next.tv_nsec += interval_ns;
+        while (next.tv_nsec >= 1000000000) {
+            next.tv_nsec -= 1000000000;
+            next.tv_sec++;
+        }
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next,
+                               NULL) == EINTR && !stopped);
+    }
+
+    elapsed = fbpool_now_us() - start;
+
+    out = output_open(cfg->output);
+    fprintf(out, "{\"mode\": \"produce\", \"pool\": \"%s\", \"width\": %d, "
+            "\"height\": %d, \"bpp\": %d, \"num_fb\": %d, "
+            "\"target_fps\": %d, \"damage_percent\": %d, \"frames\": %u, "
+            "\"skipped\": %u, \"seconds\": %.3f, \"fps\": %.1f}\n",
+            cfg->pool, cfg->width, cfg->height, cfg->bpp, cfg->num_fb,
+            cfg->fps, cfg->damage, frame, skipped, elapsed / 1e6,
+            elapsed ? frame * 1e6 / elapsed : 0);
+    output_close(out);
+
+    munmap(hdr, size);
+    pool_server_destroy(server);
+    close(fd);
+    return 0;
+}
+
+static int consume(bench_config *cfg) {
+    fbpool_header *hdr;
+    fbpool_waiter waiter;
+    latency_samples lat = { 0 };
+    struct stat st;
+    uint64_t start = 0, elapsed, bytes = 0, timestamp;
+    uint32_t frame, old_frame, fb_frame, last_frame = 0;
+    uint32_t frames = 0, lost = 0, torn = 0, undecoded = 0;
+    fbpool_read rd;
+    size_t size, hdr_size, fb_size;
+    fbcodec *codec = NULL;
+    fbcodec_header *enc_hdr;
+    uint8_t *copy, *src;
+    int fd, fb, version;
+    FILE *out;
+
+    fd = pool_open(cfg->pool);
+    if (fd < 0)
+        return -1;
+
+    // Wait for the producer to fill the header
+    while (1) {
+        if (fstat(fd, &st) < 0) {
+            fprintf(stderr, "stat %s failed\n", cfg->pool);
+            return -1;
+        }
+
+        hdr = st.st_size >= sizeof(fbpool_header) ?
+            map_pool(fd, sizeof(fbpool_header)) : NULL;
+        if (hdr && !strncmp(hdr->magic, FBPOOL_MAGIC, 4))
+            break;
+
+        if (hdr)
+            munmap(hdr, sizeof(fbpool_header));
+
+        if (stopped)
+            return -1;
+        usleep(10000);
+    }
+
+    version = fbpool_version(hdr, st.st_size);
+    hdr_size = fbpool_header_size(hdr, version);
+    size = hdr_size + (size_t)hdr->num_fb * hdr->fb_size;
+    munmap(hdr, sizeof(fbpool_header));
+
+    hdr = map_pool(fd, size);
+    copy = malloc(hdr ? hdr->fb_size : 0);
+    if (!hdr || !copy) {
+        fprintf(stderr, "map %s failed\n", cfg->pool);
+        return -1;
+    }
+
+    if (fbpool_is_encoded(hdr, version)) {
+        codec = fbcodec_create(fbpool_image_size(hdr), 0);
+        if (!codec)
+            return -1;
+    }
+
+    fbpool_waiter_init(&waiter, 1);
+    fbpool_waiter_version(&waiter, version);
+    old_frame = fbpool_frame(hdr, version);
+
+    while (!stopped) {
+        if (start && cfg->seconds &&
+            fbpool_now_us() - start >= cfg->seconds * 1000000ULL)
+            break;
+
+        frame = fbpool_frame(hdr, version);
+        if (frame == old_frame) {
+            fbpool_wait(&waiter, fbpool_notify_word(hdr, version), old_frame);
+            continue;
+        }
+        old_frame = frame;
+
+        fb = fbpool_current(hdr);
+        if (fb < 0 || fb >= hdr->num_fb)
+            continue;
+
+        if (fbpool_begin_read(hdr, version, fb, &rd) < 0) {
+            torn++;
+            continue;
+        }
+
+        fb_frame = version > 1 ? fbpool_get_slot(hdr, fb)->frame : frame;
+        timestamp = fbpool_get_timestamp(hdr, version, fb);
+
+        src = (uint8_t *)hdr + hdr_size + (size_t)fb * hdr->fb_size;
+        fb_size = hdr->fb_size;
+        if (codec) {
+            // Only the encoded bytes
+            enc_hdr = (fbcodec_header *)copy;
+            memcpy(enc_hdr, src, sizeof(*enc_hdr));
+            fb_size = sizeof(*enc_hdr) + enc_hdr->size;
+            if (fb_size > (size_t)hdr->fb_size)
+                fb_size = hdr->fb_size;
+        }
+        memcpy(copy, src, fb_size);
+
+        if (fbpool_end_read(hdr, version, fb, &rd) < 0) {
+            torn++;
+            continue;
+        }
+
+        if (codec && fbcodec_decode(codec, copy, fb_size)) {
+            undecoded++;
+            last_frame = fb_frame;
+            continue;
+        }
+
+        // Start counting from the first fb
+        if (!start) {
+            start = fbpool_now_us();
+        } else {
+            if (fb_frame - last_frame > 1)
+                lost += fb_frame - last_frame - 1;
+            frames++;
+            bytes += fb_size;
+            if (timestamp)
+                latency_add(&lat, fbpool_now_us() - timestamp);
+        }
+        last_frame = fb_frame;
+
+        fbpool_waiter_frame(&waiter);
+    }
+
+    elapsed = start ? fbpool_now_us() - start : 0;
+
+    out = output_open(cfg->output);
+    fprintf(out, "{\"mode\": \"consume\", \"pool\": \"%s\", \"version\": %d, "
+            "\"width\": %d, \"height\": %d, \"bpp\": %d, \"num_fb\": %d, "
+            "\"encoded\": %s, \"frames\": %u, \"lost\": %u, \"torn\": %u, "
+            "\"undecoded\": %u, \"seconds\": %.3f, \"fps\": %.1f, "
+            "\"mb_per_s\": %.1f, \"latency_us\": ",
+            cfg->pool, version, hdr->width, hdr->height, hdr->bpp,
+            hdr->num_fb, codec ? "true" : "false", frames, lost, torn,
+            undecoded, elapsed / 1e6,
+            elapsed ? frames * 1e6 / elapsed : 0,
+            elapsed ? bytes / (double)elapsed : 0);
+    latency_json(out, &lat);
+    fprintf(out, "}\n");
+    output_close(out);
+
+    fbcodec_destroy(codec);
+    free(lat.samples);
+    free(copy);
+    munmap(hdr, size);
+    close(fd);
+    return 0;
+}
+
+static int report(bench_config *cfg) {
+    latency_samples lat = { 0 };
+    unsigned long long us;
+    uint32_t frame, last_frame = 0, frames = 0, lost = 0;
+    FILE *log, *out;
+
+    log = fopen(cfg->pool, "r");
+    if (!log) {
+        fprintf(stderr, "open %s failed\n", cfg->pool);
+        return -1;
+    }
+
+    while (fscanf(log, "%u %llu", &frame, &us) == 2) {
+        if (frames && frame - last_frame > 1)
+            lost += frame - last_frame - 1;
+        last_frame = frame;
+        frames++;
+        latency_add(&lat, us);
+    }
+    fclose(log);
+
+    out = output_open(cfg->output);
+    fprintf(out, "{\"mode\": \"report\", \"log\": \"%s\", \"frames\": %u, "
+            "\"lost\": %u, \"latency_us\": ", cfg->pool, frames, lost);
+    latency_json(out, &lat);
+    fprintf(out, "}\n");
+    output_close(out);
+
+    free(lat.samples);
+    return 0;
+}
+
+static int dump_stats(bench_config *cfg) {
+    stats_block *block;
+    const stats_hist *hist;
+    uint64_t now = stats_now_us();
+    int fd, i;
+    FILE *out;
+
+    fd = open(cfg->pool, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "open %s failed\n", cfg->pool);
+        return -1;
+    }
+
+    block = mmap(NULL, sizeof(*block), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (block == MAP_FAILED || strncmp(block->magic, STATS_MAGIC, 4) ||
+        block->version != STATS_VERSION) {
+        fprintf(stderr, "invalid stats block: %s\n", cfg->pool);
+        return -1;
+    }
+
+    out = output_open(cfg->output);
+    fprintf(out, "{\"mode\": \"stats\", \"uptime_s\": %.3f, "
+            "\"idle_s\": %.3f, \"cpu_s\": %.3f",
+            (now - block->start_us) / 1e6, (now - block->update_us) / 1e6,
+            block->cpu_us / 1e6);
+
+    for (i = 0; i < STATS_COUNTERS; i++)
+        fprintf(out, ", \"%s\": %llu", block->counter_names[i],
+                (unsigned long long)block->counters[i]);
+
+    // Of the frames done
+    fprintf(out, ", \"skip_ratio\": %.3f",
+            block->counters[STATS_FRAMES] ?
+            (double)block->counters[STATS_SKIPPED] /
+            block->counters[STATS_FRAMES] : 0.0);
+
+    fprintf(out, ", \"stages_us\": {");
+    for (i = 0; i < STATS_STAGES; i++) {
+        hist = &block->stages[i];
+        fprintf(out, "%s\"%s\": {\"count\": %llu, \"mean\": %llu, "
+                "\"p50\": %llu, \"p90\": %llu, \"p99\": %llu, "
+                "\"max\": %llu}", i ? ", " : "", hist->name,
+                (unsigned long long)hist->count,
+                (unsigned long long)(hist->count ?
+                                     hist->sum_us / hist->count : 0),
+                (unsigned long long)stats_percentile(hist, 50),
+                (unsigned long long)stats_percentile(hist, 90),
+                (unsigned long long)stats_percentile(hist, 99),
+                (unsigned long long)hist->max_us);
+    }
+    fprintf(out, "}}\n");
+    output_close(out);
+
+    munmap(block, sizeof(*block));
+    return 0;
+}
+
+typedef struct {
+    int fd;
+    uint32_t handle;
+    void *ptr;
+    size_t size;
+    size_t pitch;
+} dumb_bo;
+
+// Dumb bos are mapped write-combined, like the ones drm-display renders to
+static int dumb_bo_create(dumb_bo *bo, const char *card, size_t row_size,
+                          int rows) {
+    struct drm_mode_create_dumb create = {
+        .width = (row_size + 3) / 4,
+        .height = rows,
+        .bpp = 32,
+    };
+    struct drm_mode_map_dumb map = {0};
+    struct drm_mode_destroy_dumb destroy = {0};
+
+    bo->fd = open(card, O_RDWR | O_CLOEXEC);
+    if (bo->fd < 0) {
+        fprintf(stderr, "open %s failed\n", card);
+        return -1;
+    }
+
+    if (ioctl(bo->fd, DRM_IOCTL_MODE_CREATE_DUMB, &create) < 0) {
+        fprintf(stderr, "create dumb failed\n");
+        goto err_close;
+    }
+
+    map.handle = create.handle;
+    if (ioctl(bo->fd, DRM_IOCTL_MODE_MAP_DUMB, &map) < 0) {
+        fprintf(stderr, "map dumb failed\n");
+        goto err_destroy;
+    }
+
+    bo->ptr = mmap(NULL, create.size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                   bo->fd, map.offset);
+    if (bo->ptr == MAP_FAILED) {
+        fprintf(stderr, "map dumb failed\n");
+        goto err_destroy;
+    }
+
+    bo->handle = create.handle;
+    bo->size = create.size;
+    bo->pitch = create.pitch;
+    return 0;
+err_destroy:
+    destroy.handle = create.handle;
+    ioctl(bo->fd, DRM_IOCTL_MODE_DESTROY_DUMB, &destroy);
+err_close:
+    close(bo->fd);
+    return -1;
+}
+
+static void dumb_bo_destroy(dumb_bo *bo) {
+    struct drm_mode_destroy_dumb destroy = {
+        .handle = bo->handle,
+    };
+
+    munmap(bo->ptr, bo->size);
+    ioctl(bo->fd, DRM_IOCTL_MODE_DESTROY_DUMB, &destroy);
+    close(bo->fd);
+}
+
+// Copies per second of a frame of rows, src_pitch != dst_pitch for row
+// copies. The kernel is NULL for memcpy itself.
+static double copy_rate(const char *kernel, uint8_t *dst, size_t dst_pitch,
+                        const uint8_t *src, size_t src_pitch,
+                        size_t row_size, int rows, uint64_t duration_us) {
+    uint64_t start, now;
+    size_t size = dst_pitch * rows;
+    int y, num = 0;
+
+    start = now = fbpool_now_us();
+    while (now - start < duration_us || num < 3) {
+        if (kernel)
+            fbcopy_rows(dst, dst_pitch, src, src_pitch, row_size, rows,
+                        FBCOPY_UNCACHED);
+        else if (src_pitch == dst_pitch)
+            memcpy(dst, src, size);
+        else
+            for (y = 0; y < rows; y++)
+                memcpy(dst + y * dst_pitch, src + y * src_pitch, row_size);
+
+        num++;
+        now = fbpool_now_us();
+    }
+
+    return num * 1e6 / (now - start);
+}
+
+static int copy_bench(bench_config *cfg) {
+    const char *kernels[] = { NULL, "memcpy", "sse2", "avx2", "neon" };
+    const int num_kernels = sizeof(kernels) / sizeof(kernels[0]);
+    const char *default_kernel = fbcopy_name();
+    size_t row_size = (size_t)cfg->width * cfg->bpp / 8;
+    int rows = cfg->bpp == 12 ? cfg->height * 3 / 2 : cfg->height;
+    uint64_t duration_us;
+    uint8_t *src = NULL, *cached = NULL;
+    dumb_bo wc = {0};
+    size_t pitch;
+    double rate;
+    int has_wc, num_cases, num_dsts, dst, layout, k, first = 1;
+    FILE *out;
+
+    if (cfg->bpp == 12)
+        row_size = cfg->width;
+
+    // No tuning in the middle of the measures
+    setenv("FBCOPY_THREADS", "1", 0);
+
+    has_wc = strcmp(cfg->pool, "none") &&
+        !dumb_bo_create(&wc, cfg->pool, row_size, rows);
+
+    // Like dumb bos, which the copy from a tight source is a row copy to
+    pitch = has_wc ? wc.pitch : (row_size + 63) / 64 * 64;
+
+    // Room for the row copies from a wider source
+    if (posix_memalign((void **)&src, 64, (pitch + 64) * rows) ||
+        posix_memalign((void **)&cached, 64, pitch * rows)) {
+        fprintf(stderr, "allocate buffers failed\n");
+        goto err;
+    }
+    memset(src, 0x5a, (pitch + 64) * rows);
+    memset(cached, 0, pitch * rows);
+
+    num_dsts = has_wc ? 2 : 1;
+    num_cases = 0;
+    for (k = 0; k < num_kernels; k++)
+        num_cases += !kernels[k] || !fbcopy_set(kernels[k]);
+    num_cases *= num_dsts * 2;
+    duration_us = cfg->seconds * 1000000ULL / num_cases;
+
+    out = output_open(cfg->output);
+    fprintf(out, "{\"mode\": \"copy\", \"width\": %d, \"height\": %d, "
+            "\"bpp\": %d, \"frame_bytes\": %zu, \"default\": \"%s\", "
+            "\"results\": [", cfg->width, cfg->height, cfg->bpp,
+            row_size * rows, default_kernel);
+
+    for (dst = 0; dst < num_dsts; dst++) {
+        for (layout = 0; layout < 2; layout++) {
+            for (k = 0; k < num_kernels; k++) {
+                if (kernels[k] && fbcopy_set(kernels[k]) < 0)
+                    continue;
+
+                rate = copy_rate(kernels[k], dst ? wc.ptr : cached, pitch,
+                                 src, layout ? pitch + 64 : pitch, row_size,
+                                 rows, duration_us);
+
+                fprintf(out, "%s{\"dst\": \"%s\", \"layout\": \"%s\", "
+                        "\"kernel\": \"%s\", \"us_per_frame\": %.1f, "
+                        "\"mb_per_s\": %.1f}", first ? "" : ", ",
+                        dst ? "wc" : "cached", layout ? "rows" : "frame",
+                        kernels[k] ? kernels[k] : "libc", 1e6 / rate,
+                        rate * row_size * rows / 1e6);
+                first = 0;
+            }
+        }
+    }
+
+    fprintf(out, "]}\n");
+    output_close(out);
+
+    free(src);
+    free(cached);
+    if (has_wc)
+        dumb_bo_destroy(&wc);
+    return 0;
+err:
+    free(src);
+    free(cached);
+    if (has_wc)
+        dumb_bo_destroy(&wc);
+    return -1;
+}
+
+#define CODEC_MAX_LEVELS    16
+#define CODEC_KEY_INTERVAL  60 // The relay's default FBPOOL_KEYFRAME
+#define GLYPH_WIDTH         8
+#define GLYPH_HEIGHT        16
+
+typedef struct {
+    uint8_t *data;
+    int width;
+    int height;
+    int bpp;
+    size_t pitch;
+} ui_image;
+
+static uint32_t ui_hash(uint32_t a, uint32_t b) {
+    uint32_t h = a * 0x9e3779b1 ^ b * 0x85ebca6b;
+
+    h ^= h >> 15;
+    h *= 0xc2b2ae35;
+    return h ^ h >> 13;
+}
+
+// rgb is 0xRRGGBB, NV12 only gets the luma
+static void ui_pixel(ui_image *img, int x, int y, uint32_t rgb) {
+    uint8_t *row = img->data + (size_t)y * img->pitch;
+
+    switch (img->bpp) {
+    case 32:
+        ((uint32_t *)row)[x] = 0xff000000 | rgb;
+        break;
+    case 24:
+        row[x * 3] = rgb;
+        row[x * 3 + 1] = rgb >> 8;
+        row[x * 3 + 2] = rgb >> 16;
+        break;
+    case 16:
+        ((uint16_t *)row)[x] = (rgb >> 8 & 0xf800) | (rgb >> 5 & 0x07e0) |
+            (rgb >> 3 & 0x001f);
+        break;
+    default:
+        row[x] = ((rgb >> 16 & 0xff) * 77 + (rgb >> 8 & 0xff) * 150 +
+                  (rgb & 0xff) * 29) >> 8;
+        break;
+    }
+}
+
+static void ui_rect(ui_image *img, int x0, int y0, int w, int h,
+                    uint32_t rgb) {
+    int x, y;
+
+    for (y = y0 < 0 ? 0 : y0; y < y0 + h && y < img->height; y++)
+        for (x = x0 < 0 ? 0 : x0; x < x0 + w && x < img->width; x++)
+            ui_pixel(img, x, y, rgb);
+}
+
+// Lines of text-like glyphs from seed, with gaps for spaces and line ends,
+// the last one cut at h
+static void ui_text(ui_image *img, int x0, int y0, int w, int h,
+                    uint32_t seed, uint32_t fg, uint32_t bg) {
+    uint32_t c, bits;
+    int x, y, gx, gy, col, line_len;
+
+    ui_rect(img, x0, y0, w, h, bg);
+
+    for (y = y0; y < y0 + h && y < img->height; y += GLYPH_HEIGHT) {
+        line_len = ui_hash(seed, y) % (w / GLYPH_WIDTH + 1);
+
+        for (col = 0; col < line_len; col++) {
+            c = ui_hash(seed ^ y, col) % 96;
+            if (c < 12)
+                continue;
+
+            // Glyph rows 3-12, columns 1-6
+            for (gy = 3; gy <= 12 && y + gy < y0 + h &&
+                 y + gy < img->height; gy++) {
+                bits = ui_hash(c, gy);
+                for (gx = 1; gx <= 6; gx++) {
+                    x = x0 + col * GLYPH_WIDTH + gx;
+                    if (x < img->width && bits >> gx & 1)
+                        ui_pixel(img, x, y + gy, fg);
+                }
+            }
+        }
+    }
+}
+
+// A gradient wallpaper, a taskbar and a few windows of text
+static void ui_desktop(ui_image *img) {
+    int x, y, i, w, h;
+
+    if (img->bpp == 12)
+        memset(img->data + (size_t)img->height * img->pitch, 0x80,
+               (size_t)img->height / 2 * img->pitch);
+
+    for (y = 0; y < img->height; y++)
+        for (x = 0; x < img->width; x++)
+            ui_pixel(img, x, y, (y * 255 / img->height) << 8 |
+                     (x * 255 / img->width));
+
+    for (i = 0; i < 3; i++) {
+        x = img->width * (1 + i * 3) / 16;
+        y = img->height * (1 + i * 2) / 16;
+        w = img->width / 2;
+        h = img->height / 2;
+
+        ui_rect(img, x, y, w, GLYPH_HEIGHT * 2, 0x3465a4);
+        ui_text(img, x + GLYPH_WIDTH, y + GLYPH_HEIGHT / 2, w / 3,
+                GLYPH_HEIGHT, i, 0xffffff, 0x3465a4);
+        ui_text(img, x, y + GLYPH_HEIGHT * 2, w, h - GLYPH_HEIGHT * 2, i + 3,
+                0x202020, 0xf0f0f0);
+    }
+
+    ui_rect(img, 0, img->height - 40, img->width, 40, 0x2e3436);
+}
+
+// A blinking cursor, and new text over percent of the rows
+static void ui_update(ui_image *img, uint32_t frame, int percent) {
+    int band = img->height * percent / 100;
+    int y0;
+
+    ui_rect(img, img->width / 2, img->height / 2, GLYPH_WIDTH, GLYPH_HEIGHT,
+            frame / 30 % 2 ? 0x202020 : 0xf0f0f0);
+
+    if (!band)
+        return;
+
+    y0 = (uint64_t)frame * GLYPH_HEIGHT % (img->height - band + 1);
+    ui_text(img, 0, y0, img->width, band, frame, 0xd3d7cf, 0x000000);
+}
+
+static int codec_bench(bench_config *cfg) {
+    int levels[CODEC_MAX_LEVELS];
+    ui_image img = {
+        .width = cfg->width,
+        .height = cfg->height,
+        .bpp = cfg->bpp,
+        .pitch = cfg->bpp == 12 ? cfg->width : cfg->width * cfg->bpp / 8,
+    };
+    size_t raw_size = img.pitch * (cfg->bpp == 12 ? img.height * 3 / 2 :
+                                   img.height);
+    uint64_t duration_us, start, t, encode_us, decode_us;
+    uint64_t key_bytes, delta_bytes;
+    uint32_t frame, keys, deltas, mismatched = 0;
+    fbcodec *encoder = NULL, *decoder = NULL;
+    fbcodec_header *enc_hdr;
+    uint8_t *enc = NULL;
+    const char *ptr = cfg->pool;
+    char *end;
+    size_t size;
+    int num_levels = 0, i;
+    FILE *out;
+
+    while (*ptr && num_levels < CODEC_MAX_LEVELS) {
+        levels[num_levels] = strtol(ptr, &end, 10);
+        if (end == ptr || levels[num_levels] < 0 || levels[num_levels] > 100) {
+            fprintf(stderr, "invalid damage percents: %s\n", cfg->pool);
+            return -1;
+        }
+        num_levels++;
+        ptr = *end == ',' ? end + 1 : end;
+    }
+
+    img.data = malloc(raw_size);
+    enc = malloc(fbcodec_bound(raw_size));
+    if (!img.data || !enc) {
+        fprintf(stderr, "allocate buffers failed\n");
+        goto err;
+    }
+
+    duration_us = cfg->seconds * 1000000ULL / (num_levels ? num_levels : 1);
+
+    out = output_open(cfg->output);
+    fprintf(out, "{\"mode\": \"codec\", \"width\": %d, \"height\": %d, "
+            "\"bpp\": %d, \"frame_bytes\": %zu, \"key_interval\": %d, "
+            "\"results\": [", cfg->width, cfg->height, cfg->bpp, raw_size,
+            CODEC_KEY_INTERVAL);
+
+    for (i = 0; i < num_levels && !stopped; i++) {
+        encoder = fbcodec_create(raw_size, CODEC_KEY_INTERVAL);
+        decoder = fbcodec_create(raw_size, 0);
+        if (!encoder || !decoder) {
+            output_close(out);
+            goto err;
+        }
+
+        ui_desktop(&img);
+        encode_us = decode_us = key_bytes = delta_bytes = 0;
+        keys = deltas = 0;
+
+        start = fbpool_now_us();
+        for (frame = 1; frame <= 3 || fbpool_now_us() - start < duration_us;
+             frame++) {
+            if (frame > 1)
+                ui_update(&img, frame, levels[i]);
+
+            t = fbpool_now_us();
+            size = fbcodec_encode(encoder, enc, img.data, frame);
+            encode_us += fbpool_now_us() - t;
+
+            enc_hdr = (fbcodec_header *)enc;
+            if (enc_hdr->type == FBCODEC_DELTA) {
+                delta_bytes += size;
+                deltas++;
+            } else {
+                key_bytes += size;
+                keys++;
+            }
+
+            t = fbpool_now_us();
+            if (fbcodec_decode(decoder, enc, size) < 0)
+                mismatched++;
+            decode_us += fbpool_now_us() - t;
+
+            if (memcmp(fbcodec_data(decoder), img.data, raw_size))
+                mismatched++;
+
+            if (stopped)
+                break;
+        }
+        frame--;
+
+        fprintf(out, "%s{\"damage_percent\": %d, \"frames\": %u, "
+                "\"key_ratio\": %.1f, \"delta_ratio\": %.1f, "
+                "\"ratio\": %.1f, \"encode_mb_per_s\": %.1f, "
+                "\"decode_mb_per_s\": %.1f, \"mismatched\": %u}",
+                i ? ", " : "", levels[i], frame,
+                key_bytes ? (double)keys * raw_size / key_bytes : 0,
+                delta_bytes ? (double)deltas * raw_size / delta_bytes : 0,
+                (double)frame * raw_size / (key_bytes + delta_bytes),
+                encode_us ? (double)frame * raw_size / encode_us : 0,
+                decode_us ? (double)frame * raw_size / decode_us : 0,
+                mismatched);
+
+        fbcodec_destroy(encoder);
+        fbcodec_destroy(decoder);
+        encoder = decoder = NULL;
+    }
+
+    fprintf(out, "]}\n");
+    output_close(out);
+
+    free(img.data);
+    free(enc);
+    return mismatched ? -1 : 0;
+err:
+    fbcodec_destroy(encoder);
+    fbcodec_destroy(decoder);
+    free(img.data);
+    free(enc);
+    return -1;
+}
+
+// Covers every tail of the 16 pixels kernels, after a few full blocks
+#define SWCONV_CHECK_WIDTH  79
+#define SWCONV_CHECK_HEIGHT 4
+// Room for the rects of the check widths, at the x tried
+#define SWCONV_CHECK_PITCH  ((SWCONV_CHECK_WIDTH + 8) * 4)
+
+static const struct {
+    int bpp;
+    const char *format;
+} swconv_formats[] = {
+    { 12, "nv12" },
+    { 16, "rgb565" },
+    { 24, "rgb888" },
+    { 32, "xrgb8888" },
+};
+
+#define SWCONV_FORMATS_NUM \
+    (int)(sizeof(swconv_formats) / sizeof(swconv_formats[0]))
+
+// Whole frames of width pixels (rect NULL), or the rect of a wider frame,
+// with the source at offset bytes of an odd alignment
+static int swconv_check_one(const char *kernel, uint8_t *ref, uint8_t *dst,
+                            const uint8_t *src, int offset, int bpp,
+                            int width, const damage_rect *rect) {
+    int src_pitch = (bpp == 12 ? width : width * bpp / 8) + offset;
+    size_t dst_size = SWCONV_CHECK_PITCH * SWCONV_CHECK_HEIGHT;
+
+    memset(ref, 0, dst_size);
+    memset(dst, 0, dst_size);
+
+    swconv_set("scalar");
+    swconv_xrgb8888(ref, SWCONV_CHECK_PITCH, src + offset, src_pitch, bpp,
+                    width, SWCONV_CHECK_HEIGHT, rect);
+    swconv_set(kernel);
+    swconv_xrgb8888(dst, SWCONV_CHECK_PITCH, src + offset, src_pitch, bpp,
+                    width, SWCONV_CHECK_HEIGHT, rect);
+
+    return memcmp(ref, dst, dst_size) != 0;
+}
+
+static uint32_t swconv_check(const char *kernel, const uint8_t *src,
+                             uint8_t *ref, uint8_t *dst, int bpp) {
+    damage_rect rect;
+    uint32_t mismatched = 0;
+    int width, x, offset;
+
+    for (width = 1; width <= SWCONV_CHECK_WIDTH; width++) {
+        for (offset = 0; offset < 4; offset++) {
+            // x -1 for the whole frame
+            for (x = -1; x < 4; x++) {
+                rect = (damage_rect){ x, 1, width, SWCONV_CHECK_HEIGHT - 2 };
+                if (!swconv_check_one(kernel, ref, dst, src, offset, bpp,
+                                      x < 0 ? width : SWCONV_CHECK_WIDTH + 4,
+                                      x < 0 ? NULL : &rect))
+                    continue;
+
+                // Only the first one, the others are likely the same bug
+                if (!mismatched++)
+                    fprintf(stderr, "swconv %s mismatched: bpp %d, "
+                            "width %d, x %d, offset %d\n", kernel, bpp,
+                            width, x, offset);
+            }
+        }
+    }
+
+    return mismatched;
+}
+
+// Frames per second of the kernel in use
+static double swconv_rate(uint8_t *dst, const uint8_t *src, int bpp,
+                          int width, int height, uint64_t duration_us) {
+    int src_pitch = bpp == 12 ? width : width * bpp / 8;
+    uint64_t start, now;
+    int num = 0;
+
+    start = now = fbpool_now_us();
+    while (now - start < duration_us || num < 3) {
+        swconv_xrgb8888(dst, width * 4, src, src_pitch, bpp, width, height,
+                        NULL);
+
+        num++;
+        now = fbpool_now_us();
+    }
+
+    return num * 1e6 / (now - start);
+}
+
+static int swconv_bench(bench_config *cfg) {
+    const char *kernels[] = { "scalar", "sse2", "avx2", "neon" };
+    const int num_kernels = sizeof(kernels) / sizeof(kernels[0]);
+    const char *default_kernel = swconv_name();
+    size_t frame_size = (size_t)cfg->width * cfg->height * 4;
+    size_t bench_size = frame_size;
+    size_t check_size = SWCONV_CHECK_PITCH * SWCONV_CHECK_HEIGHT;
+    uint8_t *src = NULL, *dst = NULL, *ref = NULL;
+    uint32_t mismatched, total = 0;
+    uint64_t duration_us;
+    double rate;
+    int num_cases = 0, f, k, first = 1;
+    FILE *out;
+
+    for (k = 0; k < num_kernels; k++) {
+        if (strcmp(cfg->pool, "all") && strcmp(cfg->pool, kernels[k]))
+            kernels[k] = NULL;
+        else if (swconv_set(kernels[k]) < 0)
+            kernels[k] = NULL;
+        else
+            num_cases++;
+    }
+
+    if (!num_cases) {
+        fprintf(stderr, "swconv %s unavailable\n", cfg->pool);
+        return -1;
+    }
+
+    // XRGB8888 is the biggest source, at most as big as its destination
+    if (frame_size < check_size)
+        frame_size = check_size;
+    src = malloc(frame_size + 3);
+    dst = malloc(frame_size);
+    ref = malloc(check_size);
+    if (!src || !dst || !ref) {
+        fprintf(stderr, "allocate buffers failed\n");
+        goto err;
+    }
+
+    // Random pixels, for every clamp and rounding path of the kernels
+    for (f = 0; f < (int)(frame_size + 3) / 4; f++)
+        ((uint32_t *)src)[f] = ui_hash(f, 0x5eed);
+
+    duration_us = cfg->seconds * 1000000ULL /
+        (num_cases * SWCONV_FORMATS_NUM);
+
+    out = output_open(cfg->output);
+    fprintf(out, "{\"mode\": \"swconv\", \"width\": %d, \"height\": %d, "
+            "\"default\": \"%s\", \"results\": [", cfg->width, cfg->height,
+            default_kernel);
+
+    for (f = 0; f < SWCONV_FORMATS_NUM && !stopped; f++) {
+        for (k = 0; k < num_kernels && !stopped; k++) {
+            if (!kernels[k])
+                continue;
+
+            mismatched = swconv_check(kernels[k], src, ref, dst,
+                                      swconv_formats[f].bpp);
+            total += mismatched;
+
+            swconv_set(kernels[k]);
+            rate = swconv_rate(dst, src, swconv_formats[f].bpp, cfg->width,
+                               cfg->height, duration_us);
+
+            fprintf(out, "%s{\"format\": \"%s\", \"bpp\": %d, "
+                    "\"kernel\": \"%s\", \"us_per_frame\": %.1f, "
+                    "\"mb_per_s\": %.1f, \"mismatched\": %u}",
+                    first ? "" : ", ", swconv_formats[f].format,
+                    swconv_formats[f].bpp, kernels[k], 1e6 / rate,
+                    rate * bench_size / 1e6, mismatched);
+            first = 0;
+        }
+    }
+
+    fprintf(out, "]}\n");
+    output_close(out);
+
+    free(src);
+    free(dst);
+    free(ref);
+    return total ? -1 : 0;
+err:
+    free(src);
+    free(dst);
+    free(ref);
+    return -1;
+}
+
+int main(int argc, char **argv) {
+    bench_config cfg = {
+        .width = 1920,
+        .height = 1080,
+        .bpp = 32,
+        .num_fb = 3,
+        .fps = 60,
+        .seconds = 10,
+        .damage = 100,
+    };
+    const char *mode;
+    int opt;
+
+    if (argc < 3)
+        usage(argv[0]);
+
+    mode = argv[1];
+    cfg.pool = argv[2];
+    optind = 3;
+
+    while ((opt = getopt(argc, argv, "w:h:b:n:f:d:t:o:")) != -1) {
+        switch (opt) {
+        case 'w':
+            cfg.width = atoi(optarg);
+            break;
+        case 'h':
+            cfg.height = atoi(optarg);
+            break;
+        case 'b':
+            cfg.bpp = atoi(optarg);
+            break;
+        case 'n':
+            cfg.num_fb = atoi(optarg);
+            break;
+        case 'f':
+            cfg.fps = atoi(optarg);
+            break;
+        case 'd':
+            cfg.damage = atoi(optarg);
+            break;
+        case 't':
+            cfg.seconds = atoi(optarg);
+            break;
+        case 'o':
+            cfg.output = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    if (cfg.width <= 0 || cfg.height <= 0 || cfg.num_fb <= 0 ||
+        (cfg.bpp != 12 && cfg.bpp != 16 && cfg.bpp != 24 && cfg.bpp != 32))
+        usage(argv[0]);
+
+    signal(SIGINT, stop_handler);
+    signal(SIGTERM, stop_handler);
+
+    if (!strcmp(mode, "produce"))
+        return produce(&cfg) < 0 ? -1 : 0;
+    if (!strcmp(mode, "consume"))
+        return consume(&cfg) < 0 ? -1 : 0;
+    if (!strcmp(mode, "report"))
+        return report(&cfg) < 0 ? -1 : 0;
+    if (!strcmp(mode, "stats"))
+        return dump_stats(&cfg) < 0 ? -1 : 0;
+    if (!strcmp(mode, "copy"))
+        return copy_bench(&cfg) < 0 ? -1 : 0;
+    if (!strcmp(mode, "codec"))
+        return codec_bench(&cfg) < 0 ? -1 : 0;
+    if (!strcmp(mode, "swconv"))
+        return swconv_bench(&cfg) < 0 ? -1 : 0;
+
+    usage(argv[0]);
+    return -1;
+}
@@ -0,0 +1,94 @@
+#ifndef _FUTEX_H
+#define _FUTEX_H
+
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+// Shared (non-private) futexes, so that they work across processes mapping
+// the same file or memfd.
+static inline int futex_wait(volatile void *addr, uint32_t val,
+                             int timeout_us)
+{
+    struct timespec ts = {
+        .tv_sec = timeout_us / 1000000,
+        .tv_nsec = (timeout_us % 1000000) * 1000,
+    };
+
+    if (syscall(SYS_futex, addr, FUTEX_WAIT, val,
+                timeout_us < 0 ? NULL : &ts, NULL, 0) < 0)
+        return -errno;
+
+    return 0;
+}
+
+static inline int futex_wake(volatile void *addr, int num)
+{
+    return syscall(SYS_futex, addr, FUTEX_WAKE, num, NULL, NULL, 0);
+}
+
+#ifndef FUTEX_WAITV_MAX
+#define FUTEX_WAITV_MAX 128
+
+struct futex_waitv {
+    uint64_t val;
+    uint64_t uaddr;
+    uint32_t flags;
+    uint32_t __reserved;
+};
+#endif
+
+#ifndef FUTEX_32
+#define FUTEX_32        2
+#endif
+
+// Any of num (<= FUTEX_WAITV_MAX) words, returns the index of the one woken,
+// -ENOSYS before Linux 5.16
+static inline int futex_waitv(volatile void **addrs, const uint32_t *vals,
+                              int num, int timeout_us)
+{
+#ifdef SYS_futex_waitv
+    struct futex_waitv waiters[FUTEX_WAITV_MAX];
+    struct timespec ts;
+    int i, ret;
+
+    for (i = 0; i < num; i++) {
+        waiters[i].val = vals[i];
+        waiters[i].uaddr = (uintptr_t)addrs[i];
+        waiters[i].flags = FUTEX_32;
+        waiters[i].__reserved = 0;
+    }
+
+    // An absolute timeout
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    ts.tv_sec += timeout_us / 1000000;
+    ts.tv_nsec += (timeout_us % 1000000) * 1000;
+    if (ts.tv_nsec >= 1000000000) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+    }
+
+    ret = syscall(SYS_futex_waitv, waiters, num, 0,
+                  timeout_us < 0 ? NULL : &ts, CLOCK_MONOTONIC);
+    return ret < 0 ? -errno : ret;
+#else
+    return -ENOSYS;
+#endif
+}
+
+static inline void cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+    __asm__ __volatile__("yield" ::: "memory");
+#else
+    __asm__ __volatile__("" ::: "memory");
+#endif
+}
+
+#endif // _FUTEX_H
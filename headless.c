@@ -0,0 +1,374 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "display_backend.h"
+#include "drm_display.h"
+#include "stats.h"
+
+/*
+ * A display without a display: bos in plain memory, flips completing at a
+ * simulated vblank, and optionally every shown frame dumped to a file.
+ *
+ * HEADLESS_MODE=<w>x<h>:   the mode, the source size by default.
+ * HEADLESS_REFRESH=<hz>:   the vblank rate, 60 by default, 0 for none.
+ * HEADLESS_DUMP=<path>:    raw frames, or Y4M (444 for RGB, 420 for NV12)
+ *                          when the path ends with .y4m.
+ */
+
+#define HEADLESS_ALIGN  64
+
+struct headless {
+    uint64_t period_ns;
+    uint64_t epoch_ns;
+    uint64_t vblank_ns; // When the pending flip completes
+    uint32_t vblanks;
+
+    FILE *dump;
+    int y4m;
+    int y4m_bpp; // Of the frames in the Y4M stream, set by the first one
+    uint8_t *planes; // Y4M conversion buffer
+    int fb_id;
+};
+
+static uint64_t headless_now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int headless_open(struct device *dev, int bpp, int fb_width,
+                         int fb_height) {
+    const char *mode = getenv("HEADLESS_MODE");
+    const char *refresh = getenv("HEADLESS_REFRESH");
+    const char *dump = getenv("HEADLESS_DUMP");
+    struct headless *headless;
+    int width = fb_width, height = fb_height, hz = 60;
+    size_t len;
+
+    if (mode && sscanf(mode, "%dx%d", &width, &height) != 2) {
+        fprintf(stderr, "invalid headless mode: %s\n", mode);
+        return -1;
+    }
+
+    if (refresh)
+        hz = atoi(refresh);
+
+    if (width <= 0 || height <= 0 || hz < 0) {
+        fprintf(stderr, "invalid headless mode: %dx%d@%d\n",
+                width, height, hz);
+        return -1;
+    }
+
+    headless = malloc(sizeof(*headless));
+    if (!headless) {
+        fprintf(stderr, "allocate headless failed\n");
+        return -1;
+    }
+    memset(headless, 0, sizeof(*headless));
+
+    if (dump) {
+        headless->dump = fopen(dump, "w");
+        if (!headless->dump) {
+            fprintf(stderr, "open %s failed\n", dump);
+            free(headless);
+            return -1;
+        }
+
+        len = strlen(dump);
+        headless->y4m = len > 4 && !strcmp(dump + len - 4, ".y4m");
+    }
+
+    headless->period_ns = hz ? 1000000000ULL / hz : 0;
+    headless->epoch_ns = headless_now_ns();
+
+    dev->fd = -1;
+    dev->out_fence_fd = -1;
+    dev->backend_data = headless;
+    dev->mode.hdisplay = width;
+    dev->mode.vdisplay = height;
+
+    // Scaling is up to the render side, there is no plane
+    dev->mode.fb_width = width;
+    dev->mode.fb_height = height;
+
+    DRM_DEBUG("Headless mode: %dx%d@%d, dump: %s\n", width, height, hz,
+              dump ? dump : "none");
+    return 0;
+}
+
+static void headless_close(struct device *dev) {
+    struct headless *headless = dev->backend_data;
+
+    if (!headless)
+        return;
+
+    DRM_DEBUG("Headless vblanks: %u\n", headless->vblanks);
+
+    if (headless->dump)
+        fclose(headless->dump);
+
+    free(headless->planes);
+    free(headless);
+    dev->backend_data = NULL;
+}
+
+static struct drm_bo *headless_bo_create(struct device *dev, int width,
+                                         int height, int bpp) {
+    struct headless *headless = dev->backend_data;
+    struct drm_bo *bo;
+
+    bo = malloc(sizeof(struct drm_bo));
+    if (bo == NULL) {
+        fprintf(stderr, "allocate bo failed\n");
+        return NULL;
+    }
+    memset(bo, 0, sizeof(*bo));
+    damage_full(&bo->damage);
+
+    // Laid out like dumb buffers, the NV12 pitch is of the whole 12bpp
+    bo->width = width;
+    bo->height = height;
+    bo->bpp = bpp;
+    bo->pitch = (width + HEADLESS_ALIGN - 1) / HEADLESS_ALIGN *
+        HEADLESS_ALIGN * bpp / 8;
+    bo->size = bo->pitch * height;
+    bo->dma_fd = -1;
+    bo->fb_id = ++headless->fb_id;
+
+    if (posix_memalign(&bo->ptr, HEADLESS_ALIGN, bo->size)) {
+        fprintf(stderr, "allocate bo memory failed\n");
+        free(bo);
+        return NULL;
+    }
+    memset(bo->ptr, 0, bo->size);
+
+    DRM_DEBUG("Created bo: %d, %dx%d\n", bo->fb_id, width, height);
+
+    return bo;
+}
+
+static void headless_bo_destroy(struct device *dev, struct drm_bo *bo) {
+    if (bo->imported && bo->ptr)
+        munmap(bo->ptr, bo->size);
+    else
+        free(bo->ptr);
+
+    free(bo);
+}
+
+// Read-only view of the dma-buf, enough to dump it
+static int headless_import(struct device *dev, struct drm_bo *bo, int dma_fd,
+                           int bpp) {
+    struct headless *headless = dev->backend_data;
+
+    if (bpp != 12 && bpp != 16 && bpp != 24 && bpp != 32)
+        return -1;
+
+    bo->size = bo->pitch * bo->height;
+    bo->ptr = mmap(NULL, bo->size, PROT_READ, MAP_SHARED, dma_fd, 0);
+    if (bo->ptr == MAP_FAILED) {
+        bo->ptr = NULL;
+        DRM_DEBUG("Map dma fd: %d failed\n", dma_fd);
+        return -1;
+    }
+
+    bo->fb_id = ++headless->fb_id;
+    return 0;
+}
+
+static int headless_dump_raw(FILE *file, struct drm_bo *bo) {
+    uint8_t *ptr = bo->ptr;
+    size_t pitch = bo->pitch, size = bo->width * bo->bpp / 8;
+    int y, rows = bo->height;
+
+    // Y then interleaved UV rows, all of them a byte per pixel wide
+    if (bo->bpp == 12) {
+        pitch = bo->pitch * 2 / 3;
+        size = bo->width;
+        rows += bo->height / 2;
+    }
+
+    for (y = 0; y < rows; y++) {
+        if (fwrite(ptr + y * pitch, size, 1, file) != 1)
+            return -1;
+    }
+
+    return 0;
+}
+
+// BT.601 limited range, matching the NV12 conversion of swconv
+static void headless_rgb_to_yuv444(uint8_t *planes, struct drm_bo *bo) {
+    int w = bo->width, h = bo->height;
+    uint8_t *y_plane = planes;
+    uint8_t *u_plane = y_plane + w * h;
+    uint8_t *v_plane = u_plane + w * h;
+    const uint8_t *row;
+    int x, y, r, g, b;
+
+    for (y = 0; y < h; y++) {
+        row = (const uint8_t *)bo->ptr + y * bo->pitch;
+
+        for (x = 0; x < w; x++) {
+            b = row[x * 4];
+            g = row[x * 4 + 1];
+            r = row[x * 4 + 2];
+
+            *y_plane++ = ((66 * r + 129 * g + 25 * b + 128) >> 8) + 16;
+            *u_plane++ = ((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128;
+            *v_plane++ = ((112 * r - 94 * g - 18 * b + 128) >> 8) + 128;
+        }
+    }
+}
+
+static void headless_nv12_to_yuv420(uint8_t *planes, struct drm_bo *bo) {
+    int w = bo->width, h = bo->height;
+    size_t pitch = bo->pitch * 2 / 3;
+    const uint8_t *src = bo->ptr;
+    const uint8_t *uv;
+    uint8_t *u_plane = planes + w * h;
+    uint8_t *v_plane = u_plane + (w / 2) * (h / 2);
+    int x, y;
+
+    for (y = 0; y < h; y++)
+        memcpy(planes + y * w, src + y * pitch, w);
+
+    for (y = 0; y < h / 2; y++) {
+        uv = src + (h + y) * pitch;
+
+        for (x = 0; x < w / 2; x++) {
+            *u_plane++ = uv[x * 2];
+            *v_plane++ = uv[x * 2 + 1];
+        }
+    }
+}
+
+static int headless_dump_y4m(struct headless *headless, struct drm_bo *bo) {
+    size_t size;
+    int hz;
+
+    if (bo->bpp != 12 && bo->bpp != 32)
+        return -1;
+
+    // Y4M streams can't change size or format
+    if (!headless->planes) {
+        hz = headless->period_ns ? 1000000000ULL / headless->period_ns : 60;
+        size = (size_t)bo->width * bo->height * 3;
+
+        headless->planes = malloc(size);
+        if (!headless->planes)
+            return -1;
+
+        headless->y4m_bpp = bo->bpp;
+        fprintf(headless->dump, "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 %s\n",
+                bo->width, bo->height, hz,
+                bo->bpp == 12 ? "C420mpeg2" : "C444");
+    }
+
+    if (bo->bpp != headless->y4m_bpp)
+        return -1;
+
+    if (bo->bpp == 12) {
+        headless_nv12_to_yuv420(headless->planes, bo);
+        size = (size_t)bo->width * bo->height * 3 / 2;
+    } else {
+        headless_rgb_to_yuv444(headless->planes, bo);
+        size = (size_t)bo->width * bo->height * 3;
+    }
+
+    fprintf(headless->dump, "FRAME\n");
+    if (fwrite(headless->planes, size, 1, headless->dump) != 1)
+        return -1;
+
+    return 0;
+}
+
+// Like a plane taking them all, but what Y4M dumps convert
+static int headless_has_format(struct device *dev, int bpp) {
+    struct headless *headless = dev->backend_data;
+
+    if (headless->y4m)
+        return bpp == 12 || bpp == 32;
+
+    return bpp == 12 || bpp == 16 || bpp == 32;
+}
+
+static int headless_flip_done(struct device *dev) {
+    struct headless *headless = dev->backend_data;
+    struct timespec ts;
+    uint64_t start;
+
+    if (!dev->pending_bo)
+        return 0;
+
+    start = stats_now_us();
+
+    ts.tv_sec = headless->vblank_ns / 1000000000ULL;
+    ts.tv_nsec = headless->vblank_ns % 1000000000ULL;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) ==
+           EINTR);
+
+    stats_record(STATS_VBLANK, stats_now_us() - start);
+
+    dev->scanout_bo = dev->pending_bo;
+    dev->pending_bo = NULL;
+    return 0;
+}
+
+static int headless_display(struct device *dev, struct drm_bo *bo) {
+    struct headless *headless = dev->backend_data;
+    uint64_t start, now, vblank;
+    int ret = 0;
+
+    // Only one flip can be in flight
+    headless_flip_done(dev);
+
+    DRM_DEBUG("Display bo %d(%dx%d)\n", bo->fb_id, bo->width, bo->height);
+
+    start = stats_now_us();
+
+    if (headless->dump) {
+        if (headless->y4m)
+            ret = headless_dump_y4m(headless, bo);
+        else
+            ret = headless_dump_raw(headless->dump, bo);
+
+        if (ret < 0) {
+            fprintf(stderr, "headless dump failed\n");
+            return -1;
+        }
+    }
+
+    stats_record(STATS_COMMIT, stats_now_us() - start);
+
+    // Shown at the next vblank
+    now = headless_now_ns();
+    vblank = now;
+    if (headless->period_ns) {
+        vblank = (now - headless->epoch_ns) / headless->period_ns + 1;
+        headless->vblanks = vblank;
+        vblank = headless->epoch_ns + vblank * headless->period_ns;
+    }
+
+    headless->vblank_ns = vblank;
+    dev->pending_bo = bo;
+    return 0;
+}
+
+const struct display_backend headless_backend = {
+    .name = "headless",
+    .open = headless_open,
+    .close = headless_close,
+    .bo_create = headless_bo_create,
+    .bo_destroy = headless_bo_destroy,
+    .import = headless_import,
+    .has_format = headless_has_format,
+    .display = headless_display,
+    .flip_done = headless_flip_done,
+};
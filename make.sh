@@ -7,3 +7,4 @@ export CFLAGS=" --sysroot=/nvme/buildroot/output/rockchip_rk3399/staging"
 
 make -B $@
 DRM_DISPLAY=1 make -B $@
+BENCH=1 make -B $@
@@ -0,0 +1,188 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "pipeline.h"
+
+#define MAX_STAGES  PIPELINE_MAX_STAGES
+
+struct pipeline {
+    pthread_mutex_t lock;
+    pthread_cond_t submitted;
+    pthread_cond_t freed;
+
+    pthread_t thread;
+    int stop;
+    int busy; // The thread is on a stage
+
+    pipeline_func func;
+    void *data;
+
+    void *stages[MAX_STAGES];
+    int depth;
+
+    // Free stages, and the submitted ones in order
+    void *free[MAX_STAGES];
+    int free_num;
+    void *ready[MAX_STAGES];
+    int ready_head;
+    int ready_num;
+};
+
+static void *pipeline_thread(void *arg) {
+    struct pipeline *pl = arg;
+    void *stage;
+
+    pthread_mutex_lock(&pl->lock);
+    while (1) {
+        while (!pl->stop && !pl->ready_num)
+            pthread_cond_wait(&pl->submitted, &pl->lock);
+
+        // Done with the submitted ones first
+        if (!pl->ready_num)
+            break;
+
+        stage = pl->ready[pl->ready_head];
+        pl->ready_head = (pl->ready_head + 1) % MAX_STAGES;
+        pl->ready_num--;
+        pl->busy = 1;
+        pthread_mutex_unlock(&pl->lock);
+
+        pl->func(pl->data, stage);
+
+        pthread_mutex_lock(&pl->lock);
+        pl->busy = 0;
+        pl->free[pl->free_num++] = stage;
+        pthread_cond_broadcast(&pl->freed);
+    }
+    pthread_mutex_unlock(&pl->lock);
+
+    return NULL;
+}
+
+struct pipeline *pipeline_create(int depth, size_t stage_size,
+                                 pipeline_func func, void *data) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    struct pipeline *pl;
+    int i;
+
+    if (depth < 1 || depth > MAX_STAGES) {
+        fprintf(stderr, "invalid pipeline depth: %d\n", depth);
+        return NULL;
+    }
+
+    pl = malloc(sizeof(*pl));
+    if (!pl) {
+        fprintf(stderr, "allocate pipeline failed\n");
+        return NULL;
+    }
+    memset(pl, 0, sizeof(*pl));
+
+    pl->func = func;
+    pl->data = data;
+
+    stage_size = (stage_size + page - 1) / page * page;
+    for (i = 0; i < depth; i++) {
+        if (posix_memalign(&pl->stages[i], page, stage_size)) {
+            fprintf(stderr, "allocate pipeline stage failed\n");
+            goto err;
+        }
+
+        pl->free[pl->free_num++] = pl->stages[i];
+        pl->depth++;
+    }
+
+    pthread_mutex_init(&pl->lock, NULL);
+    pthread_cond_init(&pl->submitted, NULL);
+    pthread_cond_init(&pl->freed, NULL);
+
+    if (pthread_create(&pl->thread, NULL, pipeline_thread, pl)) {
+        fprintf(stderr, "create pipeline thread failed\n");
+        pthread_cond_destroy(&pl->freed);
+        pthread_cond_destroy(&pl->submitted);
+        pthread_mutex_destroy(&pl->lock);
+        goto err;
+    }
+
+    return pl;
+err:
+    for (i = 0; i < pl->depth; i++)
+        free(pl->stages[i]);
+    free(pl);
+    return NULL;
+}
+
+void pipeline_destroy(struct pipeline *pl) {
+    int i;
+
+    if (!pl)
+        return;
+
+    pthread_mutex_lock(&pl->lock);
+    pl->stop = 1;
+    pthread_cond_signal(&pl->submitted);
+    pthread_mutex_unlock(&pl->lock);
+
+    pthread_join(pl->thread, NULL);
+
+    for (i = 0; i < pl->depth; i++)
+        free(pl->stages[i]);
+
+    pthread_cond_destroy(&pl->freed);
+    pthread_cond_destroy(&pl->submitted);
+    pthread_mutex_destroy(&pl->lock);
+    free(pl);
+}
+
+void *pipeline_acquire(struct pipeline *pl) {
+    void *stage;
+
+    pthread_mutex_lock(&pl->lock);
+    while (!pl->free_num)
+        pthread_cond_wait(&pl->freed, &pl->lock);
+
+    stage = pl->free[--pl->free_num];
+    pthread_mutex_unlock(&pl->lock);
+
+    return stage;
+}
+
+void *pipeline_try_acquire(struct pipeline *pl) {
+    void *stage = NULL;
+
+    pthread_mutex_lock(&pl->lock);
+    if (pl->free_num)
+        stage = pl->free[--pl->free_num];
+    pthread_mutex_unlock(&pl->lock);
+
+    return stage;
+}
+
+void pipeline_submit(struct pipeline *pl, void *stage) {
+    pthread_mutex_lock(&pl->lock);
+    pl->ready[(pl->ready_head + pl->ready_num) % MAX_STAGES] = stage;
+    pl->ready_num++;
+    pthread_cond_signal(&pl->submitted);
+    pthread_mutex_unlock(&pl->lock);
+}
+
+void pipeline_release(struct pipeline *pl, void *stage) {
+    pthread_mutex_lock(&pl->lock);
+    pl->free[pl->free_num++] = stage;
+    pthread_cond_broadcast(&pl->freed);
+    pthread_mutex_unlock(&pl->lock);
+}
+
+void pipeline_drain(struct pipeline *pl) {
+    pthread_mutex_lock(&pl->lock);
+    while (pl->ready_num || pl->busy)
+        pthread_cond_wait(&pl->freed, &pl->lock);
+    pthread_mutex_unlock(&pl->lock);
+}
+
+int pipeline_stages(struct pipeline *pl, void **stages) {
+    memcpy(stages, pl->stages, pl->depth * sizeof(void *));
+    return pl->depth;
+}
@@ -0,0 +1,37 @@
+#ifndef _PIPELINE_H
+#define _PIPELINE_H
+
+#include <stddef.h>
+
+/*
+ * A ring of staging buffers between two threads: the caller fills a stage
+ * and submits it, a thread of the pipeline hands it to func() in submission
+ * order and recycles it, so filling the next one overlaps with that.
+ */
+struct pipeline;
+
+#define PIPELINE_MAX_STAGES 16
+
+typedef void (*pipeline_func)(void *data, void *stage);
+
+// Stages are page aligned, of stage_size bytes each
+struct pipeline *pipeline_create(int depth, size_t stage_size,
+                                 pipeline_func func, void *data);
+// Runs the submitted stages first
+void pipeline_destroy(struct pipeline *pl);
+
+// A free stage, blocks until there is one
+void *pipeline_acquire(struct pipeline *pl);
+// Or NULL when none is
+void *pipeline_try_acquire(struct pipeline *pl);
+void pipeline_submit(struct pipeline *pl, void *stage);
+// Give back an acquired stage without submitting it
+void pipeline_release(struct pipeline *pl, void *stage);
+
+// Wait for the submitted stages to be done
+void pipeline_drain(struct pipeline *pl);
+
+// All the stages, to register them for I/O, returns their number
+int pipeline_stages(struct pipeline *pl, void **stages);
+
+#endif // _PIPELINE_H
@@ -0,0 +1,571 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#ifdef __NR_io_uring_setup
+#include <linux/io_uring.h>
+#include <linux/time_types.h>
+
+// Since Linux 5.16, older ones cancel the ops linked after the timeout,
+// which then run synchronously
+#ifndef IORING_TIMEOUT_ETIME_SUCCESS
+#define IORING_TIMEOUT_ETIME_SUCCESS    (1U << 5)
+#endif
+#endif
+
+#include "poolio.h"
+#include "stats.h"
+
+#define POOLIO_DEBUG(fmt, ...) \
+    if (getenv("FBPOOL_DEBUG")) \
+    printf("FBPOOL_DEBUG: %s(%d) " fmt, __func__, __LINE__, __VA_ARGS__)
+
+#define POOLIO_MAX_OPS      8
+#define POOLIO_MAX_FILES    8
+#define POOLIO_MAX_BUFS     16
+
+// The alignment of O_DIRECT offsets and sizes
+#define POOLIO_DIRECT_ALIGN 4096
+
+enum {
+    POOLIO_READ,
+    POOLIO_WRITE,
+    POOLIO_SLEEP,
+};
+
+struct poolio_op {
+    int type;
+    int fd;
+    void *buf;
+    size_t size;
+    size_t offset;
+    int us;
+};
+
+struct poolio {
+    int uring;
+
+    struct poolio_op ops[POOLIO_MAX_OPS];
+    int num_ops;
+    int failed; // Too many ops queued
+
+#ifdef __NR_io_uring_setup
+    int ring_fd;
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    int fds[POOLIO_MAX_FILES];
+    int num_fds;
+    struct iovec bufs[POOLIO_MAX_BUFS];
+    int num_bufs;
+
+    struct __kernel_timespec timeouts[POOLIO_MAX_OPS];
+#endif
+};
+
+int poolio_rw(int fd, void *buf, size_t size, size_t offset, int is_read)
+{
+    uint8_t *ptr = buf;
+    ssize_t ret;
+
+    while (size) {
+        if (is_read)
+            ret = pread(fd, ptr, size, offset);
+        else
+            ret = pwrite(fd, ptr, size, offset);
+        stats_count(STATS_SYSCALLS, 1);
+
+        if (ret < 0 && errno == EINTR)
+            continue;
+
+        if (ret <= 0) {
+            fprintf(stderr, "failed to %s file\n", is_read ? "read" : "write");
+            return -1;
+        }
+
+        ptr += ret;
+        offset += ret;
+        size -= ret;
+    }
+
+    return 0;
+}
+
+int pool_read_header(int fd, fbpool_header *hdr, int *version, size_t *size)
+{
+    struct stat st;
+
+    if (fstat(fd, &st) < 0) {
+        fprintf(stderr, "stat pool failed\n");
+        return -1;
+    }
+
+    // Not reading past the end, which would be SIGBUS when mapped
+    if ((size_t)st.st_size < sizeof(*hdr))
+        return 1;
+
+    if (poolio_rw(fd, hdr, sizeof(*hdr), 0, 1) < 0)
+        return -1;
+
+    if (strncmp(hdr->magic, FBPOOL_MAGIC, 4))
+        return 1;
+
+    *version = fbpool_version(hdr, st.st_size);
+    *size = fbpool_header_size(hdr, *version) +
+        (size_t)hdr->num_fb * hdr->fb_size;
+    return (size_t)st.st_size >= *size ? 0 : 1;
+}
+
+int pool_wait_header(int fd, fbpool_header *hdr, int *version, size_t *size)
+{
+    int ret;
+
+    while ((ret = pool_read_header(fd, hdr, version, size)) > 0)
+        usleep(POOL_ATTACH_RETRY_US);
+
+    return ret;
+}
+
+static int poolio_run_sync(struct poolio_op *op)
+{
+    switch (op->type) {
+    case POOLIO_READ:
+        return poolio_rw(op->fd, op->buf, op->size, op->offset, 1);
+    case POOLIO_WRITE:
+        return poolio_rw(op->fd, op->buf, op->size, op->offset, 0);
+    case POOLIO_SLEEP:
+        stats_count(STATS_SYSCALLS, 1);
+        usleep(op->us);
+        return 0;
+    default:
+        return -1;
+    }
+}
+
+#ifdef __NR_io_uring_setup
+static int io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                          unsigned flags)
+{
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+                   NULL, 0);
+}
+
+static int io_uring_register(int fd, unsigned opcode, void *arg,
+                             unsigned num)
+{
+    return syscall(__NR_io_uring_register, fd, opcode, arg, num);
+}
+
+static void poolio_uring_deinit(struct poolio *io)
+{
+    if (io->sqes)
+        munmap(io->sqes, io->sqes_size);
+    if (io->cq_ring && io->cq_ring != io->sq_ring)
+        munmap(io->cq_ring, io->cq_ring_size);
+    if (io->sq_ring)
+        munmap(io->sq_ring, io->sq_ring_size);
+    close(io->ring_fd);
+}
+
+static int poolio_uring_init(struct poolio *io)
+{
+    struct io_uring_params p;
+    uint8_t *sq, *cq;
+
+    memset(&p, 0, sizeof(p));
+    io->ring_fd = io_uring_setup(POOLIO_MAX_OPS, &p);
+    if (io->ring_fd < 0) {
+        POOLIO_DEBUG("io_uring unavailable: %s\n", strerror(errno));
+        return -1;
+    }
+
+    io->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    io->cq_ring_size = p.cq_off.cqes +
+        p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (io->cq_ring_size > io->sq_ring_size)
+            io->sq_ring_size = io->cq_ring_size;
+        io->cq_ring_size = io->sq_ring_size;
+    }
+
+    io->sq_ring = mmap(NULL, io->sq_ring_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, io->ring_fd,
+                       IORING_OFF_SQ_RING);
+    if (io->sq_ring == MAP_FAILED) {
+        io->sq_ring = NULL;
+        goto err;
+    }
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        io->cq_ring = io->sq_ring;
+    } else {
+        io->cq_ring = mmap(NULL, io->cq_ring_size, PROT_READ | PROT_WRITE,
+                           MAP_SHARED | MAP_POPULATE, io->ring_fd,
+                           IORING_OFF_CQ_RING);
+        if (io->cq_ring == MAP_FAILED) {
+            io->cq_ring = NULL;
+            goto err;
+        }
+    }
+
+    io->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    io->sqes = mmap(NULL, io->sqes_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, io->ring_fd, IORING_OFF_SQES);
+    if (io->sqes == MAP_FAILED) {
+        io->sqes = NULL;
+        goto err;
+    }
+
+    sq = io->sq_ring;
+    io->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    io->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    io->sq_array = (unsigned *)(sq + p.sq_off.array);
+
+    cq = io->cq_ring;
+    io->cq_head = (unsigned *)(cq + p.cq_off.head);
+    io->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    io->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    io->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    return 0;
+err:
+    fprintf(stderr, "map io_uring failed\n");
+    poolio_uring_deinit(io);
+    return -1;
+}
+
+static int poolio_uring_file(struct poolio *io, int fd)
+{
+    int i;
+
+    for (i = 0; i < io->num_fds; i++) {
+        if (io->fds[i] == fd)
+            return i;
+    }
+
+    return -1;
+}
+
+static int poolio_uring_buf(struct poolio *io, void *buf, size_t size)
+{
+    uint8_t *base;
+    int i;
+
+    for (i = 0; i < io->num_bufs; i++) {
+        base = io->bufs[i].iov_base;
+        if ((uint8_t *)buf >= base &&
+            (uint8_t *)buf + size <= base + io->bufs[i].iov_len)
+            return i;
+    }
+
+    return -1;
+}
+
+static void poolio_uring_prep(struct poolio *io, int index, int last)
+{
+    struct poolio_op *op = &io->ops[index];
+    struct io_uring_sqe *sqe;
+    unsigned tail = *io->sq_tail;
+    int file, buf;
+
+    sqe = &io->sqes[tail & *io->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->user_data = index;
+
+    // In order, a failed op cancels the rest
+    if (!last)
+        sqe->flags |= IOSQE_IO_LINK;
+
+    if (op->type == POOLIO_SLEEP) {
+        io->timeouts[index].tv_sec = op->us / 1000000;
+        io->timeouts[index].tv_nsec = op->us % 1000000 * 1000;
+
+        sqe->opcode = IORING_OP_TIMEOUT;
+        sqe->fd = -1;
+        sqe->addr = (uintptr_t)&io->timeouts[index];
+        sqe->len = 1;
+        // Expiring is what it is for, keep the link going
+        sqe->timeout_flags = IORING_TIMEOUT_ETIME_SUCCESS;
+    } else {
+        file = poolio_uring_file(io, op->fd);
+        buf = poolio_uring_buf(io, op->buf, op->size);
+
+        if (buf < 0)
+            sqe->opcode = op->type == POOLIO_READ ?
+                IORING_OP_READ : IORING_OP_WRITE;
+        else
+            sqe->opcode = op->type == POOLIO_READ ?
+                IORING_OP_READ_FIXED : IORING_OP_WRITE_FIXED;
+
+        if (file < 0) {
+            sqe->fd = op->fd;
+        } else {
+            sqe->fd = file;
+            sqe->flags |= IOSQE_FIXED_FILE;
+        }
+
+        sqe->addr = (uintptr_t)op->buf;
+        sqe->len = op->size;
+        sqe->off = op->offset;
+        sqe->buf_index = buf < 0 ? 0 : buf;
+    }
+
+    io->sq_array[tail & *io->sq_mask] = tail & *io->sq_mask;
+    __atomic_store_n(io->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+static int poolio_uring_submit(struct poolio *io)
+{
+    int done[POOLIO_MAX_OPS] = { 0 };
+    struct io_uring_cqe *cqe;
+    struct poolio_op *op;
+    unsigned head, pending;
+    int i, ret;
+
+    for (i = 0; i < io->num_ops; i++)
+        poolio_uring_prep(io, i, i == io->num_ops - 1);
+
+    ret = io_uring_enter(io->ring_fd, io->num_ops, io->num_ops,
+                         IORING_ENTER_GETEVENTS);
+    stats_count(STATS_SYSCALLS, 1);
+
+    if (ret < 0 && errno != EINTR) {
+        // Never submitted, the ring is unusable
+        POOLIO_DEBUG("io_uring_enter failed: %s\n", strerror(errno));
+        *io->sq_tail -= io->num_ops;
+        goto fallback;
+    }
+
+    for (pending = io->num_ops; pending;) {
+        head = *io->cq_head;
+        if (head == __atomic_load_n(io->cq_tail, __ATOMIC_ACQUIRE)) {
+            ret = io_uring_enter(io->ring_fd, 0, pending,
+                                 IORING_ENTER_GETEVENTS);
+            stats_count(STATS_SYSCALLS, 1);
+            if (ret < 0 && errno != EINTR)
+                return -1;
+            continue;
+        }
+
+        cqe = &io->cqes[head & *io->cq_mask];
+        op = &io->ops[cqe->user_data];
+
+        if (op->type == POOLIO_SLEEP)
+            done[cqe->user_data] = cqe->res == -ETIME || cqe->res == 0;
+        else
+            done[cqe->user_data] = cqe->res == (int)op->size;
+
+        __atomic_store_n(io->cq_head, head + 1, __ATOMIC_RELEASE);
+        pending--;
+    }
+
+fallback:
+    // Short, failed or cancelled ops and the rest after them, in order
+    for (i = 0; i < io->num_ops && done[i]; i++);
+    for (; i < io->num_ops; i++) {
+        if (poolio_run_sync(&io->ops[i]) < 0)
+            return -1;
+    }
+
+    return 0;
+}
+#endif
+
+struct poolio *poolio_create(void)
+{
+    const char *engine = getenv("FBPOOL_IO");
+    struct poolio *io;
+
+    io = malloc(sizeof(*io));
+    if (!io) {
+        fprintf(stderr, "allocate poolio failed\n");
+        return NULL;
+    }
+    memset(io, 0, sizeof(*io));
+
+#ifdef __NR_io_uring_setup
+    if (!engine || !strcmp(engine, "uring"))
+        io->uring = !poolio_uring_init(io);
+#endif
+
+    if (engine && strcmp(engine, "uring") && strcmp(engine, "sync"))
+        fprintf(stderr, "invalid io engine: %s\n", engine);
+
+    POOLIO_DEBUG("Using %s io engine\n", poolio_name(io));
+    return io;
+}
+
+void poolio_destroy(struct poolio *io)
+{
+    if (!io)
+        return;
+
+#ifdef __NR_io_uring_setup
+    if (io->uring)
+        poolio_uring_deinit(io);
+#endif
+    free(io);
+}
+
+const char *poolio_name(const struct poolio *io)
+{
+    return io->uring ? "uring" : "sync";
+}
+
+int poolio_register(struct poolio *io, const int *fds, int num_fds,
+                    const struct iovec *bufs, int num_bufs)
+{
+#ifdef __NR_io_uring_setup
+    struct rlimit limit;
+    size_t size = 0;
+    int i;
+
+    if (!io->uring || io->num_fds || io->num_bufs)
+        return 0;
+
+    if (num_fds > POOLIO_MAX_FILES || num_bufs > POOLIO_MAX_BUFS)
+        return -1;
+
+    if (num_fds && !io_uring_register(io->ring_fd, IORING_REGISTER_FILES,
+                                      (void *)fds, num_fds)) {
+        memcpy(io->fds, fds, num_fds * sizeof(int));
+        io->num_fds = num_fds;
+    }
+
+    // Pinned, counted against the memlock limit
+    for (i = 0; i < num_bufs; i++)
+        size += bufs[i].iov_len;
+    if (getrlimit(RLIMIT_MEMLOCK, &limit) == 0 &&
+        limit.rlim_cur != RLIM_INFINITY && size > limit.rlim_cur) {
+        POOLIO_DEBUG("Not registering %zu bytes of buffers, over "
+                        "memlock limit\n", size);
+        return 0;
+    }
+
+    if (num_bufs && !io_uring_register(io->ring_fd, IORING_REGISTER_BUFFERS,
+                                       (void *)bufs, num_bufs)) {
+        memcpy(io->bufs, bufs, num_bufs * sizeof(struct iovec));
+        io->num_bufs = num_bufs;
+    }
+
+    POOLIO_DEBUG("Registered %d files and %d buffers\n",
+                    io->num_fds, io->num_bufs);
+#else
+    (void)io;
+    (void)fds;
+    (void)num_fds;
+    (void)bufs;
+    (void)num_bufs;
+#endif
+    return 0;
+}
+
+static void poolio_queue(struct poolio *io, int type, int fd, void *buf,
+                         size_t size, size_t offset, int us)
+{
+    struct poolio_op *op;
+
+    if (io->num_ops == POOLIO_MAX_OPS) {
+        io->failed = 1;
+        return;
+    }
+
+    op = &io->ops[io->num_ops++];
+    op->type = type;
+    op->fd = fd;
+    op->buf = buf;
+    op->size = size;
+    op->offset = offset;
+    op->us = us;
+}
+
+void poolio_read(struct poolio *io, int fd, void *buf, size_t size,
+                 size_t offset)
+{
+    poolio_queue(io, POOLIO_READ, fd, buf, size, offset, 0);
+}
+
+void poolio_write(struct poolio *io, int fd, const void *buf, size_t size,
+                  size_t offset)
+{
+    poolio_queue(io, POOLIO_WRITE, fd, (void *)buf, size, offset, 0);
+}
+
+void poolio_sleep(struct poolio *io, int us)
+{
+    poolio_queue(io, POOLIO_SLEEP, -1, NULL, 0, 0, us);
+}
+
+int poolio_submit(struct poolio *io)
+{
+    int i, ret = 0;
+
+    if (io->failed) {
+        fprintf(stderr, "too many io ops\n");
+        ret = -1;
+        goto out;
+    }
+
+#ifdef __NR_io_uring_setup
+    if (io->uring && io->num_ops) {
+        ret = poolio_uring_submit(io);
+        goto out;
+    }
+#endif
+
+    for (i = 0; i < io->num_ops; i++) {
+        ret = poolio_run_sync(&io->ops[i]);
+        if (ret < 0)
+            break;
+    }
+out:
+    io->num_ops = 0;
+    io->failed = 0;
+    return ret;
+}
+
+int poolio_open_direct(int fd, int is_read, size_t offset, size_t size)
+{
+    char path[64];
+    int direct_fd;
+
+    if (offset % POOLIO_DIRECT_ALIGN || size % POOLIO_DIRECT_ALIGN) {
+        POOLIO_DEBUG("Unaligned fbs for O_DIRECT: %zu + %zu\n",
+                        offset, size);
+        return -1;
+    }
+
+    // Not supported by tmpfs, memfd or sockets' fds
+    snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+    direct_fd = open(path, (is_read ? O_RDONLY : O_WRONLY) | O_DIRECT |
+                     O_CLOEXEC);
+    if (direct_fd < 0)
+        POOLIO_DEBUG("O_DIRECT unavailable: %s\n", strerror(errno));
+
+    return direct_fd;
+}
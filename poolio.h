@@ -0,0 +1,128 @@
+#ifndef _POOLIO_H
+#define _POOLIO_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+
+#include "fbpool.h"
+
+// The mmap might failed, for example in sshfs's direct_io mode, build with
+// NO_MMAP=1 then
+#ifndef FBPOOL_NO_MMAP
+#define USE_MMAP
+#endif
+
+/*
+ * File I/O on pools without mmap, in batches of operations run in order:
+ * uring: one io_uring_enter() per batch, with registered files and buffers
+ *        when possible (default).
+ * sync:  pread()/pwrite() per operation, also the fallback when io_uring
+ *        isn't available or an operation comes back short.
+ *
+ * Selected by FBPOOL_IO, an engine is only used by one thread at a time.
+ * The file I/O syscalls are counted as STATS_SYSCALLS.
+ */
+struct poolio;
+
+struct poolio *poolio_create(void);
+void poolio_destroy(struct poolio *io);
+
+const char *poolio_name(const struct poolio *io);
+
+// Optional, once before queuing anything, the buffers are only pinned when
+// the memlock limit allows it
+int poolio_register(struct poolio *io, const int *fds, int num_fds,
+                    const struct iovec *bufs, int num_bufs);
+
+// Queue an operation of the next batch
+void poolio_read(struct poolio *io, int fd, void *buf, size_t size,
+                 size_t offset);
+void poolio_write(struct poolio *io, int fd, const void *buf, size_t size,
+                  size_t offset);
+void poolio_sleep(struct poolio *io, int us);
+
+// Run the batch, returns < 0 when any of its operations failed
+int poolio_submit(struct poolio *io);
+
+// A single blocking read or write, retrying short ones
+int poolio_rw(int fd, void *buf, size_t size, size_t offset, int is_read);
+
+// An O_DIRECT fd of the same file, or -1 when the file or the alignment of
+// offset and size don't allow that. Direct buffers must be page aligned.
+int poolio_open_direct(int fd, int is_read, size_t offset, size_t size);
+
+#define POOL_ATTACH_RETRY_US 10000
+
+// Consumer side: wait for the producer to lay the pool out, it sizes the
+// file first and writes the magic last. Reads the header into hdr and
+// returns 0 once the file holds all of the fbs, -1 on errors.
+int pool_wait_header(int fd, fbpool_header *hdr, int *version, size_t *size);
+// Without waiting, returns 1 while the pool isn't laid out
+int pool_read_header(int fd, fbpool_header *hdr, int *version, size_t *size);
+
+// A pool mapped, or without mmap, its copy in memory
+static inline void *map_buf(int fd, size_t offset, size_t size, int needs_read)
+{
+    void *buf;
+
+#ifdef USE_MMAP
+    buf = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, offset);
+    if (buf == MAP_FAILED) {
+        fprintf(stderr, "mmap failed\n");
+        return NULL;
+    }
+#else
+    buf = malloc(size);
+    if (!buf) {
+        fprintf(stderr, "malloc failed\n");
+        return NULL;
+    }
+
+    if (needs_read && poolio_rw(fd, buf, size, offset, 1) < 0) {
+        fprintf(stderr, "read failed\n");
+        return NULL;
+    }
+#endif
+
+    return buf;
+}
+
+static inline void release_buf(void *buf, size_t size)
+{
+#ifdef USE_MMAP
+    munmap(buf, size);
+#else
+    free(buf);
+#endif
+}
+
+#ifndef USE_MMAP
+// Between the file and the same area of its copy in memory
+static inline void queue_area(struct poolio *io, int fd, uint8_t *buf,
+                              size_t offset, size_t size, int is_read)
+{
+    if (is_read)
+        poolio_read(io, fd, buf + offset, size, offset);
+    else
+        poolio_write(io, fd, buf + offset, size, offset);
+}
+
+#define QUEUE_MEMBER(io, fd, s, m, is_read) \
+    queue_area(io, fd, (void *)(s), offsetof(fbpool_header, m), \
+               sizeof((s)->m), is_read)
+
+#define QUEUE_SLOT(io, fd, s, fb, is_read) \
+    queue_area(io, fd, (void *)(s), \
+               (void *)fbpool_get_slot(s, fb) - (void *)s, \
+               (s)->slot_size, is_read)
+
+// The whole header, with the slots of v2, to notice layout changes as well
+#define QUEUE_HEADER(io, fd, s, hdr_size) \
+    queue_area(io, fd, (void *)(s), 0, hdr_size, 1)
+#endif
+
+#endif // _POOLIO_H
@@ -0,0 +1,1234 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "fbcodec.h"
+#include "fbcopy.h"
+#include "fbhash.h"
+#include "fbpool.h"
+#include "pipeline.h"
+#include "poolio.h"
+#include "relay.h"
+#include "stats.h"
+#include "transport.h"
+
+#define RELAY_DEBUG(fmt, ...) \
+    if (getenv("FBPOOL_DEBUG")) \
+    printf("FBPOOL_DEBUG: %s(%d) " fmt, __func__, __LINE__, __VA_ARGS__)
+
+/*
+ * Durability of the destination pool, configured by FBPOOL_SYNC:
+ * none:     shared memory semantics, leave the writeback to the kernel.
+ * async:    start writeback of the written fb and header, without waiting.
+ * periodic: flush every FBPOOL_SYNC_FRAMES frames or FBPOOL_SYNC_MS ms.
+ * strict:   flush the fb before publishing it, then flush the header,
+ *           default for file pools.
+ *
+ * msync(MS_ASYNC) is a no-op on Linux, so async uses sync_file_range().
+ */
+enum {
+    SYNC_NONE,
+    SYNC_ASYNC,
+    SYNC_PERIODIC,
+    SYNC_STRICT,
+};
+
+typedef struct {
+    int mode;
+    int frames;
+    int ms;
+
+    int pending;
+    uint64_t last_us;
+} sync_policy;
+
+struct relay_frames {
+    pthread_mutex_t lock;
+    pthread_cond_t freed;
+
+    relay_done_func done;
+    void *data;
+
+    relay_frame *frames;
+    int num;
+    size_t size; // Of their data
+};
+
+// A frame taken by a destination
+typedef struct {
+    relay_frame *frame;
+    damage_region damage; // Since the last one taken, with the dropped ones
+} relay_stage;
+
+struct relay_dest {
+    const char *path;
+    fbpool_header *dst;
+    size_t size;
+    int fd;
+    pool_server *server; // Of memfd pools
+    int version;
+    size_t hdr_size;
+    sync_policy policy;
+    fbcodec *codec; // Encoding the fbs, with FBPOOL_ENCODE
+#ifdef USE_MMAP
+    damage_region *dst_damage; // What each fb misses
+#else
+    int data_fd; // For the fbs, O_DIRECT or fd
+    struct poolio *io; // Only used on the pipeline's thread
+    uint8_t *enc;
+#endif
+    struct pipeline *pl;
+    stats_ctx *stats;
+
+    damage_region missed; // Of the frames dropped, on the sender's side
+    int last_fb; // Holding the last frame, -1 if none
+    int fb; // Being written
+};
+
+static void sync_policy_init(sync_policy *policy, int is_file)
+{
+    const char *mode = getenv("FBPOOL_SYNC");
+    const char *frames = getenv("FBPOOL_SYNC_FRAMES");
+    const char *ms = getenv("FBPOOL_SYNC_MS");
+
+    memset(policy, 0, sizeof(*policy));
+
+    policy->mode = is_file ? SYNC_STRICT : SYNC_NONE;
+    if (mode && !strcmp(mode, "none"))
+        policy->mode = SYNC_NONE;
+    else if (mode && !strcmp(mode, "async"))
+        policy->mode = SYNC_ASYNC;
+    else if (mode && !strcmp(mode, "periodic"))
+        policy->mode = SYNC_PERIODIC;
+    else if (mode && !strcmp(mode, "strict"))
+        policy->mode = SYNC_STRICT;
+
+    policy->frames = frames ? atoi(frames) : 60;
+    policy->ms = ms ? atoi(ms) : 1000;
+    policy->last_us = fbpool_now_us();
+}
+
+static int sync_range(int fd, void *base, size_t offset, size_t size,
+                      int wait)
+{
+#ifdef USE_MMAP
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t start = offset / page * page;
+#endif
+
+    if (!wait)
+        return sync_file_range(fd, offset, size, SYNC_FILE_RANGE_WRITE);
+
+#ifdef USE_MMAP
+    return msync((uint8_t *)base + start, offset + size - start, MS_SYNC);
+#else
+    return fdatasync(fd);
+#endif
+}
+
+// Called after writing a fb, before publishing it
+static int sync_fb(sync_policy *policy, int fd, void *base,
+                   size_t offset, size_t size)
+{
+    switch (policy->mode) {
+    case SYNC_ASYNC:
+        return sync_range(fd, base, offset, size, 0);
+    case SYNC_STRICT:
+        return sync_range(fd, base, offset, size, 1);
+    default:
+        return 0;
+    }
+}
+
+// Called after publishing a fb
+static int sync_header(sync_policy *policy, int fd, void *base, size_t size)
+{
+    uint64_t now;
+
+    switch (policy->mode) {
+    case SYNC_ASYNC:
+        return sync_range(fd, base, 0, size, 0);
+    case SYNC_STRICT:
+        return sync_range(fd, base, 0, size, 1);
+    case SYNC_PERIODIC:
+        now = fbpool_now_us();
+        if (++policy->pending < policy->frames &&
+            now - policy->last_us < policy->ms * 1000ULL)
+            return 0;
+
+        policy->pending = 0;
+        policy->last_us = now;
+        return fdatasync(fd);
+    default:
+        return 0;
+    }
+}
+
+relay_frames *relay_frames_create(int num, size_t size, relay_done_func done,
+                                  void *data)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    relay_frames *frames;
+    int i;
+
+    if (num < 1 || num > RELAY_MAX_FRAMES) {
+        fprintf(stderr, "invalid relay frames: %d\n", num);
+        return NULL;
+    }
+
+    frames = malloc(sizeof(*frames));
+    if (!frames) {
+        fprintf(stderr, "allocate relay frames failed\n");
+        return NULL;
+    }
+    memset(frames, 0, sizeof(*frames));
+
+    frames->done = done;
+    frames->data = data;
+
+    pthread_mutex_init(&frames->lock, NULL);
+    pthread_cond_init(&frames->freed, NULL);
+
+    frames->frames = calloc(num, sizeof(relay_frame));
+    if (!frames->frames) {
+        fprintf(stderr, "allocate relay frames failed\n");
+        relay_frames_destroy(frames);
+        return NULL;
+    }
+
+    frames->size = (size + page - 1) / page * page;
+    for (i = 0; i < num; i++) {
+        if (posix_memalign((void **)&frames->frames[i].data, page,
+                           frames->size)) {
+            fprintf(stderr, "allocate relay frame failed\n");
+            frames->frames[i].data = NULL;
+            relay_frames_destroy(frames);
+            return NULL;
+        }
+
+        frames->frames[i].frames = frames;
+        damage_full(&frames->frames[i].stale);
+        frames->num++;
+    }
+
+    return frames;
+}
+
+void relay_frames_destroy(relay_frames *frames)
+{
+    int i;
+
+    if (!frames)
+        return;
+
+    for (i = 0; i < frames->num; i++)
+        free(frames->frames[i].data);
+
+    pthread_cond_destroy(&frames->freed);
+    pthread_mutex_destroy(&frames->lock);
+    free(frames->frames);
+    free(frames);
+}
+
+int relay_frames_bufs(relay_frames *frames, struct iovec *bufs)
+{
+    int i;
+
+    for (i = 0; i < frames->num; i++) {
+        bufs[i].iov_base = frames->frames[i].data;
+        bufs[i].iov_len = frames->size;
+    }
+
+    return frames->num;
+}
+
+relay_frame *relay_frame_get(relay_frames *frames)
+{
+    relay_frame *frame = NULL;
+    int i;
+
+    pthread_mutex_lock(&frames->lock);
+    while (1) {
+        for (i = 0; i < frames->num && !frame; i++) {
+            if (!frames->frames[i].refs)
+                frame = &frames->frames[i];
+        }
+
+        if (frame)
+            break;
+
+        pthread_cond_wait(&frames->freed, &frames->lock);
+    }
+
+    frame->refs = 1;
+    frame->users = 1;
+    frame->sent = 0;
+    frame->image = NULL;
+    pthread_mutex_unlock(&frames->lock);
+
+    return frame;
+}
+
+static relay_frame *relay_frame_use(relay_frame *frame, int users)
+{
+    pthread_mutex_lock(&frame->frames->lock);
+    frame->refs++;
+    frame->users += users;
+    pthread_mutex_unlock(&frame->frames->lock);
+
+    return frame;
+}
+
+static void relay_frame_release(relay_frame *frame, int users)
+{
+    relay_frames *frames = frame->frames;
+    relay_frame *image = NULL;
+
+    pthread_mutex_lock(&frames->lock);
+
+    // Under the lock, one at a time for the stats and logs
+    frame->users -= users;
+    if (users && !frame->users)
+        frames->done(frames->data, frame);
+
+    if (!--frame->refs) {
+        image = frame->image;
+        frame->image = NULL;
+        pthread_cond_broadcast(&frames->freed);
+    }
+    pthread_mutex_unlock(&frames->lock);
+
+    if (image)
+        relay_frame_unref(image);
+}
+
+void relay_frame_put(relay_frame *frame)
+{
+    relay_frame_release(frame, 1);
+}
+
+relay_frame *relay_frame_ref(relay_frame *frame)
+{
+    return relay_frame_use(frame, 0);
+}
+
+void relay_frame_unref(relay_frame *frame)
+{
+    relay_frame_release(frame, 0);
+}
+
+void relay_frame_read(relay_frame *frame, int width, int height)
+{
+    relay_frames *frames = frame->frames;
+    int i;
+
+    for (i = 0; i < frames->num; i++) {
+        if (&frames->frames[i] != frame)
+            damage_add(&frames->frames[i].stale, &frame->damage, width,
+                       height);
+    }
+
+    damage_reset(&frame->stale);
+}
+
+// The last fb written again as a new frame, its content unchanged. Readers
+// still on it see it torn, and get it again as the new frame.
+static int relay_republish(relay_dest *dest, relay_frame *frame)
+{
+    fbpool_header *dst = dest->dst;
+    int version = dest->version, fb = dest->last_fb;
+    damage_region damage;
+
+    damage_reset(&damage);
+    fbpool_begin_write(dst, version, fb);
+    fbpool_set_damage(dst, version, fb, &damage);
+    fbpool_set_timestamp(dst, version, fb, frame->timestamp);
+    fbpool_set_hash(dst, version, fb, frame->hash);
+    fbpool_end_write(dst, version, fb, frame->frame);
+    fbpool_publish(dst, version, fb, frame->frame);
+
+#ifndef USE_MMAP
+    if (version > 1) {
+        QUEUE_SLOT(dest->io, dest->fd, dst, fb, 0);
+        QUEUE_MEMBER(dest->io, dest->fd, dst, frame, 0);
+    }
+    QUEUE_MEMBER(dest->io, dest->fd, dst, current_fb, 0);
+    if (poolio_submit(dest->io) < 0)
+        return -1;
+#endif
+
+    if (sync_header(&dest->policy, dest->fd, dst, dest->hdr_size) < 0)
+        RELAY_DEBUG("Sync header failed: %d\n", fb);
+    return 0;
+}
+
+static void relay_flush(relay_dest *dest, relay_frame *frame)
+{
+    fbpool_publish(dest->dst, dest->version, -1, frame->frame);
+
+#ifndef USE_MMAP
+    if (dest->version > 1)
+        QUEUE_MEMBER(dest->io, dest->fd, dest->dst, frame, 0);
+    QUEUE_MEMBER(dest->io, dest->fd, dest->dst, current_fb, 0);
+    poolio_submit(dest->io);
+#endif
+}
+
+// A destination fb nobody reads, -1 when the readers hold all of them. The
+// slots of the source don't tell, consumers of the destination might still
+// be reading or scanning out the fb of the same index.
+static int relay_dest_slot(relay_dest *dest)
+{
+    fbpool_header *dst = dest->dst;
+
+#ifdef USE_MMAP
+    if (dest->version > 1)
+        return fbpool_acquire_slot(dst);
+#endif
+
+    // Without the readers, in turn like v1 producers
+    return (dest->last_fb + 1) % dst->num_fb;
+}
+
+// The image of data into a fb of the destination, as frame, returns the size
+// written or -1. Published by relay_publish_fb(), or aborted.
+static ssize_t relay_copy_fb(relay_dest *dest, relay_frame *frame,
+                             const uint8_t *data, damage_region *damage)
+{
+    fbpool_header *dst = dest->dst;
+    int version = dest->version, fb;
+    size_t offset, size = dst->fb_size;
+    uint64_t stage_us;
+#ifdef USE_MMAP
+    int i;
+
+    // What each fb misses, whether this one gets written or not
+    for (i = 0; i < dst->num_fb; i++)
+        damage_add(&dest->dst_damage[i], damage, dst->width, dst->height);
+#endif
+
+    fb = relay_dest_slot(dest);
+    if (fb < 0) {
+        RELAY_DEBUG("Dropped frame: %u, %s fbs all read\n", frame->frame,
+                    dest->path);
+        stats_count(STATS_DROPPED, 1);
+        // The next frames can't be republished
+        dest->last_fb = -1;
+        return -1;
+    }
+    dest->fb = fb;
+    offset = dest->hdr_size + fb * dst->fb_size;
+
+    fbpool_begin_write(dst, version, fb);
+    fbpool_set_damage(dst, version, fb, damage);
+    fbpool_set_timestamp(dst, version, fb, frame->timestamp);
+    fbpool_set_hash(dst, version, fb, frame->hash);
+
+    stage_us = fbpool_now_us();
+#ifdef USE_MMAP
+    if (dest->codec) {
+        size = fbcodec_encode(dest->codec, (uint8_t *)dst + offset, data,
+                              frame->frame);
+    } else if (fbpool_is_encoded(dst, version)) {
+        // Relayed as is, the damage isn't of the bytes
+        fbcopy((uint8_t *)dst + offset, data, size, 0);
+    } else {
+        damage_copy((uint8_t *)dst + offset, fbpool_pitch(dst), data,
+                    fbpool_pitch(dst), &dest->dst_damage[fb], dst->width,
+                    dst->height, dst->bpp, 0);
+        damage_reset(&dest->dst_damage[fb]);
+    }
+#else
+    if (dest->codec) {
+        size = fbcodec_encode(dest->codec, dest->enc, data, frame->frame);
+        data = dest->enc;
+
+        // Whole blocks for O_DIRECT
+        if (dest->data_fd != dest->fd)
+            size = (size + 4095) & ~(size_t)4095;
+    }
+
+    if (version > 1)
+        QUEUE_SLOT(dest->io, dest->fd, dst, fb, 0);
+    poolio_write(dest->io, dest->data_fd, data, size, offset);
+    if (poolio_submit(dest->io) < 0) {
+        fbpool_abort_write(dst, version, fb);
+        dest->last_fb = -1;
+        // The next delta would be of a frame never published
+        if (dest->codec)
+            fbcodec_reset(dest->codec);
+        if (version > 1) {
+            QUEUE_SLOT(dest->io, dest->fd, dst, fb, 0);
+            poolio_submit(dest->io);
+        }
+        return -1;
+    }
+#endif
+    stats_record(STATS_COPY, frame->read_us + fbpool_now_us() - stage_us);
+
+    return size;
+}
+
+#ifdef USE_MMAP
+// The copied fb turned out torn
+static void relay_abort_fb(relay_dest *dest)
+{
+    int fb = dest->fb;
+
+    fbpool_abort_write(dest->dst, dest->version, fb);
+    damage_full(&dest->dst_damage[fb]);
+    if (dest->last_fb == fb)
+        dest->last_fb = -1;
+}
+#endif
+
+static int relay_publish_fb(relay_dest *dest, relay_frame *frame,
+                            size_t size)
+{
+    fbpool_header *dst = dest->dst;
+    int version = dest->version, fb = dest->fb;
+    size_t offset = dest->hdr_size + fb * dst->fb_size;
+    uint64_t stage_us, sync_us;
+
+    stage_us = fbpool_now_us();
+    if (sync_fb(&dest->policy, dest->fd, dst, offset, size) < 0)
+        RELAY_DEBUG("Sync fb: %d failed\n", fb);
+    sync_us = fbpool_now_us() - stage_us;
+
+    fbpool_end_write(dst, version, fb, frame->frame);
+    fbpool_publish(dst, version, fb, frame->frame);
+    dest->last_fb = fb;
+
+#ifndef USE_MMAP
+    if (version > 1) {
+        QUEUE_SLOT(dest->io, dest->fd, dst, fb, 0);
+        QUEUE_MEMBER(dest->io, dest->fd, dst, frame, 0);
+    }
+    QUEUE_MEMBER(dest->io, dest->fd, dst, current_fb, 0);
+    if (poolio_submit(dest->io) < 0)
+        return -1;
+#endif
+
+    stage_us = fbpool_now_us();
+    if (sync_header(&dest->policy, dest->fd, dst, dest->hdr_size) < 0)
+        RELAY_DEBUG("Sync header failed: %d\n", fb);
+    if (dest->policy.mode != SYNC_NONE)
+        stats_record(STATS_SYNC, sync_us + fbpool_now_us() - stage_us);
+
+    return 0;
+}
+
+static int relay_write_fb(relay_dest *dest, relay_frame *frame,
+                          const uint8_t *data, damage_region *damage)
+{
+    ssize_t size;
+
+    size = relay_copy_fb(dest, frame, data, damage);
+    if (size < 0)
+        return -1;
+
+    return relay_publish_fb(dest, frame, size);
+}
+
+// On the pipeline's thread, which owns the destination
+static void relay_write(void *data, void *ptr)
+{
+    relay_dest *dest = data;
+    relay_stage *stage = ptr;
+    relay_frame *frame = stage->frame;
+
+    stats_use(dest->stats);
+
+    if (frame->fb < 0) {
+        relay_flush(dest, frame);
+    } else if (!frame->repeat) {
+        relay_write_fb(dest, frame, frame->data, &stage->damage);
+    } else if (dest->last_fb >= 0 && !stage->damage.num) {
+        relay_republish(dest, frame);
+    } else if (frame->image) {
+        // Missed the frames since, or the write of the last one failed
+        if (dest->last_fb < 0)
+            damage_full(&stage->damage);
+        relay_write_fb(dest, frame, frame->image->data, &stage->damage);
+    }
+
+    relay_frame_put(frame);
+}
+
+int relay_dest_depth(void)
+{
+    const char *depth = getenv("FBPOOL_PIPELINE");
+
+    return depth ? atoi(depth) : 2;
+}
+
+relay_dest *relay_dest_create(const char *path, fbpool_header *src,
+                              int version, size_t hdr_size,
+                              relay_frames *frames, stats_ctx *stats)
+{
+    const char *encode = getenv("FBPOOL_ENCODE");
+    const char *keyframe = getenv("FBPOOL_KEYFRAME");
+#ifndef USE_MMAP
+    const char *direct = getenv("FBPOOL_DIRECT");
+    struct iovec bufs[1 + RELAY_MAX_FRAMES];
+    int fds[2], num_bufs;
+#endif
+    relay_dest *dest;
+    fbpool_header *dst;
+    int fb;
+
+    dest = malloc(sizeof(*dest));
+    if (!dest) {
+        fprintf(stderr, "allocate relay destination failed\n");
+        return NULL;
+    }
+    memset(dest, 0, sizeof(*dest));
+
+    dest->path = path;
+    dest->fd = -1;
+#ifndef USE_MMAP
+    dest->data_fd = -1;
+#endif
+    dest->version = version;
+    dest->hdr_size = hdr_size;
+    dest->stats = stats;
+    dest->last_fb = -1;
+
+    // FBPOOL_ENCODE=1: the destination fbs are deltas of the previous one,
+    // with a keyframe every FBPOOL_KEYFRAME (60 by default) frames, which
+    // readers attaching later wait for
+    dest->size = hdr_size + src->num_fb * src->fb_size;
+    if (encode && atoi(encode)) {
+        if (version < 2 || fbpool_is_encoded(src, version)) {
+            fprintf(stderr, "can only encode v2 pools, relaying as is\n");
+        } else {
+            // Without the padding of the fbs
+            dest->codec = fbcodec_create(fbpool_image_size(src),
+                                         keyframe ? atoi(keyframe) : 60);
+            if (!dest->codec)
+                goto err;
+
+            dest->size = hdr_size +
+                src->num_fb * fbcodec_bound(fbpool_image_size(src));
+        }
+    }
+
+    dest->fd = pool_create(path, dest->size, &dest->server);
+    if (dest->fd < 0) {
+        fprintf(stderr, "create %s failed\n", path);
+        goto err;
+    }
+
+    dst = (fbpool_header *)map_buf(dest->fd, 0, dest->size, 0);
+    if (!dst) {
+        fprintf(stderr, "map %s failed\n", path);
+        goto err;
+    }
+    dest->dst = dst;
+
+    // Same layout as the source, with all slots free
+    memcpy(dst, src, hdr_size);
+
+    dst->current_fb = -1;
+    if (dest->codec) {
+        dst->fb_size = fbcodec_bound(fbpool_image_size(src));
+        dst->flags |= FBPOOL_FLAG_ENCODED;
+    }
+    if (version > 1) {
+        dst->frame = 0;
+        for (fb = 0; fb < dst->num_fb; fb++)
+            memset(fbpool_get_slot(dst, fb), 0, dst->slot_size);
+    }
+
+#ifdef USE_MMAP
+    // What each destination fb misses, starting with everything
+    dest->dst_damage = malloc(dst->num_fb * sizeof(damage_region));
+    if (!dest->dst_damage) {
+        fprintf(stderr, "alloc damage failed\n");
+        goto err;
+    }
+
+    for (fb = 0; fb < dst->num_fb; fb++)
+        damage_full(&dest->dst_damage[fb]);
+#else
+    if (poolio_rw(dest->fd, dst, hdr_size, 0, 0) < 0) {
+        fprintf(stderr, "write %s failed\n", path);
+        goto err;
+    }
+
+    // With FBPOOL_DIRECT=1, the fbs skip the page cache when the pools
+    // allow O_DIRECT
+    dest->data_fd = dest->fd;
+    if (direct && atoi(direct)) {
+        dest->data_fd = poolio_open_direct(dest->fd, 0, hdr_size,
+                                           dst->fb_size);
+        if (dest->data_fd < 0)
+            dest->data_fd = dest->fd;
+    }
+
+    dest->io = poolio_create();
+    if (!dest->io) {
+        fprintf(stderr, "create io engine failed\n");
+        goto err;
+    }
+
+    if (dest->codec &&
+        posix_memalign((void **)&dest->enc, 4096, dst->fb_size)) {
+        fprintf(stderr, "allocate encoding buffer failed\n");
+        dest->enc = NULL;
+        goto err;
+    }
+
+    // The header and the frames, which both sides read or write
+    bufs[0].iov_base = dst;
+    bufs[0].iov_len = hdr_size;
+    num_bufs = 1 + relay_frames_bufs(frames, bufs + 1);
+
+    fds[0] = dest->fd;
+    fds[1] = dest->data_fd;
+    poolio_register(dest->io, fds, 1 + (dest->data_fd != dest->fd), bufs,
+                    num_bufs);
+#endif
+
+    sync_policy_init(&dest->policy, !pool_is_unix(path));
+
+    dest->pl = pipeline_create(relay_dest_depth(), sizeof(relay_stage),
+                               relay_write, dest);
+    if (!dest->pl) {
+        fprintf(stderr, "create pipeline failed\n");
+        goto err;
+    }
+
+    return dest;
+err:
+    relay_dest_destroy(dest);
+    return NULL;
+}
+
+void relay_dest_destroy(relay_dest *dest)
+{
+    if (!dest)
+        return;
+
+    pipeline_destroy(dest->pl);
+
+#ifdef USE_MMAP
+    free(dest->dst_damage);
+#else
+    free(dest->enc);
+    poolio_destroy(dest->io);
+    if (dest->data_fd >= 0 && dest->data_fd != dest->fd)
+        close(dest->data_fd);
+#endif
+    if (dest->dst)
+        release_buf((void *)dest->dst, dest->size);
+    // No more consumers getting the pool
+    pool_server_destroy(dest->server);
+    if (dest->fd >= 0)
+        close(dest->fd);
+    fbcodec_destroy(dest->codec);
+    free(dest);
+}
+
+int relay_dest_send(relay_dest *dest, relay_frame *frame)
+{
+    fbpool_header *dst = dest->dst;
+    relay_stage *stage;
+
+    if (frame->fb < 0) {
+        stage = pipeline_acquire(dest->pl);
+    } else {
+        stage = pipeline_try_acquire(dest->pl);
+        if (!stage) {
+            RELAY_DEBUG("Dropped frame: %u, %s busy\n", frame->frame,
+                        dest->path);
+            stats_count(STATS_DROPPED, 1);
+            if (!frame->repeat)
+                damage_add(&dest->missed, &frame->damage, dst->width,
+                           dst->height);
+            return -1;
+        }
+    }
+
+    stage->frame = relay_frame_use(frame, 1);
+    stage->damage = dest->missed;
+    if (frame->fb >= 0 && !frame->repeat)
+        damage_add(&stage->damage, &frame->damage, dst->width, dst->height);
+    if (frame->fb >= 0)
+        damage_reset(&dest->missed);
+
+    frame->sent++;
+    pipeline_submit(dest->pl, stage);
+    return 0;
+}
+
+struct relay_source {
+    const char *path;
+    int fd;
+    fbpool_header *src;
+    fbpool_header layout; // The header when attached
+    size_t size;
+    int version;
+    size_t hdr_size;
+#ifdef USE_MMAP
+    uint8_t *src_ptr;
+#else
+    int data_fd; // For the fbs, O_DIRECT or fd
+    struct poolio *io;
+#endif
+    fbhash_tiles *tiles; // Hashing the fbs without damage info
+    stats_ctx *stats;
+
+    relay_frames *frames;
+    relay_dest *dests[RELAY_MAX_DESTS];
+    int num_dests;
+    relay_frame *image; // The last frame read
+#ifdef USE_MMAP
+    // The only destination, written straight from the source on its thread
+    int direct;
+#endif
+
+    int old_fb;
+    uint32_t old_frame;
+    uint32_t last_frame;
+    uint64_t last_hash;
+    uint64_t wait_us;
+};
+
+relay_source *relay_source_create(const char *path, int fd,
+                                  const char **dests, int num_dests,
+                                  stats_ctx *stats, relay_done_func done,
+                                  void *data)
+{
+    const char *hashing = getenv("FBPOOL_HASH");
+#ifndef USE_MMAP
+    const char *direct = getenv("FBPOOL_DIRECT");
+    struct iovec bufs[1 + RELAY_MAX_FRAMES];
+    int fds[2], num_bufs;
+#endif
+    relay_source *source;
+    fbpool_header *src, hdr;
+    int i;
+
+    if (num_dests < 1 || num_dests > RELAY_MAX_DESTS) {
+        fprintf(stderr, "invalid relay destinations: %d\n", num_dests);
+        close(fd);
+        return NULL;
+    }
+
+    source = malloc(sizeof(*source));
+    if (!source) {
+        fprintf(stderr, "allocate relay source failed\n");
+        close(fd);
+        return NULL;
+    }
+    memset(source, 0, sizeof(*source));
+
+    source->path = path;
+    source->fd = fd;
+    source->stats = stats;
+#ifndef USE_MMAP
+    source->data_fd = -1;
+#endif
+    source->old_fb = -1;
+
+    // Recording into its stats from now on, the destinations too
+    stats_use(stats);
+
+    if (pool_read_header(source->fd, &hdr, &source->version,
+                         &source->size)) {
+        fprintf(stderr, "read %s failed\n", path);
+        goto err;
+    }
+    source->hdr_size = fbpool_header_size(&hdr, source->version);
+
+    RELAY_DEBUG("Source fb pool v%d with %d fb, size: %dx%d(%d), bpp: %d\n",
+                source->version, hdr.num_fb, hdr.width, hdr.height,
+                hdr.fb_size, hdr.bpp);
+
+    src = (fbpool_header *)map_buf(source->fd, 0, source->size, 0);
+    if (!src) {
+        fprintf(stderr, "map %s failed\n", path);
+        goto err;
+    }
+    source->src = src;
+
+#ifdef USE_MMAP
+    source->src_ptr = (uint8_t *)src + source->hdr_size;
+#else
+    if (poolio_rw(source->fd, src, source->hdr_size, 0, 1) < 0) {
+        fprintf(stderr, "read %s failed\n", path);
+        goto err;
+    }
+
+    source->io = poolio_create();
+    if (!source->io) {
+        fprintf(stderr, "create io engine failed\n");
+        goto err;
+    }
+
+    // With FBPOOL_DIRECT=1, the fbs skip the page cache when the pools
+    // allow O_DIRECT
+    source->data_fd = source->fd;
+    if (direct && atoi(direct)) {
+        source->data_fd = poolio_open_direct(source->fd, 1, source->hdr_size,
+                                             src->fb_size);
+        if (source->data_fd < 0)
+            source->data_fd = source->fd;
+    }
+#endif
+
+    source->layout = *src;
+
+    // FBPOOL_HASH=0: the fbs without damage info are relayed as a whole.
+    // Otherwise only their changed tiles are, and unchanged fbs not at all.
+    // Encoded fbs are relayed as is, their tiles aren't the image.
+    if ((!hashing || atoi(hashing)) &&
+        !fbpool_is_encoded(src, source->version)) {
+        source->tiles = fbhash_tiles_create(src->width, src->height,
+                                            src->bpp);
+        if (!source->tiles)
+            goto err;
+    }
+
+    // Enough for each destination to queue as many as it can, with the one
+    // being read and the last one read
+    source->frames = relay_frames_create(num_dests * relay_dest_depth() + 2,
+                                         src->fb_size, done, data);
+    if (!source->frames)
+        goto err;
+
+    for (i = 0; i < num_dests; i++) {
+        source->dests[i] = relay_dest_create(dests[i], src, source->version,
+                                             source->hdr_size,
+                                             source->frames, stats);
+        if (!source->dests[i])
+            goto err;
+        source->num_dests++;
+    }
+
+#ifdef USE_MMAP
+    // Without copying the fbs into the frames first, unless the destination
+    // encodes them or FBPOOL_PIPELINE gives it a thread
+    source->direct = num_dests == 1 && !source->dests[0]->codec &&
+        !getenv("FBPOOL_PIPELINE");
+#else
+    // The header and the frames read into
+    bufs[0].iov_base = src;
+    bufs[0].iov_len = source->hdr_size;
+    num_bufs = 1 + relay_frames_bufs(source->frames, bufs + 1);
+
+    fds[0] = source->fd;
+    fds[1] = source->data_fd;
+    poolio_register(source->io, fds, 1 + (source->data_fd != source->fd),
+                    bufs, num_bufs);
+#endif
+
+    // Make sure that the current fb would be sent
+    source->old_frame = fbpool_frame(src, source->version) - 1;
+    return source;
+err:
+    relay_source_destroy(source);
+    return NULL;
+}
+
+void relay_source_destroy(relay_source *source)
+{
+    int i;
+
+    if (!source)
+        return;
+
+    // Writing the frames queued first
+    for (i = 0; i < source->num_dests; i++)
+        relay_dest_destroy(source->dests[i]);
+    if (source->image)
+        relay_frame_unref(source->image);
+    relay_frames_destroy(source->frames);
+
+    fbhash_tiles_destroy(source->tiles);
+#ifndef USE_MMAP
+    poolio_destroy(source->io);
+    if (source->data_fd >= 0 && source->data_fd != source->fd)
+        close(source->data_fd);
+#endif
+    if (source->src)
+        release_buf((void *)source->src, source->size);
+    if (source->fd >= 0)
+        close(source->fd);
+    free(source);
+}
+
+volatile void *relay_source_wait(relay_source *source, uint32_t *seen)
+{
+    if (!source->wait_us)
+        source->wait_us = fbpool_now_us();
+
+    *seen = source->old_frame;
+#ifdef USE_MMAP
+    return fbpool_notify_word(source->src, source->version);
+#else
+    return NULL;
+#endif
+}
+
+// Sends to all the destinations the frame read, or the flush
+static void relay_source_send(relay_source *source, relay_frame *frame)
+{
+    int i;
+
+    for (i = 0; i < source->num_dests; i++)
+        relay_dest_send(source->dests[i], frame);
+    relay_frame_put(frame);
+}
+
+#ifdef USE_MMAP
+// The fb read into the destination, still mapped, before fbpool_end_read()
+static int relay_source_direct(relay_source *source, relay_frame *rf,
+                               const fbpool_read *rd, damage_region *damage,
+                               int hashed)
+{
+    relay_dest *dest = source->dests[0];
+    fbpool_header *src = source->src;
+    int version = source->version, fb = rf->fb;
+    ssize_t size = 0;
+
+    rf->damage = *damage;
+    rf->read_us = 0;
+    rf->sent = 1;
+
+    // Unless the destination lost the last one
+    if (rf->repeat && dest->last_fb < 0) {
+        rf->repeat = 0;
+        damage_full(&rf->damage);
+    }
+
+    if (!rf->repeat)
+        size = relay_copy_fb(dest, rf, source->src_ptr + fb * src->fb_size,
+                             &rf->damage);
+
+    if (size < 0) {
+        fbpool_end_read(src, version, fb, rd);
+        rf->sent = 0;
+        relay_frame_put(rf);
+        return 1;
+    }
+
+    if (fbpool_end_read(src, version, fb, rd) < 0) {
+        RELAY_DEBUG("Dropped torn fb: %d\n", fb);
+        stats_count(STATS_TORN, 1);
+        if (!rf->repeat)
+            relay_abort_fb(dest);
+        rf->sent = 0;
+        relay_frame_put(rf);
+        return 1;
+    }
+
+    if (rf->repeat) {
+        relay_republish(dest, rf);
+    } else {
+        relay_publish_fb(dest, rf, size);
+
+        if (hashed)
+            fbhash_tiles_commit(source->tiles);
+        else if (source->tiles)
+            fbhash_tiles_invalidate(source->tiles);
+    }
+
+    source->old_fb = fb;
+    source->last_frame = rf->frame;
+    source->last_hash = rf->hash;
+    relay_frame_put(rf);
+    return 1;
+}
+#endif
+
+int relay_source_poll(relay_source *source, int sleep_us)
+{
+    fbpool_header *src = source->src;
+    int version = source->version, fb, hashed;
+    uint32_t frame, fb_frame;
+    fbpool_read rd;
+    uint64_t frame_us, stage_us;
+    damage_region damage;
+    relay_frame *rf;
+    size_t offset;
+
+    stats_use(source->stats);
+
+#ifndef USE_MMAP
+    if (sleep_us)
+        poolio_sleep(source->io, sleep_us);
+    QUEUE_HEADER(source->io, source->fd, src, source->hdr_size);
+    if (poolio_submit(source->io) < 0)
+        return 0;
+#endif
+    // Laid out again by its producer, restarting
+    if (!fbpool_same_layout(src, &source->layout, version)) {
+        RELAY_DEBUG("Source layout changed: %s\n", source->path);
+        return -1;
+    }
+
+    frame = fbpool_frame(src, version);
+    if (frame == source->old_frame)
+        return 0;
+    source->old_frame = frame;
+
+    frame_us = fbpool_now_us();
+    if (source->wait_us)
+        stats_record(STATS_WAIT, frame_us - source->wait_us);
+    source->wait_us = 0;
+
+    fb = fbpool_current(src);
+    offset = fb * src->fb_size;
+
+    if (fb < 0) {
+        RELAY_DEBUG("Flushing fb: %d\n", fb);
+        source->old_fb = -1;
+
+        rf = relay_frame_get(source->frames);
+        rf->fb = -1;
+        rf->frame = frame;
+#ifdef USE_MMAP
+        if (source->direct) {
+            relay_flush(source->dests[0], rf);
+            relay_frame_put(rf);
+            return 1;
+        }
+#endif
+        relay_source_send(source, rf);
+        return 1;
+    } else if (fb >= src->num_fb) {
+        // Being laid out again, or broken until then
+        fprintf(stderr, "invalid fb: %d\n", fb);
+        source->old_fb = -1;
+        return 0;
+    }
+
+    if (fbpool_begin_read(src, version, fb, &rd) < 0) {
+        RELAY_DEBUG("Dropped fb: %d, being written\n", fb);
+        stats_count(STATS_TORN, 1);
+        return 1;
+    }
+
+    if (version > 1) {
+        fb_frame = fbpool_get_slot(src, fb)->frame;
+        if (source->last_frame && fb_frame == source->last_frame) {
+            stats_count(STATS_REPEATED, 1);
+        } else if (source->last_frame && fb_frame != source->last_frame + 1) {
+            RELAY_DEBUG("Lost %u frames before: %u\n",
+                        fb_frame - source->last_frame - 1, fb_frame);
+            stats_count(STATS_DROPPED, fb_frame - source->last_frame - 1);
+        }
+    } else {
+        fb_frame = frame;
+        if (source->old_fb != -1 &&
+            fb != ((source->old_fb + 1) % src->num_fb)) {
+            RELAY_DEBUG("Lost fb between: %d - %d\n", source->old_fb, fb);
+            stats_count(STATS_DROPPED, (fb - source->old_fb - 1 +
+                                        src->num_fb) % src->num_fb);
+        }
+    }
+
+    // The damage is relative to the previous frame
+    fbpool_get_damage(src, version, fb, &damage);
+    if (version < 2 || !source->last_frame ||
+        fb_frame != source->last_frame + 1)
+        damage_full(&damage);
+
+    RELAY_DEBUG("Sending fb: %d\n", fb);
+
+    // Read once for all the destinations, into a frame of their own
+    rf = relay_frame_get(source->frames);
+    rf->fb = fb;
+    rf->frame = fb_frame;
+    rf->timestamp = fbpool_get_timestamp(src, version, fb);
+    rf->hash = fbpool_get_hash(src, version, fb);
+    rf->frame_us = frame_us;
+    rf->repeat = fbpool_unchanged(version, fb_frame, source->last_frame,
+                                  &damage, rf->hash, source->last_hash);
+
+    stage_us = fbpool_now_us();
+    hashed = 0;
+    if (!rf->repeat) {
+        hashed = source->tiles && damage_is_full(&damage);
+#ifdef USE_MMAP
+        // Only the changed tiles of fbs without damage info
+        if (hashed)
+            rf->repeat = !fbhash_tiles_damage(source->tiles,
+                                              source->src_ptr + offset,
+                                              fbpool_pitch(src), &damage);
+
+        // Along with what the frame missed of the ones read since
+        if (!rf->repeat && !source->direct) {
+            damage_add(&rf->stale, &damage, src->width, src->height);
+            damage_copy(rf->data, fbpool_pitch(src), source->src_ptr + offset,
+                        fbpool_pitch(src), &rf->stale, src->width,
+                        src->height, src->bpp, 0);
+        }
+#else
+        poolio_read(source->io, source->data_fd, rf->data, src->fb_size,
+                    offset + source->hdr_size);
+        if (version > 1)
+            QUEUE_SLOT(source->io, source->fd, src, fb, 1);
+        if (poolio_submit(source->io) < 0) {
+            fbpool_end_read(src, version, fb, &rd);
+            relay_frame_put(rf);
+            return 1;
+        }
+#endif
+    }
+
+#ifdef USE_MMAP
+    if (source->direct)
+        return relay_source_direct(source, rf, &rd, &damage, hashed);
+#endif
+
+    if (fbpool_end_read(src, version, fb, &rd) < 0) {
+        RELAY_DEBUG("Dropped torn fb: %d\n", fb);
+        stats_count(STATS_TORN, 1);
+        damage_full(&rf->stale);
+        relay_frame_put(rf);
+        return 1;
+    }
+
+#ifndef USE_MMAP
+    // Only the changed tiles of fbs without damage info
+    if (hashed)
+        rf->repeat = !fbhash_tiles_damage(source->tiles, rf->data,
+                                          fbpool_pitch(src), &damage);
+#endif
+    rf->read_us = fbpool_now_us() - stage_us;
+    rf->damage = damage;
+
+    if (rf->repeat) {
+        // For the destinations which missed the last one read
+        if (source->image)
+            rf->image = relay_frame_ref(source->image);
+    } else {
+        relay_frame_read(rf, src->width, src->height);
+        if (source->image)
+            relay_frame_unref(source->image);
+        source->image = relay_frame_ref(rf);
+
+        if (hashed)
+            fbhash_tiles_commit(source->tiles);
+        else if (source->tiles)
+            fbhash_tiles_invalidate(source->tiles);
+    }
+
+    relay_source_send(source, rf);
+
+    source->old_fb = fb;
+    source->last_frame = fb_frame;
+    source->last_hash = rf->hash;
+    return 1;
+}
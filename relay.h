@@ -0,0 +1,131 @@
+#ifndef _RELAY_H
+#define _RELAY_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+#include "damage.h"
+#include "fbpool.h"
+#include "pipeline.h"
+#include "stats.h"
+
+/*
+ * Destinations of the relay. Each source fb is read once, into a frame
+ * shared by all the destinations, which are written by a thread each. A
+ * destination still busy with the frames it took drops the next ones, and
+ * gets their damage along with the first one it takes again: a slow one
+ * falls behind on its own, without holding up the source or the others.
+ *
+ * Configured like a single destination, by FBPOOL_ENCODE, FBPOOL_KEYFRAME,
+ * FBPOOL_SYNC*, FBPOOL_DIRECT (without mmap) and FBPOOL_PIPELINE, the
+ * frames queued per destination (2 by default).
+ *
+ * Mapped, a single destination which doesn't encode is written straight
+ * from the source fb instead, on the source's thread, unless FBPOOL_PIPELINE
+ * is set.
+ *
+ * The fbs written are picked by fbpool_acquire_slot() in mapped v2
+ * destinations, never the ones their readers hold, like a display scanning
+ * one out. A frame finding them all held is dropped. Otherwise they are
+ * written in turn.
+ */
+#define RELAY_MAX_DESTS     8
+// Queued by each destination, with the one being read and the last one
+#define RELAY_MAX_FRAMES    (RELAY_MAX_DESTS * PIPELINE_MAX_STAGES + 2)
+
+typedef struct relay_frames relay_frames;
+
+// A fb read from the source, fb < 0 to flush the destinations
+typedef struct relay_frame {
+    int fb;
+    int repeat; // Unchanged, the destinations publish their last fb again
+    uint32_t frame;
+    uint64_t timestamp;
+    uint64_t hash;
+    uint64_t frame_us;
+    uint64_t read_us;
+    damage_region damage; // Since the previous frame
+    uint8_t *data; // The whole image, page aligned
+    // Repeats: the last frame read, for destinations which missed it
+    struct relay_frame *image;
+
+    // For the reader: what data misses of the latest fb read
+    damage_region stale;
+    // Destinations which took it
+    int sent;
+
+    relay_frames *frames;
+    int refs;
+    int users; // The reader and the destinations still on it
+} relay_frame;
+
+// Called once all the destinations are done with a frame
+typedef void (*relay_done_func)(void *data, relay_frame *frame);
+
+relay_frames *relay_frames_create(int num, size_t size, relay_done_func done,
+                                  void *data);
+// After the destinations
+void relay_frames_destroy(relay_frames *frames);
+
+// The frame buffers, to register them for I/O, returns their number
+int relay_frames_bufs(relay_frames *frames, struct iovec *bufs);
+
+// A free frame, to put once done with it. Once the reader and all the
+// destinations which took it are, the done func is called.
+relay_frame *relay_frame_get(relay_frames *frames);
+void relay_frame_put(relay_frame *frame);
+
+// References only keeping its data, without holding up done
+relay_frame *relay_frame_ref(relay_frame *frame);
+void relay_frame_unref(relay_frame *frame);
+
+// Read into frame, the damage of which the other frames now miss
+void relay_frame_read(relay_frame *frame, int width, int height);
+
+typedef struct relay_dest relay_dest;
+
+// A destination pool of the same layout as the source, the frames are
+// taken from frames, its thread records into stats
+relay_dest *relay_dest_create(const char *path, fbpool_header *src,
+                              int version, size_t hdr_size,
+                              relay_frames *frames, stats_ctx *stats);
+// Writes the frames taken first
+void relay_dest_destroy(relay_dest *dest);
+
+// Frames queued per destination, for the number of frames needed
+int relay_dest_depth(void);
+
+// Queue the frame, returns -1 when busy and dropping it. Flushes always
+// wait to be queued.
+int relay_dest_send(relay_dest *dest, relay_frame *frame);
+
+/*
+ * A source pool with its destinations, for one loop to drive several of
+ * them. FBPOOL_HASH and FBPOOL_DIRECT apply to the source as well.
+ */
+// With a futex word left for the sources being attached
+#define RELAY_MAX_SOURCES   (FUTEX_WAITV_MAX - 1)
+
+typedef struct relay_source relay_source;
+
+// Of the pool path opened as fd, which its producer laid out already, see
+// pool_read_header(). The fd is the source's, closed along with it or on
+// failure. Done with the frames of all of them alike, recording into stats.
+relay_source *relay_source_create(const char *path, int fd,
+                                  const char **dests, int num_dests,
+                                  stats_ctx *stats, relay_done_func done,
+                                  void *data);
+// Writes the frames taken first
+void relay_source_destroy(relay_source *source);
+
+// Before waiting for it, the futex word notifying its new fbs and the value
+// last seen. NULL without mmap, the source has to be polled.
+volatile void *relay_source_wait(relay_source *source, uint32_t *seen);
+
+// Relays the current fb when new, returns 1 if so, 0 if it isn't, -1 when
+// the producer laid the source out again, to be attached again. Without
+// mmap, sleeps sleep_us first, along with the polling of the source.
+int relay_source_poll(relay_source *source, int sleep_us);
+
+#endif // _RELAY_H
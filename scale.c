@@ -0,0 +1,422 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
+#include "scale.h"
+#include "swconv.h"
+
+struct scale_job {
+    int filter;
+
+    uint8_t *dst;
+    int dst_pitch;
+    damage_rect rect;
+    damage_rect clip;
+
+    const uint8_t *src;
+    int src_pitch;
+    int bpp;
+    int src_w;
+    int src_h;
+
+    // Source columns of each clip column, relative to span_x
+    int *x0;
+    int *x1; // Box end, exclusive
+    uint8_t *xf; // Bilinear weight of x0 + 1
+    int span_x;
+    int span_w;
+
+    int stripes;
+    int error;
+};
+
+// Cached source rows, converted and scaled horizontally
+struct scale_rows {
+    uint8_t *conv;
+    uint8_t *rows[2];
+    int y[2];
+};
+
+static int map_nearest(int d, int dst, int src) {
+    return (int64_t)(2 * d + 1) * src / (2 * dst);
+}
+
+// Pixel centers aligned, 8 bits weight of the next one
+static int map_bilinear(int d, int dst, int src, int *weight) {
+    int64_t pos = ((int64_t)(2 * d + 1) * src << 15) / dst - (1 << 15);
+    int i;
+
+    if (pos < 0)
+        pos = 0;
+
+    i = pos >> 16;
+    *weight = (pos >> 8) & 0xff;
+
+    if (i >= src - 1) {
+        i = src - 1;
+        *weight = 0;
+    }
+
+    return i;
+}
+
+static void map_box(int d, int dst, int src, int *start, int *end) {
+    *start = (int64_t)d * src / dst;
+    *end = (int64_t)(d + 1) * src / dst;
+
+    if (*end <= *start)
+        *end = *start + 1;
+}
+
+// Both halves of each channel pair at once, no carry between them
+static inline uint32_t lerp32(uint32_t p0, uint32_t p1, int f) {
+    uint32_t rb = (((p0 & 0xff00ff) * (256 - f) + (p1 & 0xff00ff) * f) >> 8);
+    uint32_t ag = ((p0 >> 8) & 0xff00ff) * (256 - f) +
+        ((p1 >> 8) & 0xff00ff) * f;
+
+    return (rb & 0xff00ff) | (ag & 0xff00ff00);
+}
+
+static void blend_rows(uint8_t *dst, const uint8_t *a, const uint8_t *b,
+                       int f, int size) {
+    int i = 0;
+
+    if (!f) {
+        memcpy(dst, a, size);
+        return;
+    }
+
+#if defined(__SSE2__)
+    {
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i wa = _mm_set1_epi16(256 - f);
+        const __m128i wb = _mm_set1_epi16(f);
+        __m128i va, vb, lo, hi;
+
+        for (; i + 16 <= size; i += 16) {
+            va = _mm_loadu_si128((const __m128i *)(a + i));
+            vb = _mm_loadu_si128((const __m128i *)(b + i));
+
+            lo = _mm_add_epi16(
+                _mm_mullo_epi16(_mm_unpacklo_epi8(va, zero), wa),
+                _mm_mullo_epi16(_mm_unpacklo_epi8(vb, zero), wb));
+            hi = _mm_add_epi16(
+                _mm_mullo_epi16(_mm_unpackhi_epi8(va, zero), wa),
+                _mm_mullo_epi16(_mm_unpackhi_epi8(vb, zero), wb));
+
+            _mm_storeu_si128((__m128i *)(dst + i),
+                             _mm_packus_epi16(_mm_srli_epi16(lo, 8),
+                                              _mm_srli_epi16(hi, 8)));
+        }
+    }
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+    {
+        const uint8x8_t wa = vdup_n_u8(256 - f);
+        const uint8x8_t wb = vdup_n_u8(f);
+        uint8x16_t va, vb;
+        uint16x8_t lo, hi;
+
+        for (; i + 16 <= size; i += 16) {
+            va = vld1q_u8(a + i);
+            vb = vld1q_u8(b + i);
+
+            lo = vmlal_u8(vmull_u8(vget_low_u8(va), wa), vget_low_u8(vb), wb);
+            hi = vmlal_u8(vmull_u8(vget_high_u8(va), wa), vget_high_u8(vb),
+                          wb);
+
+            vst1q_u8(dst + i, vcombine_u8(vshrn_n_u16(lo, 8),
+                                          vshrn_n_u16(hi, 8)));
+        }
+    }
+#endif
+
+    for (; i < size; i++)
+        dst[i] = (a[i] * (256 - f) + b[i] * f) >> 8;
+}
+
+static void scale_row_h(struct scale_job *job, uint32_t *out,
+                        const uint32_t *conv) {
+    int j, f;
+
+    for (j = 0; j < job->clip.w; j++) {
+        if (job->filter == SCALE_NEAREST) {
+            out[j] = conv[job->x0[j]];
+            continue;
+        }
+
+        f = job->xf[j];
+        out[j] = f ? lerp32(conv[job->x0[j]], conv[job->x0[j] + 1], f) :
+            conv[job->x0[j]];
+    }
+}
+
+static const uint8_t *scale_get_row(struct scale_job *job,
+                                    struct scale_rows *rows, int sy) {
+    int slot;
+
+    if (rows->y[0] == sy)
+        return rows->rows[0];
+    if (rows->y[1] == sy)
+        return rows->rows[1];
+
+    // Going down, the lower one is done with
+    slot = rows->y[0] < rows->y[1] ? 0 : 1;
+
+    swconv_row(rows->conv, job->src, job->src_pitch, job->bpp, job->src_h,
+               job->span_x, sy, job->span_w);
+    scale_row_h(job, (uint32_t *)rows->rows[slot], (uint32_t *)rows->conv);
+
+    rows->y[slot] = sy;
+    return rows->rows[slot];
+}
+
+static void scale_box_row(struct scale_job *job, uint8_t *out,
+                          uint32_t *acc, uint8_t *conv, int d) {
+    const uint32_t *pixels = (const uint32_t *)conv;
+    uint32_t p;
+    int sy, sy0, sy1, j, x, area;
+
+    map_box(d, job->rect.h, job->src_h, &sy0, &sy1);
+
+    memset(acc, 0, job->clip.w * 4 * sizeof(*acc));
+
+    for (sy = sy0; sy < sy1; sy++) {
+        swconv_row(conv, job->src, job->src_pitch, job->bpp, job->src_h,
+                   job->span_x, sy, job->span_w);
+
+        for (j = 0; j < job->clip.w; j++) {
+            for (x = job->x0[j]; x < job->x1[j]; x++) {
+                p = pixels[x];
+                acc[j * 4] += p & 0xff;
+                acc[j * 4 + 1] += (p >> 8) & 0xff;
+                acc[j * 4 + 2] += (p >> 16) & 0xff;
+            }
+        }
+    }
+
+    for (j = 0; j < job->clip.w; j++) {
+        area = (sy1 - sy0) * (job->x1[j] - job->x0[j]);
+        out[j * 4] = acc[j * 4] / area;
+        out[j * 4 + 1] = acc[j * 4 + 1] / area;
+        out[j * 4 + 2] = acc[j * 4 + 2] / area;
+        out[j * 4 + 3] = 0xff;
+    }
+}
+
+static void scale_stripe(void *data, int index) {
+    struct scale_job *job = data;
+    struct scale_rows rows = { .y = { -1, -1 } };
+    size_t row_size = job->clip.w * 4;
+    const uint8_t *a, *b;
+    uint32_t *acc = NULL;
+    uint8_t *out;
+    int y, y0, y1, d, sy, f;
+
+    y0 = job->clip.y + job->clip.h * index / job->stripes;
+    y1 = job->clip.y + job->clip.h * (index + 1) / job->stripes;
+
+    rows.conv = malloc(job->span_w * 4);
+    rows.rows[0] = malloc(row_size);
+    rows.rows[1] = malloc(row_size);
+    if (job->filter == SCALE_BOX)
+        acc = malloc(row_size * sizeof(*acc));
+
+    if (!rows.conv || !rows.rows[0] || !rows.rows[1] ||
+        (job->filter == SCALE_BOX && !acc)) {
+        job->error = 1;
+        goto out;
+    }
+
+    for (y = y0; y < y1; y++) {
+        out = job->dst + (size_t)y * job->dst_pitch + job->clip.x * 4;
+        d = y - job->rect.y;
+
+        switch (job->filter) {
+        case SCALE_NEAREST:
+            sy = map_nearest(d, job->rect.h, job->src_h);
+            memcpy(out, scale_get_row(job, &rows, sy), row_size);
+            break;
+        case SCALE_BILINEAR:
+            sy = map_bilinear(d, job->rect.h, job->src_h, &f);
+            a = scale_get_row(job, &rows, sy);
+            b = f ? scale_get_row(job, &rows, sy + 1) : a;
+            blend_rows(out, a, b, f, row_size);
+            break;
+        case SCALE_BOX:
+            scale_box_row(job, out, acc, rows.conv, d);
+            break;
+        }
+    }
+out:
+    free(acc);
+    free(rows.rows[1]);
+    free(rows.rows[0]);
+    free(rows.conv);
+}
+
+int scale_filter(int src_w, int src_h, int dst_w, int dst_h) {
+    const char *filter = getenv("SCALE_FILTER");
+
+    if (filter && !strcmp(filter, "nearest"))
+        return SCALE_NEAREST;
+    if (filter && !strcmp(filter, "bilinear"))
+        return SCALE_BILINEAR;
+    if (filter && !strcmp(filter, "box"))
+        return SCALE_BOX;
+
+    // Bilinear skips source pixels when shrinking more than that
+    if (src_w > dst_w * 2 || src_h > dst_h * 2)
+        return SCALE_BOX;
+
+    return SCALE_BILINEAR;
+}
+
+void scale_placement(damage_rect *rect, int src_w, int src_h,
+                     int dst_w, int dst_h) {
+    const char *letterbox = getenv("SCALE_LETTERBOX");
+
+    rect->x = 0;
+    rect->y = 0;
+    rect->w = dst_w;
+    rect->h = dst_h;
+
+    if (letterbox && !atoi(letterbox))
+        return;
+
+    if ((int64_t)src_w * dst_h > (int64_t)src_h * dst_w) {
+        rect->h = (int64_t)src_h * dst_w / src_w;
+        rect->y = (dst_h - rect->h) / 2;
+    } else {
+        rect->w = (int64_t)src_w * dst_h / src_h;
+        rect->x = (dst_w - rect->w) / 2;
+    }
+}
+
+void scale_damage(damage_rect *dst_damage, const damage_rect *src_damage,
+                  const damage_rect *rect, int src_w, int src_h) {
+    // Covers the filters' footprint
+    int mx = rect->w / src_w + 2;
+    int my = rect->h / src_h + 2;
+    int x0, y0, x1, y1;
+
+    x0 = (int64_t)src_damage->x * rect->w / src_w - mx;
+    y0 = (int64_t)src_damage->y * rect->h / src_h - my;
+    x1 = ((int64_t)(src_damage->x + src_damage->w) * rect->w +
+          src_w - 1) / src_w + mx;
+    y1 = ((int64_t)(src_damage->y + src_damage->h) * rect->h +
+          src_h - 1) / src_h + my;
+
+    if (x0 < 0)
+        x0 = 0;
+    if (y0 < 0)
+        y0 = 0;
+    if (x1 > rect->w)
+        x1 = rect->w;
+    if (y1 > rect->h)
+        y1 = rect->h;
+
+    dst_damage->x = rect->x + x0;
+    dst_damage->y = rect->y + y0;
+    dst_damage->w = x1 - x0;
+    dst_damage->h = y1 - y0;
+}
+
+int scale_xrgb8888(struct workers *workers, int filter,
+                   uint8_t *dst, int dst_pitch, const damage_rect *rect,
+                   const damage_rect *clip, const uint8_t *src,
+                   int src_pitch, int bpp, int src_w, int src_h) {
+    struct scale_job job = {
+        .filter = filter,
+        .dst = dst,
+        .dst_pitch = dst_pitch,
+        .rect = *rect,
+        .src = src,
+        .src_pitch = src_pitch,
+        .bpp = bpp,
+        .src_w = src_w,
+        .src_h = src_h,
+    };
+    int j, d, f, end, x2, y2;
+
+    if (!swconv_supported(bpp) || rect->w <= 0 || rect->h <= 0)
+        return -1;
+
+    job.clip = clip ? *clip : *rect;
+
+    // Within the rect
+    x2 = job.clip.x + job.clip.w;
+    y2 = job.clip.y + job.clip.h;
+    if (job.clip.x < rect->x)
+        job.clip.x = rect->x;
+    if (job.clip.y < rect->y)
+        job.clip.y = rect->y;
+    job.clip.w = (x2 < rect->x + rect->w ? x2 : rect->x + rect->w) -
+        job.clip.x;
+    job.clip.h = (y2 < rect->y + rect->h ? y2 : rect->y + rect->h) -
+        job.clip.y;
+    if (job.clip.w <= 0 || job.clip.h <= 0)
+        return 0;
+
+    job.x0 = malloc(job.clip.w * sizeof(int));
+    job.x1 = malloc(job.clip.w * sizeof(int));
+    job.xf = malloc(job.clip.w);
+    if (!job.x0 || !job.x1 || !job.xf) {
+        fprintf(stderr, "allocate scale tables failed\n");
+        job.error = 1;
+        goto out;
+    }
+
+    for (j = 0; j < job.clip.w; j++) {
+        d = job.clip.x + j - rect->x;
+        f = 0;
+
+        switch (filter) {
+        case SCALE_NEAREST:
+            job.x0[j] = map_nearest(d, rect->w, src_w);
+            job.x1[j] = job.x0[j] + 1;
+            break;
+        case SCALE_BILINEAR:
+            job.x0[j] = map_bilinear(d, rect->w, src_w, &f);
+            job.x1[j] = job.x0[j] + (f ? 2 : 1);
+            break;
+        default:
+            map_box(d, rect->w, src_w, &job.x0[j], &job.x1[j]);
+            break;
+        }
+        job.xf[j] = f;
+    }
+
+    // The source columns to convert, from a full NV12 uv pair
+    job.span_x = job.x0[0] & ~1;
+    end = 0;
+    for (j = 0; j < job.clip.w; j++) {
+        if (job.x1[j] > end)
+            end = job.x1[j];
+        job.x0[j] -= job.span_x;
+        job.x1[j] -= job.span_x;
+    }
+    job.span_w = end - job.span_x;
+
+    // A few more stripes than threads, for balancing
+    job.stripes = workers_num(workers) * 2;
+    if (job.stripes > job.clip.h)
+        job.stripes = job.clip.h;
+
+    workers_run(workers, scale_stripe, &job, job.stripes);
+
+    if (job.error)
+        fprintf(stderr, "scale failed\n");
+out:
+    free(job.xf);
+    free(job.x1);
+    free(job.x0);
+    return job.error ? -1 : 0;
+}
@@ -0,0 +1,41 @@
+#ifndef _SCALE_H
+#define _SCALE_H
+
+#include <stdint.h>
+
+#include "damage.h"
+#include "workers.h"
+
+/*
+ * Software scaling to XRGB8888, converting the source rows (any swconv
+ * format) as they get read.
+ *
+ * SCALE_FILTER=nearest|bilinear|box picks the filter, the default is
+ * bilinear, or box when shrinking to less than half.
+ * SCALE_LETTERBOX=0 stretches the frame instead of keeping its aspect ratio.
+ */
+
+enum {
+    SCALE_NEAREST,
+    SCALE_BILINEAR,
+    SCALE_BOX,
+};
+
+int scale_filter(int src_w, int src_h, int dst_w, int dst_h);
+
+// Where the frame goes in a dst_w x dst_h buffer
+void scale_placement(damage_rect *rect, int src_w, int src_h,
+                     int dst_w, int dst_h);
+
+// Map a source damage rect to the area of the dst rect it changes
+void scale_damage(damage_rect *dst_damage, const damage_rect *src_damage,
+                  const damage_rect *rect, int src_w, int src_h);
+
+// Scale src into rect of dst, only writing the part of it within clip (the
+// whole rect when NULL), spread over the workers
+int scale_xrgb8888(struct workers *workers, int filter,
+                   uint8_t *dst, int dst_pitch, const damage_rect *rect,
+                   const damage_rect *clip, const uint8_t *src,
+                   int src_pitch, int bpp, int src_w, int src_h);
+
+#endif // _SCALE_H
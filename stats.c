@@ -0,0 +1,303 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+
+#include "stats.h"
+
+#define STATS_TEXT_INTERVAL_US  1000000
+#define STATS_CPU_INTERVAL_US   100000
+
+static const char *stage_names[STATS_STAGES] = {
+    "wait", "copy", "commit", "vblank", "sync", "frame", "latency",
+};
+
+static const char *counter_names[STATS_COUNTERS] = {
+    "frames", "dropped", "repeated", "torn", "syscalls", "undecoded",
+    "skipped",
+};
+
+struct stats_ctx {
+    stats_block *block;
+    int shared;
+
+    const char *name;
+    char *text_path;
+    char *text_tmp;
+    uint64_t text_us;
+    uint64_t cpu_us;
+};
+
+// The process's, and the ones threads record into instead
+static stats_ctx stats;
+static __thread stats_ctx *stats_cur;
+
+static inline stats_ctx *stats_get(void) {
+    return stats_cur ? stats_cur : &stats;
+}
+
+uint64_t stats_percentile(const stats_hist *hist, double p) {
+    uint64_t count = 0, target = hist->count * p / 100;
+    int i;
+
+    for (i = 0; i < STATS_BUCKETS; i++) {
+        count += hist->buckets[i];
+        if (count > target)
+            break;
+    }
+
+    if (i == STATS_BUCKETS || stats_bucket_max(i) > hist->max_us)
+        return hist->max_us;
+
+    return stats_bucket_max(i);
+}
+
+static stats_block *stats_map(const char *path, int *shared) {
+    stats_block *block;
+    int fd;
+
+    *shared = 0;
+    if (!path) {
+        block = malloc(sizeof(*block));
+        if (block)
+            memset(block, 0, sizeof(*block));
+        return block;
+    }
+
+    fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "open %s failed\n", path);
+        return NULL;
+    }
+
+    if (ftruncate(fd, sizeof(*block)) < 0) {
+        fprintf(stderr, "truncate %s failed\n", path);
+        close(fd);
+        return NULL;
+    }
+
+    block = mmap(NULL, sizeof(*block), PROT_READ | PROT_WRITE, MAP_SHARED,
+                 fd, 0);
+    close(fd);
+    if (block == MAP_FAILED) {
+        fprintf(stderr, "map %s failed\n", path);
+        return NULL;
+    }
+
+    *shared = 1;
+    memset(block, 0, sizeof(*block));
+    return block;
+}
+
+static int stats_setup(stats_ctx *ctx, const char *name, const char *path,
+                       const char *text) {
+    stats_block *block;
+    int i;
+
+    if (!path && !text)
+        return 0;
+
+    block = stats_map(path, &ctx->shared);
+    if (!block)
+        return -1;
+
+    block->version = STATS_VERSION;
+    block->num_stages = STATS_STAGES;
+    block->num_counters = STATS_COUNTERS;
+    block->start_us = stats_now_us();
+
+    for (i = 0; i < STATS_STAGES; i++)
+        strncpy(block->stages[i].name, stage_names[i], STATS_NAME_SIZE - 1);
+    for (i = 0; i < STATS_COUNTERS; i++)
+        strncpy(block->counter_names[i], counter_names[i],
+                STATS_NAME_SIZE - 1);
+
+    if (text) {
+        ctx->text_path = strdup(text);
+        if (asprintf(&ctx->text_tmp, "%s.tmp", text) < 0)
+            ctx->text_tmp = NULL;
+    }
+
+    ctx->name = name;
+
+    // Readers check the magic last
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(block->magic, STATS_MAGIC, 4);
+
+    __atomic_store_n(&ctx->block, block, __ATOMIC_RELEASE);
+    return 1;
+}
+
+static void stats_clear(stats_ctx *ctx) {
+    stats_block *block = ctx->block;
+
+    if (!block)
+        return;
+
+    ctx->block = NULL;
+    if (ctx->shared)
+        munmap(block, sizeof(*block));
+    else
+        free(block);
+
+    free(ctx->text_path);
+    free(ctx->text_tmp);
+    memset(ctx, 0, sizeof(*ctx));
+}
+
+int stats_init(const char *name) {
+    return stats_setup(&stats, name, getenv("FBPOOL_STATS"),
+                       getenv("FBPOOL_STATS_TEXT"));
+}
+
+void stats_deinit(void) {
+    stats_clear(&stats);
+}
+
+stats_ctx *stats_create(const char *name, const char *path,
+                        const char *text) {
+    stats_ctx *ctx;
+
+    ctx = malloc(sizeof(*ctx));
+    if (!ctx) {
+        fprintf(stderr, "allocate stats failed\n");
+        return NULL;
+    }
+    memset(ctx, 0, sizeof(*ctx));
+
+    if (stats_setup(ctx, name, path, text) < 0) {
+        free(ctx);
+        return NULL;
+    }
+
+    return ctx;
+}
+
+void stats_destroy(stats_ctx *ctx) {
+    if (!ctx)
+        return;
+
+    stats_clear(ctx);
+    free(ctx);
+}
+
+void stats_use(stats_ctx *ctx) {
+    stats_cur = ctx;
+}
+
+void stats_record(int stage, uint64_t us) {
+    stats_block *block = __atomic_load_n(&stats_get()->block,
+                                         __ATOMIC_RELAXED);
+    stats_hist *hist;
+
+    if (!block)
+        return;
+
+    hist = &block->stages[stage];
+    __atomic_fetch_add(&hist->buckets[stats_bucket(us)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&hist->sum_us, us, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&hist->count, 1, __ATOMIC_RELAXED);
+
+    // Racy, a concurrent larger max could get lost once in a while
+    if (us > __atomic_load_n(&hist->max_us, __ATOMIC_RELAXED))
+        __atomic_store_n(&hist->max_us, us, __ATOMIC_RELAXED);
+}
+
+void stats_count(int counter, uint64_t num) {
+    stats_block *block = __atomic_load_n(&stats_get()->block,
+                                         __ATOMIC_RELAXED);
+
+    if (block)
+        __atomic_fetch_add(&block->counters[counter], num, __ATOMIC_RELAXED);
+}
+
+static void stats_update_cpu(stats_block *block) {
+    struct rusage usage;
+
+    if (getrusage(RUSAGE_SELF, &usage) < 0)
+        return;
+
+    __atomic_store_n(&block->cpu_us,
+                     (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) *
+                     1000000ULL + usage.ru_utime.tv_usec +
+                     usage.ru_stime.tv_usec, __ATOMIC_RELAXED);
+}
+
+// Prometheus text format
+static void stats_write_text(stats_ctx *ctx, stats_block *block,
+                             uint64_t now) {
+    const stats_hist *hist;
+    FILE *file;
+    int i;
+
+    file = fopen(ctx->text_tmp, "w");
+    if (!file)
+        return;
+
+    fprintf(file, "%s_uptime_seconds %.3f\n", ctx->name,
+            (now - block->start_us) / 1e6);
+    fprintf(file, "%s_cpu_seconds_total %.3f\n", ctx->name,
+            block->cpu_us / 1e6);
+
+    for (i = 0; i < STATS_COUNTERS; i++)
+        fprintf(file, "%s_%s_total %llu\n", ctx->name,
+                block->counter_names[i],
+                (unsigned long long)block->counters[i]);
+
+    // Of the frames done
+    fprintf(file, "%s_skip_ratio %.3f\n", ctx->name,
+            block->counters[STATS_FRAMES] ?
+            (double)block->counters[STATS_SKIPPED] /
+            block->counters[STATS_FRAMES] : 0);
+
+    for (i = 0; i < STATS_STAGES; i++) {
+        hist = &block->stages[i];
+        if (!hist->count)
+            continue;
+
+        fprintf(file, "%s_stage_count{stage=\"%s\"} %llu\n", ctx->name,
+                hist->name, (unsigned long long)hist->count);
+        fprintf(file, "%s_stage_sum_us{stage=\"%s\"} %llu\n", ctx->name,
+                hist->name, (unsigned long long)hist->sum_us);
+        fprintf(file, "%s_stage_max_us{stage=\"%s\"} %llu\n", ctx->name,
+                hist->name, (unsigned long long)hist->max_us);
+        fprintf(file, "%s_stage_p50_us{stage=\"%s\"} %llu\n", ctx->name,
+                hist->name, (unsigned long long)stats_percentile(hist, 50));
+        fprintf(file, "%s_stage_p99_us{stage=\"%s\"} %llu\n", ctx->name,
+                hist->name, (unsigned long long)stats_percentile(hist, 99));
+    }
+
+    fclose(file);
+    rename(ctx->text_tmp, ctx->text_path);
+}
+
+void stats_update(void) {
+    stats_ctx *ctx = stats_get();
+    stats_block *block = ctx->block;
+    uint64_t now, last;
+
+    if (!block)
+        return;
+
+    now = stats_now_us();
+    __atomic_store_n(&block->update_us, now, __ATOMIC_RELAXED);
+
+    // Threads sharing the stats take turns
+    last = __atomic_load_n(&ctx->cpu_us, __ATOMIC_RELAXED);
+    if (now - last >= STATS_CPU_INTERVAL_US &&
+        __atomic_compare_exchange_n(&ctx->cpu_us, &last, now, 0,
+                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        stats_update_cpu(block);
+
+    last = __atomic_load_n(&ctx->text_us, __ATOMIC_RELAXED);
+    if (!ctx->text_tmp || now - last < STATS_TEXT_INTERVAL_US ||
+        !__atomic_compare_exchange_n(&ctx->text_us, &last, now, 0,
+                                     __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        return;
+
+    stats_write_text(ctx, block, now);
+}
@@ -0,0 +1,121 @@
+#ifndef _STATS_H
+#define _STATS_H
+
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * Per stage timing histograms and frame counters, cheap enough to stay on:
+ * FBPOOL_STATS=<path>:      a shared stats_block, updated in place.
+ * FBPOOL_STATS_TEXT=<path>: a text summary, rewritten every second.
+ *
+ * Nothing is recorded when neither is set.
+ */
+
+#define STATS_MAGIC     "FBST"
+#define STATS_VERSION   4
+#define STATS_BUCKETS   112
+#define STATS_NAME_SIZE 16
+
+enum {
+    STATS_WAIT, // Waiting for a new fb
+    STATS_COPY, // Copying or converting it
+    STATS_COMMIT, // Handing it to the display
+    STATS_VBLANK, // Waiting for the flip
+    STATS_SYNC, // Flushing it to storage
+    STATS_FRAME, // From noticing the fb to done with it
+    STATS_LATENCY, // From the producer's timestamp to done with it
+    STATS_STAGES,
+};
+
+enum {
+    STATS_FRAMES,
+    STATS_DROPPED, // Never seen, the producer was faster
+    STATS_REPEATED, // Published again with the same frame number
+    STATS_TORN, // Overwritten while being read
+    STATS_SYSCALLS, // File I/O, without mmap
+    STATS_UNDECODED, // Encoded, missing the frame it's a delta of
+    STATS_SKIPPED, // Same content as the last one, not shown or copied again
+    STATS_COUNTERS,
+};
+
+// us histogram, 4 linear buckets per power of 2
+typedef struct {
+    char name[STATS_NAME_SIZE];
+    uint64_t count;
+    uint64_t sum_us;
+    uint64_t max_us;
+    uint64_t buckets[STATS_BUCKETS];
+} stats_hist;
+
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint32_t num_stages;
+    uint32_t num_counters;
+    uint64_t start_us;
+    uint64_t update_us;
+    uint64_t cpu_us; // User and system time of the process
+
+    char counter_names[STATS_COUNTERS][STATS_NAME_SIZE];
+    uint64_t counters[STATS_COUNTERS];
+    stats_hist stages[STATS_STAGES];
+} stats_block;
+
+static inline uint64_t stats_now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static inline int stats_bucket(uint64_t us)
+{
+    int bits, index;
+
+    if (us < 4)
+        return us;
+
+    bits = 63 - __builtin_clzll(us);
+    index = 4 + (bits - 2) * 4 + ((us >> (bits - 2)) & 3);
+
+    return index < STATS_BUCKETS ? index : STATS_BUCKETS - 1;
+}
+
+// The largest value of a bucket
+static inline uint64_t stats_bucket_max(int index)
+{
+    int bits;
+
+    if (index < 4)
+        return index;
+
+    bits = (index - 4) / 4 + 2;
+    return ((uint64_t)(4 + (index - 4) % 4 + 1) << (bits - 2)) - 1;
+}
+
+// Upper bound of the p percentile
+uint64_t stats_percentile(const stats_hist *hist, double p);
+
+// Name is the prefix of the text summary, returns 0 when disabled
+int stats_init(const char *name);
+void stats_deinit(void);
+
+// Separate stats, of a pool among others, paths as the envs above
+typedef struct stats_ctx stats_ctx;
+
+stats_ctx *stats_create(const char *name, const char *path, const char *text);
+void stats_destroy(stats_ctx *ctx);
+
+// What the calling thread records into from now on, NULL for the process's
+void stats_use(stats_ctx *ctx);
+
+// Thread-safe
+void stats_record(int stage, uint64_t us);
+void stats_count(int counter, uint64_t num);
+
+// Once per frame, rewrites the text summary when due
+void stats_update(void);
+
+#endif // _STATS_H
@@ -0,0 +1,495 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SWCONV_X86
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define SWCONV_NEON
+#endif
+
+#include "swconv.h"
+
+// BT.601 limited range, 6 bits fixed point. Every kernel uses the same
+// 16 bits math (saturating where it could overflow), so they all match the
+// scalar one exactly.
+#define YG  74  // 1.164
+#define VR  102 // 1.596
+#define UG  25  // 0.391
+#define VG  52  // 0.813
+#define UB  129 // 2.018
+
+struct swconv_ops {
+    const char *name;
+    // uv points to the pair of the first pixel, which has an even x
+    void (*nv12)(uint8_t *dst, const uint8_t *y, const uint8_t *uv, int width);
+    void (*rgb565)(uint8_t *dst, const uint8_t *src, int width);
+    void (*rgb24)(uint8_t *dst, const uint8_t *src, int width);
+};
+
+static inline uint8_t clamp_u8(int val) {
+    return val < 0 ? 0 : val > 255 ? 255 : val;
+}
+
+static inline void put_pixel(uint8_t *dst, int r, int g, int b) {
+    dst[0] = b;
+    dst[1] = g;
+    dst[2] = r;
+    dst[3] = 0xff;
+}
+
+static void nv12_row_scalar(uint8_t *dst, const uint8_t *y, const uint8_t *uv,
+                            int width) {
+    int x, y1, u, v;
+
+    for (x = 0; x < width; x++) {
+        y1 = (y[x] - 16) * YG;
+        u = uv[x & ~1] - 128;
+        v = uv[x | 1] - 128;
+
+        put_pixel(dst + x * 4,
+                  clamp_u8((y1 + VR * v + 32) >> 6),
+                  clamp_u8((y1 - UG * u - VG * v + 32) >> 6),
+                  clamp_u8((y1 + UB * u + 32) >> 6));
+    }
+}
+
+static void rgb565_row_scalar(uint8_t *dst, const uint8_t *src, int width) {
+    int x, p, r, g, b;
+
+    for (x = 0; x < width; x++) {
+        p = src[x * 2] | src[x * 2 + 1] << 8;
+        r = p >> 11;
+        g = (p >> 5) & 0x3f;
+        b = p & 0x1f;
+
+        put_pixel(dst + x * 4,
+                  r << 3 | r >> 2, g << 2 | g >> 4, b << 3 | b >> 2);
+    }
+}
+
+static void rgb24_row_scalar(uint8_t *dst, const uint8_t *src, int width) {
+    int x;
+
+    for (x = 0; x < width; x++)
+        put_pixel(dst + x * 4, src[x * 3 + 2], src[x * 3 + 1], src[x * 3]);
+}
+
+#ifdef SWCONV_X86
+// 8 pixels of 16 bits r, g, b to XRGB8888
+__attribute__((target("sse2")))
+static inline void sse2_store8(uint8_t *dst, __m128i r, __m128i g, __m128i b) {
+    __m128i bg = _mm_unpacklo_epi8(_mm_packus_epi16(b, b),
+                                   _mm_packus_epi16(g, g));
+    __m128i ra = _mm_unpacklo_epi8(_mm_packus_epi16(r, r),
+                                   _mm_set1_epi8(-1));
+
+    _mm_storeu_si128((__m128i *)dst, _mm_unpacklo_epi16(bg, ra));
+    _mm_storeu_si128((__m128i *)(dst + 16), _mm_unpackhi_epi16(bg, ra));
+}
+
+__attribute__((target("sse2")))
+static void nv12_row_sse2(uint8_t *dst, const uint8_t *y, const uint8_t *uv,
+                          int width) {
+    const __m128i zero = _mm_setzero_si128();
+    __m128i y1, uvs, u, v, r, g, b;
+    int x;
+
+    for (x = 0; x + 8 <= width; x += 8) {
+        y1 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(y + x)),
+                               zero);
+        y1 = _mm_mullo_epi16(_mm_sub_epi16(y1, _mm_set1_epi16(16)),
+                             _mm_set1_epi16(YG));
+
+        // 4 uv pairs, each for 2 pixels
+        uvs = _mm_loadl_epi64((const __m128i *)(uv + x));
+        uvs = _mm_unpacklo_epi16(uvs, uvs);
+        u = _mm_sub_epi16(_mm_and_si128(uvs, _mm_set1_epi16(0xff)),
+                          _mm_set1_epi16(128));
+        v = _mm_sub_epi16(_mm_srli_epi16(uvs, 8), _mm_set1_epi16(128));
+
+        r = _mm_adds_epi16(y1, _mm_mullo_epi16(v, _mm_set1_epi16(VR)));
+        g = _mm_subs_epi16(y1, _mm_mullo_epi16(u, _mm_set1_epi16(UG)));
+        g = _mm_subs_epi16(g, _mm_mullo_epi16(v, _mm_set1_epi16(VG)));
+        b = _mm_adds_epi16(y1, _mm_mullo_epi16(u, _mm_set1_epi16(UB)));
+
+        r = _mm_srai_epi16(_mm_adds_epi16(r, _mm_set1_epi16(32)), 6);
+        g = _mm_srai_epi16(_mm_adds_epi16(g, _mm_set1_epi16(32)), 6);
+        b = _mm_srai_epi16(_mm_adds_epi16(b, _mm_set1_epi16(32)), 6);
+
+        sse2_store8(dst + x * 4, r, g, b);
+    }
+
+    nv12_row_scalar(dst + x * 4, y + x, uv + x, width - x);
+}
+
+__attribute__((target("sse2")))
+static inline void sse2_rgb565(__m128i p, __m128i *r, __m128i *g,
+                               __m128i *b) {
+    __m128i r5 = _mm_srli_epi16(p, 11);
+    __m128i g6 = _mm_and_si128(_mm_srli_epi16(p, 5), _mm_set1_epi16(0x3f));
+    __m128i b5 = _mm_and_si128(p, _mm_set1_epi16(0x1f));
+
+    *r = _mm_or_si128(_mm_slli_epi16(r5, 3), _mm_srli_epi16(r5, 2));
+    *g = _mm_or_si128(_mm_slli_epi16(g6, 2), _mm_srli_epi16(g6, 4));
+    *b = _mm_or_si128(_mm_slli_epi16(b5, 3), _mm_srli_epi16(b5, 2));
+}
+
+__attribute__((target("sse2")))
+static void rgb565_row_sse2(uint8_t *dst, const uint8_t *src, int width) {
+    __m128i r, g, b;
+    int x;
+
+    for (x = 0; x + 8 <= width; x += 8) {
+        sse2_rgb565(_mm_loadu_si128((const __m128i *)(src + x * 2)),
+                    &r, &g, &b);
+        sse2_store8(dst + x * 4, r, g, b);
+    }
+
+    rgb565_row_scalar(dst + x * 4, src + x * 2, width - x);
+}
+
+// 16 pixels of 16 bits r, g, b to XRGB8888, the packs work per 128 bits
+// lane, so the halves get swapped back in order at the end
+__attribute__((target("avx2")))
+static inline void avx2_store16(uint8_t *dst, __m256i r, __m256i g,
+                                __m256i b) {
+    __m256i bg = _mm256_unpacklo_epi8(_mm256_packus_epi16(b, b),
+                                      _mm256_packus_epi16(g, g));
+    __m256i ra = _mm256_unpacklo_epi8(_mm256_packus_epi16(r, r),
+                                      _mm256_set1_epi8(-1));
+    __m256i lo = _mm256_unpacklo_epi16(bg, ra);
+    __m256i hi = _mm256_unpackhi_epi16(bg, ra);
+
+    _mm256_storeu_si256((__m256i *)dst, _mm256_permute2x128_si256(lo, hi,
+                                                                  0x20));
+    _mm256_storeu_si256((__m256i *)(dst + 32),
+                        _mm256_permute2x128_si256(lo, hi, 0x31));
+}
+
+__attribute__((target("avx2")))
+static void nv12_row_avx2(uint8_t *dst, const uint8_t *y, const uint8_t *uv,
+                          int width) {
+    __m256i y1, uvs, u, v, r, g, b;
+    __m128i uv8;
+    int x;
+
+    for (x = 0; x + 16 <= width; x += 16) {
+        y1 = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(y + x)));
+        y1 = _mm256_mullo_epi16(_mm256_sub_epi16(y1, _mm256_set1_epi16(16)),
+                                _mm256_set1_epi16(YG));
+
+        // 8 uv pairs, each for 2 pixels
+        uv8 = _mm_loadu_si128((const __m128i *)(uv + x));
+        uvs = _mm256_inserti128_si256(
+            _mm256_castsi128_si256(_mm_unpacklo_epi16(uv8, uv8)),
+            _mm_unpackhi_epi16(uv8, uv8), 1);
+        u = _mm256_sub_epi16(_mm256_and_si256(uvs, _mm256_set1_epi16(0xff)),
+                             _mm256_set1_epi16(128));
+        v = _mm256_sub_epi16(_mm256_srli_epi16(uvs, 8),
+                             _mm256_set1_epi16(128));
+
+        r = _mm256_adds_epi16(y1, _mm256_mullo_epi16(v,
+                                                     _mm256_set1_epi16(VR)));
+        g = _mm256_subs_epi16(y1, _mm256_mullo_epi16(u,
+                                                     _mm256_set1_epi16(UG)));
+        g = _mm256_subs_epi16(g, _mm256_mullo_epi16(v,
+                                                    _mm256_set1_epi16(VG)));
+        b = _mm256_adds_epi16(y1, _mm256_mullo_epi16(u,
+                                                     _mm256_set1_epi16(UB)));
+
+        r = _mm256_srai_epi16(_mm256_adds_epi16(r, _mm256_set1_epi16(32)), 6);
+        g = _mm256_srai_epi16(_mm256_adds_epi16(g, _mm256_set1_epi16(32)), 6);
+        b = _mm256_srai_epi16(_mm256_adds_epi16(b, _mm256_set1_epi16(32)), 6);
+
+        avx2_store16(dst + x * 4, r, g, b);
+    }
+
+    nv12_row_sse2(dst + x * 4, y + x, uv + x, width - x);
+}
+
+__attribute__((target("avx2")))
+static void rgb565_row_avx2(uint8_t *dst, const uint8_t *src, int width) {
+    __m256i p, r5, g6, b5, r, g, b;
+    int x;
+
+    for (x = 0; x + 16 <= width; x += 16) {
+        p = _mm256_loadu_si256((const __m256i *)(src + x * 2));
+        r5 = _mm256_srli_epi16(p, 11);
+        g6 = _mm256_and_si256(_mm256_srli_epi16(p, 5),
+                              _mm256_set1_epi16(0x3f));
+        b5 = _mm256_and_si256(p, _mm256_set1_epi16(0x1f));
+
+        r = _mm256_or_si256(_mm256_slli_epi16(r5, 3),
+                            _mm256_srli_epi16(r5, 2));
+        g = _mm256_or_si256(_mm256_slli_epi16(g6, 2),
+                            _mm256_srli_epi16(g6, 4));
+        b = _mm256_or_si256(_mm256_slli_epi16(b5, 3),
+                            _mm256_srli_epi16(b5, 2));
+
+        avx2_store16(dst + x * 4, r, g, b);
+    }
+
+    rgb565_row_sse2(dst + x * 4, src + x * 2, width - x);
+}
+
+// No byte shuffle before SSSE3, so this one needs AVX2 (or falls back to
+// the scalar one)
+__attribute__((target("avx2")))
+static void rgb24_row_avx2(uint8_t *dst, const uint8_t *src, int width) {
+    const __m256i shuf = _mm256_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1,
+                                          6, 7, 8, -1, 9, 10, 11, -1,
+                                          0, 1, 2, -1, 3, 4, 5, -1,
+                                          6, 7, 8, -1, 9, 10, 11, -1);
+    const __m256i alpha = _mm256_set1_epi32(0xff000000);
+    __m256i p;
+    int x;
+
+    // Each half reads 16 bytes for 4 pixels, stay within the row
+    for (x = 0; x + 10 <= width; x += 8) {
+        p = _mm256_inserti128_si256(
+            _mm256_castsi128_si256(
+                _mm_loadu_si128((const __m128i *)(src + x * 3))),
+            _mm_loadu_si128((const __m128i *)(src + x * 3 + 12)), 1);
+        p = _mm256_or_si256(_mm256_shuffle_epi8(p, shuf), alpha);
+        _mm256_storeu_si256((__m256i *)(dst + x * 4), p);
+    }
+
+    rgb24_row_scalar(dst + x * 4, src + x * 3, width - x);
+}
+#endif
+
+#ifdef SWCONV_NEON
+static inline uint8x8_t neon_clamp(int16x8_t val) {
+    return vqmovun_s16(vshrq_n_s16(vqaddq_s16(val, vdupq_n_s16(32)), 6));
+}
+
+// 8 pixels of NV12 to 8 bits r, g, b
+static inline void neon_yuv8(uint8x8_t y, uint8x8_t u, uint8x8_t v,
+                             uint8x8_t *r, uint8x8_t *g, uint8x8_t *b) {
+    int16x8_t y1 = vreinterpretq_s16_u16(vmovl_u8(y));
+    int16x8_t u1 = vreinterpretq_s16_u16(vmovl_u8(u));
+    int16x8_t v1 = vreinterpretq_s16_u16(vmovl_u8(v));
+
+    y1 = vmulq_n_s16(vsubq_s16(y1, vdupq_n_s16(16)), YG);
+    u1 = vsubq_s16(u1, vdupq_n_s16(128));
+    v1 = vsubq_s16(v1, vdupq_n_s16(128));
+
+    *r = neon_clamp(vqaddq_s16(y1, vmulq_n_s16(v1, VR)));
+    *g = neon_clamp(vqsubq_s16(vqsubq_s16(y1, vmulq_n_s16(u1, UG)),
+                               vmulq_n_s16(v1, VG)));
+    *b = neon_clamp(vqaddq_s16(y1, vmulq_n_s16(u1, UB)));
+}
+
+static void nv12_row_neon(uint8_t *dst, const uint8_t *y, const uint8_t *uv,
+                          int width) {
+    uint8x8_t r0, g0, b0, r1, g1, b1;
+    uint8x8x2_t uvs, u, v;
+    uint8x16x4_t out;
+    uint8x16_t y16;
+    int x;
+
+    out.val[3] = vdupq_n_u8(0xff);
+
+    for (x = 0; x + 16 <= width; x += 16) {
+        y16 = vld1q_u8(y + x);
+
+        // 8 uv pairs, each for 2 pixels
+        uvs = vld2_u8(uv + x);
+        u = vzip_u8(uvs.val[0], uvs.val[0]);
+        v = vzip_u8(uvs.val[1], uvs.val[1]);
+
+        neon_yuv8(vget_low_u8(y16), u.val[0], v.val[0], &r0, &g0, &b0);
+        neon_yuv8(vget_high_u8(y16), u.val[1], v.val[1], &r1, &g1, &b1);
+
+        out.val[0] = vcombine_u8(b0, b1);
+        out.val[1] = vcombine_u8(g0, g1);
+        out.val[2] = vcombine_u8(r0, r1);
+        vst4q_u8(dst + x * 4, out);
+    }
+
+    nv12_row_scalar(dst + x * 4, y + x, uv + x, width - x);
+}
+
+static void rgb565_row_neon(uint8_t *dst, const uint8_t *src, int width) {
+    uint16x8_t p, r5, g6, b5;
+    uint8x8x4_t out;
+    int x;
+
+    out.val[3] = vdup_n_u8(0xff);
+
+    for (x = 0; x + 8 <= width; x += 8) {
+        p = vreinterpretq_u16_u8(vld1q_u8(src + x * 2));
+        r5 = vshrq_n_u16(p, 11);
+        g6 = vandq_u16(vshrq_n_u16(p, 5), vdupq_n_u16(0x3f));
+        b5 = vandq_u16(p, vdupq_n_u16(0x1f));
+
+        out.val[0] = vmovn_u16(vorrq_u16(vshlq_n_u16(b5, 3),
+                                         vshrq_n_u16(b5, 2)));
+        out.val[1] = vmovn_u16(vorrq_u16(vshlq_n_u16(g6, 2),
+                                         vshrq_n_u16(g6, 4)));
+        out.val[2] = vmovn_u16(vorrq_u16(vshlq_n_u16(r5, 3),
+                                         vshrq_n_u16(r5, 2)));
+        vst4_u8(dst + x * 4, out);
+    }
+
+    rgb565_row_scalar(dst + x * 4, src + x * 2, width - x);
+}
+
+static void rgb24_row_neon(uint8_t *dst, const uint8_t *src, int width) {
+    uint8x16x3_t in;
+    uint8x16x4_t out;
+    int x;
+
+    out.val[3] = vdupq_n_u8(0xff);
+
+    for (x = 0; x + 16 <= width; x += 16) {
+        in = vld3q_u8(src + x * 3);
+        out.val[0] = in.val[0];
+        out.val[1] = in.val[1];
+        out.val[2] = in.val[2];
+        vst4q_u8(dst + x * 4, out);
+    }
+
+    rgb24_row_scalar(dst + x * 4, src + x * 3, width - x);
+}
+#endif
+
+static const struct swconv_ops swconv_ops_list[] = {
+#ifdef SWCONV_NEON
+    { "neon", nv12_row_neon, rgb565_row_neon, rgb24_row_neon },
+#endif
+#ifdef SWCONV_X86
+    { "avx2", nv12_row_avx2, rgb565_row_avx2, rgb24_row_avx2 },
+    { "sse2", nv12_row_sse2, rgb565_row_sse2, rgb24_row_scalar },
+#endif
+    { "scalar", nv12_row_scalar, rgb565_row_scalar, rgb24_row_scalar },
+};
+
+#define SWCONV_OPS_NUM \
+    (int)(sizeof(swconv_ops_list) / sizeof(swconv_ops_list[0]))
+
+static int swconv_available(const struct swconv_ops *ops) {
+#ifdef SWCONV_X86
+    __builtin_cpu_init();
+
+    if (!strcmp(ops->name, "avx2"))
+        return __builtin_cpu_supports("avx2");
+    if (!strcmp(ops->name, "sse2"))
+        return __builtin_cpu_supports("sse2");
+#endif
+    return 1;
+}
+
+static const struct swconv_ops *swconv_ops;
+
+static const struct swconv_ops *swconv_find(const char *name) {
+    int i;
+
+    // The list is sorted from the fastest
+    for (i = 0; i < SWCONV_OPS_NUM; i++) {
+        if (name && strcmp(name, swconv_ops_list[i].name))
+            continue;
+
+        if (swconv_available(&swconv_ops_list[i]))
+            return &swconv_ops_list[i];
+    }
+
+    return NULL;
+}
+
+static const struct swconv_ops *swconv_get_ops(void) {
+    const struct swconv_ops *ops;
+    const char *name;
+
+    ops = __atomic_load_n(&swconv_ops, __ATOMIC_ACQUIRE);
+    if (ops)
+        return ops;
+
+    name = getenv("SWCONV");
+    ops = swconv_find(name);
+    if (!ops) {
+        fprintf(stderr, "swconv %s unavailable\n", name);
+        ops = &swconv_ops_list[SWCONV_OPS_NUM - 1];
+    }
+
+    __atomic_store_n(&swconv_ops, ops, __ATOMIC_RELEASE);
+    return ops;
+}
+
+int swconv_supported(int bpp) {
+    return bpp == 12 || bpp == 16 || bpp == 24 || bpp == 32;
+}
+
+const char *swconv_name(void) {
+    return swconv_get_ops()->name;
+}
+
+int swconv_set(const char *name) {
+    const struct swconv_ops *ops = swconv_find(name);
+
+    if (!ops)
+        return -1;
+
+    __atomic_store_n(&swconv_ops, ops, __ATOMIC_RELEASE);
+    return 0;
+}
+
+int swconv_row(uint8_t *dst, const uint8_t *src, int src_pitch, int bpp,
+               int height, int x, int y, int width) {
+    const struct swconv_ops *ops = swconv_get_ops();
+    const uint8_t *s = src + (size_t)y * src_pitch;
+
+    switch (bpp) {
+    case 12:
+        if (x & 1)
+            return -1;
+
+        ops->nv12(dst, s + x,
+                  src + (size_t)(height + y / 2) * src_pitch + x, width);
+        break;
+    case 16:
+        ops->rgb565(dst, s + x * 2, width);
+        break;
+    case 24:
+        ops->rgb24(dst, s + x * 3, width);
+        break;
+    case 32:
+        memcpy(dst, s + x * 4, width * 4);
+        break;
+    default:
+        return -1;
+    }
+
+    return 0;
+}
+
+int swconv_xrgb8888(uint8_t *dst, int dst_pitch,
+                    const uint8_t *src, int src_pitch, int bpp,
+                    int width, int height, const damage_rect *rect) {
+    damage_rect r = { 0, 0, width, height };
+    int y, x2;
+
+    if (!swconv_supported(bpp))
+        return -1;
+
+    if (rect)
+        r = *rect;
+
+    // Start on a full uv pair
+    if (bpp == 12 && r.x & 1) {
+        x2 = r.x + r.w;
+        r.x--;
+        r.w = x2 - r.x;
+    }
+
+    for (y = r.y; y < r.y + r.h; y++)
+        swconv_row(dst + (size_t)y * dst_pitch + r.x * 4, src, src_pitch,
+                   bpp, height, r.x, y, r.w);
+
+    return 0;
+}
@@ -0,0 +1,35 @@
+#ifndef _SWCONV_H
+#define _SWCONV_H
+
+#include <stdint.h>
+
+#include "damage.h"
+
+/*
+ * Software conversion to XRGB8888, for when RGA isn't available.
+ *
+ * Source bpp: 12 NV12 (BT.601 limited range), 16 RGB565, 24 RGB888,
+ * 32 XRGB8888 (or BGRA8888, the alpha is dropped).
+ *
+ * The kernels (scalar, sse2, avx2, neon) are picked at runtime from the CPU
+ * features, SWCONV=<name> forces one of them.
+ */
+
+int swconv_supported(int bpp);
+
+// Name of the kernels in use
+const char *swconv_name(void);
+// Force a kernel, for benchmarks
+int swconv_set(const char *name);
+
+// Convert the rect (the whole frame when NULL) of a frame, src_pitch is the
+// pitch of the Y plane for NV12, with the UV plane right after it
+int swconv_xrgb8888(uint8_t *dst, int dst_pitch,
+                    const uint8_t *src, int src_pitch, int bpp,
+                    int width, int height, const damage_rect *rect);
+
+// Convert width pixels of row y from x, which must be even for NV12
+int swconv_row(uint8_t *dst, const uint8_t *src, int src_pitch, int bpp,
+               int height, int x, int y, int width);
+
+#endif // _SWCONV_H
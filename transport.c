@@ -0,0 +1,647 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <linux/udmabuf.h>
+
+#include "futex.h"
+#include "transport.h"
+
+#define HUGEPAGE_SIZE   (2 << 20)
+#define CONNECT_RETRY_US 10000
+#define OPEN_RETRY_MS   1000 // Without inotify events, rechecking anyway
+
+// The pool path showing up, going away or being replaced
+#define WATCH_EVENTS    (IN_CREATE | IN_MOVED_TO | IN_DELETE | IN_MOVED_FROM)
+
+struct pool_watch {
+    int fd; // inotify
+    int stop_fd;
+    char *name; // In the watched directory
+    pthread_t thread;
+
+    volatile void *word;
+    int changed;
+};
+
+// A single guarded mapping, see pool_guard()
+static struct {
+    void *addr;
+    size_t size;
+    volatile sig_atomic_t hit;
+} guard;
+
+struct pool_server {
+    int listen_fd;
+    int pool_fd; // A dup of the producer's, which might close it first
+    struct sockaddr_un addr;
+    pthread_t thread;
+    int stop;
+};
+
+int pool_is_unix(const char *path) {
+    return !strncmp(path, POOL_UNIX_PREFIX, strlen(POOL_UNIX_PREFIX));
+}
+
+static socklen_t unix_addr(const char *path, struct sockaddr_un *addr) {
+    const char *name = path + strlen(POOL_UNIX_PREFIX);
+    size_t len = strlen(name);
+
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+
+    if (len >= sizeof(addr->sun_path))
+        len = sizeof(addr->sun_path) - 1;
+
+    memcpy(addr->sun_path, name, len);
+
+    // Abstract socket
+    if (name[0] == '@')
+        addr->sun_path[0] = '\0';
+
+    return offsetof(struct sockaddr_un, sun_path) + len;
+}
+
+static int send_fd(int sock, int fd) {
+    char data = 'F';
+    char buf[CMSG_SPACE(sizeof(int))];
+    struct iovec iov = {
+        .iov_base = &data,
+        .iov_len = 1,
+    };
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = buf,
+        .msg_controllen = sizeof(buf),
+    };
+    struct cmsghdr *cmsg;
+
+    memset(buf, 0, sizeof(buf));
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+    return sendmsg(sock, &msg, MSG_NOSIGNAL) == 1 ? 0 : -1;
+}
+
+static int recv_fd(int sock) {
+    char data;
+    char buf[CMSG_SPACE(sizeof(int))];
+    struct iovec iov = {
+        .iov_base = &data,
+        .iov_len = 1,
+    };
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = buf,
+        .msg_controllen = sizeof(buf),
+    };
+    struct cmsghdr *cmsg;
+    int fd;
+
+    if (recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) != 1)
+        return -1;
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (!cmsg || cmsg->cmsg_level != SOL_SOCKET ||
+        cmsg->cmsg_type != SCM_RIGHTS)
+        return -1;
+
+    memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+    return fd;
+}
+
+// Connected to the producer serving path, -1 while it isn't
+static int unix_connect(const char *path) {
+    struct sockaddr_un addr;
+    socklen_t len = unix_addr(path, &addr);
+    int sock;
+
+    sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0) {
+        fprintf(stderr, "create socket failed\n");
+        return -1;
+    }
+
+    if (connect(sock, (struct sockaddr *)&addr, len) < 0) {
+        close(sock);
+        return -1;
+    }
+
+    return sock;
+}
+
+static int unix_receive(const char *path, int sock) {
+    int fd = recv_fd(sock);
+
+    if (fd < 0)
+        fprintf(stderr, "receive pool from %s failed\n", path);
+
+    close(sock);
+    return fd;
+}
+
+static int unix_open(const char *path) {
+    int sock, warned = 0;
+
+    while (1) {
+        sock = unix_connect(path);
+        if (sock >= 0)
+            break;
+
+        if (!warned) {
+            fprintf(stderr, "connect %s failed, retrying\n", path);
+            warned = 1;
+        }
+        usleep(CONNECT_RETRY_US);
+    }
+
+    return unix_receive(path, sock);
+}
+
+// The file a pool path is in the filesystem, NULL for abstract sockets
+static const char *pool_file(const char *path) {
+    if (!pool_is_unix(path))
+        return path;
+
+    path += strlen(POOL_UNIX_PREFIX);
+    return path[0] == '@' ? NULL : path;
+}
+
+// Watch the directory of file for events about it, returns its name there
+static const char *watch_dir(int fd, const char *file) {
+    const char *slash = strrchr(file, '/');
+    char dir[PATH_MAX];
+    size_t len;
+
+    if (!slash) {
+        strcpy(dir, ".");
+    } else {
+        len = slash == file ? 1 : slash - file;
+        if (len >= sizeof(dir))
+            return NULL;
+
+        memcpy(dir, file, len);
+        dir[len] = '\0';
+    }
+
+    if (inotify_add_watch(fd, dir, WATCH_EVENTS) < 0)
+        return NULL;
+
+    return slash ? slash + 1 : file;
+}
+
+// Consume the pending events, returns 1 if any was about name
+static int watch_read(int fd, const char *name) {
+    char buf[4096]
+        __attribute__((aligned(__alignof__(struct inotify_event))));
+    const struct inotify_event *event;
+    ssize_t len;
+    char *ptr;
+    int found = 0;
+
+    len = read(fd, buf, sizeof(buf));
+    for (ptr = buf; len > 0 && ptr < buf + len;
+         ptr += sizeof(*event) + event->len) {
+        event = (const struct inotify_event *)ptr;
+
+        // Lost events might have been about it
+        if ((event->mask & IN_Q_OVERFLOW) ||
+            (event->len && !strcmp(event->name, name)))
+            found = 1;
+    }
+
+    return found;
+}
+
+int pool_open(const char *path) {
+    struct pollfd pfd = {
+        .events = POLLIN,
+        .fd = -1,
+    };
+    const char *name = NULL;
+    int fd, warned = 0;
+
+    if (pool_is_unix(path))
+        return unix_open(path);
+
+    // Watching before trying, not to miss its creation in between
+    pfd.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (pfd.fd >= 0)
+        name = watch_dir(pfd.fd, path);
+
+    while (1) {
+        fd = open(path, O_RDWR | O_CLOEXEC);
+        if (fd >= 0)
+            break;
+
+        if (!warned) {
+            fprintf(stderr, "open %s failed, waiting for it\n", path);
+            warned = 1;
+        }
+
+        if (!name) {
+            usleep(OPEN_RETRY_MS * 1000);
+            continue;
+        }
+
+        if (poll(&pfd, 1, OPEN_RETRY_MS) > 0)
+            watch_read(pfd.fd, name);
+    }
+
+    if (pfd.fd >= 0)
+        close(pfd.fd);
+    return fd;
+}
+
+int pool_try_open(const char *path) {
+    int sock;
+
+    if (!pool_is_unix(path))
+        return open(path, O_RDWR | O_CLOEXEC);
+
+    sock = unix_connect(path);
+    if (sock < 0)
+        return -1;
+
+    return unix_receive(path, sock);
+}
+
+static void *pool_watch_thread(void *data) {
+    pool_watch *watch = data;
+    struct pollfd fds[2] = {
+        {
+            .events = POLLIN,
+            .fd = watch->fd,
+        },
+        {
+            .events = POLLIN,
+            .fd = watch->stop_fd,
+        },
+    };
+    volatile void *word;
+
+    while (1) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+
+        if (fds[1].revents)
+            break;
+
+        if (!watch_read(watch->fd, watch->name))
+            continue;
+
+        __atomic_store_n(&watch->changed, 1, __ATOMIC_RELEASE);
+        word = __atomic_load_n(&watch->word, __ATOMIC_ACQUIRE);
+        if (word)
+            futex_wake(word, INT_MAX);
+    }
+
+    return NULL;
+}
+
+pool_watch *pool_watch_create(const char *path) {
+    const char *file = pool_file(path), *name;
+    pool_watch *watch;
+
+    if (!file)
+        return NULL;
+
+    watch = malloc(sizeof(*watch));
+    if (!watch) {
+        fprintf(stderr, "allocate pool watch failed\n");
+        return NULL;
+    }
+    memset(watch, 0, sizeof(*watch));
+    watch->stop_fd = -1;
+
+    watch->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (watch->fd < 0) {
+        fprintf(stderr, "create inotify failed\n");
+        goto err;
+    }
+
+    name = watch_dir(watch->fd, file);
+    if (!name) {
+        fprintf(stderr, "watch %s failed\n", path);
+        goto err;
+    }
+
+    watch->name = strdup(name);
+    watch->stop_fd = eventfd(0, EFD_CLOEXEC);
+    if (!watch->name || watch->stop_fd < 0) {
+        fprintf(stderr, "create pool watch failed\n");
+        goto err;
+    }
+
+    if (pthread_create(&watch->thread, NULL, pool_watch_thread, watch)) {
+        fprintf(stderr, "create pool watch thread failed\n");
+        goto err;
+    }
+
+    return watch;
+err:
+    if (watch->stop_fd >= 0)
+        close(watch->stop_fd);
+    if (watch->fd >= 0)
+        close(watch->fd);
+    free(watch->name);
+    free(watch);
+    return NULL;
+}
+
+void pool_watch_destroy(pool_watch *watch) {
+    uint64_t stop = 1;
+
+    if (!watch)
+        return;
+
+    if (write(watch->stop_fd, &stop, sizeof(stop)) == sizeof(stop))
+        pthread_join(watch->thread, NULL);
+    else
+        pthread_detach(watch->thread);
+
+    close(watch->stop_fd);
+    close(watch->fd);
+    free(watch->name);
+    free(watch);
+}
+
+void pool_watch_wake(pool_watch *watch, volatile void *word) {
+    if (watch)
+        __atomic_store_n(&watch->word, word, __ATOMIC_RELEASE);
+}
+
+int pool_watch_changed(pool_watch *watch) {
+    if (!watch || !__atomic_load_n(&watch->changed, __ATOMIC_ACQUIRE))
+        return 0;
+
+    __atomic_store_n(&watch->changed, 0, __ATOMIC_RELAXED);
+    return 1;
+}
+
+static void pool_sigbus(int sig, siginfo_t *info, void *context) {
+    uint8_t *addr = info->si_addr, *start = guard.addr;
+
+    if (!start || addr < start || addr >= start + guard.size) {
+        // Not ours, faulting again with the default action
+        signal(SIGBUS, SIG_DFL);
+        return;
+    }
+
+    // Zeros instead, until the pool gets attached again
+    if (mmap(start, guard.size, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED) {
+        signal(SIGBUS, SIG_DFL);
+        return;
+    }
+
+    guard.hit = 1;
+}
+
+int pool_guard(void *addr, size_t size) {
+    static int installed;
+    struct sigaction action;
+
+    if (!installed) {
+        memset(&action, 0, sizeof(action));
+        action.sa_sigaction = pool_sigbus;
+        action.sa_flags = SA_SIGINFO;
+        sigemptyset(&action.sa_mask);
+
+        if (sigaction(SIGBUS, &action, NULL) < 0) {
+            fprintf(stderr, "install SIGBUS handler failed\n");
+            return -1;
+        }
+        installed = 1;
+    }
+
+    guard.hit = 0;
+    guard.size = size;
+    __atomic_store_n(&guard.addr, addr, __ATOMIC_RELEASE);
+    return 0;
+}
+
+void pool_unguard(void) {
+    __atomic_store_n(&guard.addr, NULL, __ATOMIC_RELEASE);
+    guard.size = 0;
+}
+
+int pool_guard_hit(void) {
+    return guard.hit;
+}
+
+static void *pool_serve(void *data) {
+    struct pool_server *server = data;
+    int fd;
+
+    while (1) {
+        fd = accept4(server->listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (__atomic_load_n(&server->stop, __ATOMIC_ACQUIRE))
+                break;
+
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+
+            fprintf(stderr, "accept failed\n");
+            break;
+        }
+
+        if (send_fd(fd, server->pool_fd) < 0)
+            fprintf(stderr, "send pool failed\n");
+
+        close(fd);
+    }
+
+    return NULL;
+}
+
+static int memfd_pool(size_t size) {
+    int fd = -1;
+
+    if (getenv("FBPOOL_HUGEPAGES")) {
+        fd = memfd_create("fbpool", MFD_CLOEXEC | MFD_ALLOW_SEALING |
+                          MFD_HUGETLB);
+        if (fd >= 0) {
+            size = (size + HUGEPAGE_SIZE - 1) / HUGEPAGE_SIZE * HUGEPAGE_SIZE;
+            if (!ftruncate(fd, size))
+                goto seal;
+
+            close(fd);
+        }
+
+        fprintf(stderr, "hugepages unavailable, using normal pages\n");
+    }
+
+    fd = memfd_create("fbpool", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd < 0) {
+        fprintf(stderr, "memfd create failed\n");
+        return -1;
+    }
+
+    if (ftruncate(fd, size) < 0) {
+        fprintf(stderr, "truncate memfd failed\n");
+        close(fd);
+        return -1;
+    }
+
+seal:
+    // Consumers can't shrink it under our feet
+    if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) < 0)
+        fprintf(stderr, "seal memfd failed\n");
+
+    return fd;
+}
+
+static int unix_create(const char *path, size_t size,
+                       pool_server **serverp) {
+    struct pool_server *server;
+    socklen_t len;
+    int fd;
+
+    server = malloc(sizeof(*server));
+    if (!server) {
+        fprintf(stderr, "allocate server failed\n");
+        return -1;
+    }
+    memset(server, 0, sizeof(*server));
+    len = unix_addr(path, &server->addr);
+
+    fd = memfd_pool(size);
+    if (fd < 0)
+        goto err_free;
+
+    server->pool_fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    if (server->pool_fd < 0) {
+        fprintf(stderr, "dup memfd failed\n");
+        goto err_close_fd;
+    }
+
+    server->listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (server->listen_fd < 0) {
+        fprintf(stderr, "create socket failed\n");
+        goto err_close_pool;
+    }
+
+    // Remove the stale socket
+    if (server->addr.sun_path[0])
+        unlink(server->addr.sun_path);
+
+    if (bind(server->listen_fd, (struct sockaddr *)&server->addr, len) < 0 ||
+        listen(server->listen_fd, 8) < 0) {
+        fprintf(stderr, "listen on %s failed\n", path);
+        goto err_close_listen;
+    }
+
+    if (pthread_create(&server->thread, NULL, pool_serve, server)) {
+        fprintf(stderr, "create server thread failed\n");
+        goto err_unlink;
+    }
+
+    *serverp = server;
+    return fd;
+err_unlink:
+    if (server->addr.sun_path[0])
+        unlink(server->addr.sun_path);
+err_close_listen:
+    close(server->listen_fd);
+err_close_pool:
+    close(server->pool_fd);
+err_close_fd:
+    close(fd);
+err_free:
+    free(server);
+    return -1;
+}
+
+void pool_server_destroy(pool_server *server) {
+    if (!server)
+        return;
+
+    // Waking up the accept(), new clients get refused
+    __atomic_store_n(&server->stop, 1, __ATOMIC_RELEASE);
+    shutdown(server->listen_fd, SHUT_RDWR);
+    pthread_join(server->thread, NULL);
+
+    if (server->addr.sun_path[0])
+        unlink(server->addr.sun_path);
+    close(server->listen_fd);
+    close(server->pool_fd);
+    free(server);
+}
+
+int pool_create(const char *path, size_t size, pool_server **server) {
+    struct stat st;
+    int fd;
+
+    *server = NULL;
+    if (pool_is_unix(path))
+        return unix_create(path, size, server);
+
+    fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+    if (fd < 0) {
+        fprintf(stderr, "open %s failed\n", path);
+        return -1;
+    }
+
+    if (fstat(fd, &st) < 0 ||
+        (st.st_size < size && ftruncate(fd, size) < 0)) {
+        fprintf(stderr, "truncate %s failed\n", path);
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+int pool_dmabuf(int pool_fd, size_t offset, size_t size) {
+    struct udmabuf_create arg = {
+        .memfd = pool_fd,
+        .flags = UDMABUF_FLAGS_CLOEXEC,
+        .offset = offset,
+        .size = size,
+    };
+    size_t page = sysconf(_SC_PAGESIZE);
+    int dev_fd, fd, seals;
+
+    if (offset % page || size % page)
+        return -1;
+
+    // Only sealed memfds can be turned into dma-bufs
+    seals = fcntl(pool_fd, F_GET_SEALS);
+    if (seals < 0 || !(seals & F_SEAL_SHRINK))
+        return -1;
+
+    dev_fd = open("/dev/udmabuf", O_RDWR | O_CLOEXEC);
+    if (dev_fd < 0)
+        return -1;
+
+    fd = ioctl(dev_fd, UDMABUF_CREATE, &arg);
+    close(dev_fd);
+
+    return fd;
+}
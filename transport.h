@@ -0,0 +1,53 @@
+#ifndef _TRANSPORT_H
+#define _TRANSPORT_H
+
+#include <stddef.h>
+
+/*
+ * Pool paths are either files, or "unix:<socket path>" for memfd pools
+ * handed over a Unix domain socket, "unix:@<name>" for abstract sockets.
+ *
+ * FBPOOL_HUGEPAGES=1 backs the created memfd pools with hugepages.
+ */
+#define POOL_UNIX_PREFIX "unix:"
+
+int pool_is_unix(const char *path);
+
+// Consumer side: wait for the pool to be available and return its fd, files
+// are opened as soon as they are created
+int pool_open(const char *path);
+// Without waiting, -1 while the pool isn't there
+int pool_try_open(const char *path);
+
+// Consumer side: notices the pool path being created, removed or replaced,
+// from a thread which then wakes up the futex word set, if any. NULL when the
+// path can't be watched, like abstract sockets.
+typedef struct pool_watch pool_watch;
+
+pool_watch *pool_watch_create(const char *path);
+void pool_watch_destroy(pool_watch *watch);
+
+void pool_watch_wake(pool_watch *watch, volatile void *word);
+// Returns 1 once after each change
+int pool_watch_changed(pool_watch *watch);
+
+// Consumer side: a mapping of a pool its producer might truncate. Reading it
+// past the end of the file then gets zeros instead of SIGBUS, and
+// pool_guard_hit() returns 1 until the next pool_guard(). One at a time.
+int pool_guard(void *addr, size_t size);
+void pool_unguard(void);
+int pool_guard_hit(void);
+
+// Producer side: create a pool of at least size bytes and return its fd.
+// memfd pools are served to consumers from a background thread, with a fd of
+// their own, until pool_server_destroy() of server, which is NULL for files.
+typedef struct pool_server pool_server;
+
+int pool_create(const char *path, size_t size, pool_server **server);
+void pool_server_destroy(pool_server *server);
+
+// Export part of a memfd pool as a dma-buf through udmabuf, or -1 when the
+// pool isn't a sealed memfd or the range isn't page aligned
+int pool_dmabuf(int pool_fd, size_t offset, size_t size);
+
+#endif // _TRANSPORT_H
@@ -0,0 +1,188 @@
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "workers.h"
+
+#define MAX_WORKERS 32
+
+struct workers {
+    pthread_mutex_t lock;
+    pthread_cond_t start;
+    pthread_cond_t done;
+
+    pthread_t threads[MAX_WORKERS];
+    int num; // Threads, the caller excluded
+    int stop;
+
+    // Current job, a new generation wakes the threads up
+    unsigned int generation;
+    workers_func func;
+    void *data;
+    int count;
+    int next; // Next index to run, atomic
+    int busy; // Threads still on the job
+};
+
+// Run indexes of the current job until there are none left
+static void workers_work(struct workers *workers, workers_func func,
+                         void *data, int count) {
+    int index;
+
+    while (1) {
+        index = __atomic_fetch_add(&workers->next, 1, __ATOMIC_RELAXED);
+        if (index >= count)
+            break;
+
+        func(data, index);
+    }
+}
+
+static void *workers_thread(void *arg) {
+    struct workers *workers = arg;
+    unsigned int generation = 0;
+    workers_func func;
+    void *data;
+    int count;
+
+    pthread_mutex_lock(&workers->lock);
+    while (1) {
+        while (!workers->stop && generation == workers->generation)
+            pthread_cond_wait(&workers->start, &workers->lock);
+
+        if (workers->stop)
+            break;
+
+        generation = workers->generation;
+        func = workers->func;
+        data = workers->data;
+        count = workers->count;
+        pthread_mutex_unlock(&workers->lock);
+
+        workers_work(workers, func, data, count);
+
+        pthread_mutex_lock(&workers->lock);
+        if (!--workers->busy)
+            pthread_cond_signal(&workers->done);
+    }
+    pthread_mutex_unlock(&workers->lock);
+
+    return NULL;
+}
+
+struct workers *workers_create(int num) {
+    struct workers *workers;
+    int i;
+
+    if (num <= 0)
+        num = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (num > MAX_WORKERS)
+        num = MAX_WORKERS;
+
+    workers = malloc(sizeof(*workers));
+    if (!workers) {
+        fprintf(stderr, "allocate workers failed\n");
+        return NULL;
+    }
+    memset(workers, 0, sizeof(*workers));
+
+    pthread_mutex_init(&workers->lock, NULL);
+    pthread_cond_init(&workers->start, NULL);
+    pthread_cond_init(&workers->done, NULL);
+
+    // The caller is one of them
+    for (i = 0; i < num - 1; i++) {
+        if (pthread_create(&workers->threads[i], NULL, workers_thread,
+                           workers)) {
+            fprintf(stderr, "create worker failed\n");
+            break;
+        }
+        workers->num++;
+    }
+
+    return workers;
+}
+
+void workers_destroy(struct workers *workers) {
+    int i;
+
+    if (!workers)
+        return;
+
+    pthread_mutex_lock(&workers->lock);
+    workers->stop = 1;
+    pthread_cond_broadcast(&workers->start);
+    pthread_mutex_unlock(&workers->lock);
+
+    for (i = 0; i < workers->num; i++)
+        pthread_join(workers->threads[i], NULL);
+
+    pthread_cond_destroy(&workers->done);
+    pthread_cond_destroy(&workers->start);
+    pthread_mutex_destroy(&workers->lock);
+    free(workers);
+}
+
+int workers_num(const struct workers *workers) {
+    return workers ? workers->num + 1 : 1;
+}
+
+int workers_pin(struct workers *workers) {
+    cpu_set_t allowed, cpu;
+    int cpus[CPU_SETSIZE];
+    int i, num = 0, ret = 0;
+
+    if (!workers || !workers->num)
+        return 0;
+
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0)
+        return -1;
+
+    for (i = 0; i < CPU_SETSIZE; i++) {
+        if (CPU_ISSET(i, &allowed))
+            cpus[num++] = i;
+    }
+
+    for (i = 0; i < workers->num; i++) {
+        CPU_ZERO(&cpu);
+        CPU_SET(cpus[(i + 1) % num], &cpu);
+
+        if (pthread_setaffinity_np(workers->threads[i], sizeof(cpu), &cpu))
+            ret = -1;
+    }
+
+    return ret;
+}
+
+void workers_run(struct workers *workers, workers_func func, void *data,
+                 int count) {
+    int i;
+
+    if (!workers || !workers->num || count <= 1) {
+        for (i = 0; i < count; i++)
+            func(data, i);
+        return;
+    }
+
+    pthread_mutex_lock(&workers->lock);
+    workers->func = func;
+    workers->data = data;
+    workers->count = count;
+    workers->next = 0;
+    workers->busy = workers->num;
+    workers->generation++;
+    pthread_cond_broadcast(&workers->start);
+    pthread_mutex_unlock(&workers->lock);
+
+    workers_work(workers, func, data, count);
+
+    pthread_mutex_lock(&workers->lock);
+    while (workers->busy)
+        pthread_cond_wait(&workers->done, &workers->lock);
+    pthread_mutex_unlock(&workers->lock);
+}
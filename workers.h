@@ -0,0 +1,28 @@
+#ifndef _WORKERS_H
+#define _WORKERS_H
+
+/*
+ * A pool of threads running the parts of a job in parallel, the caller
+ * works on it too.
+ */
+struct workers;
+
+typedef void (*workers_func)(void *data, int index);
+
+// num <= 0 picks the number of online CPUs
+struct workers *workers_create(int num);
+void workers_destroy(struct workers *workers);
+
+// Threads working on a job, the caller included
+int workers_num(const struct workers *workers);
+
+// Pin the threads, the caller excluded, to a CPU each of the ones the
+// process can run on, starting from the second one
+int workers_pin(struct workers *workers);
+
+// Call func(data, index) for each index in [0, count), returns when all of
+// them are done. A NULL workers runs them on the caller's thread.
+void workers_run(struct workers *workers, workers_func func, void *data,
+                 int count);
+
+#endif // _WORKERS_H